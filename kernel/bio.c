@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,70 +22,174 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
+
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so that looking up different blocks
+// on different CPUs doesn't contend. A buffer's refcnt and the
+// bucket lists are protected by the bucket's lock. Instead of
+// an LRU list, each buffer records when it was last released;
+// a miss recycles the unused buffer released longest ago,
+// moving it to the new block's bucket. bcache.lock serializes
+// recycling, so two CPUs can't both cache the same block.
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;
+  uint hits;      // bget()s of its blocks that found them cached
+  uint misses;
+};
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  uchar data[NBUF][BSIZE];
+  struct bucket bucket[NBUCKET];
+  uint clock;
 } bcache;
 
+static struct bucket *
+bucketof(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Start all the buffers off in bucket 0.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = bcache.data[b - bcache.buf];
+    b->next = bcache.bucket[0].head;
+    bcache.bucket[0].head = b;
   }
 }
 
+// The buffer for block blockno of dev in bk, with a new
+// reference, or 0. Caller holds bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
+  }
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk = bucketof(dev, blockno), *vbk, *vb = 0;
+  struct buf *b, **pp, *victim = 0;
 
+  // Is the block already cached?
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0)
+    bk->hits++;
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Check again, now that no other CPU can be
+  // recycling a buffer for it.
   acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0)
+    bk->hits++;
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Recycle the unused buffer released longest ago. Keep the
+  // lock of the bucket holding the best so far, so it stays
+  // unused; buckets are locked in order.
+  for(vbk = bcache.bucket; vbk < bcache.bucket+NBUCKET; vbk++){
+    int better = 0;
+    acquire(&vbk->lock);
+    for(b = vbk->head; b; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse - victim->lastuse > (1u << 31))){
+        victim = b;
+        better = 1;
+      }
     }
+    if(better){
+      if(vb)
+        release(&vb->lock);
+      vb = vbk;
+    } else
+      release(&vbk->lock);
   }
+  if(victim == 0)
+    panic("bget: no buffers");
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  for(pp = &vb->head; *pp != victim; pp = &(*pp)->next)
+    ;
+  *pp = victim->next;
+  if(vb != bk){
+    release(&vb->lock);
+    acquire(&bk->lock);
+  }
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  victim->next = bk->head;
+  bk->head = victim;
+  bk->misses++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&victim->lock);
+  return victim;
+}
+
+// The buffer cache's hit and miss totals, for sysinfo();
+// read without the locks, so slightly stale.
+void
+bstats(uint64 *hits, uint64 *misses)
+{
+  struct bucket *bk;
+
+  *hits = *misses = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    *hits += bk->hits;
+    *misses += bk->misses;
   }
-  panic("bget: no buffers");
+}
+
+// Drop a reference to b, noting when it became unused, for
+// bget()'s recycling.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    b->lastuse = __sync_fetch_and_add(&bcache.clock, 1);
+  }
+  release(&bk->lock);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,12 +200,161 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
+    TRACE(TR_BMISS, blockno, 0);
+    virtio_disk_rw(b, 0);
+    b->valid = 1;
+  } else
+    TRACE(TR_BHIT, blockno, 0);
+  return b;
+}
+
+// A locked buf for a block the caller is about to overwrite
+// entirely, so there's no need to read it from the disk.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
+// Like bread(), but if the block must come from the disk,
+// return with the read started (or only queued; see bkick()).
+// bwait() for it before using the data.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(!b->valid){
+    TRACE(TR_BMISS, blockno, 0);
+    virtio_disk_start(b, 0);
+  } else
+    TRACE(TR_BHIT, blockno, 0);
+  return b;
+}
+
+// Start writing b's contents to disk. Must be locked, and
+// bwait() for before brelse().
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for b's bread_async() or bwrite_async() to finish.
+void
+bwait(struct buf *b)
+{
+  if(b->disk)
+    virtio_disk_wait(b);
+  b->valid = 1;
+}
+
+// Tell the disk about the requests started since the last
+// time, so it can work on them while we do something else.
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
+// Start reading block blockno of dev into the cache, if it
+// isn't there, without waiting for it or keeping the buffer.
+// bdone() releases the buffer when the read finishes.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk = bucketof(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return; // cached, or being read
+
+  b = bget(dev, blockno);
+  if(b->valid){
+    brelse(b);
+    return;
+  }
+  b->async = 1;
+  virtio_disk_start(b, 0);
+}
+
+// Like bread(), but only if block blockno of dev is cached (or
+// being read into the cache); otherwise returns 0, recycling
+// no buffer for it.
+struct buf*
+bpeek(uint dev, uint blockno)
+{
+  struct bucket *bk = bucketof(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0)
+    bk->hits++;
+  release(&bk->lock);
+  if(b == 0)
+    return 0;
+  acquiresleep(&b->lock);
+  if(!b->valid){
+    // recycled for this block, but its read hasn't started.
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Read or write blocks blockno[0..n-1] of dev from or to
+// mem[0..n-1], BSIZE bytes each, straight between the disk and
+// that memory, and wait for all of them. The blocks mustn't be
+// in the cache (see bpeek()); the caller keeps them out, and
+// keeps mem from being freed. Requests for consecutive blocks
+// are merged as in bread_async(). Returns 0, or -1 if there
+// isn't memory to describe the transfer.
+int
+bdirect(uint dev, uint *blockno, uchar **mem, int n, int write)
+{
+  struct buf *v;
+  int i;
+
+  if(n == 0)
+    return 0;
+  if((v = kmalloc(n * sizeof(struct buf))) == 0)
+    return -1;
+  memset(v, 0, n * sizeof(struct buf));
+  for(i = 0; i < n; i++){
+    v[i].dev = dev;
+    v[i].blockno = blockno[i];
+    v[i].data = mem[i];
+    v[i].valid = 1;
+    virtio_disk_start(&v[i], write);
+  }
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(&v[i]);
+  kmfree(v);
+  return 0;
+}
+
+// A breadahead() read of b finished; called by the disk
+// driver's interrupt handler.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,7 +365,6 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +372,23 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
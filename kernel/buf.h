@@ -1,12 +1,14 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // hand to bdone() when the disk is done
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  uint lastuse;     // bcache.clock when refcnt last fell to 0
+  struct buf *next; // in its hash bucket
+  struct buf *qnext; // next in the same disk request
+  uchar *data;      // BSIZE bytes: bcache's, or user memory for bdirect()
 };
 
@@ -21,23 +21,27 @@
 #include "riscv.h"
 #include "defs.h"
 #include "proc.h"
+#include "poll.h"
 
 #define BACKSPACE 0x100
 #define C(x)  ((x)-'@')  // Control-x
 
 //
 // send one character to the uart.
-// called by printf, and to echo input characters,
+// called to echo input characters,
 // but not from write().
 //
 void
 consputc(int c)
 {
+  char b;
+
   if(c == BACKSPACE){
     // if the user typed backspace, overwrite with a space.
-    uartputc_sync('\b'); uartputc_sync(' '); uartputc_sync('\b');
+    uartputs("\b \b", 3);
   } else {
-    uartputc_sync(c);
+    b = c;
+    uartputs(&b, 1);
   }
 }
 
@@ -58,13 +62,14 @@ struct {
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
+  char buf[128];
+  int i, m;
 
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
 
   return i;
@@ -126,6 +131,20 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+// a whole line (or end-of-file) is ready once consoleintr()
+// has advanced cons.w. output never waits for long.
+int
+consolepoll(void)
+{
+  int ev = POLLOUT;
+
+  acquire(&cons.lock);
+  if(cons.r != cons.w)
+    ev |= POLLIN;
+  release(&cons.lock);
+  return ev;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +189,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwakeup();
       }
     }
     break;
@@ -189,4 +209,5 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
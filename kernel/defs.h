@@ -6,14 +6,25 @@ struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct rwlock;
+struct vclock;
+struct spawnact;
+struct iovec;
 struct stat;
 struct superblock;
+struct kmem_cache;
+struct execseg;
+struct schedstat;
+struct syscallstat;
 
 #define LAB_NET 1
 
 #ifdef LAB_NET
 struct mbuf;
+struct mbufq;
 struct sock;
+struct tcpcb;
+struct ip;
 #endif
 
 // bio.c
@@ -23,6 +34,16 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+struct buf*     bnew(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
+void            bkick(void);
+void            bdone(struct buf*);
+struct buf*     bpeek(uint, uint);
+int             bdirect(uint, uint*, uchar**, int, int);
+void            bstats(uint64*, uint64*);
 
 // console.c
 void            consoleinit(void);
@@ -30,35 +51,55 @@ void            consoleintr(int);
 void            consputc(int);
 
 // exec.c
+void            execinit(void);
+void            textinval(struct inode*);
+void            execput(struct proc*);
+void            execfork(struct proc*, struct proc*);
+struct execseg* execseg(struct proc*, uint64);
+int             execfault(pagetable_t, struct execseg*, uint64);
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, uint64, int n);
+int             fileread(struct file*, int, uint64, int n);
 int             filestat(struct file*, uint64 addr);
-int             filewrite(struct file*, uint64, int n);
+int             filepoll(struct file*);
+void            pollwakeup(void);
+int             pollfds(uint64, int, int);
+int             filewrite(struct file*, int, uint64, int n);
+int             filesplice(struct file*, struct file*, int);
+int             filereadv(struct file*, struct iovec*, int);
+int             filewritev(struct file*, struct iovec*, int);
+int             filepread(struct file*, uint64, int, uint);
+int             filepwrite(struct file*, uint64, int, uint);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dcacheset(struct inode*, char*, uint, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            iunlockshared(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readi_direct(struct inode*, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             writei_direct(struct inode*, uint64, uint, uint);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -66,33 +107,79 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
+// ipi.c
+void            ipiinit(void);
+void            ipi(int);
+int             ipicall(int, void (*)(void *), void *);
+void            ipiintr(void);
+void            tlbshootdown(pagetable_t);
+
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefs(void *);
 void            kinit(void);
+void            kzerostart(void);
+uint64          kfreemem(void);
+
+// mmap.c
+uint64          mmap(struct file*, uint64, int, int, uint64);
+int             mmapfault(pagetable_t, uint64, int);
+uint64          mmapbase(struct proc*);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*, pagetable_t);
+int             mmapfork(struct proc*, struct proc*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+int             log_holds(uint);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int, int);
+int             pipewrite(struct pipe*, int, uint64, int, int);
+int             pipereadpage(struct pipe*, char**, int, int);
+int             pipewritepage(struct pipe*, char**, int, int);
+int             pipepoll(struct pipe*);
+int             pipesize(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawnact*, int);
+int             clone(uint64, uint64, uint64);
+int             join(int);
 int             growproc(int);
+int             kthread_create(void (*)(void *), void *, char *, int);
+int             kthread_clone(void (*)(void *), void *, char *);
+int             kthreadstop(struct proc*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -108,7 +195,12 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
+void            preempt(void);
+int             setnice(int);
+void            getschedstat(struct schedstat*);
+int             nproc(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -119,6 +211,7 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -129,11 +222,23 @@ int             lockfree_read4(int *addr);
 void            freelock(struct spinlock*);
 #endif
 
+// rwlock.c
+void            initrwlock(struct rwlock*, char*);
+void            acquireread(struct rwlock*);
+void            releaseread(struct rwlock*);
+void            acquirewrite(struct rwlock*);
+void            releasewrite(struct rwlock*);
+int             holdingwrite(struct rwlock*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
+int             holdingsleepshared(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            sleeplockdump(void);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -151,9 +256,32 @@ int             argaddr(int, uint64 *);
 int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
+void            syscallstats(int, struct syscallstat*);
+
+// sysfile.c
+void            argfdput(void);
+
+// hrtimer.c
+void            hrtimerinit(void);
+int             hrtimerintr(void);
+int             sleepuntil(void*, struct spinlock*, uint64);
+int             nanosleep(uint64);
+
+// prof.c
+void            profinit(void);
+int             profile(int);
+int             profintr(void);
+int             profread(int, uint64, int);
+
+// trace.c
+extern uint     tracemask;
+void            traceinit(void);
+void            tracerec(int, uint64, uint64);
+int             traceread(int, uint64, int);
 
 // trap.c
 extern uint     ticks;
+extern struct vclock *vclock;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -162,10 +290,16 @@ void            usertrapret(void);
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
-void            uartputc(int);
+void            uartwrite(char*, int);
+void            uartputs(char*, int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// uring.c
+uint64          uringsetup(void);
+int             uringenter(int);
+void            uringfree(struct proc*);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
@@ -176,11 +310,18 @@ void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
+int             lazyfault(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t *         walk(pagetable_t, uint64, int);
+uint64          uvmsatp(struct proc*);
+void            uvmstale(pagetable_t);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+uint64          uvmpin(pagetable_t, uint64, int);
+int             uvmfaultin(pagetable_t, uint64, uint64, int);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
@@ -188,11 +329,16 @@ int             copyinstr(pagetable_t, char *, uint64, uint64);
 void            plicinit(void);
 void            plicinithart(void);
 int             plic_claim(void);
+int             irqaffinity(int, int);
+void            irqstats(int, uint64*);
 void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -225,16 +371,66 @@ void            pci_init();
 void            e1000_init(uint32 *);
 void            e1000_intr(void);
 int             e1000_transmit(struct mbuf*);
+int             e1000_transmit_batch(struct mbufq*);
+int             e1000_txwait(int);
+void            e1000_start(void);
+int             e1000_txcsum(void);
+int             e1000_stats(char*, int);
+uint64          e1000_bypass(void);
+int             e1000_unbypass(struct proc*);
+void            e1000_mcfilter(uint8*, int);
 
 // net.c
+void            netinit(void);
+void            netstart(void);
 void            net_rx(struct mbuf*);
+void            net_tx_ip(struct mbuf*, uint8, uint32);
 void            net_tx_udp(struct mbuf*, uint32, uint16, uint16);
+int             net_tx_udpq(struct mbufq*, uint32, uint16, uint16, int);
+int             net_stats(char*, int);
+uint32          net_srcaddr(uint32);
+int             net_mcjoin(uint32);
+void            net_mcleave(uint32);
+uint64          in_sum(const void*, int, uint64);
+uint64          in_sum_chain(struct mbuf*, uint64);
+uint64          in_pseudo(uint32, uint32, uint8, uint16);
+uint16          in_fold(uint64);
+
+// netstats.c
+void            netstatsinit(void);
 
 // sysnet.c
 void            sockinit(void);
 int             sockalloc(struct file **, uint32, uint16, uint16);
 void            sockclose(struct sock *);
-int             sockread(struct sock *, uint64, int);
-int             sockwrite(struct sock *, uint64, int);
+int             sockread(struct sock *, int, uint64, int, uint64, int);
+int             sockpoll(struct sock *);
+int             sockwrite(struct sock *, int, uint64, int);
+int             sockwriteto(struct sock *, int, uint64, int, uint32, uint16);
+int             sockreadmany(struct sock *, uint64, int, int);
+int             sockwritemany(struct sock *, uint64, int);
+int             socksendfile(struct sock *, struct inode *, uint, int);
+int             sockwritev(struct sock *, struct iovec *, int);
+int             socksetopt(struct sock *, int, int);
+int             sockgetopt(struct sock *, int);
+int             sockdropped(void);
+int             sockstats(char*, int);
+int             sockrecvzc(struct sock *, uint64, int);
+int             zcfree(uint64);
+void            zcrelease(struct proc *);
 void            sockrecvudp(struct mbuf*, uint32, uint16, uint16);
+void            sockrecvmcast(struct mbuf*, uint32, uint32, uint16, uint16);
+
+// tcp.c
+void            tcpinit(void);
+void            tcpstart(void);
+void            tcp_input(struct mbuf*, uint16, struct ip*);
+struct tcpcb*   tcpconnect(uint32, uint16, uint16);
+struct tcpcb*   tcplisten(uint16);
+struct tcpcb*   tcpaccept(struct tcpcb*, int);
+int             tcpread(struct tcpcb*, int, uint64, int, int);
+int             tcpwrite(struct tcpcb*, int, uint64, int, int);
+int             tcpsendfile(struct tcpcb*, struct inode*, uint, int);
+int             tcppoll(struct tcpcb*);
+void            tcpclose(struct tcpcb*);
 #endif
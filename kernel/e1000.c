@@ -6,9 +6,23 @@
 #include "proc.h"
 #include "defs.h"
 #include "e1000_dev.h"
+#include "netbypass.h"
 #include "net.h"
+#include "trace.h"
 
-#define TX_RING_SIZE 16
+// ring lengths must be a multiple of 128 bytes, i.e. of
+// 8 descriptors [E1000 13.4.27, 13.4.38].
+#if NTXDESC % 8 != 0 || NTXDESC > 256
+#error "NTXDESC must be a multiple of 8, at most 256"
+#endif
+#if NRXDESC % 8 != 0 || NRXDESC > 4096
+#error "NRXDESC must be a multiple of 8, at most 4096"
+#endif
+
+// 32-bit registers in the multicast table array.
+#define NMTA (4096/32)
+
+#define TX_RING_SIZE NTXDESC
 static struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));
 static struct mbuf *tx_mbufs[TX_RING_SIZE];
 
@@ -16,16 +30,116 @@ static struct mbuf *tx_mbufs[TX_RING_SIZE];
  * or receive queue. It's a circular ring in the sense that
  * when the card or driver reaches the end of the array,
  * it wraps back to the beginning.*/
-#define RX_RING_SIZE 16
+#define RX_RING_SIZE NRXDESC
 static struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));
 static struct mbuf *rx_mbufs[RX_RING_SIZE];
 
 // remember where the e1000's registers live.
 static volatile uint32 *regs;
 
+// next TX descriptor to fill; a copy of TDT, so that
+// the transmit path need not read the register back.
+static uint32 tx_tail;
+// oldest TX descriptor whose mbuf has not been reclaimed yet.
+static uint32 tx_clean;
+
+// whether the checksum-offload context is loaded in the e1000;
+// it stays loaded until reset, so it is sent only once.
+static int tx_ctx_loaded;
+// last RX descriptor given to the e1000; a copy of RDT.
+static uint32 rx_tail;
+
+// ring occupancy: descriptors currently owned by the e1000 on
+// the TX side, and the most seen waiting on either ring, so
+// that NTXDESC/NRXDESC can be sized from real traffic.
+static uint32 tx_inflight;
+static uint32 tx_hiwat;
+static uint32 rx_hiwat;
+
+// the e1000's statistics registers clear when read, so they
+// are accumulated here; see e1000_stats().
+static struct {
+  char *name;
+  int reg;
+  int hi;      // register holding the upper 32 bits, or 0
+  uint64 sum;
+} hwstats[] = {
+  { "hw_gprc", E1000_GPRC, 0 },
+  { "hw_gptc", E1000_GPTC, 0 },
+  { "hw_gorc", E1000_GORCL, E1000_GORCH },
+  { "hw_gotc", E1000_GOTCL, E1000_GOTCH },
+  { "hw_tpr", E1000_TPR, 0 },
+  { "hw_tpt", E1000_TPT, 0 },
+  { "hw_mpc", E1000_MPC, 0 },
+  { "hw_rnbc", E1000_RNBC, 0 },
+  { "hw_crcerrs", E1000_CRCERRS, 0 },
+};
+
 struct spinlock e1000_lock;
+
+// RX is handled NAPI-style: the interrupt masks further RX
+// interrupts and wakes the poller thread, which drains the
+// ring NETBUDGET packets at a time and unmasks only once the
+// ring is empty. rx_sched is set while the poller owns RX.
+static struct spinlock rx_lock;
+static int rx_sched;
 //struct spinlock e1000_lock2;
 
+// the process that owns the e1000, see e1000_bypass(). while
+// there is one, the kernel's rings are idle: frames sent by
+// the stack are dropped, and nothing is received. rx_bypass,
+// guarded by rx_lock, keeps the poller and RX interrupts off.
+static struct proc *bpowner;
+static int rx_bypass;
+
+#define TCTL_ON (E1000_TCTL_EN |      /* enable */ \
+    E1000_TCTL_PSP |                  /* pad short packets */ \
+    (0x10 << E1000_TCTL_CT_SHIFT) |   /* collision stuff */ \
+    (0x40 << E1000_TCTL_COLD_SHIFT))
+#define RCTL_ON (E1000_RCTL_EN |      /* enable receiver */ \
+    E1000_RCTL_BAM |                  /* enable broadcast */ \
+    E1000_RCTL_SZ_2048 |              /* 2048-byte rx buffers */ \
+    E1000_RCTL_SECRC)                 /* strip CRC */
+
+// point the e1000 at the kernel's rings, with every TX
+// descriptor free and every RX descriptor posted, freeing
+// any frames that were still waiting to be sent. the e1000's
+// transmitter and receiver must be off. caller must hold
+// e1000_lock, or be e1000_init().
+static void
+e1000_rings(void)
+{
+  int i;
+
+  // [E1000 14.5] Transmit initialization
+  memset(tx_ring, 0, sizeof(tx_ring));
+  for (i = 0; i < TX_RING_SIZE; i++) {
+    tx_ring[i].status = E1000_TXD_STAT_DD;
+    if (tx_mbufs[i])
+      mbuffree(tx_mbufs[i]);
+    tx_mbufs[i] = 0;
+  }
+  regs[E1000_TDBAL] = (uint64) tx_ring;
+  if(sizeof(tx_ring) % 128 != 0)
+    panic("e1000");
+  regs[E1000_TDLEN] = sizeof(tx_ring);
+  regs[E1000_TDH] = regs[E1000_TDT] = 0;
+  tx_tail = tx_clean = 0;
+  tx_inflight = 0;
+  tx_ctx_loaded = 0;
+
+  // [E1000 14.4] Receive initialization
+  memset(rx_ring, 0, sizeof(rx_ring));
+  for (i = 0; i < RX_RING_SIZE; i++)
+    rx_ring[i].addr = (uint64) rx_mbufs[i]->head;
+  regs[E1000_RDBAL] = (uint64) rx_ring;
+  if(sizeof(rx_ring) % 128 != 0)
+    panic("e1000");
+  regs[E1000_RDH] = 0;
+  regs[E1000_RDT] = rx_tail = RX_RING_SIZE - 1;
+  regs[E1000_RDLEN] = sizeof(rx_ring);
+}
+
 // called by pci_init().
 // xregs is the memory address at which the
 // e1000's registers are mapped.
@@ -35,6 +149,7 @@ e1000_init(uint32 *xregs)
   int i;
 
   initlock(&e1000_lock, "e1000");
+  initlock(&rx_lock, "e1000rx");
 //  initlock(&e1000_lock2, "e10002");
 
   regs = xregs;
@@ -45,154 +160,565 @@ e1000_init(uint32 *xregs)
   regs[E1000_IMS] = 0; // redisable interrupts
   __sync_synchronize();
 
-  // [E1000 14.5] Transmit initialization
-  memset(tx_ring, 0, sizeof(tx_ring));
-  for (i = 0; i < TX_RING_SIZE; i++) {
-    tx_ring[i].status = E1000_TXD_STAT_DD;
-    tx_mbufs[i] = 0;
+  tx_hiwat = rx_hiwat = 0;
+  for (i = 0; i < NELEM(hwstats); i++) {
+    (void) regs[hwstats[i].reg]; // clear what the reset left
+    if (hwstats[i].hi)
+      (void) regs[hwstats[i].hi];
+    hwstats[i].sum = 0;
   }
-  regs[E1000_TDBAL] = (uint64) tx_ring;
-  if(sizeof(tx_ring) % 128 != 0)
-    panic("e1000");
-  regs[E1000_TDLEN] = sizeof(tx_ring);
-  regs[E1000_TDH] = regs[E1000_TDT] = 0;
-  
-  // [E1000 14.4] Receive initialization
-  memset(rx_ring, 0, sizeof(rx_ring));
+
   for (i = 0; i < RX_RING_SIZE; i++) {
     rx_mbufs[i] = mbufalloc(0);
     if (!rx_mbufs[i])
       panic("e1000");
-    rx_ring[i].addr = (uint64) rx_mbufs[i]->head;
   }
-  regs[E1000_RDBAL] = (uint64) rx_ring;
-  if(sizeof(rx_ring) % 128 != 0)
-    panic("e1000");
-  regs[E1000_RDH] = 0;
-  regs[E1000_RDT] = RX_RING_SIZE - 1;
-  regs[E1000_RDLEN] = sizeof(rx_ring);
+  e1000_rings();
 
   // filter by qemu's MAC address, 52:54:00:12:34:56
   regs[E1000_RA] = 0x12005452;
   regs[E1000_RA+1] = 0x5634 | (1<<31);
-  // multicast table
-  for (int i = 0; i < 4096/32; i++)
+  // multicast table: nothing until a socket joins a group.
+  for (int i = 0; i < NMTA; i++)
     regs[E1000_MTA + i] = 0;
 
   // transmitter control bits.
-  regs[E1000_TCTL] = E1000_TCTL_EN |  // enable
-    E1000_TCTL_PSP |                  // pad short packets
-    (0x10 << E1000_TCTL_CT_SHIFT) |   // collision stuff
-    (0x40 << E1000_TCTL_COLD_SHIFT);
+  regs[E1000_TCTL] = TCTL_ON;
   regs[E1000_TIPG] = 10 | (8<<10) | (6<<20); // inter-pkt gap
 
   // receiver control bits.
-  regs[E1000_RCTL] = E1000_RCTL_EN | // enable receiver
-    E1000_RCTL_BAM |                 // enable broadcast
-    E1000_RCTL_SZ_2048 |             // 2048-byte rx buffers
-    E1000_RCTL_SECRC;                // strip CRC
+  regs[E1000_RCTL] = RCTL_ON;
+
+  // check IP and UDP checksums of received packets.
+  regs[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
   
-  // ask e1000 for receive interrupts.
-  regs[E1000_RDTR] = 0; // interrupt after every received packet (no timer)
-  regs[E1000_RADV] = 0; // interrupt after every packet (no timer)
-  regs[E1000_IMS] = (1 << 7); // RXDW -- Receiver Descriptor Write Back
+  // ask e1000 for receive interrupts, but no more often than
+  // NETITR allows; the delay timers can batch further.
+  regs[E1000_ITR] = NETITR;
+  regs[E1000_RDTR] = NETRDTR;
+  regs[E1000_RADV] = NETRADV;
+  regs[E1000_IMS] = E1000_ICR_RXT0 | // RXDW -- Receiver Descriptor Write Back
+    E1000_ICR_TXDW;                  // TXDW -- Transmit Descriptor Write Back
+}
+
+// free the mbufs of TX descriptors the e1000 has finished
+// with, oldest first, and wake up anyone waiting for ring
+// space. the e1000 completes descriptors in order, so stop
+// at the first one that is still pending.
+// caller must hold e1000_lock.
+static int
+e1000_txreclaim(void)
+{
+  struct mbuf *done[16];
+  int n = 0, k = 0;
+
+  while(n < tx_inflight && (tx_ring[tx_clean].status & E1000_TXD_STAT_DD)){
+    // context descriptors have no mbuf.
+    if(tx_mbufs[tx_clean]){
+      done[k++] = tx_mbufs[tx_clean];
+      if(k == NELEM(done)){
+        mbuffree_batch(done, k);
+        k = 0;
+      }
+      tx_mbufs[tx_clean] = 0;
+    }
+    tx_clean = (tx_clean + 1) % TX_RING_SIZE;
+    n++;
+  }
+  mbuffree_batch(done, k);
+  tx_inflight -= n;
+  if(n > 0)
+    wakeup(&tx_clean);
+  return n;
 }
 
+// wait until there are at least need free descriptors in
+// the TX ring. returns -1 if the process was killed.
 int
-e1000_transmit(struct mbuf *m)
+e1000_txwait(int need)
 {
-  //
-  // Your code here.
-  //
-  // the mbuf contains an ethernet frame; program it into
-  // the TX descriptor ring so that the e1000 sends it. Stash
-  // a pointer so that it can be freed after sending.
-  //
+  struct proc *p = myproc();
 
-  uint32 i;
+  if(need > TX_RING_SIZE)
+    need = TX_RING_SIZE;
+  acquire(&e1000_lock);
+  while(tx_inflight + need > TX_RING_SIZE && bpowner == 0 &&
+        e1000_txreclaim() == 0){
+    if(p->killed){
+      release(&e1000_lock);
+      return -1;
+    }
+    sleep(&tx_clean, &e1000_lock);
+  }
+  release(&e1000_lock);
+  return 0;
+}
+
+// whether the e1000 should compute IP and UDP checksums of
+// packets sent with M_CSUM_TX.
+int
+e1000_txcsum(void)
+{
+  return NETCSUM && regs != 0;
+}
+
+// fill in a TCP/IP context descriptor for UDP over IPv4 in an
+// untagged ethernet frame, which is all that net.c sends with
+// M_CSUM_TX: the IP header checksum at offset 24, covering
+// bytes 14-33, and the UDP checksum at 40, from 34 to the end.
+// the UDP checksum field must already hold the pseudo-header
+// sum. caller must hold e1000_lock.
+static void
+e1000_txctx(struct tx_desc *slot)
+{
+  struct tx_ctx_desc *c = (struct tx_ctx_desc *)slot;
+
+  memset(c, 0, sizeof(*c));
+  c->ipcss = 14;
+  c->ipcso = 14 + 10;
+  c->ipcse = 14 + 20 - 1;
+  c->tucss = 14 + 20;
+  c->tucso = 14 + 20 + 6;
+  c->tucse = 0;
+  c->dtyp = E1000_TXD_DTYP_C;
+  c->tucmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_TUCMD_IP;
+  tx_ctx_loaded = 1;
+}
+
+// give the e1000 the used descriptors filled in since the
+// last call. caller must hold e1000_lock.
+static void
+e1000_txpublish(int used)
+{
+  if(used == 0)
+    return;
+  tx_inflight += used;
+  if(tx_inflight > tx_hiwat)
+    tx_hiwat = tx_inflight;
+  __sync_synchronize();
+  regs[E1000_TDT] = tx_tail;
+}
+
+// program as many of q's frames (each an mbuf chain holding an
+// ethernet frame) into free TX descriptors as fit, then tell
+// the e1000 about all of them with a single write of the tail
+// register. the mbufs are stashed until the TXDW interrupt (or
+// a later call) finds them sent and frees them.
+// returns the number of frames taken off q; any that did not
+// fit in the ring are left on q for the caller.
+int
+e1000_transmit_batch(struct mbufq *q)
+{
   struct tx_desc *d;
-  struct mbuf *m0;
+  struct mbuf *m, *s;
+  int n = 0, need, used = 0, len;
 
   acquire(&e1000_lock);
-  // tx ring index
-  i = regs[E1000_TDT];
-
-  // if the ring is overflowing
-  d = &tx_ring[i];
-  if (!(d->status & E1000_TXD_STAT_DD)) {
+  if(bpowner){
+    // a process has the e1000; the stack's frames go nowhere.
+    for(; !mbufq_empty(q); n++)
+      mbuffree(mbufq_pophead(q));
+    netstat_add(bp_drops, n);
     release(&e1000_lock);
-    return -1;
+    return n;
   }
+  while(!mbufq_empty(q)){
+    m = q->head;
+    // a descriptor for each mbuf in the frame's chain.
+    need = mbufsegs(m);
+    if((m->flags & M_CSUM_TX) && !tx_ctx_loaded)
+      need++;
+    if(need > TX_RING_SIZE){
+      mbuffree(mbufq_pophead(q)); // would never fit
+      continue;
+    }
+
+    if(tx_inflight + used + need > TX_RING_SIZE){
+      // let the e1000 start on what is filled in so far,
+      // and collect descriptors that it has finished with.
+      e1000_txpublish(used);
+      used = 0;
+      if(e1000_txreclaim() == 0){
+        netstat_add(tx_ringfull, 1);
+        break;
+      }
+      continue; // reclaimed some, but maybe not enough
+    }
 
-  // free the last m0
-  m0 = tx_mbufs[i];
-  if (m0)
-    mbuffree(m0);
+    if((m->flags & M_CSUM_TX) && !tx_ctx_loaded){
+      e1000_txctx(&tx_ring[tx_tail]);
+      tx_tail = (tx_tail + 1) % TX_RING_SIZE;
+      used++;
+    }
 
-  // fill in the descriptor
-//  memset(d, 0, sizeof(*d));
-  d->addr = (uint64) m->head;
-  d->length = m->len;
-  d->cmd = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
-  tx_mbufs[i] = m;
+    // fill in the descriptors, ending the frame at the last.
+    m = mbufq_pophead(q);
+    len = 0;
+    for(s = m; s; s = s->next){
+      d = &tx_ring[tx_tail];
+      d->addr = (uint64) s->head;
+      d->length = s->len;
+      d->status = 0;
+      d->special = 0;
+      d->cmd = E1000_TXD_CMD_RS;
+      if(s->next == 0)
+        d->cmd |= E1000_TXD_CMD_EOP;
+      if(m->flags & M_CSUM_TX){
+        // data descriptor: have the e1000 insert both checksums.
+        d->cso = E1000_TXD_DTYP_D;
+        d->cmd |= E1000_TXD_CMD_DEXT;
+        d->css = E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+      } else {
+        d->cso = 0;
+        d->css = 0;
+      }
+      // each mbuf is freed when its own descriptor is done.
+      tx_mbufs[tx_tail] = s;
+      netstat.tx_bytes += s->len;
+      len += s->len;
 
-  // update the ring position
-  regs[E1000_TDT] = (i + 1) % TX_RING_SIZE;
+      tx_tail = (tx_tail + 1) % TX_RING_SIZE;
+      used++;
+    }
+    netstat.tx_pkts++;
+    TRACE(TR_NETTX, len, 0);
+    n++;
+  }
+
+  // one MMIO write (and one trap into qemu) for the whole burst.
+  e1000_txpublish(used);
   release(&e1000_lock);
 
-  return 0;
+  return n;
 }
 
-static void
-e1000_recv(void)
+// send a single ethernet frame.
+// returns -1 if the TX ring is full, in which case the
+// caller still owns m.
+int
+e1000_transmit(struct mbuf *m)
 {
-  //
-  // Your code here.
-  //
-  // Check for packets that have arrived from the e1000
-  // Create and deliver an mbuf for each packet (using net_rx()).
-  //
+  struct mbufq q;
 
-  uint32 i;
+  mbufq_init(&q);
+  mbufq_pushtail(&q, m);
+  if(e1000_transmit_batch(&q) == 0)
+    return -1;
+  return 0;
+}
+
+// deliver up to budget packets that have arrived from the
+// e1000 to the network stack. returns the number delivered;
+// fewer than budget means the ring is empty.
+static int
+e1000_recv(int budget)
+{
+  struct mbuf *pkts[NETBUDGET], *fresh[NETBUDGET];
   struct rx_desc *d;
-  struct mbuf *m;
+  uint32 i;
+  int n, k, got;
+
+  if (budget > NETBUDGET)
+    budget = NETBUDGET;
 
-  while (1) {
-    // rx ring index
-    i = (regs[E1000_RDT] + 1) % RX_RING_SIZE;
+  // the e1000 has filled the descriptors from rx_tail+1 up to
+  // RDH; that many received packets are waiting in the ring.
+  i = (regs[E1000_RDH] + RX_RING_SIZE - rx_tail - 1) % RX_RING_SIZE;
+  if (i > rx_hiwat)
+    rx_hiwat = i;
 
-    // if a new packet is available
+  // collect the packets that are ready.
+  for (n = 0; n < budget; n++) {
+    i = (rx_tail + 1 + n) % RX_RING_SIZE;
     d = &rx_ring[i];
     if (!(d->status & E1000_RXD_STAT_DD))
       break;
+    pkts[n] = rx_mbufs[i];
+    pkts[n]->len = d->length;
+    pkts[n]->flags = 0;
+    if (!(d->status & E1000_RXD_STAT_IXSM)) {
+      if ((d->status & E1000_RXD_STAT_IPCS) && !(d->errors & E1000_RXD_ERR_IPE))
+        pkts[n]->flags |= M_IPCSUM_OK;
+      if ((d->status & E1000_RXD_STAT_TCPCS) && !(d->errors & E1000_RXD_ERR_TCPE))
+        pkts[n]->flags |= M_L4CSUM_OK;
+    }
+  }
+  if (n == 0)
+    return 0;
+
+  // repost the descriptors with fresh buffers, all at once.
+  // if the pool runs dry, drop the newest packets and give
+  // their buffers back to the e1000 rather than stalling RX.
+  got = mbufalloc_batch(fresh, n, 0);
+  if (got < n)
+    netstat_add(rx_nobuf, n - got);
+  for (k = got; k < n; k++) {
+    fresh[k] = pkts[k];
+    pkts[k] = 0;
+  }
+  for (k = 0; k < n; k++) {
+    i = (rx_tail + 1) % RX_RING_SIZE;
+    rx_mbufs[i] = fresh[k];
+    rx_ring[i].addr = (uint64) fresh[k]->head;
+    rx_ring[i].status = 0;
+    rx_tail = i;
+  }
+  __sync_synchronize();
+  regs[E1000_RDT] = rx_tail;
+
+  // deliver the mbufs to the network stack
+  for (k = 0; k < got; k++) {
+    netstat.rx_pkts++;
+    netstat.rx_bytes += pkts[k]->len;
+    TRACE(TR_NETRX, pkts[k]->len, 0);
+    net_rx(pkts[k]);
+  }
+  return n;
+}
+
+// kernel thread that polls the RX ring while packets keep
+// arriving, rather than taking an interrupt for each one.
+static void
+e1000_poller(void *arg)
+{
+  acquire(&rx_lock);
+  for(;;){
+    while(!rx_sched)
+      sleep(&rx_sched, &rx_lock);
+    release(&rx_lock);
+
+    // a full budget means more may be waiting;
+    // let other processes run, then poll again.
+    while(e1000_recv(NETBUDGET) == NETBUDGET)
+      yield();
+
+    // ring is empty: go back to interrupts. a packet that
+    // arrived since the last poll has already latched its
+    // cause in ICR, so unmasking raises the interrupt.
+    // unless e1000_bypass() is waiting for the ring to go
+    // idle, in which case RX stays off.
+    acquire(&rx_lock);
+    rx_sched = 0;
+    if(rx_bypass)
+      wakeup(&rx_bypass);
+    else
+      regs[E1000_IMS] = E1000_ICR_RXT0;
+  }
+}
+
+// start the RX poller. called once processes can be created.
+void
+e1000_start(void)
+{
+  if(regs == 0)
+    return; // no e1000 found by pci_init()
+  if(kthread_create(e1000_poller, 0, "e1000rx", -1) < 0)
+    panic("e1000_start");
+}
+
+// let through frames for the n multicast MAC addresses at
+// macs, ETHADDR_LEN bytes each, and no others. the multicast
+// table is 4096 bits, indexed by bits 47:36 of the
+// destination address when RCTL.MO is 0, as e1000_init() leaves it.
+void
+e1000_mcfilter(uint8 *macs, int n)
+{
+  uint32 mta[NMTA];
+  uint8 *mac;
+  uint h;
+  int i;
+
+  if(regs == 0)
+    return;
+  memset(mta, 0, sizeof(mta));
+  for(i = 0; i < n; i++){
+    mac = macs + i*ETHADDR_LEN;
+    h = ((mac[4] >> 4) | (mac[5] << 4)) & 0xfff;
+    mta[h >> 5] |= 1 << (h & 31);
+  }
+  acquire(&e1000_lock);
+  for(i = 0; i < NMTA; i++)
+    regs[E1000_MTA + i] = mta[i];
+  release(&e1000_lock);
+}
+
+// the physical address of offset off in the pages of a
+// process's NETBP.
+static uint64
+bpaddr(char **pa, int off)
+{
+  return (uint64) pa[off / PGSIZE] + off % PGSIZE;
+}
+
+// give the e1000 to the current process, for it to poll
+// DPDK-style: map the e1000's registers at NETBPREGS and fresh
+// rings and buffers at NETBP, laid out as netbypass.h says,
+// point the e1000 at them, and keep the kernel's stack and
+// interrupts off it until e1000_unbypass(). there is no IOMMU,
+// so the owner can have the e1000 DMA anywhere; only a
+// trusted appliance process should ask for it.
+// returns NETBP, or -1 if there is no e1000 or someone
+// already has it.
+uint64
+e1000_bypass(void)
+{
+  struct proc *g = myproc()->leader;
+  struct netbpring *r;
+  char *pa[NETBPPAGES];
+  int i, k;
+
+  if(regs == 0)
+    return -1;
+  acquire(&e1000_lock);
+  if(bpowner){
+    release(&e1000_lock);
+    return -1;
+  }
+  bpowner = g;
+  release(&e1000_lock);
+
+  for(k = 0; k < NETBPPAGES; k++)
+    if((pa[k] = kalloc_zeroed()) == 0)
+      goto bad;
+  r = (struct netbpring *) pa[0];
+  for(i = 0; i < NBPDESC; i++){
+    r->tx[i].addr = bpaddr(pa, BPTXBUF(i));
+    r->tx[i].status = E1000_TXD_STAT_DD;
+    r->rx[i].addr = bpaddr(pa, BPRXBUF(i));
+  }
+
+  // the registers are 128KB, where pci_init() put them.
+  acquire(&g->tglock);
+  if(mappages(g->pagetable, NETBPREGS, 32*PGSIZE, (uint64) regs,
+              PTE_R | PTE_W | PTE_U) < 0){
+    release(&g->tglock);
+    goto bad;
+  }
+  for(i = 0; i < NETBPPAGES; i++){
+    if(mappages(g->pagetable, NETBP + i*PGSIZE, PGSIZE, (uint64) pa[i],
+                PTE_R | PTE_W | PTE_U) < 0){
+      uvmunmap(g->pagetable, NETBP, i, 0);
+      uvmunmap(g->pagetable, NETBPREGS, 32, 0);
+      release(&g->tglock);
+      goto bad;
+    }
+  }
+  release(&g->tglock);
+
+  // turn the receiver off and wait for the poller to finish
+  // with the kernel's ring; from here on no RX interrupt
+  // hands it back.
+  acquire(&rx_lock);
+  rx_bypass = 1;
+  regs[E1000_IMC] = 0xffffffff;
+  regs[E1000_RCTL] = 0;
+  while(rx_sched)
+    sleep(&rx_bypass, &rx_lock);
+  release(&rx_lock);
+
+  acquire(&e1000_lock);
+  regs[E1000_TCTL] = 0;
+  e1000_rings(); // drops what the stack had queued to send
+  regs[E1000_TDBAL] = (uint64) r->tx;
+  regs[E1000_TDLEN] = sizeof(r->tx);
+  regs[E1000_TDH] = regs[E1000_TDT] = 0;
+  regs[E1000_RDBAL] = (uint64) r->rx;
+  regs[E1000_RDLEN] = sizeof(r->rx);
+  regs[E1000_RDH] = 0;
+  regs[E1000_RDT] = NBPDESC - 1;
+  regs[E1000_TCTL] = TCTL_ON;
+  regs[E1000_RCTL] = RCTL_ON;
+  wakeup(&tx_clean); // senders waiting for space drop instead
+  release(&e1000_lock);
+  return NETBP;
+
+bad:
+  while(--k >= 0)
+    kfree(pa[k]);
+  acquire(&e1000_lock);
+  bpowner = 0;
+  release(&e1000_lock);
+  return -1;
+}
+
+// give the e1000 back to the kernel's stack if p has it, at
+// netbypass(0), exit or exec. returns -1 if p doesn't.
+int
+e1000_unbypass(struct proc *p)
+{
+  acquire(&e1000_lock);
+  if(bpowner == 0 || bpowner != p){
+    release(&e1000_lock);
+    return -1;
+  }
+  // stop the e1000 before p's pages go away.
+  regs[E1000_TCTL] = 0;
+  regs[E1000_RCTL] = 0;
+  e1000_rings();
+  regs[E1000_TCTL] = TCTL_ON;
+  regs[E1000_RCTL] = RCTL_ON;
+  acquire(&rx_lock);
+  rx_bypass = 0;
+  regs[E1000_IMS] = E1000_ICR_RXT0 | E1000_ICR_TXDW;
+  release(&rx_lock);
+  bpowner = 0;
+  release(&e1000_lock);
 
-    // update the mbuf
-    m = rx_mbufs[i];
-    m->len = d->length;
+  acquire(&p->tglock);
+  uvmunmap(p->pagetable, NETBPREGS, 32, 0);
+  uvmunmap(p->pagetable, NETBP, NETBPPAGES, 1);
+  release(&p->tglock);
+  return 0;
+}
 
-    // deliver the mbuf to the network stack
-    net_rx(m);
+// formats the ring state and hardware counters into buf for
+// the netstats device. returns the number of bytes written.
+int
+e1000_stats(char *buf, int sz)
+{
+  int n = 0;
 
-    // allocate a new mbuf
-    m = mbufalloc(0);
-    if (!m)
-      panic("e1000_recv: mbufalloc");
-    rx_mbufs[i] = m;
-    d->addr = (uint64) m->head;
-    d->status = 0;
+  if(regs == 0)
+    return 0;
 
-    // update the E1000_RDT register
-    regs[E1000_RDT] = i;
+  acquire(&e1000_lock);
+  n += snprintf(buf+n, sz-n, "tx_ring %d/%d hiwat %d\n",
+                tx_inflight, TX_RING_SIZE, tx_hiwat);
+  n += snprintf(buf+n, sz-n, "rx_ring %d hiwat %d\n",
+                RX_RING_SIZE, rx_hiwat);
+  for (int i = 0; i < NELEM(hwstats); i++) {
+    hwstats[i].sum += regs[hwstats[i].reg];
+    if (hwstats[i].hi)
+      hwstats[i].sum += (uint64)regs[hwstats[i].hi] << 32;
+    n += snprintf(buf+n, sz-n, "%s %ld\n", hwstats[i].name, hwstats[i].sum);
   }
+  release(&e1000_lock);
+  return n;
 }
 
 void
 e1000_intr(void)
 {
+  uint32 icr = regs[E1000_ICR];
+
   // tell the e1000 we've seen this interrupt;
   // without this the e1000 won't raise any
   // further interrupts.
   regs[E1000_ICR] = 0xffffffff;
 
-  e1000_recv();
+  if(icr & E1000_ICR_RXT0){
+    // hand RX over to the poller until the ring is drained,
+    // unless a process has taken the e1000 meanwhile.
+    acquire(&rx_lock);
+    if(!rx_bypass){
+      regs[E1000_IMC] = E1000_ICR_RXT0;
+      rx_sched = 1;
+      wakeup(&rx_sched);
+    }
+    release(&rx_lock);
+  }
+
+  acquire(&e1000_lock);
+  e1000_txreclaim();
+  release(&e1000_lock);
 }
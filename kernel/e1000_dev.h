@@ -6,7 +6,9 @@
 /* Registers */
 #define E1000_CTL      (0x00000/4)  /* Device Control Register - RW */
 #define E1000_ICR      (0x000C0/4)  /* Interrupt Cause Read - R */
+#define E1000_ITR      (0x000C4/4)  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS      (0x000D0/4)  /* Interrupt Mask Set - RW */
+#define E1000_IMC      (0x000D8/4)  /* Interrupt Mask Clear - WO */
 #define E1000_RCTL     (0x00100/4)  /* RX Control - RW */
 #define E1000_TCTL     (0x00400/4)  /* TX Control - RW */
 #define E1000_TIPG     (0x00410/4)  /* TX Inter-packet gap -RW */
@@ -21,9 +23,25 @@
 #define E1000_TDLEN    (0x03808/4)  /* TX Descriptor Length - RW */
 #define E1000_TDH      (0x03810/4)  /* TX Descriptor Head - RW */
 #define E1000_TDT      (0x03818/4)  /* TX Descripotr Tail - RW */
+#define E1000_CRCERRS  (0x04000/4)  /* CRC Error Count - R/clr */
+#define E1000_MPC      (0x04010/4)  /* Missed Packet Count - R/clr */
+#define E1000_GPRC     (0x04074/4)  /* Good Packets RX Count - R/clr */
+#define E1000_GPTC     (0x04080/4)  /* Good Packets TX Count - R/clr */
+#define E1000_GORCL    (0x04088/4)  /* Good Octets RX Count Low - R/clr */
+#define E1000_GORCH    (0x0408C/4)  /* Good Octets RX Count High - R/clr */
+#define E1000_GOTCL    (0x04090/4)  /* Good Octets TX Count Low - R/clr */
+#define E1000_GOTCH    (0x04094/4)  /* Good Octets TX Count High - R/clr */
+#define E1000_RNBC     (0x040A0/4)  /* RX No Buffers Count - R/clr */
+#define E1000_TPR      (0x040D0/4)  /* Total Packets RX - R/clr */
+#define E1000_TPT      (0x040D4/4)  /* Total Packets TX - R/clr */
+#define E1000_RXCSUM   (0x05000/4)  /* RX Checksum Control - RW */
 #define E1000_MTA      (0x05200/4)  /* Multicast Table Array - RW Array */
 #define E1000_RA       (0x05400/4)  /* Receive Address - RW Array */
 
+/* Interrupt Cause/Mask bits */
+#define E1000_ICR_TXDW    0x00000001    /* TX descriptor written back */
+#define E1000_ICR_RXT0    0x00000080    /* RX timer intr (ring 0) */
+
 /* Device Control */
 #define E1000_CTL_SLU     0x00000040    /* set link up */
 #define E1000_CTL_FRCSPD  0x00000800    /* force speed */
@@ -89,9 +107,25 @@
 
 #define DATA_MAX 1518
 
+/* Receive Checksum Control */
+#define E1000_RXCSUM_IPOFL   0x00000100 /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL   0x00000200 /* TCP/UDP checksum offload */
+
 /* Transmit Descriptor command definitions [E1000 3.3.3.1] */
 #define E1000_TXD_CMD_EOP    0x01 /* End of Packet */
 #define E1000_TXD_CMD_RS     0x08 /* Report Status */
+#define E1000_TXD_CMD_DEXT   0x20 /* Descriptor extension (non-legacy) */
+
+/* Extended descriptor types, in the byte after the length [E1000 3.3.7] */
+#define E1000_TXD_DTYP_C     0x00 /* Context descriptor */
+#define E1000_TXD_DTYP_D     0x10 /* Data descriptor */
+
+/* Context descriptor TUCMD bits [E1000 3.3.6] */
+#define E1000_TXD_TUCMD_IP   0x02 /* IPv4 (else IPv6) */
+
+/* Data descriptor POPTS bits [E1000 3.3.7.1] */
+#define E1000_TXD_POPTS_IXSM 0x01 /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02 /* Insert TCP/UDP checksum */
 
 /* Transmit Descriptor status definitions [E1000 3.3.3.2] */
 #define E1000_TXD_STAT_DD    0x00000001 /* Descriptor Done */
@@ -108,9 +142,33 @@ struct tx_desc
   uint16 special;
 };
 
+// TCP/IP context descriptor [E1000 3.3.6]: tells the e1000
+// where the checksums of following data descriptors go.
+// occupies a TX ring slot, and shares tx_desc's status byte.
+struct tx_ctx_desc
+{
+  uint8 ipcss;       /* IP checksum start */
+  uint8 ipcso;       /* IP checksum offset */
+  uint16 ipcse;      /* IP checksum end (inclusive) */
+  uint8 tucss;       /* TCP/UDP checksum start */
+  uint8 tucso;       /* TCP/UDP checksum offset */
+  uint16 tucse;      /* TCP/UDP checksum end (0 = end of packet) */
+  uint16 paylen;     /* TSO payload length, low bits */
+  uint8 dtyp;        /* TSO payload length, high bits + type */
+  uint8 tucmd;
+  uint8 status;
+  uint8 hdrlen;
+  uint16 mss;
+};
+
 /* Receive Descriptor bit definitions [E1000 3.2.3.1] */
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
+#define E1000_RXD_STAT_IXSM     0x04    /* Ignore checksum indication */
+#define E1000_RXD_STAT_TCPCS    0x20    /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS     0x40    /* IP checksum calculated */
+#define E1000_RXD_ERR_TCPE      0x20    /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE       0x40    /* IP checksum error */
 
 /* memo: The E1000 requires these buffers to be described by
  * an array of "descriptors" in RAM; each descriptor contains
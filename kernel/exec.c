@@ -6,11 +6,244 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
+// exec() doesn't read the program in; it records the loadable
+// segments in p->seg, keeps a reference to the file in
+// p->execip, and lazyfault() pages them in as they're touched,
+// through execfault(). The pages that lie wholly inside a
+// segment's file contents are kept in the text cache while
+// any process runs the file, and shared read-only (or
+// copy-on-write, for a writable segment) by all of them; the
+// others, holding the end of the file contents or bss, are
+// private. Writing or truncating the file drops its cached
+// pages, so later faults see the new contents.
+struct textpg {
+  struct inode *ip;  // 0 if the slot is free
+  uint off;
+  char *pa;          // holds a reference of its own
+};
+
+static struct {
+  struct spinlock lock;
+  struct textpg pg[NTEXTPG];
+} textcache;
+
+void
+execinit(void)
+{
+  initlock(&textcache.lock, "textcache");
+}
+
+// drop ip's cached pages. caller holds textcache.lock.
+static void
+textdrop(struct inode *ip)
+{
+  struct textpg *t;
+
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->ip == ip){
+      kfree(t->pa);
+      t->ip = 0;
+    }
+  }
+}
+
+// another process runs ip, with a reference the caller has.
+static struct inode *
+textget(struct inode *ip)
+{
+  acquire(&textcache.lock);
+  ip->ntext++;
+  release(&textcache.lock);
+  return ip;
+}
+
+// ip's contents are about to change; called by writei() and
+// itrunc() with ip locked.
+void
+textinval(struct inode *ip)
+{
+  acquire(&textcache.lock);
+  if(ip->ntext > 0)
+    textdrop(ip);
+  release(&textcache.lock);
+}
+
+// p stops running its program.
+void
+execput(struct proc *p)
+{
+  struct inode *ip = p->execip;
+
+  if(ip == 0)
+    return;
+  acquire(&textcache.lock);
+  if(--ip->ntext == 0)
+    textdrop(ip);
+  release(&textcache.lock);
+  p->execip = 0;
+  p->nseg = 0;
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+// give fork()'s child np p's program. doesn't sleep.
+void
+execfork(struct proc *p, struct proc *np)
+{
+  if(p->execip)
+    np->execip = textget(idup(p->execip));
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
+}
+
+// lock ip shared, unless this process already holds it
+// exclusively: a write() of the program file itself faults in
+// the pages of the buffer with it locked. returns whether it
+// locked ip. (a read() holding it shared can take it again.)
+static int
+lockprog(struct inode *ip)
+{
+  if(holdingsleep(&ip->lock))
+    return 0;
+  ilockshared(ip);
+  return 1;
+}
+
+// the page at file offset off of ip from the text cache, read
+// in if it isn't there, with a reference for the caller; or 0.
+static char *
+textpage(struct inode *ip, uint off)
+{
+  struct textpg *t, *free = 0;
+  char *pa;
+  int locked;
+
+  // ip->lock keeps writei() from changing the page between
+  // reading it and caching it.
+  locked = lockprog(ip);
+  acquire(&textcache.lock);
+  for(t = textcache.pg; t < &textcache.pg[NTEXTPG]; t++){
+    if(t->ip == ip && t->off == off){
+      pa = t->pa;
+      kdup(pa);
+      release(&textcache.lock);
+      goto out;
+    }
+    if(t->ip == 0 && free == 0)
+      free = t;
+  }
+  release(&textcache.lock);
+
+  if((pa = kalloc()) == 0)
+    goto out;
+  if(readi(ip, 0, (uint64)pa, off, PGSIZE) != PGSIZE){
+    kfree(pa);
+    pa = 0;
+    goto out;
+  }
+  acquire(&textcache.lock);
+  if(free && free->ip == 0){
+    free->ip = ip;
+    free->off = off;
+    free->pa = pa;
+    kdup(pa);
+  }
+  release(&textcache.lock);
+
+ out:
+  if(locked)
+    iunlockshared(ip);
+  return pa;
+}
+
+// the segment of p's program holding va, or 0.
+struct execseg *
+execseg(struct proc *p, uint64 va)
+{
+  struct execseg *s;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      return s;
+  return 0;
+}
+
+// map the page at va of segment s of the current process's
+// program, for lazyfault(). returns 0 if it did, and -1 rather
+// than read the file under a spin lock, e.g. for a copyout()
+// from a pipe; see uvmfaultin().
+int
+execfault(pagetable_t pagetable, struct execseg *s, uint64 va)
+{
+  struct proc *p = myproc()->leader;
+  uint64 n;
+  char *pa;
+  pte_t *pte;
+  int perm, locked, r;
+
+  va = PGROUNDDOWN(va);
+  n = va - s->va;
+  if(n < s->filesz && holdingany())
+    return -1;
+  perm = PTE_R | PTE_X | PTE_U;
+  if(n + PGSIZE <= s->filesz){
+    if((pa = textpage(p->execip, s->off + n)) == 0)
+      return -1;
+    if(s->writable)
+      perm |= PTE_COW;
+  } else {
+    if((pa = kalloc_zeroed()) == 0)
+      return -1;
+    if(n < s->filesz){
+      locked = lockprog(p->execip);
+      r = readi(p->execip, 0, (uint64)pa, s->off + n, s->filesz - n);
+      if(locked)
+        iunlockshared(p->execip);
+      if(r != s->filesz - n){
+        kfree(pa);
+        return -1;
+      }
+    }
+    if(s->writable)
+      perm |= PTE_W;
+  }
+  // another thread may have faulted the page in meanwhile.
+  acquire(&p->tglock);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    r = 1;
+  else
+    r = mappages(pagetable, va, PGSIZE, (uint64)pa, perm);
+  release(&p->tglock);
+  if(r != 0)
+    kfree(pa);
+  return r < 0 ? -1 : 0;
+}
+
+// the calling process runs path instead.
 int
 exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+
+  // other user threads would be left running in the old
+  // image; kernel threads, such as uring workers, are stopped.
+  if(p->leader != p || kthreadstop(p) < 0)
+    return -1;
+  return execinto(p, path, argv);
+}
+
+// replace p's user image with path's. p is either the caller,
+// or, for spawn(), a new process that isn't running yet.
+int
+execinto(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -19,7 +252,9 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct execseg seg[NEXECSEG];
+  struct inode *text = 0;
+  int nseg = 0;
 
   begin_op();
 
@@ -27,7 +262,8 @@ exec(char *path, char **argv)
     end_op();
     return -1;
   }
-  ilock(ip);
+  // exec only reads ip, so other execs of it can go at once.
+  ilockshared(ip);
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -48,20 +284,36 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if(ph.vaddr % PGSIZE != 0)
+      goto bad;
+    if(nseg < NEXECSEG && ph.vaddr >= PGROUNDUP(sz) && ph.vaddr + ph.memsz < UMAPTOP){
+      // page it in later.
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].memsz = ph.memsz;
+      seg[nseg].off = ph.off;
+      seg[nseg].writable = (ph.flags & ELF_PROG_FLAG_WRITE) != 0;
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // keep the reference to the file for paging in the segments.
+  iunlockshared(ip);
+  if(nseg > 0)
+    text = ip;
+  else
+    iput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -109,11 +361,23 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  uringfree(p);
+#ifdef LAB_NET
+  zcrelease(p);
+  e1000_unbypass(p);
+#endif
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->asidgen = 0; // the new page table gets a new ASID
   p->sz = sz;
+  execput(p);
+  if(text)
+    p->execip = textget(text);
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  munmapall(p, oldpagetable);
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -122,7 +386,13 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
+    end_op();
+  }
+  if(text){
+    begin_op();
+    iput(text);
     end_op();
   }
   return -1;
@@ -3,3 +3,17 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_NONBLOCK 0x800
+#define O_DIRECT  0x1000 // whole-block transfers skip the buffer cache
+
+// mmap() protections and flags
+#define PROT_READ    0x1
+#define PROT_WRITE   0x2
+#define MAP_SHARED   0x1
+#define MAP_PRIVATE  0x2
+
+// fcntl() commands
+#define F_GETFL   1
+#define F_SETFL   2
+#define F_GETPIPE_SZ 3  // a pipe's capacity in bytes
+#define F_SETPIPE_SZ 4  // resize a pipe; returns the new capacity
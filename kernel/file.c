@@ -12,8 +12,18 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "poll.h"
+#include "iovec.h"
 
 struct devsw devsw[NDEV];
+
+// poll() sleeps until anything it might be waiting for changes:
+// every source of readiness calls pollwakeup(), which bumps seq.
+static struct {
+  struct spinlock lock;
+  uint seq;
+  int nwaiting;   // processes in poll()
+} pollstate;
 struct {
   struct spinlock lock;
   struct file file[NFILE];
@@ -23,6 +33,7 @@ void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  initlock(&pollstate.lock, "poll");
 }
 
 // Allocate a file structure.
@@ -82,11 +93,55 @@ fileclose(struct file *f)
   }
 #ifdef LAB_NET
   else if(ff.type == FD_SOCK){
-    sockclose(ff.sock);
+    if(ff.sotype == SOCK_STREAM)
+      tcpclose(ff.tcp);
+    else
+      sockclose(ff.sock);
   }
 #endif
 }
 
+// lock f's inode for a read through f: shared, unless another
+// process or thread could be using f's offset at once, which
+// it can't if f's only references are one descriptor and the
+// one argfd() holds for this call. Neither can change while
+// this, the only thread, is here. Returns whether it took the
+// lock shared, for unlockread().
+static int
+lockread(struct file *f)
+{
+  if(f->ref == 2 && myproc()->leader->tids == 0){
+    ilockshared(f->ip);
+    return 1;
+  }
+  ilock(f->ip);
+  return 0;
+}
+
+static void
+unlockread(struct file *f, int shared)
+{
+  if(shared)
+    iunlockshared(f->ip);
+  else
+    iunlock(f->ip);
+}
+
+// fault in the user memory at addr that a read (rd set) of up
+// to n bytes at off in ip, or a write, will copy to or from,
+// before ip is locked: the copy holds the buffer of a block of
+// ip, and a fault on a page mmap()ed from that block would wait
+// for it in mmapfault(). ip->size, read unlocked, is a hint;
+// as in pipewrite(), a failure is left for the copy.
+static void
+faultin(struct inode *ip, int user, uint64 addr, int n, uint off, int rd)
+{
+  if(rd && off + n > ip->size)
+    n = off < ip->size ? ip->size - off : 0;
+  if(user && n > 0)
+    uvmfaultin(myproc()->pagetable, addr, n, rd);
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -96,9 +151,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -106,31 +161,53 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Can n bytes at addr move between f and the disk directly,
+// at offset off? Only whole blocks of an O_DIRECT file, to or
+// from aligned user memory; anything else, even on an O_DIRECT
+// file, goes through the buffer cache.
+static int
+isdirect(struct file *f, int user, uint64 addr, int n, uint off)
+{
+  return f->direct && user && n > 0 &&
+    addr % BSIZE == 0 && n % BSIZE == 0 && off % BSIZE == 0;
+}
+
 // Read from file f.
-// addr is a user virtual address.
+// addr is a user virtual address if user is set, else a
+// kernel address.
 int
-fileread(struct file *f, uint64 addr, int n)
+fileread(struct file *f, int user, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, shared;
 
   if(f->readable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, user, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    if(f->nonblock && !(filepoll(f) & POLLIN))
+      return -1;
+    r = devsw[f->major].read(user, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    faultin(f->ip, user, addr, n, f->off, 1);
+    shared = lockread(f);
+    if(isdirect(f, user, addr, n, f->off))
+      r = readi_direct(f->ip, addr, f->off, n);
+    else
+      r = readi(f->ip, user, addr, f->off, n);
+    if(r > 0)
       f->off += r;
-    iunlock(f->ip);
+    unlockread(f, shared);
   }
 #ifdef LAB_NET
   else if(f->type == FD_SOCK){
-    r = sockread(f->sock, addr, n);
+    if(f->sotype == SOCK_STREAM)
+      r = tcpread(f->tcp, user, addr, n, f->nonblock);
+    else
+      r = sockread(f->sock, user, addr, n, 0, f->nonblock);
   }
 #endif
   else {
@@ -140,60 +217,371 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// write the niov pieces at iov to ip at *off, advancing it.
+// the pieces are grouped into as few log transactions as
+// fit: a few blocks at a time, to avoid exceeding the maximum
+// log transaction size, including i-node, indirect block,
+// allocation blocks, and 2 blocks of slop for non-aligned
+// writes. this really belongs lower down, since writei()
+// might be writing a device like the console. returns the
+// total, or -1 if not all of it was written.
+static int
+writeiv(struct inode *ip, int user, struct iovec *iov, int niov, uint *off)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int i, k = 0, r = 0, n1 = 0, room, tot = 0;
+  uint koff = 0;
+
+  for(i = 0; i < niov; i++)
+    faultin(ip, user, iov[i].base, iov[i].len, 0, 0);
+  while(k < niov){
+    begin_op();
+    ilock(ip);
+    for(room = max; room > 0 && k < niov; ){
+      if(koff == iov[k].len){
+        k++;
+        koff = 0;
+        continue;
+      }
+      n1 = iov[k].len - koff < room ? iov[k].len - koff : room;
+      if((r = writei(ip, user, iov[k].base + koff, *off, n1)) > 0){
+        *off += r;
+        koff += r;
+        room -= r;
+        tot += r;
+      }
+      if(r != n1)
+        break; // error from writei
+    }
+    iunlock(ip);
+    end_op();
+    if(r != n1)
+      return -1;
+  }
+  return tot;
+}
+
+// write n bytes at user address addr to ip at *off, advancing
+// it, for an O_DIRECT file: up to NDIRECTIO blocks per
+// transaction, fewer where it adds blocks to the file, since
+// their allocation is what goes through the log (see
+// writei_direct()). returns n, or -1 if not all of it was
+// written.
+static int
+writedirect(struct inode *ip, uint64 addr, int n, uint *off)
+{
+  int n1, r, tot = 0;
+
+  faultin(ip, 1, addr, n, 0, 0);
+  while(tot < n){
+    n1 = n - tot < NDIRECTIO*BSIZE ? n - tot : NDIRECTIO*BSIZE;
+    begin_op();
+    ilock(ip);
+    if((r = writei_direct(ip, addr + tot, *off, n1)) > 0){
+      *off += r;
+      tot += r;
+    }
+    iunlock(ip);
+    end_op();
+    if(r <= 0)
+      return -1;
+  }
+  return tot;
+}
+
 // Write to file f.
-// addr is a user virtual address.
+// addr is a user virtual address if user is set, else a
+// kernel address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+filewrite(struct file *f, int user, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
+    struct iovec iov = { addr, n };
+    if(isdirect(f, user, addr, n, f->off))
+      ret = writedirect(f->ip, addr, n, &f->off);
+    else
+      ret = writeiv(f->ip, user, &iov, 1, &f->off);
+  }
+#ifdef LAB_NET
+  else if(f->type == FD_SOCK){
+    if(f->sotype == SOCK_STREAM)
+      ret = tcpwrite(f->tcp, user, addr, n, f->nonblock);
+    else
+      ret = sockwrite(f->sock, user, addr, n);
+  }
+#endif
+  else {
+    panic("filewrite");
+  }
 
-      if(r != n1){
-        // error from writei
-        break;
+  return ret;
+}
+
+// Read into the niov pieces at iov, user addresses, in order.
+// A file is read under one lockread(), so the pieces are
+// contiguous in it. Stops after a short read.
+int
+filereadv(struct file *f, struct iovec *iov, int niov)
+{
+  int i, r = 0, tot = 0, shared;
+  uint off;
+
+  if(f->readable == 0)
+    return -1;
+  if(f->type == FD_INODE){
+    for(i = 0, off = f->off; i < niov; off += iov[i].len, i++)
+      faultin(f->ip, 1, iov[i].base, iov[i].len, off, 1);
+    shared = lockread(f);
+    for(i = 0; i < niov; i++){
+      if((r = readi(f->ip, 1, iov[i].base, f->off, iov[i].len)) > 0){
+        f->off += r;
+        tot += r;
       }
-      i += r;
+      if(r != iov[i].len)
+        break;
     }
-    ret = (i == n ? n : -1);
+    unlockread(f, shared);
+    return tot > 0 || r == 0 ? tot : -1;
+  }
+  for(i = 0; i < niov; i++){
+    if((r = fileread(f, 1, iov[i].base, iov[i].len)) > 0)
+      tot += r;
+    if(r != iov[i].len)
+      break;
+  }
+  return tot > 0 || r == 0 ? tot : -1;
+}
+
+// Write the niov pieces at iov, user addresses, in order. A
+// file gets them in as few log transactions as fit, and a
+// UDP socket sends them as one datagram.
+int
+filewritev(struct file *f, struct iovec *iov, int niov)
+{
+  int i, r = 0, tot = 0;
+
+  if(f->writable == 0)
+    return -1;
+  if(f->type == FD_INODE)
+    return writeiv(f->ip, 1, iov, niov, &f->off);
+#ifdef LAB_NET
+  if(f->type == FD_SOCK && f->sotype == SOCK_DGRAM)
+    return sockwritev(f->sock, iov, niov);
+#endif
+  for(i = 0; i < niov; i++){
+    if((r = filewrite(f, 1, iov[i].base, iov[i].len)) > 0)
+      tot += r;
+    if(r != iov[i].len)
+      break;
+  }
+  return tot > 0 || r == 0 ? tot : -1;
+}
+
+// read or write n bytes at user addr, at offset off of the
+// file f, leaving f's offset alone.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  faultin(f->ip, 1, addr, n, off, 1);
+  ilockshared(f->ip);
+  if(isdirect(f, 1, addr, n, off))
+    r = readi_direct(f->ip, addr, off, n);
+  else
+    r = readi(f->ip, 1, addr, off, n);
+  iunlockshared(f->ip);
+  return r;
+}
+
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  struct iovec iov = { addr, n };
+
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  if(isdirect(f, 1, addr, n, off))
+    return writedirect(f->ip, addr, n, &off);
+  return writeiv(f->ip, 1, &iov, 1, &off);
+}
+
+// Move up to n bytes from in to out inside the kernel, a page
+// at a time, through a kernel page rather than user memory.
+// Pipes trade whole pages with that page instead of copying
+// where they can (see pipereadpage()). Stops at end of file or
+// after a short read. out must not be O_NONBLOCK, since bytes
+// read from in would have nowhere to go. Returns the number of
+// bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *page;
+  int k, r = 0, w, tot = 0;
+
+  if(!in->readable || !out->writable || out->nonblock || n < 0)
+    return -1;
+  if((page = kalloc()) == 0)
+    return -1;
+  while(tot < n){
+    k = n - tot < PGSIZE ? n - tot : PGSIZE;
+    if(in->type == FD_PIPE)
+      r = pipereadpage(in->pipe, &page, k, in->nonblock);
+    else
+      r = fileread(in, 0, (uint64)page, k);
+    if(r <= 0)
+      break;
+    if(out->type == FD_PIPE)
+      w = pipewritepage(out->pipe, &page, r, 0);
+    else
+      w = filewrite(out, 0, (uint64)page, r);
+    if(w > 0)
+      tot += w;
+    if(w != r){
+      r = -1;
+      break;
+    }
+    if(r < k)
+      break;
+  }
+  kfree(page);
+  return tot > 0 || r == 0 ? tot : -1;
+}
+
+
+// Return the POLLIN/POLLOUT/POLLHUP events ready on f now.
+int
+filepoll(struct file *f)
+{
+  int ev;
+
+  if(f->type == FD_PIPE){
+    ev = pipepoll(f->pipe);
+  } else if(f->type == FD_DEVICE){
+    ev = POLLIN | POLLOUT;
+    if(f->major >= 0 && f->major < NDEV && devsw[f->major].poll)
+      ev = devsw[f->major].poll();
   }
 #ifdef LAB_NET
   else if(f->type == FD_SOCK){
-    ret = sockwrite(f->sock, addr, n);
+    if(f->sotype == SOCK_STREAM)
+      ev = tcppoll(f->tcp);
+    else
+      ev = sockpoll(f->sock);
   }
 #endif
   else {
-    panic("filewrite");
+    ev = POLLIN | POLLOUT;
   }
 
-  return ret;
+  if(!f->readable)
+    ev &= ~POLLIN;
+  if(!f->writable)
+    ev &= ~POLLOUT;
+  return ev;
 }
 
+// Readiness may have changed; wake up poll()ers.
+// Cheap if nobody is polling. Callers make the change (under
+// their own lock) before calling, and poll() checks readiness
+// after announcing itself in nwaiting, so one of the two sees
+// the other.
+void
+pollwakeup(void)
+{
+  __sync_synchronize();
+  if(pollstate.nwaiting == 0)
+    return;
+  acquire(&pollstate.lock);
+  pollstate.seq++;
+  wakeup(&pollstate.seq);
+  release(&pollstate.lock);
+}
+
+// Wait until at least one of the n struct pollfds at user
+// address addr is ready, or timeout ticks pass (never, if
+// timeout is negative). Return the number of ready fds.
+int
+pollfds(uint64 addr, int n, int timeout)
+{
+  struct proc *p = myproc();
+  struct pollfd pfd;
+  struct file *f;
+  uint64 deadline;
+  uint seq;
+  int i, ready;
+
+  acquire(&pollstate.lock);
+  pollstate.nwaiting++;
+  release(&pollstate.lock);
+
+  // the timeout is in ticks, but runs on an hrtimer rather
+  // than being checked at each tick.
+  deadline = r_time() + (uint64)(timeout > 0 ? timeout : 0) * TICKINTERVAL;
+
+  for(;;){
+    acquire(&pollstate.lock);
+    seq = pollstate.seq;
+    release(&pollstate.lock);
+
+    ready = 0;
+    for(i = 0; i < n; i++){
+      if(copyin(p->pagetable, (char*)&pfd, addr + i*sizeof(pfd), sizeof(pfd)) < 0){
+        ready = -1;
+        goto out;
+      }
+      f = 0;
+      if(pfd.fd >= 0 && pfd.fd < NOFILE){
+        // keep f open even if another thread close()s it.
+        acquire(&p->leader->tglock);
+        if((f = p->leader->ofile[pfd.fd]) != 0)
+          filedup(f);
+        release(&p->leader->tglock);
+      }
+      if(f == 0)
+        pfd.revents = POLLNVAL;
+      else {
+        pfd.revents = filepoll(f) & (pfd.events | POLLHUP);
+        fileclose(f);
+      }
+      if(pfd.revents)
+        ready++;
+      if(copyout(p->pagetable, addr + i*sizeof(pfd), (char*)&pfd, sizeof(pfd)) < 0){
+        ready = -1;
+        goto out;
+      }
+    }
+    if(ready > 0 || timeout == 0 || p->killed)
+      break;
+    if(timeout > 0 && r_time() >= deadline)
+      break;
+
+    acquire(&pollstate.lock);
+    if(pollstate.seq == seq){
+      if(timeout > 0)
+        sleepuntil(&pollstate.seq, &pollstate.lock, deadline);
+      else
+        sleep(&pollstate.seq, &pollstate.lock);
+    }
+    release(&pollstate.lock);
+  }
+
+out:
+  acquire(&pollstate.lock);
+  pollstate.nwaiting--;
+  release(&pollstate.lock);
+  return p->killed ? -1 : ready;
+}
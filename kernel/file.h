@@ -7,15 +7,22 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;     // O_NONBLOCK: fail rather than wait
+  char direct;       // O_DIRECT, see fileread()
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
 #ifdef LAB_NET
-  struct sock *sock; // FD_SOCK
+  char sotype;       // FD_SOCK: SOCK_DGRAM or SOCK_STREAM
+  struct sock *sock; // FD_SOCK, SOCK_DGRAM
+  struct tcpcb *tcp; // FD_SOCK, SOCK_STREAM
 #endif
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
 };
 
+#define SOCK_DGRAM  1 // UDP
+#define SOCK_STREAM 2 // TCP
+
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
@@ -25,24 +32,35 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // in its hash bucket, see fs.c
+  struct inode *freenext; // on the free list, if ref is 0
+  struct inode *freeprev;
+  int ntext;          // processes running this file, see exec.c
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // readahead: the block a sequential read reads next
+  uint raend;         // readahead: blocks before this have been started
+  uint rawin;         // readahead: blocks to read ahead
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
 };
 
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(void);  // POLLIN/POLLOUT readiness; 0 means always ready
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
 #define STATS   2
+#define NETSTATS 3
+#define TRACEDEV 4
+#define PROFDEV  5
@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "rwlock.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -26,6 +27,8 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +47,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
 }
 
 // Zero a block.
@@ -60,27 +64,127 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+#define NBITMAP (FSSIZE/BPB + 1)
+
+// A summary of the free map, so that balloc() needn't read the
+// bitmap blocks that have nothing free, or scan the parts that
+// are full: for each bitmap block, the number of free blocks it
+// covers, and a bit below which none are free. balloc() and
+// bfree() update it in step with the bitmap, with the bitmap
+// block locked. cursor is just after the last block allocated,
+// where allocations without a hint start looking. There is one
+// file system, so one of these.
+static struct {
+  struct spinlock lock;
+  uint cursor;
+  int nfree[NBITMAP];
+  int first[NBITMAP];
+} bsum;
+
+// Find a clear bit in bitmap block data at or after bit from,
+// and before bit end, 64 bits at a time. Returns -1 if none.
+static int
+bitscan(uchar *data, int from, int end)
+{
+  uint64 *w = (uint64*)data, x;
+  int i, bi;
+
+  for(i = from / 64; i * 64 < end; i++){
+    x = w[i];
+    if(i == from / 64)
+      x |= (1UL << (from % 64)) - 1;
+    if(x == ~0UL)
+      continue;
+    for(bi = i * 64; x & 1; bi++)
+      x >>= 1;
+    return bi < end ? bi : -1;
+  }
+  return -1;
+}
+
+// blocks covered by bitmap block i.
+static int
+bitmapbits(int i)
+{
+  return min(BPB, sb.size - i * BPB);
+}
+
+// Count the free blocks, once the log has been recovered.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  int i, bi;
+
+  initlock(&bsum.lock, "bsum");
+  if(sb.size > NBITMAP * BPB)
+    panic("bsuminit: file system too big");
+  for(i = 0; i * BPB < sb.size; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    bsum.first[i] = -1;
+    for(bi = 0; bi < bitmapbits(i); bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+        if(bsum.first[i] < 0)
+          bsum.first[i] = bi;
+        bsum.nfree[i]++;
+      }
+    }
+    if(bsum.first[i] < 0)
+      bsum.first[i] = bitmapbits(i);
+    brelse(bp);
+  }
+}
+
+// Allocate a disk block: the first free one at or after near,
+// so that a file's blocks tend to be contiguous, wrapping
+// around to the start of the disk. If near is 0, start where
+// the last allocation ended. The block is zeroed, unless the
+// caller is about to overwrite all of it without the log's
+// help (see writei_direct()).
 static uint
-balloc(uint dev)
+balloc(uint dev, uint near, int zero)
 {
-  int b, bi, m;
+  int n = (sb.size + BPB - 1) / BPB;
+  int i, k, bi, from, skip;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(near == 0 || near >= sb.size){
+    acquire(&bsum.lock);
+    near = bsum.cursor;
+    release(&bsum.lock);
+  }
+
+  // n+1 steps, to come back to the start of near's bitmap block.
+  i = near / BPB;
+  from = near % BPB;
+  for(k = 0; k <= n; k++, i = (i + 1) % n, from = 0){
+    acquire(&bsum.lock);
+    skip = bsum.nfree[i] == 0;
+    release(&bsum.lock);
+    if(skip)
+      continue;
+
+    bp = bread(dev, sb.bmapstart + i);
+    acquire(&bsum.lock);
+    if(from < bsum.first[i])
+      from = bsum.first[i];
+    release(&bsum.lock);
+    if((bi = bitscan(bp->data, from, bitmapbits(i))) < 0){
+      brelse(bp);
+      continue;
     }
+    bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+    log_write(bp);
+    acquire(&bsum.lock);
+    bsum.nfree[i]--;
+    if(from == bsum.first[i])
+      bsum.first[i] = bi + 1;
+    bsum.cursor = i * BPB + bi + 1;
+    release(&bsum.lock);
     brelse(bp);
+    if(zero)
+      bzero(dev, i * BPB + bi);
+    return i * BPB + bi;
   }
   panic("balloc: out of blocks");
 }
@@ -99,6 +203,11 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  if(bi < bsum.first[b / BPB])
+    bsum.first[b / BPB] = bi;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -162,32 +271,113 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cached inodes are hashed by (dev, inum) into NIBUCKET
+// buckets, each with a spin-lock that protects its list and the
+// ref of the inodes on it. Unreferenced inodes are also on a
+// free list, oldest first, under icache.freelock; a miss in
+// iget() recycles the first. icache.lock serializes misses, so
+// two CPUs can't both cache the same inode. Since ip->ref
+// indicates whether an entry is free, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold the
+// bucket's lock while changing any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct ibucket bucket[NIBUCKET];
+  struct spinlock freelock;
+  struct inode freelist;  // head of the circular free list
 } icache;
 
+static struct ibucket *
+ibucketof(uint dev, uint inum)
+{
+  return &icache.bucket[(dev * 31 + inum) % NIBUCKET];
+}
+
+// take ip off the free list. caller holds icache.freelock.
+static void
+freeunlink(struct inode *ip)
+{
+  ip->freeprev->freenext = ip->freenext;
+  ip->freenext->freeprev = ip->freeprev;
+}
+
+// put ip at the end of the free list.
+// caller holds icache.freelock.
+static void
+freeappend(struct inode *ip)
+{
+  ip->freenext = &icache.freelist;
+  ip->freeprev = icache.freelist.freeprev;
+  icache.freelist.freeprev->freenext = ip;
+  icache.freelist.freeprev = ip;
+}
+
+// add a reference to ip, taking it off the free list if this
+// is the first. caller holds ip's bucket lock.
+static void
+iref(struct inode *ip)
+{
+  if(ip->ref++ == 0){
+    acquire(&icache.freelock);
+    freeunlink(ip);
+    release(&icache.freelock);
+  }
+}
+
+// The dentry cache remembers what dirlookup() found, name by
+// name: (directory, name) -> inum and offset, or that the name
+// isn't there (inum 0). An entry is changed only with the
+// directory locked, by dirlookup(), dirlink() and dcacheset(),
+// so it's as good as the directory's contents; entries of a
+// directory go away when its inode is freed. Entries are
+// recycled round-robin. Lookups only read the cache, so path
+// walks on different CPUs share its lock.
+struct dentry {
+  uint dev;
+  uint dinum;        // directory; 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;         // 0 if name isn't in the directory
+  uint off;          // of name's dirent
+  struct dentry *next; // in its hash chain
+};
+
+struct {
+  struct rwlock lock;
+  struct dentry ent[NDENTRY];
+  struct dentry *hash[NDHASH];
+  int hand;          // next entry to recycle
+} dcache;
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
+  initlock(&icache.freelock, "icache.free");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+  icache.freelist.freenext = icache.freelist.freeprev = &icache.freelist;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    freeappend(&icache.inode[i]);
   }
+  initrwlock(&dcache.lock, "dcache");
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcachepurge(uint dev, uint dinum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -239,34 +429,83 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// The inode for (dev, inum) in bk, with a new reference,
+// or 0. Caller holds bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      iref(ip);
+      return ip;
+    }
+  }
+  return 0;
+}
+
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bk = ibucketof(dev, inum), *vb;
+  struct inode *ip, **pp;
 
+  // Is the inode already cached?
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Not cached. Check again, now that no other CPU can be
+  // recycling an entry for it.
   acquire(&icache.lock);
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip){
+    release(&icache.lock);
+    return ip;
+  }
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
+  // Recycle the entry unused longest. Its bucket must be locked
+  // before the free list, so look, lock, and look again.
+  for(;;){
+    acquire(&icache.freelock);
+    ip = icache.freelist.freenext;
+    if(ip == &icache.freelist)
+      panic("iget: no inodes");
+    vb = ip->inum ? ibucketof(ip->dev, ip->inum) : 0;
+    release(&icache.freelock);
+    if(vb)
+      acquire(&vb->lock);
+    acquire(&icache.freelock);
+    if(icache.freelist.freenext == ip && ip->ref == 0){
+      freeunlink(ip);
+      release(&icache.freelock);
+      break;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    release(&icache.freelock);
+    if(vb)
+      release(&vb->lock);
+  }
+  if(vb){
+    for(pp = &vb->head; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&vb->lock);
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  acquire(&bk->lock);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->raend = ip->rawin = 0;
+  ip->next = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
   release(&icache.lock);
 
   return ip;
@@ -277,9 +516,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ibucketof(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -322,6 +563,33 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the inode in shared mode, for reading: other readers
+// may hold it at the same time, but no writer. The readahead
+// hints are then updated by several readers at once, which
+// at worst wastes a prefetch.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  // the caller's reference keeps ip valid once it is.
+  if(ip->valid == 0){
+    ilock(ip);
+    iunlock(ip);
+  }
+  acquiresleepshared(&ip->lock);
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || !holdingsleepshared(&ip->lock) || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
@@ -332,7 +600,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ibucketof(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,20 +611,26 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bk->lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcachepurge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bk->lock);
   }
 
-  ip->ref--;
-  release(&icache.lock);
+  if(--ip->ref == 0){
+    acquire(&icache.freelock);
+    freeappend(ip);
+    release(&icache.freelock);
+  }
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -370,19 +646,42 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT after
+// that are listed in the blocks listed in block
+// ip->addrs[NDIRECT+1].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Return entry i of indirect block addr, allocating a block
+// for it if there is none, after the entry before it if that
+// one is there and otherwise near near; zero as for balloc().
 static uint
-bmap(struct inode *ip, uint bn)
+indirect(struct inode *ip, uint addr, uint i, uint near, int zero)
 {
-  uint addr, *a;
   struct buf *bp;
+  uint *a, x;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((x = a[i]) == 0){
+    if(i > 0 && a[i-1])
+      near = a[i-1] + 1;
+    a[i] = x = balloc(ip->dev, near, zero);
+    log_write(bp);
+  }
+  brelse(bp);
+  return x;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, zeroed if
+// zero is set; indirect blocks are always zeroed.
+static uint
+bmap(struct inode *ip, uint bn, int zero)
+{
+  uint addr, mid;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0, zero);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,29 +689,54 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : 0, 1);
+    return indirect(ip, addr, bn, addr + 1, zero);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the doubly-indirect block, then the indirect
+    // block it lists for bn.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev, 0, 1);
+    mid = indirect(ip, addr, bn / NINDIRECT, addr + 1, 1);
+    return indirect(ip, mid, bn % NINDIRECT, mid + 1, zero);
   }
 
   panic("bmap: out of range");
 }
 
+// Free indirect block addr and the blocks it lists, down to
+// depth more levels of indirection.
+static void
+ifree(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      ifree(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
+  textinval(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -420,16 +744,11 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 2; i++){
+    if(ip->addrs[NDIRECT+i]){
+      ifree(ip->dev, ip->addrs[NDIRECT+i], i);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
@@ -448,6 +767,34 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Readahead. When readi() moves on to the block after the one
+// it read last from ip, it starts reading the next rawin blocks
+// of the file into the buffer cache, so that the disk works on
+// them while the caller uses this one. The window doubles with
+// each sequential block, from RAMIN up to RAMAX, and closes on
+// a seek; raend is where the blocks already started end.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end;
+
+  if(bn + 1 == ip->ranext)
+    return; // more of the same block
+  if(bn != ip->ranext){
+    ip->ranext = ip->raend = bn + 1;
+    ip->rawin = 0;
+    return;
+  }
+  ip->ranext = bn + 1;
+  ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  end = min(bn + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  if(ip->raend < bn + 1)
+    ip->raend = bn + 1;
+  for(; ip->raend < end; ip->raend++)
+    breadahead(ip->dev, bmap(ip, ip->raend, 1));
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -464,7 +811,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    readahead(ip, off/BSIZE);
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -493,9 +841,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  textinval(ip);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -516,6 +865,140 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Direct I/O, for O_DIRECT files: whole blocks move between
+// the disk and the user's pages, without a copy in the buffer
+// cache. off, n and the user address must be multiples of
+// BSIZE. Blocks that are cached anyway are copied to or from
+// the cache instead, so that it never holds a stale copy; the
+// rest go to the disk NDIRECTIO at a time, consecutive blocks
+// in one request.
+
+// Most new blocks writei_direct() adds in one transaction. Each
+// may dirty a bitmap block; the log must also hold the i-node,
+// and when the file grows into its indirect blocks, the ones
+// it changes and allocates and their bitmap blocks: at worst
+// 5, moving from the singly- to the doubly-indirect blocks.
+#define DIRECTALLOC (MAXOPBLOCKS-1-5)
+
+// Move the k blocks in blockno[] between the disk and the user
+// pages pinned at mem[], and unpin the pages.
+static int
+directio(uint dev, uint *blockno, uchar **mem, int k, int write)
+{
+  int i, r;
+
+  r = bdirect(dev, blockno, mem, k, write);
+  for(i = 0; i < k; i++)
+    kfree((void*)PGROUNDDOWN((uint64)mem[i]));
+  return r;
+}
+
+// Read like readi() from a user address, but directly. A
+// partial last block of the file is read whole, since dst has
+// room for it. Caller must hold ip->lock.
+int
+readi_direct(struct inode *ip, uint64 dst, uint off, uint n)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  uint blockno[NDIRECTIO], tot, m, bn;
+  uchar *mem[NDIRECTIO];
+  uint64 pa;
+  struct buf *bp;
+  int k;
+
+  if(off % BSIZE || n % BSIZE || dst % BSIZE)
+    return -1;
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0, k=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, BSIZE);
+    bn = bmap(ip, off/BSIZE, 1);
+    if((bp = bpeek(ip->dev, bn)) != 0){
+      if(copyout(pagetable, dst, (char*)bp->data, m) < 0){
+        brelse(bp);
+        break;
+      }
+      brelse(bp);
+      continue;
+    }
+    if((pa = uvmpin(pagetable, dst, 1)) == 0)
+      break;
+    blockno[k] = bn;
+    mem[k++] = (uchar*)pa;
+    if(k == NDIRECTIO){
+      if(directio(ip->dev, blockno, mem, k, 0) < 0)
+        return -1;
+      k = 0;
+    }
+  }
+  if(directio(ip->dev, blockno, mem, k, 0) < 0 || tot < n)
+    return -1;
+  return tot;
+}
+
+// Write like writei() from a user address, but directly. Only
+// the blocks' allocation and the inode go through the log:
+// new blocks aren't zeroed first, and their contents reach the
+// disk before the transaction that makes them part of the
+// file commits. Cached blocks are updated in the cache and
+// written home, or log_write()n if the open transaction
+// already holds them. At most n/BSIZE <= NDIRECTIO blocks are
+// written, of which at most DIRECTALLOC are new, so that the
+// caller's transaction can hold what they change. Returns the
+// number of bytes written, maybe fewer than n; caller must
+// hold ip->lock.
+int
+writei_direct(struct inode *ip, uint64 src, uint off, uint n)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  uint blockno[NDIRECTIO], tot, bn;
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE, nalloc = 0;
+  uchar *mem[NDIRECTIO];
+  uint64 pa;
+  struct buf *bp;
+  int k = 0;
+
+  if(off % BSIZE || n % BSIZE || src % BSIZE || n > NDIRECTIO*BSIZE)
+    return -1;
+  if(off > ip->size || off + n < off)
+    return -1;
+  if(off + n > MAXFILE*BSIZE)
+    return -1;
+  textinval(ip);
+
+  for(tot=0; tot<n; tot+=BSIZE){
+    if((off + tot)/BSIZE >= nblocks && nalloc++ == DIRECTALLOC)
+      break; // the transaction has no room for another
+    if((pa = uvmpin(pagetable, src + tot, 0)) == 0)
+      break;
+    bn = bmap(ip, (off + tot)/BSIZE, 0);
+    if((bp = bpeek(ip->dev, bn)) != 0){
+      memmove(bp->data, (char*)pa, BSIZE);
+      kfree((void*)PGROUNDDOWN(pa));
+      if(log_holds(bn))
+        log_write(bp);
+      else
+        bwrite(bp);
+      brelse(bp);
+      continue;
+    }
+    blockno[k] = bn;
+    mem[k++] = (uchar*)pa;
+  }
+  if(directio(ip->dev, blockno, mem, k, 1) < 0)
+    tot = 0;
+
+  // a failure leaves blocks past the new size, as writei() can,
+  // so their old contents are never visible.
+  if(off + tot > ip->size)
+    ip->size = off + tot;
+  iupdate(ip);
+  return tot;
+}
+
 // Directories
 
 int
@@ -524,6 +1007,106 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static struct dentry **
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// find dp's entry for name. caller holds dcache.lock.
+static struct dentry *
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dhash(dev, dinum, name); d; d = d->next)
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// unhook d from its hash chain. caller holds dcache.lock.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dhash(d->dev, d->dinum, d->name); *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dinum = 0;
+}
+
+// Record that name in directory dp is inum at offset off, or,
+// if inum is 0, isn't there. Caller must hold dp->lock, and
+// call this whenever it changes dp's entry for name.
+void
+dcacheset(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquirewrite(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    d = &dcache.ent[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDENTRY;
+    if(d->dinum)
+      dunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    struct dentry **pp = dhash(d->dev, d->dinum, d->name);
+    d->next = *pp;
+    *pp = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  releasewrite(&dcache.lock);
+}
+
+// Look name up in directory dp in the dentry cache. Returns 0
+// if it isn't cached, -1 if it is known not to be in dp, and
+// 1 with *ipp set (as by iget()) and *poff (if poff isn't 0)
+// set if it is. dp needn't be locked: the reference keeps the
+// entry's inode from being freed even if it is unlinked now.
+static int
+dcacheget(struct inode *dp, char *name, struct inode **ipp, uint *poff)
+{
+  struct dentry *d;
+  int r = 0;
+
+  acquireread(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) != 0){
+    if(d->inum == 0){
+      r = -1;
+    } else {
+      *ipp = iget(dp->dev, d->inum);
+      if(poff)
+        *poff = d->off;
+      r = 1;
+    }
+  }
+  releaseread(&dcache.lock);
+  return r;
+}
+
+// forget the entries of a directory that is being freed,
+// before its inode number can be reused.
+static void
+dcachepurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquirewrite(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDENTRY]; d++)
+    if(d->dinum == dinum && d->dev == dev)
+      dunhash(d);
+  releasewrite(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -531,10 +1114,15 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct inode *ip;
+  int r;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if((r = dcacheget(dp, name, &ip, poff)) != 0)
+    return r > 0 ? ip : 0;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -545,10 +1133,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcacheset(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheset(dp, name, 0, 0);
   return 0;
 }
 
@@ -578,6 +1168,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheset(dp, name, inum, off);
 
   return 0;
 }
@@ -629,6 +1220,7 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  int r;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
@@ -636,6 +1228,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // a cached entry means ip is a directory; skip locking it.
+    if(!(nameiparent && *path == '\0') &&
+       (r = dcacheget(ip, name, &next, 0)) != 0){
+      iput(ip);
+      if(r < 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
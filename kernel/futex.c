@@ -0,0 +1,94 @@
+// Futexes, for locks in user space: a thread only enters the
+// kernel to wait for a contended lock, in futex_wait(), or to
+// wake its waiters, in futex_wake(); the uncontended paths are
+// plain atomic instructions in user/ulock.c.
+//
+// A futex is keyed on the physical address of its word, so all
+// the threads of a process, and processes sharing a MAP_SHARED
+// page, agree on it. Waiters sleep with that address as the
+// channel, under the lock of its bucket in a small hash table;
+// futex_wake() holds the same lock, so that a wake can't slip
+// in between a waiter's check of the word and its sleep.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+static struct spinlock futexq[NFUTEX];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i], "futex");
+}
+
+static struct spinlock *
+futexlock(uint64 pa)
+{
+  return &futexq[(pa / sizeof(int)) % NFUTEX];
+}
+
+// the physical address of the int at user address addr, or 0.
+// a copy-on-write page is copied first, or the next store to
+// it would move the futex to another page.
+static uint64
+futexkey(uint64 addr)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  pte_t *pte;
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0 || walkaddr(pagetable, addr) == 0)
+    return 0;
+  pte = walk(pagetable, addr, 0);
+  if((*pte & PTE_COW) && cowfault(pagetable, addr) < 0)
+    return 0;
+  if((pa = walkaddr(pagetable, addr)) == 0)
+    return 0;
+  return pa + (addr % PGSIZE);
+}
+
+// sleep until futex_wake() on addr, if the int there still
+// holds val. returns 0 when woken, which may be spuriously,
+// or -1 if it didn't hold val or the process was killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexkey(addr)) == 0)
+    return -1;
+  lk = futexlock(pa);
+  acquire(lk);
+  if(__atomic_load_n((int *)pa, __ATOMIC_SEQ_CST) != val){
+    release(lk);
+    return -1;
+  }
+  sleep((void *)pa, lk);
+  release(lk);
+  return myproc()->killed ? -1 : 0;
+}
+
+// wake up to n threads waiting on addr. returns how many
+// were woken, or -1.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int r;
+
+  if((pa = futexkey(addr)) == 0)
+    return -1;
+  lk = futexlock(pa);
+  acquire(lk);
+  r = wakeupn((void *)pa, n);
+  release(lk);
+  return r;
+}
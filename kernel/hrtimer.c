@@ -0,0 +1,221 @@
+//
+// high-resolution timeouts.
+//
+// the clock tick is TICKINTERVAL time CSR counts (~100 ms),
+// too coarse for short sleeps and network timeouts. a timer
+// here instead has a deadline in time CSR counts, and sits in
+// the heap of the CPU that armed it. the heap's earliest
+// deadline goes in timer_scratch[hart][7], and timervec sets
+// mtimecmp to whichever comes first, it or the next tick, so
+// the timer interrupt arrives on time; devintr() then calls
+// hrtimerintr() to wake the sleepers whose time has come.
+//
+// kernel code waits with sleepuntil(); user code with
+// nanosleep().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+// timervec's per-CPU scratch areas, in start.c.
+extern uint64 timer_scratch[NCPU][10];
+
+struct hrtimer {
+  uint64 when;          // time CSR value at which to wake chan
+  void *chan;
+  int cpu;              // whose heap it's on, or -1
+  int idx;              // where in that heap
+};
+
+// each process waits on at most one timer at a time.
+static struct hrheap {
+  struct spinlock lock;
+  int n;
+  struct hrtimer *h[NPROC];
+} hrheap[NCPU];
+
+static struct spinlock nslock; // for nanosleep()
+
+void
+hrtimerinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&hrheap[i].lock, "hrtimer");
+  initlock(&nslock, "nanosleep");
+}
+
+static void
+hrswap(struct hrheap *q, int i, int j)
+{
+  struct hrtimer *t = q->h[i];
+
+  q->h[i] = q->h[j];
+  q->h[j] = t;
+  q->h[i]->idx = i;
+  q->h[j]->idx = j;
+}
+
+static void
+siftup(struct hrheap *q, int i)
+{
+  for(; i > 0 && q->h[i]->when < q->h[(i-1)/2]->when; i = (i-1)/2)
+    hrswap(q, i, (i-1)/2);
+}
+
+static void
+siftdown(struct hrheap *q, int i)
+{
+  int c;
+
+  for(; (c = 2*i + 1) < q->n; i = c){
+    if(c + 1 < q->n && q->h[c+1]->when < q->h[c]->when)
+      c++;
+    if(q->h[i]->when <= q->h[c]->when)
+      break;
+    hrswap(q, i, c);
+  }
+}
+
+static void
+hrremove(struct hrheap *q, struct hrtimer *t)
+{
+  int i = t->idx;
+
+  q->n--;
+  if(i != q->n){
+    q->h[i] = q->h[q->n];
+    q->h[i]->idx = i;
+    siftdown(q, i);
+    siftup(q, i);
+  }
+  __atomic_store_n(&t->cpu, -1, __ATOMIC_RELEASE);
+}
+
+// tell timervec about this CPU's earliest deadline. mtimecmp
+// is written only earlier than timervec would set it, so a
+// race with timervec costs at most a spurious interrupt.
+// caller holds q->lock, on q's CPU.
+static void
+hrprogram(int cpu)
+{
+  struct hrheap *q = &hrheap[cpu];
+  uint64 next = q->n ? q->h[0]->when : ~0ULL;
+
+  __atomic_store_n(&timer_scratch[cpu][7], next, __ATOMIC_RELEASE);
+  if(next < __atomic_load_n(&timer_scratch[cpu][8], __ATOMIC_ACQUIRE))
+    *(volatile uint64 *)CLINT_MTIMECMP(cpu) = next;
+}
+
+// arm t on this CPU.
+static void
+hrstart(struct hrtimer *t)
+{
+  struct hrheap *q;
+  int cpu;
+
+  push_off();
+  cpu = cpuid();
+  q = &hrheap[cpu];
+  acquire(&q->lock);
+  if(q->n == NELEM(q->h))
+    panic("hrstart");
+  t->cpu = cpu;
+  t->idx = q->n;
+  q->h[q->n++] = t;
+  siftup(q, t->idx);
+  if(t->idx == 0)
+    hrprogram(cpu);
+  release(&q->lock);
+  pop_off();
+}
+
+// disarm t, if it hasn't gone off. once this returns,
+// hrtimerintr() is done with t.
+static void
+hrcancel(struct hrtimer *t)
+{
+  struct hrheap *q;
+  int cpu;
+
+  if((cpu = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE)) < 0)
+    return;
+  q = &hrheap[cpu];
+  acquire(&q->lock);
+  if(t->cpu == cpu)
+    hrremove(q, t);
+  release(&q->lock);
+}
+
+// called by devintr() on each timer interrupt, and on IPIs,
+// with interrupts off. wakes the channels of this CPU's
+// expired timers, and returns how many there were.
+int
+hrtimerintr(void)
+{
+  int cpu = cpuid();
+  struct hrheap *q = &hrheap[cpu];
+  struct hrtimer *t;
+  uint64 now;
+  void *chan;
+  int n = 0;
+
+  if(q->n == 0)
+    return 0;
+  acquire(&q->lock);
+  now = r_time();
+  while(q->n > 0 && (t = q->h[0])->when <= now){
+    chan = t->chan;
+    hrremove(q, t);
+    wakeup(chan);
+    n++;
+  }
+  hrprogram(cpu);
+  release(&q->lock);
+  return n;
+}
+
+// like sleep(chan, lk), but also woken once the time CSR
+// reaches when. returns 1 if it has, 0 if something else
+// woke chan first. the caller must hold lk, a spinlock, which
+// keeps it on this CPU until it's asleep, so the timer can't
+// go off early enough to be missed.
+int
+sleepuntil(void *chan, struct spinlock *lk, uint64 when)
+{
+  struct hrtimer t;
+
+  if(r_time() >= when)
+    return 1;
+  t.when = when;
+  t.chan = chan;
+  hrstart(&t);
+  sleep(chan, lk);
+  hrcancel(&t);
+  return r_time() >= when;
+}
+
+// sleep for ns nanoseconds, rounded up to the time CSR's
+// resolution. returns -1 if killed.
+int
+nanosleep(uint64 ns)
+{
+  uint64 step = 1000000000 / TIMEHZ;
+  uint64 when;
+
+  when = r_time() + (ns + step - 1) / step;
+  acquire(&nslock);
+  while(r_time() < when){
+    if(myproc()->killed){
+      release(&nslock);
+      return -1;
+    }
+    sleepuntil(&when, &nslock, when);
+  }
+  release(&nslock);
+  return 0;
+}
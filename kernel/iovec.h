@@ -0,0 +1,5 @@
+// one piece of a readv() or writev() buffer.
+struct iovec {
+  uint64 base;  // user address
+  uint len;
+};
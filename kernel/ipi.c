@@ -0,0 +1,125 @@
+// Inter-processor interrupts.
+//
+// ipi() sets the target hart's CLINT MSIP bit. timervec in
+// kernelvec.S takes the machine software interrupt, clears the
+// bit and raises a supervisor software interrupt, as it does for
+// a clock tick; devintr() tells the two apart and calls
+// ipiintr(), which runs whatever ipicall() queued for this CPU.
+//
+// tlbshootdown() makes sure that no other CPU is still using
+// stale translations of a user page table, before the pages
+// they pointed to are reused.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+void
+ipiinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].ipilock, "ipi");
+}
+
+// interrupt CPU id, or just wake it from wfi.
+void
+ipi(int id)
+{
+  push_off();
+  mycpu()->ipisent++;
+  pop_off();
+  *(volatile uint32 *)CLINT_MSIP(id) = 1;
+}
+
+// have CPU id run fn(arg) in its interrupt handler, soon; the
+// caller doesn't wait. fn runs with interrupts off and mustn't
+// sleep. returns -1 if id's queue is full, though it is still
+// interrupted.
+int
+ipicall(int id, void (*fn)(void *), void *arg)
+{
+  struct cpu *c = &cpus[id];
+  int r = -1;
+
+  acquire(&c->ipilock);
+  if(c->ncall < NIPICALL){
+    c->call[c->ncall].fn = fn;
+    c->call[c->ncall].arg = arg;
+    c->ncall++;
+    r = 0;
+  }
+  release(&c->ipilock);
+  ipi(id);
+  return r;
+}
+
+// an IPI may have arrived: run the calls queued for this CPU.
+// interrupts are off.
+void
+ipiintr(void)
+{
+  struct cpu *c = mycpu();
+  struct ipicall call[NIPICALL];
+  int i, n;
+
+  if(__atomic_load_n(&c->ncall, __ATOMIC_ACQUIRE) == 0)
+    return;
+  acquire(&c->ipilock);
+  n = c->ncall;
+  memmove(call, c->call, n * sizeof(call[0]));
+  c->ncall = 0;
+  release(&c->ipilock);
+  for(i = 0; i < n; i++)
+    call[i].fn(call[i].arg);
+}
+
+static void
+tlbflushall(void *arg)
+{
+  sfence_vma();
+}
+
+// pagetable's PTEs have been removed or write-protected: wait
+// until every other CPU that is in user space with it has
+// trapped into the kernel, flushing its TLB. a CPU that isn't
+// in user space with pagetable now will flush before it
+// returns, since the caller has called uvmstale(). CPUs in
+// user space always take interrupts, so this can't deadlock
+// with one that spins, interrupts off, for a lock the caller
+// holds.
+void
+tlbshootdown(pagetable_t pagetable)
+{
+  uint gen[NCPU];
+  uint64 wait = 0;
+  int id, me;
+
+  push_off();
+  me = cpuid();
+  // order the caller's PTE and tlbstale stores before the loads
+  // of upt, against usertrapret(), which sets upt before it
+  // looks at tlbstale.
+  __sync_synchronize();
+  for(id = 0; id < NCPU; id++){
+    if(id == me || __atomic_load_n(&cpus[id].upt, __ATOMIC_RELAXED) != pagetable)
+      continue;
+    gen[id] = __atomic_load_n(&cpus[id].ugen, __ATOMIC_RELAXED);
+    wait |= 1L << id;
+    ipicall(id, tlbflushall, 0);
+  }
+  if(wait)
+    mycpu()->shootdowns++;
+  while(wait){
+    for(id = 0; id < NCPU; id++){
+      if((wait & (1L << id)) &&
+         (__atomic_load_n(&cpus[id].upt, __ATOMIC_RELAXED) != pagetable ||
+          __atomic_load_n(&cpus[id].ugen, __ATOMIC_RELAXED) != gen[id]))
+        wait &= ~(1L << id);
+    }
+  }
+  pop_off();
+}
@@ -9,8 +9,6 @@
 #include "riscv.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
-
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
@@ -18,48 +16,230 @@ struct run {
   struct run *next;
 };
 
+// each CPU has a cache of free pages, so that most kalloc()
+// and kfree() calls take only that CPU's lock. a cache is
+// refilled from the shared list, or failing that by stealing
+// from another CPU's cache, and drained back to the shared
+// list, KBATCH pages at a time.
+struct kcache {
+  struct spinlock lock; // other CPUs take it to steal
+  struct run *free;
+  int n;
+};
+
+// memory that has never been allocated isn't put on any list
+// at boot, which would mean writing every page of RAM before
+// the first process runs; it's the range [fresh, PHYSTOP),
+// carved KBATCH pages at a time when the free lists run dry.
 struct {
   struct spinlock lock;
   struct run *freelist;
+  char *fresh;          // start of never-allocated memory
+  struct kcache cpu[NCPU];
 } kmem;
 
+// references to each page of physical memory: mappings, for
+// pages that copy-on-write fork() shares, plus kernel holders.
+// kalloc() returns a page with one; kfree() drops one, and
+// frees the page when none are left.
+static int kref[(PHYSTOP - KERNBASE) / PGSIZE];
+#define KREF(pa) kref[((uint64)(pa) - KERNBASE) / PGSIZE]
+
+// pages that kzeroer() zeroed ahead of time, so that
+// kalloc_zeroed() needn't. they are still free memory:
+// kalloc() falls back on them when everything else is gone.
+struct {
+  struct spinlock lock;
+  struct run *free;
+  int n;
+} kzero;
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
+  kmem.fresh = (char*)PGROUNDUP((uint64)end);
 }
 
+// Add a reference to an allocated page.
 void
-freerange(void *pa_start, void *pa_end)
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  __sync_fetch_and_add(&KREF(pa), 1);
+}
+
+// The number of references to an allocated page.
+int
+krefs(void *pa)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  return __atomic_load_n(&KREF(pa), __ATOMIC_SEQ_CST);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Detaches up to n pages from the front of *list, and
+// returns them as a chain; *got is set to how many.
+static struct run *
+ktake(struct run **list, int n, int *got)
+{
+  struct run *head = *list, *r = 0;
+  int i;
+
+  for(i = 0; i < n && *list; i++){
+    r = *list;
+    *list = r->next;
+  }
+  if(r)
+    r->next = 0;
+  *got = i;
+  return i ? head : 0;
+}
+
+// Chains up to n never-used pages from kmem.fresh. Caller
+// holds kmem.lock.
+static struct run *
+kcarve(int n, int *got)
+{
+  struct run *head = 0, *r;
+  int i;
+
+  for(i = 0; i < n && kmem.fresh + PGSIZE <= (char*)PHYSTOP; i++){
+    r = (struct run*)kmem.fresh;
+    kmem.fresh += PGSIZE;
+    r->next = head;
+    head = r;
+  }
+  *got = i;
+  return head;
+}
+
+// Finds a batch of free pages for CPU id, whose cache is
+// empty: from the shared list, else fresh memory, else half
+// of another CPU's cache. Called with no kmem locks held.
+static struct run *
+krefill(int id, int *got)
+{
+  struct kcache *c;
+  struct run *r;
+
+  acquire(&kmem.lock);
+  if((r = ktake(&kmem.freelist, KBATCH, got)) == 0)
+    r = kcarve(KBATCH, got);
+  release(&kmem.lock);
+  if(r)
+    return r;
+
+  for(int i = 1; i < NCPU; i++){
+    c = &kmem.cpu[(id + i) % NCPU];
+    acquire(&c->lock);
+    r = ktake(&c->free, (c->n + 1) / 2, got);
+    c->n -= *got;
+    release(&c->lock);
+    if(r)
+      return r;
+  }
+  return 0;
+}
+
+// Drop a reference to the page of physical memory pointed at
+// by v, which normally should have been returned by a
+// call to kalloc(). It is freed when the last reference goes.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct kcache *c;
+  struct run *r, *extra, *last;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  if((n = __sync_sub_and_fetch(&KREF(pa), 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: not allocated");
 
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  r->next = c->free;
+  c->free = r;
+  extra = 0;
+  if(++c->n > KCACHE){
+    extra = ktake(&c->free, KBATCH, &n);
+    c->n -= n;
+  }
+  release(&c->lock);
+  pop_off();
+
+  if(extra){
+    for(last = extra; last->next; last = last->next)
+      ;
+    acquire(&kmem.lock);
+    last->next = kmem.freelist;
+    kmem.freelist = extra;
+    release(&kmem.lock);
+  }
+}
+
+// Takes a page from this CPU's cache, refilling it if need be.
+static struct run *
+kpop(void)
+{
+  struct kcache *c;
+  struct run *r, *batch;
+  int id, n;
+
+  push_off();
+  id = cpuid();
+  c = &kmem.cpu[id];
+  acquire(&c->lock);
+  r = c->free;
+  if(r){
+    c->free = r->next;
+    c->n--;
+  }
+  release(&c->lock);
+
+  if(r == 0 && (batch = krefill(id, &n)) != 0){
+    r = batch;
+    acquire(&c->lock);
+    for(batch = r->next; batch; batch = r->next){
+      r->next = batch->next;
+      batch->next = c->free;
+      c->free = batch;
+    }
+    c->n += n - 1;
+    release(&c->lock);
+  }
+  pop_off();
+  return r;
+}
+
+// Takes a page from the pre-zeroed pool, waking kzeroer()
+// once the pool is half empty.
+static struct run *
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.free) != 0){
+    kzero.free = r->next;
+    kzero.n--;
+    r->next = 0; // the rest of the page is already 0
+  }
+  if(kzero.n <= KZEROPOOL/2)
+    wakeup(&kzero);
+  release(&kzero.lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +250,81 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = kpop()) == 0 && (r = kzeropop()) == 0)
+    return 0;
+  KREF(r) = 1;
+  memset((char*)r, 5, PGSIZE); // fill with junk
+  return (void*)r;
+}
+
+// Allocate a page of zeroes, from the pool if it has one.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
 
+  if((r = kzeropop()) == 0 && (r = kpop()) != 0)
+    memset((char*)r, 0, PGSIZE);
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    KREF(r) = 1;
   return (void*)r;
 }
+
+// Keeps the pre-zeroed pool topped up to KZEROPOOL pages,
+// a page at a time, yielding the CPU after each so that it
+// mostly runs when nothing else wants to.
+static void
+kzeroer(void *arg)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&kzero.lock);
+    while(kzero.n > KZEROPOOL/2)
+      sleep(&kzero, &kzero.lock);
+    release(&kzero.lock);
+
+    while(kzero.n < KZEROPOOL){
+      if((r = kpop()) == 0){
+        // out of memory; try again in a tick
+        acquire(&tickslock);
+        sleep(&ticks, &tickslock);
+        release(&tickslock);
+        break;
+      }
+      memset((char*)r, 0, PGSIZE);
+      acquire(&kzero.lock);
+      r->next = kzero.free;
+      kzero.free = r;
+      kzero.n++;
+      release(&kzero.lock);
+      yield();
+    }
+  }
+}
+
+// Bytes of free memory, for sysinfo(): the shared list, fresh
+// memory, the CPU caches and the pre-zeroed pool.
+uint64
+kfreemem(void)
+{
+  struct run *r;
+  uint64 n = 0;
+
+  acquire(&kmem.lock);
+  for(r = kmem.freelist; r; r = r->next)
+    n++;
+  n += ((char*)PHYSTOP - kmem.fresh) / PGSIZE;
+  release(&kmem.lock);
+  for(int i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].n;
+  n += kzero.n;
+  return n * PGSIZE;
+}
+
+void
+kzerostart(void)
+{
+  if(kthread_create(kzeroer, 0, "kzero", -1) < 0)
+    panic("kzerostart");
+}
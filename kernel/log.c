@@ -21,6 +21,23 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Group commit: when other FS system calls have shared the
+// transaction, the last end_op() doesn't commit at once. The
+// transaction stays open for more calls to join, and the
+// logflush thread commits it once it has gone LOGDELAY ticks
+// without growing; the last end_op() of each such batch waits
+// for that commit, so a completed call is still on disk when
+// it returns. Writes to a block already in the transaction are
+// absorbed into it. So a burst of small concurrent operations
+// costs one commit, not one each. A transaction only one call
+// used is committed right away, as before.
+//
+// With LOGASYNC, end_op() doesn't wait at all: every
+// transaction is left to logflush, at the price of losing up to
+// LOGDELAY ticks of completed operations (but never half of
+// one) in a crash. log_sync() (fsync()) waits for those to be
+// on disk.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -28,7 +45,8 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// commit() starts the writes of all the log blocks, and later
+// of all the home locations, at once, and then waits for them.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -44,12 +62,16 @@ struct log {
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
   int dev;
+  int nops;        // FS sys calls that joined the open transaction
+  uint lastgrow;   // ticks when the open transaction last grew
+  uint ncommit;    // transactions committed so far
   struct logheader lh;
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logflush(void *);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -62,23 +84,39 @@ initlog(int dev, struct superblock *sb)
   log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+  if(kthread_create(logflush, 0, "logflush", -1) < 0)
+    panic("initlog: logflush");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// After a commit, the pinned cache blocks already hold what the
+// log does, so they're written as they are; recovery reads the
+// log. Either way all the reads, then all the writes, are
+// started before waiting for any.
 static void
 install_trans(int recovering)
 {
+  struct buf *lbuf[LOGSIZE], *dbuf[LOGSIZE];
   int tail;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
+    if(recovering)
+      lbuf[tail] = bread_async(log.dev, log.start+tail+1); // read log block
+    dbuf[tail] = bread(log.dev, log.lh.block[tail]); // read dst
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    if(recovering){
+      bwait(lbuf[tail]);
+      memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+      brelse(lbuf[tail]);
+    }
+    bwrite_async(dbuf[tail]);  // write dst to disk
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(dbuf[tail]);
     if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+      bunpin(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -122,6 +160,23 @@ recover_from_log(void)
   write_head(); // clear the log
 }
 
+// commit the open transaction, which no FS system call is in.
+// caller holds log.lock.
+static void
+commit_locked(void)
+{
+  log.committing = 1;
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.nops = 0;
+  log.ncommit++;
+  wakeup(&log);
+}
+
 // called at the start of each FS system call.
 void
 begin_op(void)
@@ -131,62 +186,109 @@ begin_op(void)
     if(log.committing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      // this op might exhaust log space; wait for commit,
+      // or commit the idle transaction now.
+      if(log.outstanding == 0)
+        commit_locked();
+      else
+        sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.nops += 1;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the end of each FS system call. if this was the
+// last outstanding operation, commits, or if others shared the
+// transaction, leaves it to logflush() for a while and waits;
+// with LOGASYNC, leaves it to logflush() and returns.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  uint n;
 
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
+  if(log.outstanding > 0 || log.lh.n == 0){
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
     wakeup(&log);
+    if(log.outstanding == 0)
+      log.nops = 0; // nothing to commit
+  } else if(log.lh.n + MAXOPBLOCKS > LOGSIZE || (!LOGASYNC && log.nops < 2)){
+    commit_locked();
+  } else {
+    n = log.ncommit;
+    wakeup(&log);
+    wakeup(&log.lastgrow);
+    while(!LOGASYNC && log.ncommit == n)
+      sleep(&log, &log.lock);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Make the operations that have completed durable: commit the
+// open transaction, once the ones in it have finished, and wait
+// for any commit in progress.
+void
+log_sync(void)
+{
+  acquire(&log.lock);
+  while(log.committing || log.lh.n > 0){
+    if(!log.committing && log.outstanding == 0)
+      commit_locked();
+    else
+      sleep(&log, &log.lock);
   }
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Commits the transaction end_op() left open, once no FS system
+// call has added to it for LOGDELAY ticks.
+static void
+logflush(void *arg)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(log.lh.n == 0 || log.outstanding > 0 || log.committing)
+      sleep(&log.lastgrow, &log.lock);
+    while(log.lh.n > 0 && ticks - log.lastgrow < LOGDELAY){
+      release(&log.lock);
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+      acquire(&log.lock);
+    }
+    if(log.lh.n > 0 && log.outstanding == 0 && !log.committing)
+      commit_locked();
+  }
+}
+
+// Copy modified blocks from cache to log, starting all the
+// writes before waiting for them. The log blocks are
+// overwritten whole, so they aren't read first.
 static void
 write_log(void)
 {
+  struct buf *to[LOGSIZE];
   int tail;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    to[tail] = bnew(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    memmove(to[tail]->data, from->data, BSIZE);
+    bwrite_async(to[tail]);  // write the log
     brelse(from);
-    brelse(to);
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
   }
 }
 
@@ -230,7 +332,28 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+    log.lastgrow = ticks;
+  }
+  release(&log.lock);
+}
+
+// Is blockno already part of the open transaction? Its cached
+// copy must then be changed through log_write(), not written
+// home. Caller is inside begin_op()/end_op(), so the
+// transaction can't commit before it's done.
+int
+log_holds(uint blockno)
+{
+  int i, r = 0;
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == blockno) {
+      r = 1;
+      break;
+    }
   }
   release(&log.lock);
+  return r;
 }
 
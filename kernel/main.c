@@ -20,9 +20,11 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small-object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    ipiinit();       // cross-CPU calls
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
@@ -30,12 +32,27 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    execinit();      // cache of running programs' pages
+    futexinit();     // futex wait table
+    traceinit();     // event tracer
+    profinit();      // sampling profiler
+    hrtimerinit();   // high-resolution timeouts
     virtio_disk_init(); // emulated hard disk
 #ifdef LAB_NET
+    netinit();
     pci_init();
     sockinit();
+    tcpinit();
+    netstatsinit();
 #endif    
     userinit();      // first user process
+    kzerostart();    // page pre-zeroing thread
+#ifdef LAB_NET
+    e1000_start();   // RX poller thread
+    netstart();      // this CPU's network worker
+    tcpstart();      // TCP timer thread
+#endif
 #ifdef KCSAN
     kcsaninit();
 #endif
@@ -49,6 +66,9 @@ main()
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+#ifdef LAB_NET
+    netstart();       // this CPU's network worker
+#endif
   }
 
   scheduler();        
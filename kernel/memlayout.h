@@ -29,8 +29,10 @@
 #define E1000_IRQ 33
 #endif
 
-// core local interruptor (CLINT), which contains the timer.
+// core local interruptor (CLINT), which contains the timer,
+// and the machine software interrupt bits used for IPIs.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -66,6 +68,23 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed files, downwards from UMAPTOP
+//   NETBP (e1000 rings and buffers, see netbypass.h)
+//   NETBPREGS (the e1000's registers, ditto)
+//   URING (async I/O rings, see uring.c)
+//   THREADTF(NTHREAD-1) .. THREADTF(1) (other threads' trapframes, see clone())
+//   ZCBASE (NZCBUF zero-copy receive pages, see sysnet.c)
+//   VPROC (p->vproc, read-only, see vdso.h)
+//   VCLOCK (the kernel's vclock, read-only, see vdso.h)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define VCLOCK (TRAPFRAME - PGSIZE)
+#define VPROC (VCLOCK - PGSIZE)
+#define ZCBASE (VPROC - NZCBUF*PGSIZE)
+#define THREADTF(t) (ZCBASE - (t)*PGSIZE)
+#define URING (THREADTF(NTHREAD-1) - PGSIZE)
+#define NETBPREGS (URING - 32*PGSIZE)
+#define NETBPPAGES 65
+#define NETBP (NETBPREGS - NETBPPAGES*PGSIZE)
+#define UMAPTOP NETBP
@@ -0,0 +1,322 @@
+// Memory-mapped files: mmap() and munmap().
+//
+// A mapping is a struct vma in the process, placed just below
+// the lowest existing one (the first goes under UMAPTOP); the
+// heap can't grow into them. Pages are read from the file when
+// first touched, by mmapfault(). A MAP_SHARED page is mapped
+// read-only until it's stored to, which marks it dirty (PTE_D),
+// and dirty pages are written back through the log when they're
+// unmapped, by munmap(), exec() or exit(). fork() gives the
+// child the parent's pages: MAP_SHARED ones as the same pages,
+// MAP_PRIVATE ones copy-on-write. Threads share their leader's
+// mappings, under its tglock.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// the mapping of p that holds va, or 0.
+static struct vma *
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// the lowest address p has mapped, which the heap must stay
+// below.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = UMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// map len bytes of f from offset off into the current process.
+// returns the address, or -1.
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint64 off)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+  uint64 base;
+
+  if(f->type != FD_INODE || len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & PROT_READ) && !f->readable)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+
+  len = PGROUNDUP(len);
+  acquire(&p->tglock);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f == 0)
+      break;
+  base = mmapbase(p);
+  if(v == &p->vma[NVMA] || len > base || base - len < PGROUNDUP(p->sz)){
+    release(&p->tglock);
+    return -1;
+  }
+
+  v->addr = base - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->f = filedup(f);
+  base = v->addr;
+  release(&p->tglock);
+  return base;
+}
+
+// handle a fault at va, a store if write is set, by mapping the
+// file's page there. returns 0 if the access may now proceed.
+int
+mmapfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v, vm;
+  pte_t *pte;
+  char *mem;
+  int perm, locked, spin, r;
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+  p = p->leader;
+  va = PGROUNDDOWN(va);
+  spin = holdingany();
+
+  acquire(&p->tglock);
+  if((v = findvma(p, va)) == 0 || v->prot == 0 ||
+     (write && (v->prot & PROT_WRITE) == 0)){
+    release(&p->tglock);
+    return -1;
+  }
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // a store to a clean MAP_SHARED page, or a page another
+    // thread has just mapped.
+    r = 0;
+    if(write && (*pte & PTE_W) == 0){
+      if(*pte & PTE_COW)
+        r = -1;
+      else
+        *pte |= PTE_W | PTE_D;
+      uvmstale(pagetable);
+    }
+    release(&p->tglock);
+    return r;
+  }
+  // reading the file sleeps, which a copy under a spin lock
+  // can't (see uvmfaultin()).
+  if(spin){
+    release(&p->tglock);
+    return -1;
+  }
+  // read the page without the lock, and keep the file open in
+  // case another thread munmap()s it meanwhile.
+  vm = *v;
+  filedup(vm.f);
+  release(&p->tglock);
+
+  r = -1;
+  if((mem = kalloc_zeroed()) == 0)
+    goto out;
+  // read() and write() fault their user memory in before they
+  // lock the inode (see faultin() in file.c), since their copy
+  // holds a buffer that readi() here may need. if the page has
+  // gone again since, a write() of the file from its own mapping
+  // holds its lock already; a read() into it holds it shared,
+  // and can take it again.
+  locked = !holdingsleep(&vm.f->ip->lock);
+  if(locked)
+    ilockshared(vm.f->ip);
+  readi(vm.f->ip, 0, (uint64)mem, vm.off + (va - vm.addr), PGSIZE);
+  if(locked)
+    iunlockshared(vm.f->ip);
+
+  perm = PTE_U | PTE_R;
+  if((vm.prot & PROT_WRITE) && (write || vm.flags == MAP_PRIVATE))
+    perm |= PTE_W | PTE_D;
+  acquire(&p->tglock);
+  v = findvma(p, va);
+  if(v == 0 || v->f != vm.f || v->addr - v->off != vm.addr - vm.off){
+    r = -1;
+  } else if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    r = 1;
+  } else {
+    r = mappages(pagetable, va, PGSIZE, (uint64)mem, perm);
+  }
+  release(&p->tglock);
+  if(r != 0)
+    kfree(mem);
+  if(r > 0)
+    r = 0;
+ out:
+  fileclose(vm.f);
+  return r;
+}
+
+// write v's page at va, physical address pa, back to the file,
+// in pieces small enough for the log, and not past its end.
+static void
+writeback(struct vma *v, uint64 va, uint64 pa)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  struct inode *ip = v->f->ip;
+  uint off = v->off + (va - v->addr);
+  int i, n, r;
+
+  for(i = 0; i < PGSIZE; i += r){
+    n = PGSIZE - i < max ? PGSIZE - i : max;
+    begin_op();
+    ilock(ip);
+    r = 0;
+    if(off + i < ip->size){
+      if(off + i + n > ip->size)
+        n = ip->size - (off + i);
+      r = writei(ip, 0, pa + i, off + i, n);
+    }
+    iunlock(ip);
+    end_op();
+    if(r != n || r == 0)
+      break;
+  }
+}
+
+// write v's dirty MAP_SHARED pages in pagetable back.
+static void
+vmasync(pagetable_t pagetable, struct vma *v)
+{
+  pte_t *pte;
+  uint64 va;
+
+  if(v->flags != MAP_SHARED)
+    return;
+  for(va = v->addr; va < v->addr + v->len; va += PGSIZE){
+    pte = walk(pagetable, va, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+      writeback(v, va, PTE2PA(*pte));
+  }
+}
+
+// unmap [addr, addr+len) from the current process. it must be
+// the start or the end of a mapping, or all of it. the range
+// is taken out of the mapping first, so that other threads
+// can't fault it back in while it's written back.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v, part;
+  int whole;
+
+  len = PGROUNDUP(len);
+  acquire(&p->tglock);
+  if(addr % PGSIZE != 0 || len == 0 || (v = findvma(p, addr)) == 0 ||
+     addr + len > v->addr + v->len ||
+     (addr != v->addr && addr + len != v->addr + v->len)){
+    release(&p->tglock);
+    return -1;
+  }
+  part = *v;
+  part.addr = addr;
+  part.len = len;
+  part.off = v->off + (addr - v->addr);
+  filedup(part.f);
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  whole = v->len == 0;
+  if(whole)
+    v->f = 0;
+  release(&p->tglock);
+
+  vmasync(p->pagetable, &part);
+  acquire(&p->tglock);
+  uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+  release(&p->tglock);
+  if(whole)
+    fileclose(part.f); // the mapping's reference
+  fileclose(part.f);
+  return 0;
+}
+
+// unmap all of p's mappings from pagetable, which exec() has
+// just replaced.
+void
+munmapall(struct proc *p, pagetable_t pagetable)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->f){
+      vmasync(pagetable, v);
+      uvmunmap(pagetable, v->addr, v->len / PGSIZE, 1);
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+}
+
+// give fork()'s child np p's mappings. doesn't sleep, since
+// fork() holds np->lock. returns -1, with nothing mapped in np,
+// if there isn't enough memory.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 va, pa;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->f == 0)
+      continue;
+    for(va = v->addr; va < v->addr + v->len; va += PGSIZE){
+      if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if(v->flags == MAP_PRIVATE && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE2PA(*pte);
+      if(mappages(np->pagetable, va, PGSIZE, pa, PTE_FLAGS(*pte)) != 0)
+        goto err;
+      kdup((void*)pa);
+    }
+  }
+  uvmstale(p->pagetable);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    np->vma[v - p->vma] = *v;
+    if(v->f)
+      filedup(v->f);
+  }
+  return 0;
+
+ err:
+  uvmstale(p->pagetable);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f)
+      uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+  return -1;
+}
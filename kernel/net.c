@@ -14,6 +14,99 @@
 static uint32 local_ip = MAKE_IP_ADDR(10, 0, 2, 15); // qemu's idea of the guest IP
 static uint8 local_mac[ETHADDR_LEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
 static uint8 broadcast_mac[ETHADDR_LEN] = { 0xFF, 0XFF, 0XFF, 0XFF, 0XFF, 0XFF };
+static uint8 zero_mac[ETHADDR_LEN];
+static uint32 local_mask = MAKE_IP_ADDR(255, 255, 255, 0);
+static uint32 gateway_ip = MAKE_IP_ADDR(10, 0, 2, 2); // qemu's slirp router
+
+//
+// IP multicast groups that some socket has joined, with how
+// many sockets are in each. the e1000's multicast table lets
+// through frames for these groups, and for others whose MAC
+// addresses hash alike, which net_rx_ip() then turns away.
+//
+#define NMCGROUP   16
+
+static struct spinlock mc_lock;
+static struct {
+  uint32 addr;
+  int refs;     // sockets in the group; 0 if the slot is free
+} mcgroups[NMCGROUP];
+
+//
+// ARP neighbor cache. an entry is PENDING from the first
+// packet for an address until a reply is heard, holding up
+// to ARP_MAXQ packets; it's then VALID for ARP_TTL ticks.
+//
+#define NARP       16
+#define ARP_TTL    1200  // ticks an entry stays valid (about 2 minutes)
+#define ARP_RETRY  10    // ticks between requests for a pending entry
+#define ARP_MAXQ   8     // packets held per pending entry
+
+enum { ARP_FREE, ARP_PENDING, ARP_VALID };
+
+struct arpent {
+  int state;
+  uint32 ip;
+  uint8 mac[ETHADDR_LEN];
+  uint stamp;         // when learned, or when last requested
+  int qlen;
+  struct mbufq q;     // packets waiting for resolution
+};
+
+static struct spinlock arp_lock;
+static struct arpent arptab[NARP];
+
+//
+// IP reassembly. the fragments of up to NREASS datagrams are
+// kept, sorted by offset, until all have arrived or REASS_TTL
+// ticks have passed since the first did.
+//
+#define NREASS     4
+#define REASS_TTL  30    // ticks to wait for missing fragments
+
+struct reass {
+  int used;
+  uint32 src;         // source address, id and protocol,
+  uint16 id;          // in network order, identify the datagram
+  uint8 proto;
+  uint stamp;         // when the first fragment arrived
+  int total;          // payload length, once the last fragment is in
+  int have;           // payload bytes received
+  int nfrag;
+  uint16 off[IP_MAXFRAGS];
+  struct mbuf *frag[IP_MAXFRAGS];
+  struct ip hdr;      // the first fragment's header
+};
+
+static struct spinlock reass_lock;
+static struct reass reasstab[NREASS];
+
+static uint ip_id;  // identifies each datagram sent, for reassembly
+
+//
+// received packets are processed by a network worker thread
+// per CPU rather than by the driver. each packet is queued for
+// a worker chosen by hashing its addresses and ports, so that
+// one flow's packets stay in order while separate flows are
+// processed in parallel.
+//
+struct netcpu {
+  struct spinlock lock;
+  struct mbufq q;     // received packets waiting for the worker
+  int qlen;
+  int drops;          // packets dropped because q was full
+};
+
+static struct netcpu netcpu[NCPU];
+static int networkers[NCPU]; // CPUs with a worker, in start order
+static int nnetworkers;
+static struct spinlock networkers_lock;
+
+static void net_tx_eth(struct mbuf *m, uint16 ethtype, uint8 *dmac);
+static void net_rx_eth(struct mbuf *m);
+static void net_rx_ip(struct mbuf *m);
+static void net_rx_one(struct mbuf *m);
+static int net_tx_arp(uint16 op, uint8 dmac[ETHADDR_LEN], uint32 dip);
 
 // Strips data from the start of the buffer and returns a pointer to it.
 // Returns 0 if less than the full requested length is available.
@@ -61,41 +154,225 @@ mbuftrim(struct mbuf *m, unsigned int len)
   return m->head + m->len;
 }
 
+// mbufs come from a pool of preallocated pages, with a small
+// per-CPU cache in front of it so that the common case takes
+// no lock. unlike kalloc(), recycled mbufs are not scrubbed;
+// every layer writes the headers it pushes in full.
+struct mbufcache {
+  int n;
+  struct mbuf *m[MBUFCACHE];
+};
+
+static struct mbufcache mbufcache[NCPU];
+
+struct netstat netstat;
+
+static struct {
+  struct spinlock lock;
+  struct mbuf *free;
+  int nfree;
+} mbufpool;
+
+void
+netinit(void)
+{
+  struct mbuf *m;
+
+  initlock(&arp_lock, "arp");
+  initlock(&reass_lock, "reass");
+  initlock(&networkers_lock, "networkers");
+  initlock(&mc_lock, "mcast");
+  initlock(&mbufpool.lock, "mbufpool");
+  for (int i = 0; i < NMBUF; i++) {
+    if ((m = kalloc()) == 0)
+      panic("netinit");
+    m->next = mbufpool.free;
+    mbufpool.free = m;
+    mbufpool.nfree++;
+  }
+}
+
+// Moves half a cache's worth of mbufs from the pool to c.
+static void
+mbufrefill(struct mbufcache *c)
+{
+  struct mbuf *m;
+
+  acquire(&mbufpool.lock);
+  while (c->n < MBUFCACHE/2 && (m = mbufpool.free) != 0) {
+    mbufpool.free = m->next;
+    mbufpool.nfree--;
+    c->m[c->n++] = m;
+  }
+  release(&mbufpool.lock);
+}
+
+// Moves half of c back to the pool. Pages beyond what the
+// pool keeps go back to kalloc().
+static void
+mbufdrain(struct mbufcache *c)
+{
+  struct mbuf *m, *extra = 0;
+
+  acquire(&mbufpool.lock);
+  while (c->n > MBUFCACHE/2) {
+    m = c->m[--c->n];
+    if (mbufpool.nfree < NMBUF) {
+      m->next = mbufpool.free;
+      mbufpool.free = m;
+      mbufpool.nfree++;
+    } else {
+      m->next = extra;
+      extra = m;
+    }
+  }
+  release(&mbufpool.lock);
+
+  while ((m = extra) != 0) {
+    extra = m->next;
+    kfree(m);
+  }
+}
+
+// Allocates up to n packet buffers into v.
+// Returns the number allocated.
+int
+mbufalloc_batch(struct mbuf **v, int n, unsigned int headroom)
+{
+  struct mbufcache *c;
+  struct mbuf *m;
+  int i;
+
+  if (headroom > MBUF_SIZE)
+    return 0;
+
+  push_off();
+  c = &mbufcache[cpuid()];
+  for (i = 0; i < n; i++) {
+    if (c->n == 0)
+      mbufrefill(c);
+    if (c->n > 0)
+      m = c->m[--c->n];
+    else if ((m = kalloc()) == 0) // pool is dry
+      break;
+    m->next = 0;
+    m->nextpkt = 0;
+    m->head = (char *)m->buf + headroom;
+    m->len = 0;
+    m->flags = 0;
+    m->refs = 1;
+    v[i] = m;
+  }
+  pop_off();
+  if (i < n)
+    netstat_add(mbuf_nomem, n - i);
+  return i;
+}
+
+// Frees n packet buffers; their chains are not followed.
+void
+mbuffree_batch(struct mbuf **v, int n)
+{
+  struct mbufcache *c;
+
+  push_off();
+  c = &mbufcache[cpuid()];
+  for (int i = 0; i < n; i++) {
+    if (c->n == MBUFCACHE)
+      mbufdrain(c);
+    c->m[c->n++] = v[i];
+  }
+  pop_off();
+}
+
 // Allocates a packet buffer.
 struct mbuf *
 mbufalloc(unsigned int headroom)
 {
   struct mbuf *m;
- 
-  if (headroom > MBUF_SIZE)
-    return 0;
-  m = kalloc();
-  if (m == 0)
+
+  if (mbufalloc_batch(&m, 1, headroom) == 0)
     return 0;
-  m->next = 0;
-  m->head = (char *)m->buf + headroom;
-  m->len = 0;
-  memset(m->buf, 0, sizeof(m->buf));
   return m;
 }
 
-// Frees a packet buffer.
+// Frees a packet: every buffer in the chain. A packet shared
+// by several holders is only freed by the last of them.
 void
 mbuffree(struct mbuf *m)
 {
-  kfree(m);
+  struct mbuf *v[16];
+  int n = 0;
+
+  if (m && m->refs > 1 && __sync_sub_and_fetch(&m->refs, 1) > 0)
+    return;
+  for (; m; m = m->next) {
+    if (n == NELEM(v)) {
+      mbuffree_batch(v, n);
+      n = 0;
+    }
+    v[n++] = m;
+  }
+  mbuffree_batch(v, n);
+}
+
+// Returns the length of a packet, summed over its chain.
+unsigned int
+mbuflen(struct mbuf *m)
+{
+  unsigned int len = 0;
+
+  for (; m; m = m->next)
+    len += m->len;
+  return len;
+}
+
+// Returns the number of buffers in a packet's chain.
+int
+mbufsegs(struct mbuf *m)
+{
+  int n = 0;
+
+  for (; m; m = m->next)
+    n++;
+  return n;
+}
+
+// Copies a packet into fresh buffers, chain and all, at the
+// same offsets. Returns 0 if out of mbufs.
+struct mbuf *
+mbufcopy(struct mbuf *m)
+{
+  struct mbuf *v[IP_MAXFRAGS];
+  struct mbuf *s;
+  int n = mbufsegs(m), i;
+
+  if (n > NELEM(v))
+    return 0;
+  if ((i = mbufalloc_batch(v, n, 0)) < n) {
+    mbuffree_batch(v, i);
+    return 0;
+  }
+  for (i = 0, s = m; s; s = s->next, i++) {
+    v[i]->head = v[i]->buf + (s->head - s->buf);
+    memmove(mbufput(v[i], s->len), s->head, s->len);
+    v[i]->flags = s->flags;
+    if (i > 0)
+      v[i-1]->next = v[i];
+  }
+  return v[0];
 }
 
-// Pushes an mbuf to the end of the queue.
+// Pushes a packet to the end of the queue.
 void
 mbufq_pushtail(struct mbufq *q, struct mbuf *m)
 {
-  m->next = 0;
+  m->nextpkt = 0;
   if (!q->head){
     q->head = q->tail = m;
     return;
   }
-  q->tail->next = m;
+  q->tail->nextpkt = m;
   q->tail = m;
 }
 
@@ -106,7 +383,7 @@ mbufq_pophead(struct mbufq *q)
   struct mbuf *head = q->head;
   if (!head)
     return 0;
-  q->head = head->next;
+  q->head = head->nextpkt;
   return head;
 }
 
@@ -124,78 +401,467 @@ mbufq_init(struct mbufq *q)
   q->head = 0;
 }
 
-// This code is lifted from FreeBSD's ping.c, and is copyright by the Regents
-// of the University of California.
-static unsigned short
-in_cksum(const unsigned char *addr, int len)
+// Adds len bytes at addr to sum as 16-bit one's complement
+// words, in memory order. Once addr is aligned, eight bytes go
+// in at a time, with the carry out of the 64-bit accumulator
+// added back in; since 2^16 = 1 (mod 2^16-1), folding the
+// result gives the same checksum as adding 16-bit words one by
+// one. Sums of consecutive pieces (pseudo-header, header,
+// payload) may be chained as long as all but the last piece
+// have even length.
+uint64
+in_sum(const void *addr, int len, uint64 sum)
 {
-  int nleft = len;
-  const unsigned short *w = (const unsigned short *)addr;
-  unsigned int sum = 0;
-  unsigned short answer = 0;
+  const unsigned char *p = addr;
+  int odd = (uint64)p & 1;
+  uint64 w;
 
-  /*
-   * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-   * sequential 16 bit words to it, and at the end, fold back all the
-   * carry bits from the top 16 bits into the lower 16 bits.
-   */
-  while (nleft > 1)  {
-    sum += *w++;
-    nleft -= 2;
+  while (len > 1 && (odd || ((uint64)p & 7))) {
+    sum += p[0] | (p[1] << 8);
+    p += 2;
+    len -= 2;
+  }
+  while (len >= 8) {
+    w = *(const uint64 *)p;
+    sum += w;
+    if (sum < w)
+      sum++;
+    p += 8;
+    len -= 8;
+  }
+  while (len > 1) {
+    sum += p[0] | (p[1] << 8);
+    p += 2;
+    len -= 2;
   }
 
   /* mop up an odd byte, if necessary */
-  if (nleft == 1) {
-    *(unsigned char *)(&answer) = *(const unsigned char *)w;
-    sum += answer;
-  }
+  if (len == 1)
+    sum += p[0];
+  return sum;
+}
 
-  /* add back carry outs from top 16 bits to low 16 bits */
+// Folds a 64-bit running sum down to 16 bits.
+uint16
+in_fold(uint64 sum)
+{
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
   sum = (sum & 0xffff) + (sum >> 16);
-  sum += (sum >> 16);
-  /* guaranteed now that the lower 16 bits of sum are correct */
+  sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
 
-  answer = ~sum; /* truncate to 16 bits */
-  return answer;
+// Adds the bytes of every buffer in m's chain to sum; all but
+// the last must have even length.
+uint64
+in_sum_chain(struct mbuf *m, uint64 sum)
+{
+  for (; m; m = m->next)
+    sum = in_sum(m->head, m->len, sum);
+  return sum;
 }
 
-// sends an ethernet packet
+// The internet checksum of len bytes at addr.
+static unsigned short
+in_cksum(const unsigned char *addr, int len)
+{
+  return ~in_fold(in_sum(addr, len, 0));
+}
+
+// The running sum of the UDP/TCP pseudo-header.
+uint64
+in_pseudo(uint32 sip, uint32 dip, uint8 proto, uint16 len)
+{
+  struct {
+    uint32 src, dst;
+    uint8 zero, proto;
+    uint16 len;
+  } ph;
+
+  ph.src = htonl(sip);
+  ph.dst = htonl(dip);
+  ph.zero = 0;
+  ph.proto = proto;
+  ph.len = htons(len);
+  return in_sum(&ph, sizeof(ph), 0);
+}
+
+// the source address of packets sent to dip.
+uint32
+net_srcaddr(uint32 dip)
+{
+  return IP_LOOPBACK(dip) ? dip : local_ip;
+}
+
+// prepends an ethernet header
 static void
-net_tx_eth(struct mbuf *m, uint16 ethtype)
+net_push_eth(struct mbuf *m, uint16 ethtype, uint8 *dmac)
 {
   struct eth *ethhdr;
 
   ethhdr = mbufpushhdr(m, *ethhdr);
   memmove(ethhdr->shost, local_mac, ETHADDR_LEN);
-  // In a real networking stack, dhost would be set to the address discovered
-  // through ARP. Because we don't support enough of the ARP protocol, set it
-  // to broadcast instead.
-  memmove(ethhdr->dhost, broadcast_mac, ETHADDR_LEN);
+  memmove(ethhdr->dhost, dmac, ETHADDR_LEN);
   ethhdr->type = htons(ethtype);
-  if (e1000_transmit(m)) {
-    mbuffree(m);
-  }
 }
 
-// sends an IP packet
+// prepends an IP header, with identification id and
+// fragment offset field off.
 static void
-net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip)
+net_push_ip(struct mbuf *m, uint8 proto, uint32 dip, uint16 id, uint16 off)
 {
   struct ip *iphdr;
 
-  // push the IP header
   iphdr = mbufpushhdr(m, *iphdr);
   memset(iphdr, 0, sizeof(*iphdr));
   iphdr->ip_vhl = (4 << 4) | (20 >> 2);
   iphdr->ip_p = proto;
-  iphdr->ip_src = htonl(local_ip);
+  iphdr->ip_src = htonl(net_srcaddr(dip));
   iphdr->ip_dst = htonl(dip);
-  iphdr->ip_len = htons(m->len);
+  iphdr->ip_len = htons(mbuflen(m));
+  iphdr->ip_id = htons(id);
+  iphdr->ip_off = htons(off);
   iphdr->ip_ttl = 100;
-  iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
+  // with M_CSUM_TX the e1000 fills in ip_sum.
+  if (!(m->flags & M_CSUM_TX))
+    iphdr->ip_sum = in_cksum((unsigned char *)iphdr, sizeof(*iphdr));
+}
+
+// prepends a UDP header. the e1000 computes the checksum if it
+// can, given the pseudo-header sum; otherwise we do it here.
+// it can't for a datagram that will be fragmented, since the
+// checksum covers all of the fragments.
+static void
+net_push_udp(struct mbuf *m, uint32 dip, uint16 sport, uint16 dport)
+{
+  struct udp *udphdr;
+  uint64 sum;
+  uint len;
+
+  udphdr = mbufpushhdr(m, *udphdr);
+  len = mbuflen(m);
+  udphdr->sport = htons(sport);
+  udphdr->dport = htons(dport);
+  udphdr->ulen = htons(len);
+  sum = in_pseudo(local_ip, dip, IPPROTO_UDP, len);
+  if (e1000_txcsum() && m->next == 0 && len + sizeof(struct ip) <= NET_MTU) {
+    m->flags |= M_CSUM_TX;
+    udphdr->sum = in_fold(sum);
+  } else {
+    udphdr->sum = 0;
+    udphdr->sum = ~in_fold(in_sum_chain(m, sum));
+    if (udphdr->sum == 0)
+      udphdr->sum = 0xffff; // zero means no checksum is provided
+  }
+}
+
+// sends an ethernet packet
+static void
+net_tx_eth(struct mbuf *m, uint16 ethtype, uint8 *dmac)
+{
+  net_push_eth(m, ethtype, dmac);
+  if (e1000_transmit(m)) {
+    mbuffree(m);
+  }
+}
+
+// the ethernet address of multicast group ip: 01:00:5e and
+// the low 23 bits of ip [RFC 1112 6.4].
+static void
+mc_mac(uint32 ip, uint8 *mac)
+{
+  mac[0] = 0x01;
+  mac[1] = 0x00;
+  mac[2] = 0x5e;
+  mac[3] = (ip >> 16) & 0x7f;
+  mac[4] = (ip >> 8) & 0xff;
+  mac[5] = ip & 0xff;
+}
+
+// has some socket joined group ip?
+static int
+mc_member(uint32 ip)
+{
+  int r = 0;
+
+  acquire(&mc_lock);
+  for (int i = 0; i < NMCGROUP; i++)
+    if (mcgroups[i].refs > 0 && mcgroups[i].addr == ip)
+      r = 1;
+  release(&mc_lock);
+  return r;
+}
+
+// tell the e1000 which groups' frames to pass.
+// caller must hold mc_lock.
+static void
+mc_filter(void)
+{
+  uint8 macs[NMCGROUP][ETHADDR_LEN];
+  int n = 0;
+
+  for (int i = 0; i < NMCGROUP; i++)
+    if (mcgroups[i].refs > 0)
+      mc_mac(mcgroups[i].addr, macs[n++]);
+  e1000_mcfilter(macs[0], n);
+}
+
+// a socket joins multicast group ip. returns -1 if ip isn't
+// a multicast address or NMCGROUP groups are in use already.
+int
+net_mcjoin(uint32 ip)
+{
+  int i, free = -1;
+
+  if (!IP_MULTICAST(ip))
+    return -1;
+  acquire(&mc_lock);
+  for (i = 0; i < NMCGROUP; i++) {
+    if (mcgroups[i].refs > 0 && mcgroups[i].addr == ip) {
+      mcgroups[i].refs++;
+      release(&mc_lock);
+      return 0;
+    }
+    if (mcgroups[i].refs == 0 && free < 0)
+      free = i;
+  }
+  if (free < 0) {
+    release(&mc_lock);
+    return -1;
+  }
+  mcgroups[free].addr = ip;
+  mcgroups[free].refs = 1;
+  mc_filter();
+  release(&mc_lock);
+  return 0;
+}
+
+// a socket leaves multicast group ip, which it had joined.
+void
+net_mcleave(uint32 ip)
+{
+  acquire(&mc_lock);
+  for (int i = 0; i < NMCGROUP; i++) {
+    if (mcgroups[i].refs > 0 && mcgroups[i].addr == ip) {
+      if (--mcgroups[i].refs == 0)
+        mc_filter();
+      break;
+    }
+  }
+  release(&mc_lock);
+}
+
+// the address to ARP for to reach dip: dip itself if it's
+// on the local subnet, else the router.
+static uint32
+arp_nexthop(uint32 dip)
+{
+  if ((dip & local_mask) == (local_ip & local_mask))
+    return dip;
+  return gateway_ip;
+}
+
+// finds the cache entry for ip; if there is none and create is
+// set, recycles a free or the least recently stamped entry as
+// a new PENDING one. an expired entry reverts to PENDING.
+// caller must hold arp_lock.
+static struct arpent *
+arp_find(uint32 ip, int create)
+{
+  struct arpent *e, *victim = 0;
+
+  for (e = arptab; e < &arptab[NARP]; e++) {
+    if (e->state != ARP_FREE && e->ip == ip) {
+      if (e->state == ARP_VALID && ticks - e->stamp > ARP_TTL) {
+        e->state = ARP_PENDING;
+        e->stamp = ticks - ARP_RETRY; // ask again straight away
+      }
+      return e;
+    }
+    if (victim == 0 || e->state == ARP_FREE ||
+        (victim->state != ARP_FREE && (int)(e->stamp - victim->stamp) < 0))
+      victim = e;
+  }
+  if (!create)
+    return 0;
+
+  e = victim;
+  while (!mbufq_empty(&e->q))
+    mbuffree(mbufq_pophead(&e->q));
+  e->state = ARP_PENDING;
+  e->ip = ip;
+  e->stamp = ticks - ARP_RETRY;
+  e->qlen = 0;
+  mbufq_init(&e->q);
+  return e;
+}
+
+// looks up the MAC address for next hop ip; returns 0 and
+// fills in mac if it's known.
+static int
+arp_resolve(uint32 ip, uint8 *mac)
+{
+  struct arpent *e;
+  int r = -1;
+
+  acquire(&arp_lock);
+  e = arp_find(ip, 0);
+  if (e && e->state == ARP_VALID) {
+    memmove(mac, e->mac, ETHADDR_LEN);
+    r = 0;
+  }
+  release(&arp_lock);
+  return r;
+}
+
+// sends an IP datagram (with its IP header pushed) to the
+// MAC address of dip's next hop. if that isn't known yet the
+// datagram waits in the neighbor cache while we ask for it.
+static void
+arp_output(struct mbuf *m, uint32 dip)
+{
+  struct arpent *e;
+  uint8 mac[ETHADDR_LEN];
+  uint32 nh;
+  int ask = 0;
+
+  if (dip == MAKE_IP_ADDR(255, 255, 255, 255)) {
+    net_tx_eth(m, ETHTYPE_IP, broadcast_mac);
+    return;
+  }
+  if (IP_MULTICAST(dip)) {
+    mc_mac(dip, mac);
+    net_tx_eth(m, ETHTYPE_IP, mac);
+    return;
+  }
+
+  nh = arp_nexthop(dip);
+  acquire(&arp_lock);
+  e = arp_find(nh, 1);
+  if (e->state == ARP_VALID) {
+    memmove(mac, e->mac, ETHADDR_LEN);
+    release(&arp_lock);
+    net_tx_eth(m, ETHTYPE_IP, mac);
+    return;
+  }
+  if (e->qlen < ARP_MAXQ) {
+    mbufq_pushtail(&e->q, m);
+    e->qlen++;
+    m = 0;
+  }
+  if (ticks - e->stamp >= ARP_RETRY) {
+    e->stamp = ticks;
+    ask = 1;
+  }
+  release(&arp_lock);
+
+  if (m)
+    mbuffree(m); // too many waiting already
+  if (ask)
+    net_tx_arp(ARP_OP_REQUEST, zero_mac, nh);
+}
+
+// records that ip is at mac, and sends any packets that were
+// waiting for it. only creates an entry if create is set.
+static void
+arp_learn(uint32 ip, uint8 *mac, int create)
+{
+  struct arpent *e;
+  struct mbufq q;
+
+  mbufq_init(&q);
+  acquire(&arp_lock);
+  e = arp_find(ip, create);
+  if (e) {
+    memmove(e->mac, mac, ETHADDR_LEN);
+    e->state = ARP_VALID;
+    e->stamp = ticks;
+    q = e->q;
+    mbufq_init(&e->q);
+    e->qlen = 0;
+  }
+  release(&arp_lock);
+
+  while (!mbufq_empty(&q))
+    net_tx_eth(mbufq_pophead(&q), ETHTYPE_IP, mac);
+}
+
+// splits datagram m, its transport header pushed, into IP
+// fragments and appends them to frames. each fragment is a new
+// mbuf holding the IP header, chained to one of m's buffers,
+// so nothing is copied; the e1000 gathers the two. m must be
+// laid out as sockfill() does it: no buffer bigger than
+// IP_FRAGDATA, and all but the last a multiple of 8 bytes.
+// returns the number of fragments, or -1 if m can't be sent
+// (fragments already on frames then go out, and are discarded
+// by the receiver).
+static int
+net_ip_frag(struct mbuf *m, uint8 proto, uint32 dip, struct mbufq *frames)
+{
+  struct mbuf *seg, *h;
+  uint16 id = __sync_fetch_and_add(&ip_id, 1);
+  uint off = 0;
+  int n = 0;
+
+  for (seg = m; seg; seg = seg->next) {
+    if (seg->len > IP_FRAGDATA || (seg->next && seg->len % 8 != 0)) {
+      mbuffree(m);
+      return -1;
+    }
+  }
+
+  while ((seg = m) != 0) {
+    m = seg->next;
+    seg->next = 0;
+    if ((h = mbufalloc(MBUF_DEFAULT_HEADROOM)) == 0) {
+      mbuffree(seg);
+      mbuffree(m);
+      return -1;
+    }
+    h->next = seg;
+    net_push_ip(h, proto, dip, id, (off >> 3) | (m ? IP_MF : 0));
+    if (m)
+      h->flags |= M_MOREFRAG;
+    mbufq_pushtail(frames, h);
+    off += seg->len;
+    n++;
+  }
+  return n;
+}
+
+// sends an IP packet, in fragments if it's too big for a frame
+void
+net_tx_ip(struct mbuf *m, uint8 proto, uint32 dip)
+{
+  struct mbufq frames;
+
+  // loopback: back up the stack, whole, in the same mbuf. it
+  // can't have been corrupted on the way, so there's no
+  // checksum to verify. it goes through a network worker like
+  // a received packet, so that a sender (TCP) holding locks
+  // never finds itself running the receive side too.
+  if (IP_LOOPBACK(dip)) {
+    net_push_ip(m, proto, dip, 0, 0);
+    m->flags = M_IPCSUM_OK | M_L4CSUM_OK | M_LOOP;
+    netstat_add(lo_pkts, 1);
+    net_rx(m);
+    return;
+  }
+
+  if (mbuflen(m) + sizeof(struct ip) > NET_MTU) {
+    mbufq_init(&frames);
+    net_ip_frag(m, proto, dip, &frames);
+    while (!mbufq_empty(&frames))
+      arp_output(mbufq_pophead(&frames), dip);
+    return;
+  }
+
+  // push the IP header
+  net_push_ip(m, proto, dip, __sync_fetch_and_add(&ip_id, 1), 0);
 
   // now on to the ethernet layer
-  net_tx_eth(m, ETHTYPE_IP);
+  arp_output(m, dip);
 }
 
 // sends a UDP packet
@@ -203,19 +869,95 @@ void
 net_tx_udp(struct mbuf *m, uint32 dip,
            uint16 sport, uint16 dport)
 {
-  struct udp *udphdr;
-
   // put the UDP header
-  udphdr = mbufpushhdr(m, *udphdr);
-  udphdr->sport = htons(sport);
-  udphdr->dport = htons(dport);
-  udphdr->ulen = htons(m->len);
-  udphdr->sum = 0; // zero means no checksum is provided
+  net_push_udp(m, dip, sport, dport);
 
   // now on to the IP layer
   net_tx_ip(m, IPPROTO_UDP, dip);
 }
 
+// sends a queue of UDP payloads to the same destination.
+// all the headers are built first, and then the frames are
+// handed to the driver in bursts, so that the e1000 is told
+// about new descriptors once per burst rather than once per
+// packet. if block is set, waits for TX ring space as needed;
+// otherwise frames that do not fit are dropped, as
+// net_tx_eth() would. returns the number of datagrams sent
+// in full.
+int
+net_tx_udpq(struct mbufq *q, uint32 dip,
+            uint16 sport, uint16 dport, int block)
+{
+  uint8 mac[ETHADDR_LEN];
+  struct mbufq frames;
+  struct mbuf *m, *c;
+  int n, ndgram, unsent;
+
+  // loopback needs no headers at all: hand each payload mbuf
+  // to the receiving socket as it is, as a pipe would.
+  if (IP_LOOPBACK(dip)) {
+    for (n = 0; !mbufq_empty(q); n++) {
+      m = mbufq_pophead(q);
+      netstat_add(lo_pkts, 1);
+      sockrecvudp(m, dip, dport, sport);
+    }
+    return n;
+  }
+
+  // datagrams too big for a frame become several, all
+  // but the last marked M_MOREFRAG. a datagram for a group
+  // that sockets here have joined is looped back to them too,
+  // as one copy that they all share.
+  mbufq_init(&frames);
+  for (ndgram = 0; !mbufq_empty(q); ndgram++) {
+    m = mbufq_pophead(q);
+    if (IP_MULTICAST(dip) && mc_member(dip) && (c = mbufcopy(m)) != 0) {
+      netstat_add(lo_pkts, 1);
+      sockrecvmcast(c, dip, local_ip, dport, sport);
+    }
+    net_push_udp(m, dip, sport, dport);
+    if (mbuflen(m) + sizeof(struct ip) <= NET_MTU) {
+      net_push_ip(m, IPPROTO_UDP, dip, __sync_fetch_and_add(&ip_id, 1), 0);
+      mbufq_pushtail(&frames, m);
+    } else if (net_ip_frag(m, IPPROTO_UDP, dip, &frames) < 0) {
+      ndgram--;
+    }
+  }
+
+  // the next hop's address isn't known yet; let the
+  // neighbor cache hold the burst (or what fits of it).
+  if (dip != MAKE_IP_ADDR(255, 255, 255, 255) && !IP_MULTICAST(dip) &&
+      arp_resolve(arp_nexthop(dip), mac) < 0) {
+    while (!mbufq_empty(&frames))
+      arp_output(mbufq_pophead(&frames), dip);
+    return ndgram;
+  }
+  if (dip == MAKE_IP_ADDR(255, 255, 255, 255))
+    memmove(mac, broadcast_mac, ETHADDR_LEN);
+  else if (IP_MULTICAST(dip))
+    mc_mac(dip, mac);
+
+  for (m = frames.head; m; m = m->nextpkt)
+    net_push_eth(m, ETHTYPE_IP, mac);
+
+  while (!mbufq_empty(&frames)) {
+    n = e1000_transmit_batch(&frames);
+    if (n == 0 &&
+        (!block || e1000_txwait(mbufsegs(frames.head) + 1) < 0))
+      break;
+  }
+
+  // a datagram with any frame left over didn't get out.
+  unsent = 0;
+  while (!mbufq_empty(&frames)) {
+    m = mbufq_pophead(&frames);
+    if (!(m->flags & M_MOREFRAG))
+      unsent++;
+    mbuffree(m);
+  }
+  return ndgram - unsent;
+}
+
 // sends an ARP packet
 static int
 net_tx_arp(uint16 op, uint8 dmac[ETHADDR_LEN], uint32 dip)
@@ -241,8 +983,8 @@ net_tx_arp(uint16 op, uint8 dmac[ETHADDR_LEN], uint32 dip)
   memmove(arphdr->tha, dmac, ETHADDR_LEN);
   arphdr->tip = htonl(dip);
 
-  // header is ready, send the packet
-  net_tx_eth(m, ETHTYPE_ARP);
+  // header is ready, send the packet; requests are broadcast.
+  net_tx_eth(m, ETHTYPE_ARP, op == ARP_OP_REQUEST ? broadcast_mac : dmac);
   return 0;
 }
 
@@ -256,29 +998,38 @@ net_rx_arp(struct mbuf *m)
 
   arphdr = mbufpullhdr(m, *arphdr);
   if (!arphdr)
-    goto done;
+    goto bad;
 
   // validate the ARP header
   if (ntohs(arphdr->hrd) != ARP_HRD_ETHER ||
       ntohs(arphdr->pro) != ETHTYPE_IP ||
       arphdr->hln != ETHADDR_LEN ||
       arphdr->pln != sizeof(uint32)) {
-    goto done;
+    goto bad;
   }
 
-  // only requests are supported so far
-  // check if our IP was solicited
   tip = ntohl(arphdr->tip); // target IP address
+  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
+  sip = ntohl(arphdr->sip); // sender's IP address (qemu's slirp)
+
+  // learn the sender's address from requests and replies alike,
+  // but only take up a cache entry if the packet was meant for us.
+  arp_learn(sip, smac, tip == local_ip);
+
+  // check if our IP was solicited
   if (ntohs(arphdr->op) != ARP_OP_REQUEST || tip != local_ip)
     goto done;
 
   // handle the ARP request
-  memmove(smac, arphdr->sha, ETHADDR_LEN); // sender's ethernet address
-  sip = ntohl(arphdr->sip); // sender's IP address (qemu's slirp)
   net_tx_arp(ARP_OP_REPLY, smac, sip);
 
 done:
   mbuffree(m);
+  return;
+
+bad:
+  netstat_add(arp_drops, 1);
+  mbuffree(m);
 }
 
 // receives a UDP packet
@@ -286,7 +1037,7 @@ static void
 net_rx_udp(struct mbuf *m, uint16 len, struct ip *iphdr)
 {
   struct udp *udphdr;
-  uint32 sip;
+  uint32 sip, dip;
   uint16 sport, dport;
 
 
@@ -294,33 +1045,153 @@ net_rx_udp(struct mbuf *m, uint16 len, struct ip *iphdr)
   if (!udphdr)
     goto fail;
 
-  // TODO: validate UDP checksum
-
   // validate lengths reported in headers
   if (ntohs(udphdr->ulen) != len)
     goto fail;
   len -= sizeof(*udphdr);
-  if (len > m->len)
+  if (len > mbuflen(m))
     goto fail;
-  // minimum packet size could be larger than the payload
-  mbuftrim(m, m->len - len);
+  // minimum packet size could be larger than the payload;
+  // a reassembled chain is already exactly the right length.
+  if (m->next == 0)
+    mbuftrim(m, m->len - len);
 
-  // parse the necessary fields
+  // validate the UDP checksum, unless the e1000 already has,
+  // or the sender didn't provide one.
   sip = ntohl(iphdr->ip_src);
+  if (udphdr->sum != 0 && !(m->flags & M_L4CSUM_OK) &&
+      in_fold(in_sum_chain(m, in_sum(udphdr, sizeof(*udphdr),
+                     in_pseudo(sip, ntohl(iphdr->ip_dst), IPPROTO_UDP,
+                               ntohs(udphdr->ulen))))) != 0xffff)
+    goto fail;
+
+  // parse the necessary fields
   sport = ntohs(udphdr->sport);
   dport = ntohs(udphdr->dport);
-  sockrecvudp(m, sip, dport, sport);
+  dip = ntohl(iphdr->ip_dst);
+  if (IP_MULTICAST(dip)) {
+    netstat_add(mc_pkts, 1);
+    sockrecvmcast(m, dip, sip, dport, sport);
+  } else
+    sockrecvudp(m, sip, dport, sport);
   return;
 
 fail:
+  netstat_add(udp_drops, 1);
+  mbuffree(m);
+}
+
+// frees the fragments of a datagram being reassembled.
+// caller must hold reass_lock.
+static void
+ip_reass_free(struct reass *r)
+{
+  for (int i = 0; i < r->nfrag; i++)
+    mbuffree(r->frag[i]);
+  r->nfrag = 0;
+  r->used = 0;
+}
+
+// adds fragment m, with its IP header pulled and trimmed to its
+// payload, to the reassembly of its datagram. once all the
+// fragments are in, returns the whole payload as an mbuf chain,
+// and fills in *hdr with an IP header for it; until then, or if
+// m is dropped, returns 0. either way m is consumed.
+static struct mbuf *
+ip_reass(struct mbuf *m, struct ip *iphdr, struct ip *hdr)
+{
+  struct reass *r, *free = 0;
+  struct mbuf *t;
+  uint16 offw = ntohs(iphdr->ip_off);
+  int off = (offw & IP_OFFMASK) * 8;
+  int len = m->len;
+  int last = !(offw & IP_MF);
+  int i;
+
+  if (len == 0 || (!last && len % 8 != 0) ||
+      off + len > IP_MAXLEN - sizeof(struct ip)) {
+    mbuffree(m);
+    return 0;
+  }
+
+  acquire(&reass_lock);
+  for (r = reasstab; r < &reasstab[NREASS]; r++) {
+    if (r->used && ticks - r->stamp > REASS_TTL)
+      ip_reass_free(r); // gave up waiting for the rest
+    if (r->used && r->src == iphdr->ip_src && r->id == iphdr->ip_id &&
+        r->proto == iphdr->ip_p)
+      break;
+    if (!r->used && free == 0)
+      free = r;
+  }
+  if (r == &reasstab[NREASS]) {
+    if ((r = free) == 0)
+      goto drop; // too many datagrams in pieces already
+    r->used = 1;
+    r->src = iphdr->ip_src;
+    r->id = iphdr->ip_id;
+    r->proto = iphdr->ip_p;
+    r->stamp = ticks;
+    r->total = -1;
+    r->have = 0;
+    r->nfrag = 0;
+  }
+
+  // find m's place, and drop it if it overlaps a fragment
+  // already held (retransmissions, say) or the datagram's end.
+  for (i = 0; i < r->nfrag && r->off[i] < off; i++)
+    ;
+  if (r->nfrag == IP_MAXFRAGS ||
+      (i < r->nfrag && r->off[i] < off + len) ||
+      (i > 0 && r->off[i-1] + mbuflen(r->frag[i-1]) > off) ||
+      (r->total >= 0 && (last || off + len > r->total)) ||
+      (last && r->nfrag > 0 &&
+       r->off[r->nfrag-1] + mbuflen(r->frag[r->nfrag-1]) > off + len))
+    goto drop;
+  memmove(&r->off[i+1], &r->off[i], (r->nfrag - i) * sizeof(r->off[0]));
+  memmove(&r->frag[i+1], &r->frag[i], (r->nfrag - i) * sizeof(r->frag[0]));
+  r->off[i] = off;
+  r->frag[i] = m;
+  r->nfrag++;
+  r->have += len;
+  if (last)
+    r->total = off + len;
+  if (off == 0)
+    memmove(&r->hdr, iphdr, sizeof(*iphdr));
+
+  // with no overlaps, having every byte means having them all
+  // in order, from offset 0.
+  if (r->total < 0 || r->have != r->total) {
+    release(&reass_lock);
+    return 0;
+  }
+  for (i = 0; i + 1 < r->nfrag; i++) {
+    for (t = r->frag[i]; t->next; t = t->next)
+      ;
+    t->next = r->frag[i+1];
+  }
+  m = r->frag[0];
+  m->flags = 0; // the e1000 can't have checked the whole datagram
+  memmove(hdr, &r->hdr, sizeof(*hdr));
+  hdr->ip_len = htons(r->total + sizeof(struct ip));
+  hdr->ip_off = 0;
+  r->nfrag = 0;
+  r->used = 0;
+  release(&reass_lock);
+  return m;
+
+drop:
+  release(&reass_lock);
+  netstat_add(ip_drops, 1);
   mbuffree(m);
+  return 0;
 }
 
 // receives an IP packet
 static void
 net_rx_ip(struct mbuf *m)
 {
-  struct ip *iphdr;
+  struct ip *iphdr, hdr;
   uint16 len;
 
   iphdr = mbufpullhdr(m, *iphdr);
@@ -330,36 +1201,174 @@ net_rx_ip(struct mbuf *m)
   // check IP version and header len
   if (iphdr->ip_vhl != ((4 << 4) | (20 >> 2)))
     goto fail;
-  // validate IP checksum
-  if (in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
+  // validate IP checksum, unless the e1000 already has
+  if (!(m->flags & M_IPCSUM_OK) &&
+      in_cksum((unsigned char *)iphdr, sizeof(*iphdr)))
     goto fail;
-  // can't support fragmented IP packets
-  if (htons(iphdr->ip_off) != 0)
+  // is the packet addressed to us? 127/8 only counts if it
+  // really came over loopback, and a multicast group only if
+  // a socket has joined it. multicast is UDP only.
+  if (IP_MULTICAST(ntohl(iphdr->ip_dst))) {
+    if (iphdr->ip_p != IPPROTO_UDP || !mc_member(ntohl(iphdr->ip_dst)))
+      goto fail;
+  } else if (ntohl(iphdr->ip_dst) != local_ip &&
+      !(IP_LOOPBACK(ntohl(iphdr->ip_dst)) && (m->flags & M_LOOP)))
     goto fail;
-  // is the packet addressed to us?
-  if (htonl(iphdr->ip_dst) != local_ip)
+  if (iphdr->ip_p != IPPROTO_UDP && iphdr->ip_p != IPPROTO_TCP)
     goto fail;
-  // can only support UDP
-  if (iphdr->ip_p != IPPROTO_UDP)
+  if (ntohs(iphdr->ip_len) < sizeof(*iphdr))
     goto fail;
-
   len = ntohs(iphdr->ip_len) - sizeof(*iphdr);
-  net_rx_udp(m, len, iphdr);
+
+  // a fragment waits for the rest of its datagram.
+  if (ntohs(iphdr->ip_off) & (IP_MF | IP_OFFMASK)) {
+    if (len > m->len)
+      goto fail;
+    mbuftrim(m, m->len - len);
+    if ((m = ip_reass(m, iphdr, &hdr)) == 0)
+      return;
+    iphdr = &hdr;
+    len = ntohs(hdr.ip_len) - sizeof(hdr);
+  }
+
+  if (iphdr->ip_p == IPPROTO_TCP)
+    tcp_input(m, len, iphdr);
+  else
+    net_rx_udp(m, len, iphdr);
   return;
 
 fail:
+  netstat_add(ip_drops, 1);
   mbuffree(m);
 }
 
-// called by e1000 driver's interrupt handler to deliver a packet to the
-// networking stack
-void net_rx(struct mbuf *m)
+
+// chooses which worker processes m.
+static struct netcpu *
+net_rx_cpu(struct mbuf *m)
+{
+  uchar *p = (uchar *)m->head;
+  struct ip *iphdr;
+  uint h = 0;
+  int i, n;
+
+  // source/destination address and ports of an IP packet;
+  // just the addresses of a fragment, since only the first
+  // has the ports, and all must go to the same worker.
+  // loopback packets have no ethernet header.
+  if (!(m->flags & M_LOOP)) {
+    if (m->len < sizeof(struct eth) ||
+        ntohs(((struct eth *)p)->type) != ETHTYPE_IP)
+      p = 0;
+    else
+      p += sizeof(struct eth);
+  }
+  if (p && m->len >= (p - (uchar *)m->head) + sizeof(struct ip) + 4) {
+    iphdr = (struct ip *)p;
+    n = 12;
+    if (ntohs(iphdr->ip_off) & (IP_MF | IP_OFFMASK))
+      n = 8;
+    p += 12;
+    for (i = 0; i < n; i++)
+      h = h * 31 + p[i];
+  }
+  return &netcpu[networkers[h % nnetworkers]];
+}
+
+// the network worker thread for one CPU.
+static void
+networker(void *arg)
+{
+  struct netcpu *nc = arg;
+  struct mbufq q;
+
+  acquire(&nc->lock);
+  for (;;) {
+    while (mbufq_empty(&nc->q))
+      sleep(nc, &nc->lock);
+    // take everything queued so far.
+    q = nc->q;
+    mbufq_init(&nc->q);
+    nc->qlen = 0;
+    release(&nc->lock);
+
+    while (!mbufq_empty(&q))
+      net_rx_one(mbufq_pophead(&q));
+
+    acquire(&nc->lock);
+  }
+}
+
+// starts this CPU's network worker. called on each CPU
+// once processes can be created.
+void
+netstart(void)
+{
+  int id = cpuid();
+  struct netcpu *nc = &netcpu[id];
+
+  initlock(&nc->lock, "netcpu");
+  mbufq_init(&nc->q);
+  if (kthread_create(networker, nc, "netrx", id) < 0)
+    panic("netstart");
+
+  acquire(&networkers_lock);
+  networkers[nnetworkers] = id;
+  __sync_synchronize();
+  nnetworkers++;
+  release(&networkers_lock);
+}
+
+// called by the e1000 driver (and loopback) to deliver a
+// packet to the networking stack; queues it for a network worker.
+void
+net_rx(struct mbuf *m)
+{
+  struct netcpu *nc;
+  int wake;
+
+  if (nnetworkers == 0) {
+    net_rx_one(m); // too early in boot for workers
+    return;
+  }
+
+  nc = net_rx_cpu(m);
+  acquire(&nc->lock);
+  if (nc->qlen >= NETBACKLOG) {
+    nc->drops++;
+    release(&nc->lock);
+    mbuffree(m);
+    return;
+  }
+  wake = mbufq_empty(&nc->q);
+  mbufq_pushtail(&nc->q, m);
+  nc->qlen++;
+  if (wake)
+    wakeup(nc);
+  release(&nc->lock);
+}
+
+// processes a packet from net_rx(): an ethernet frame, or
+// an IP packet sent over loopback.
+static void
+net_rx_one(struct mbuf *m)
+{
+  if (m->flags & M_LOOP)
+    net_rx_ip(m);
+  else
+    net_rx_eth(m);
+}
+
+// processes a received ethernet frame.
+static void
+net_rx_eth(struct mbuf *m)
 {
   struct eth *ethhdr;
   uint16 type;
 
   ethhdr = mbufpullhdr(m, *ethhdr);
   if (!ethhdr) {
+    netstat_add(eth_drops, 1);
     mbuffree(m);
     return;
   }
@@ -369,6 +1378,40 @@ void net_rx(struct mbuf *m)
     net_rx_ip(m);
   else if (type == ETHTYPE_ARP)
     net_rx_arp(m);
-  else
+  else {
+    netstat_add(eth_drops, 1);
     mbuffree(m);
+  }
+}
+
+// formats the stack's counters into buf for the netstats
+// device. returns the number of bytes written.
+int
+net_stats(char *buf, int sz)
+{
+  struct netstat *ns = &netstat;
+  int n = 0, backlog = 0, drops = 0;
+
+  for (int i = 0; i < nnetworkers; i++) {
+    backlog += netcpu[networkers[i]].qlen;
+    drops += netcpu[networkers[i]].drops;
+  }
+
+  n += snprintf(buf+n, sz-n, "rx_pkts %ld\nrx_bytes %ld\n",
+                ns->rx_pkts, ns->rx_bytes);
+  n += snprintf(buf+n, sz-n, "tx_pkts %ld\ntx_bytes %ld\n",
+                ns->tx_pkts, ns->tx_bytes);
+  n += snprintf(buf+n, sz-n, "tx_ringfull %ld\nrx_nobuf %ld\n",
+                ns->tx_ringfull, ns->rx_nobuf);
+  n += snprintf(buf+n, sz-n, "mbuf_nomem %ld\nmbuf_pool %d\n",
+                ns->mbuf_nomem, mbufpool.nfree);
+  n += snprintf(buf+n, sz-n, "eth_drops %ld\narp_drops %ld\n",
+                ns->eth_drops, ns->arp_drops);
+  n += snprintf(buf+n, sz-n, "ip_drops %ld\nudp_drops %ld\nnosock_drops %ld\n",
+                ns->ip_drops, ns->udp_drops, ns->nosock_drops);
+  n += snprintf(buf+n, sz-n, "backlog %d\nbacklog_drops %d\n",
+                backlog, drops);
+  n += snprintf(buf+n, sz-n, "lo_pkts %ld\nbp_drops %ld\nmc_pkts %ld\n",
+                ns->lo_pkts, ns->bp_drops, ns->mc_pkts);
+  return n;
 }
@@ -9,13 +9,28 @@
  * than the driver can process them, e1000_init() provides
  * the E1000 with multiple buffers into which the E1000
  * can write packets.*/
+//
+// a packet is a chain of mbufs linked by next; most are a
+// single mbuf, but a large datagram is a chain of fragment-
+// sized pieces. queues of packets link them by nextpkt.
 struct mbuf {
   struct mbuf  *next; // the next mbuf in the chain
+  struct mbuf  *nextpkt; // the next packet in an mbufq
   char         *head; // the current start position of the buffer
   unsigned int len;   // the length of the buffer
+  unsigned int flags; // M_* below
+  uint32       raddr; // sender of a received datagram, for recvfrom()
+  uint16       rport;
+  int          refs;  // holders of a shared packet, see sockrecvmcast()
   char         buf[MBUF_SIZE]; // the backing store
 };
 
+#define M_CSUM_TX    0x1  // NIC to fill in IP and UDP checksums on send
+#define M_IPCSUM_OK  0x2  // NIC verified the IP header checksum
+#define M_L4CSUM_OK  0x4  // NIC verified the UDP or TCP checksum
+#define M_MOREFRAG   0x8  // a frame that isn't its datagram's last
+#define M_LOOP       0x10 // sent over loopback, not received by the NIC
+
 char *mbufpull(struct mbuf *m, unsigned int len);
 char *mbufpush(struct mbuf *m, unsigned int len);
 char *mbufput(struct mbuf *m, unsigned int len);
@@ -36,6 +51,11 @@ char *mbuftrim(struct mbuf *m, unsigned int len);
 
 struct mbuf *mbufalloc(unsigned int headroom);
 void mbuffree(struct mbuf *m);
+int mbufalloc_batch(struct mbuf **v, int n, unsigned int headroom);
+void mbuffree_batch(struct mbuf **v, int n);
+unsigned int mbuflen(struct mbuf *m);
+int mbufsegs(struct mbuf *m);
+struct mbuf *mbufcopy(struct mbuf *m);
 
 struct mbufq {
   struct mbuf *head;  // the first element in the queue
@@ -47,6 +67,29 @@ struct mbuf *mbufq_pophead(struct mbufq *q);
 int mbufq_empty(struct mbufq *q);
 void mbufq_init(struct mbufq *q);
 
+//
+// counters reported by the netstats device
+//
+
+struct netstat {
+  uint64 rx_pkts, rx_bytes;   // frames the e1000 handed to the stack
+  uint64 tx_pkts, tx_bytes;   // frames given to the e1000
+  uint64 tx_ringfull;         // sends that found the TX ring full
+  uint64 rx_nobuf;            // frames dropped: no mbuf to repost
+  uint64 mbuf_nomem;          // mbufalloc_batch() came up short
+  uint64 eth_drops;           // unparsable or unknown frames
+  uint64 arp_drops;           // malformed ARP packets
+  uint64 ip_drops;            // bad or unsupported IP packets
+  uint64 udp_drops;           // bad UDP lengths or checksums
+  uint64 nosock_drops;        // UDP for a port nobody bound
+  uint64 lo_pkts;             // packets sent over loopback
+  uint64 bp_drops;            // frames sent while a process owns the e1000
+  uint64 mc_pkts;             // multicast datagrams received
+};
+
+extern struct netstat netstat;
+#define netstat_add(field, n) __sync_fetch_and_add(&netstat.field, (n))
+
 
 //
 // endianness support
@@ -103,10 +146,24 @@ struct ip {
   uint32 ip_src, ip_dst;
 };
 
+#define IP_DF      0x4000 // ip_off: don't fragment
+#define IP_MF      0x2000 // ip_off: more fragments follow
+#define IP_OFFMASK 0x1fff // ip_off: offset of this fragment, in 8 bytes
+
+#define NET_MTU     1500  // largest IP packet in one ethernet frame
+#define IP_FRAGDATA (NET_MTU - sizeof(struct ip)) // payload of a full fragment
+#define IP_MAXLEN   65535 // largest IP datagram
+#define IP_MAXFRAGS ((IP_MAXLEN - sizeof(struct ip) + IP_FRAGDATA - 1) / IP_FRAGDATA)
+
 #define IPPROTO_ICMP 1  // Control message protocol
 #define IPPROTO_TCP  6  // Transmission control protocol
 #define IPPROTO_UDP  17 // User datagram protocol
 
+// 127.0.0.0/8 never leaves the machine.
+#define IP_LOOPBACK(ip) (((ip) >> 24) == 127)
+// 224.0.0.0/4 is IP multicast.
+#define IP_MULTICAST(ip) (((ip) >> 28) == 0xe)
+
 #define MAKE_IP_ADDR(a, b, c, d)           \
   (((uint32)a << 24) | ((uint32)b << 16) | \
    ((uint32)c << 8) | (uint32)d)
@@ -119,6 +176,31 @@ struct udp {
   uint16 sum;   // checksum
 };
 
+#define UDP_MAXDATA (IP_MAXLEN - sizeof(struct ip) - sizeof(struct udp))
+
+// a TCP segment header (comes after an IP header).
+struct tcp {
+  uint16 sport; // source port
+  uint16 dport; // destination port
+  uint32 seq;   // sequence number of the first byte
+  uint32 ack;   // next sequence number expected, with TCP_ACK
+  uint8  off;   // header length in 32-bit words << 4
+  uint8  flags; // TCP_* below
+  uint16 win;   // receive window
+  uint16 sum;   // checksum
+  uint16 urp;   // urgent pointer
+} __attribute__((packed));
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+
 // an ARP packet (comes after an Ethernet header).
 struct arp {
   uint16 hrd; // format of hardware address
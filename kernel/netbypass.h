@@ -0,0 +1,31 @@
+// the e1000 as netbypass() hands it to a process; needs
+// e1000_dev.h and memlayout.h.
+//
+// the e1000's registers are mapped at NETBPREGS, as an array
+// of uint32 indexed by E1000_RDT and friends, and NETBPPAGES
+// pages of memory the e1000 can DMA to at NETBP: a struct
+// netbpring in the first page, then the buffers. the kernel
+// fills in each descriptor's addr and the process must leave
+// it alone.
+//
+// to receive, wait for E1000_RXD_STAT_DD in rx[i].status,
+// use the frame at NETBP + BPRXBUF(i), clear the status and
+// write i to E1000_RDT. to send, put a frame at
+// NETBP + BPTXBUF(i), fill in tx[i]'s length and cmd (EOP|RS),
+// clear its status and write i+1 to E1000_TDT; the e1000
+// sets E1000_TXD_STAT_DD when it's done with the buffer.
+
+#define NBPDESC  64       // descriptors in each ring
+#define BPBUFSZ  2048     // bytes per buffer
+
+struct netbpring {
+  struct tx_desc tx[NBPDESC];
+  struct rx_desc rx[NBPDESC];
+};
+
+#define BPRXBUF(i) (4096 + (i) * BPBUFSZ)
+#define BPTXBUF(i) (4096 + (NBPDESC + (i)) * BPBUFSZ)
+
+#if 1 + 2 * NBPDESC * BPBUFSZ / 4096 != NETBPPAGES
+#error "NETBPPAGES in memlayout.h must fit the rings and buffers"
+#endif
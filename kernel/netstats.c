@@ -0,0 +1,60 @@
+//
+// the netstats device: a read-only text report of the e1000's
+// rings and counters, the network stack's drops, and the
+// queue depth of each open socket.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ PGSIZE
+
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} netstats;
+
+// a report is generated when a read starts at its beginning,
+// and served from the buffer until a read reaches its end,
+// which returns 0 so that the next read starts a fresh one.
+int
+netstatsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquire(&netstats.lock);
+  if(netstats.off == 0){
+    netstats.sz = e1000_stats(netstats.buf, BUFSZ);
+    netstats.sz += net_stats(netstats.buf + netstats.sz, BUFSZ - netstats.sz);
+    netstats.sz += sockstats(netstats.buf + netstats.sz, BUFSZ - netstats.sz);
+  }
+
+  m = netstats.sz - netstats.off;
+  if(m > n)
+    m = n;
+  if(m > 0){
+    if(either_copyout(user_dst, dst, netstats.buf + netstats.off, m) == -1)
+      m = -1;
+    else
+      netstats.off += m;
+  } else {
+    netstats.off = 0;
+  }
+  release(&netstats.lock);
+  return m;
+}
+
+void
+netstatsinit(void)
+{
+  initlock(&netstats.lock, "netstats");
+  devsw[NETSTATS].read = netstatsread;
+}
@@ -1,13 +1,60 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NPRIO         4  // scheduling levels
+#define SCHEDAGE     10  // ticks a queued process waits before it runs ahead of higher levels
+#define NSLEEPQ      64  // sleep queues wakeup() hashes channels into (power of 2)
+#define NOFILE      128  // open files per process
+#define NFILE       512  // open files per system
+#define NINODE      200  // maximum number of active i-nodes
+#define NIBUCKET     31  // hash buckets in the inode cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define NBUF         256  // size of disk block cache
+#define NBUCKET      31   // hash buckets in the disk block cache
+#define RAMIN        4    // first readahead window, in blocks
+#define RAMAX        32   // largest readahead window
+#define NDIRECTIO    16   // most blocks per O_DIRECT disk batch and transaction
+#define LOGDELAY     1    // ticks a shared transaction stays open for more FS calls
+#define LOGASYNC     0    // 1 = end_op() leaves every commit to logflush; see fsync()
+#define FSSIZE       200000  // size of file system in blocks
+#define NDENTRY      256   // cached directory entries
+#define NDHASH       61    // hash chains in the directory entry cache
 #define MAXPATH      128   // maximum file path name
+#define NTXDESC      64    // e1000 TX ring size (multiple of 8, <= 256)
+#define NRXDESC      128   // e1000 RX ring size (multiple of 8, <= 4096)
+#define NETITR       500   // e1000 min interrupt interval, 256ns units (0 = off)
+#define NETRDTR      0     // e1000 RX packet delay timer, 1.024us units
+#define NETRADV      0     // e1000 RX absolute delay timer, 1.024us units
+#define NETBUDGET    64    // max RX packets per e1000 poll pass
+#define NETCSUM      1     // offload IP/UDP checksums to the e1000 (0 = software)
+#define NETBACKLOG   256   // max received packets queued per CPU
+#define NMBUF        256   // mbufs kept in the free pool
+#define MBUFCACHE    32    // mbufs cached per CPU
+#define NEXECSEG      4    // demand-paged program segments per process
+#define NTEXTPG      512   // cached pages of running programs
+#define NVMA         16    // mmap()ed regions per process
+#define NZCBUF       16    // zero-copy receive buffers mapped per process
+#define NTHREAD      16    // threads per process, see clone()
+#define NURINGWORKER  8    // kernel threads serving a process's async I/O ring
+#define NSPAWNACT    16    // file descriptor actions per spawn()
+#define PIPEMAXPG    16    // most pages in a pipe's buffer, see F_SETPIPE_SZ
+#define NSENDBATCH   16    // datagrams sendfile() queues per burst
+#define NIOV         16    // pieces per readv() or writev()
+#define NFUTEX       32    // futex wait-table buckets
+#define NIPICALL      8    // queued cross-CPU calls per CPU
+#define TLBBATCH     16    // pages uvmunmap() frees per TLB shootdown
+#define SLEEPSPIN    2000  // polls of a running sleeplock holder before sleeping
+#define NTRACEEV     512   // events kept per CPU by the tracer
+#define TICKINTERVAL 1000000 // timer cycles per clock tick; about 1/10th second in qemu
+#define TIMEHZ       10000000 // time CSR counts per second in qemu
+#define NPROFSAMPLE  1024  // profiler samples buffered per CPU
+#define PROFMAXRATE  100   // most profiler samples per tick
+#define KCACHE       64    // free pages cached per CPU by kalloc()
+#define KBATCH       32    // pages moved at once between a CPU cache and the shared list
+#define KZEROPOOL    128   // pages kept zeroed ahead of time for kalloc_zeroed()
+#define NKMEMCACHE   16    // maximum number of slab caches
+#define SLABMAG      16    // free objects cached per CPU by each slab cache
+#define NIRQ         64    // PLIC interrupt sources managed
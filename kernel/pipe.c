@@ -7,18 +7,44 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
 
-#define PIPESIZE 512
+#define PIPESIZE PGSIZE  // to start with; see pipesize()
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEMAXPG]; // the ring, size bytes in size/PGSIZE pages
+  uint size;      // a power of two, so that nread and nwrite can wrap
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rwait;      // a reader is asleep on nread
+  int wwait;      // a writer is asleep on nwrite
 };
 
+static struct kmem_cache *pipecache;
+
+static void
+pipector(void *o)
+{
+  initlock(&((struct pipe*)o)->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe), pipector);
+}
+
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < pi->size / PGSIZE; i++)
+    kfree(pi->page[i]);
+  kmem_cache_free(pipecache, pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +54,17 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
+    goto bad;
+  pi->size = 0;
+  if((pi->page[0] = kalloc()) == 0)
     goto bad;
+  pi->size = PIPESIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
+  pi->rwait = pi->wwait = 0;
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +77,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,65 +96,287 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwakeup();
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// the longest contiguous run of the ring at byte n, at most
+// max bytes.
+static uint
+piperun(struct pipe *pi, uint n, uint max, char **p)
+{
+  uint off = n % pi->size;
+  uint len = PGSIZE - off % PGSIZE;
+
+  *p = pi->page[off / PGSIZE] + off % PGSIZE;
+  return len < max ? len : max;
+}
+
+// return the pipe's capacity; if n isn't 0, first change it to
+// n bytes, rounded up to a power-of-two number of pages. fails
+// if n is too big, or smaller than what's in the pipe now.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipesize(struct pipe *pi, int n)
+{
+  char *page[PIPEMAXPG], *p;
+  uint size, count, i, k, cc;
+
+  if(n == 0)
+    return pi->size;
+  if(n < 0 || n > PIPEMAXPG*PGSIZE)
+    return -1;
+  for(size = PGSIZE; size < n; size *= 2)
+    ;
+  for(k = 0; k < size / PGSIZE; k++)
+    if((page[k] = kalloc()) == 0)
+      goto bad;
+
+  acquire(&pi->lock);
+  count = pi->nwrite - pi->nread;
+  if(count > size){
+    release(&pi->lock);
+    goto bad;
+  }
+  // move the contents to the start of the new ring.
+  for(i = 0; i < count; i += cc){
+    cc = piperun(pi, pi->nread + i, count - i, &p);
+    if(PGSIZE - i % PGSIZE < cc)
+      cc = PGSIZE - i % PGSIZE;
+    memmove(page[i / PGSIZE] + i % PGSIZE, p, cc);
+  }
+  // and keep the old pages to free.
+  for(i = 0; i < PIPEMAXPG; i++){
+    p = i < pi->size / PGSIZE ? pi->page[i] : 0;
+    pi->page[i] = i < k ? page[i] : 0;
+    page[i] = p;
+  }
+  k = pi->size / PGSIZE;
+  pi->size = size;
+  pi->nread = 0;
+  pi->nwrite = count;
+  if(pi->wwait){
+    pi->wwait = 0;
+    wakeup(&pi->nwrite);
+  }
+  release(&pi->lock);
+  pollwakeup();
+
+  for(i = 0; i < k; i++)
+    kfree(page[i]);
+  return size;
+
+ bad:
+  while(k > 0)
+    kfree(page[--k]);
+  return -1;
+}
+
+// wait for room for need bytes. returns 1 when there is,
+// 0 if there isn't and nonblock is set, and -1 if the reader
+// has gone or the caller was killed. caller holds pi->lock.
+static int
+pipewaitroom(struct pipe *pi, uint need, int nonblock)
 {
-  int i = 0;
   struct proc *pr = myproc();
 
+  for(;;){
+    if(pi->readopen == 0 || pr->killed)
+      return -1;
+    if(pi->size - (pi->nwrite - pi->nread) >= need)
+      return 1;
+    if(nonblock)
+      return 0;
+    pi->rwait = 0;
+    wakeup(&pi->nread);
+    pollwakeup();
+    pi->wwait = 1;
+    sleep(&pi->nwrite, &pi->lock);
+  }
+}
+
+// wait for something to read, or the end of the pipe.
+// returns -1 if nonblock is set or the caller was killed.
+// caller holds pi->lock.
+static int
+pipewaitdata(struct pipe *pi, int nonblock)
+{
+  struct proc *pr = myproc();
+
+  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+    if(pr->killed || nonblock)
+      return -1;
+    pi->rwait = 1;
+    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  }
+  return 0;
+}
+
+// a reader has made room: a blocked writer waits until half
+// the ring is free, rather than waking for every read.
+static void
+pipewakewriter(struct pipe *pi)
+{
+  if(pi->wwait && pi->nwrite - pi->nread <= pi->size / 2){  //DOC: piperead-wakeup
+    pi->wwait = 0;
+    wakeup(&pi->nwrite);
+  }
+  pollwakeup();
+}
+
+static void
+pipewakereader(struct pipe *pi)
+{
+  if(pi->rwait){
+    pi->rwait = 0;
+    wakeup(&pi->nread);
+  }
+  pollwakeup();
+}
+
+// write n bytes at addr, a user address if user is set.
+int
+pipewrite(struct pipe *pi, int user, uint64 addr, int n, int nonblock)
+{
+  int i = 0, r;
+  uint cc;
+  char *p;
+
+  // a page fault under pi->lock mustn't read a file, so fault
+  // addr in now. if that fails, so will either_copyin().
+  if(user)
+    uvmfaultin(myproc()->pagetable, addr, n, 0);
   acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || pr->killed){
+    if((r = pipewaitroom(pi, 1, nonblock)) < 0){  //DOC: pipewrite-full
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    if(r == 0){
+      if(i == 0)
+        i = -1;
+      break;
     }
+    // as much as fits in one contiguous run of the ring.
+    cc = piperun(pi, pi->nwrite, pi->nread + pi->size - pi->nwrite, &p);
+    if(cc > n - i)
+      cc = n - i;
+    if(either_copyin(p, user, addr + i, cc) == -1)
+      break;
+    pi->nwrite += cc;
+    i += cc;
   }
-  wakeup(&pi->nread);
+  pipewakereader(pi);
   release(&pi->lock);
 
   return i;
 }
 
+// read up to n bytes into addr, a user address if user is set.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, int user, uint64 addr, int n, int nonblock)
 {
-  int i;
-  struct proc *pr = myproc();
-  char ch;
+  int i, m;
+  uint cc;
+  char *p;
 
+  // as in pipewrite(); one read returns at most a full ring.
+  m = n < PIPEMAXPG*PGSIZE ? n : PIPEMAXPG*PGSIZE;
+  if(user)
+    uvmfaultin(myproc()->pagetable, addr, m, 1);
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(pr->killed){
-      release(&pi->lock);
-      return -1;
-    }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  if(pipewaitdata(pi, nonblock) < 0){
+    release(&pi->lock);
+    return -1;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += cc){  //DOC: piperead-copy
+    cc = piperun(pi, pi->nread, pi->nwrite - pi->nread, &p);
+    if(cc > n - i)
+      cc = n - i;
+    if(either_copyout(user, addr + i, p, cc) == -1)
       break;
+    pi->nread += cc;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pipewakewriter(pi);
   release(&pi->lock);
   return i;
 }
+
+// for splice(): like pipewrite() of n <= PGSIZE bytes at the
+// start of the kernel page *page, but a whole page that lines
+// up with a slot of the ring is swapped in rather than copied,
+// and *page becomes the slot's old page.
+int
+pipewritepage(struct pipe *pi, char **page, int n, int nonblock)
+{
+  char *p;
+  int k;
+
+  if(n != PGSIZE)
+    return pipewrite(pi, 0, (uint64)*page, n, nonblock);
+  acquire(&pi->lock);
+  if(pi->nwrite % PGSIZE != 0){
+    release(&pi->lock);
+    return pipewrite(pi, 0, (uint64)*page, n, nonblock);
+  }
+  if((k = pipewaitroom(pi, PGSIZE, nonblock)) <= 0){
+    release(&pi->lock);
+    return k < 0 ? -1 : pipewrite(pi, 0, (uint64)*page, n, nonblock);
+  }
+  k = (pi->nwrite % pi->size) / PGSIZE;
+  p = pi->page[k];
+  pi->page[k] = *page;
+  *page = p;
+  pi->nwrite += PGSIZE;
+  pipewakereader(pi);
+  release(&pi->lock);
+  return PGSIZE;
+}
+
+// for splice(): like piperead() of up to n bytes into the
+// kernel page *page, but a whole page of the ring is swapped
+// out rather than copied, leaving *page in the ring and the
+// data in what *page then points to.
+int
+pipereadpage(struct pipe *pi, char **page, int n, int nonblock)
+{
+  char *p;
+  int k;
+
+  acquire(&pi->lock);
+  if(pipewaitdata(pi, nonblock) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  if(n < PGSIZE || pi->nread % PGSIZE != 0 || pi->nwrite - pi->nread < PGSIZE){
+    release(&pi->lock);
+    return piperead(pi, 0, (uint64)*page, n < PGSIZE ? n : PGSIZE, nonblock);
+  }
+  k = (pi->nread % pi->size) / PGSIZE;
+  p = pi->page[k];
+  pi->page[k] = *page;
+  *page = p;
+  pi->nread += PGSIZE;
+  pipewakewriter(pi);
+  release(&pi->lock);
+  return PGSIZE;
+}
+
+int
+pipepoll(struct pipe *pi)
+{
+  int ev = 0;
+
+  acquire(&pi->lock);
+  if(pi->nread != pi->nwrite || !pi->writeopen)
+    ev |= POLLIN;
+  if(pi->nwrite != pi->nread + pi->size || !pi->readopen)
+    ev |= POLLOUT;
+  if(!pi->readopen || !pi->writeopen)
+    ev |= POLLHUP;
+  release(&pi->lock);
+  return ev;
+}
@@ -1,51 +1,127 @@
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
+#include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
 
 //
 // the riscv Platform Level Interrupt Controller (PLIC).
 //
+// each IRQ has a mask of the CPUs allowed to take it, which
+// irqaffinity() can change at any time, e.g. to keep the
+// e1000's interrupts, and with them e1000_lock and the rings,
+// on one CPU. a hart's enable bits are rewritten from the
+// masks whenever one changes.
+//
+
+#define ALLCPUS ((1 << NCPU) - 1)
+
+static struct {
+  struct spinlock lock;
+  int mask[NIRQ];       // CPUs that may take each IRQ; 0 if unused
+  int online;           // harts that have called plicinithart()
+} plic;
+
+// interrupts each CPU has claimed, by IRQ; only that CPU
+// writes its row.
+static uint64 irqcount[NCPU][NIRQ];
 
 void
 plicinit(void)
 {
+  initlock(&plic.lock, "plic");
+
   // set desired IRQ priorities non-zero (otherwise disabled).
   *(uint32*)(PLIC + UART0_IRQ*4) = 1;
   *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
+  plic.mask[UART0_IRQ] = ALLCPUS;
+  plic.mask[VIRTIO0_IRQ] = ALLCPUS;
   
 #ifdef LAB_NET
   // PCIE IRQs are 32 to 35
   for(int irq = 1; irq < 0x35; irq++){
     *(uint32*)(PLIC + irq*4) = 1;
   }
+  for(int irq = 32; irq <= 35; irq++)
+    plic.mask[irq] = ALLCPUS;
 #endif  
 }
 
+// set hart's S-mode enable bits from the masks. caller holds
+// plic.lock.
+static void
+plicenable(int hart)
+{
+  uint32 en[NIRQ/32];
+  int irq;
+
+  memset(en, 0, sizeof(en));
+  for(irq = 1; irq < NIRQ; irq++)
+    if(plic.mask[irq] & (1 << hart))
+      en[irq/32] |= 1 << (irq%32);
+  for(int i = 0; i < NIRQ/32; i++)
+    *(uint32*)(PLIC_SENABLE(hart) + 4*i) = en[i];
+}
+
 void
 plicinithart(void)
 {
   int hart = cpuid();
   
-  // set uart's enable bit for this hart's S-mode. 
-  *(uint32*)PLIC_SENABLE(hart)= (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
-
-#ifdef LAB_NET
-  // hack to get at next 32 IRQs for e1000
-  *(uint32*)(PLIC_SENABLE(hart)+4) = 0xffffffff;
-#endif
+  acquire(&plic.lock);
+  plic.online |= 1 << hart;
+  plicenable(hart);
+  release(&plic.lock);
   
   // set this hart's S-mode priority threshold to 0.
   *(uint32*)PLIC_SPRIORITY(hart) = 0;
 }
 
+// let only the CPUs in mask take irq; a mask of 0 just asks.
+// returns irq's old mask, or -1 if it isn't a device's IRQ or
+// mask names no running CPU.
+int
+irqaffinity(int irq, int mask)
+{
+  int old;
+
+  if(irq <= 0 || irq >= NIRQ)
+    return -1;
+  mask &= ALLCPUS;
+  acquire(&plic.lock);
+  old = plic.mask[irq];
+  if(old == 0 || (mask != 0 && (mask & plic.online) == 0)){
+    release(&plic.lock);
+    return -1;
+  }
+  if(mask != 0){
+    plic.mask[irq] = mask;
+    for(int hart = 0; hart < NCPU; hart++)
+      if(plic.online & (1 << hart))
+        plicenable(hart);
+  }
+  release(&plic.lock);
+  return old;
+}
+
+// the interrupts CPU cpu has taken, by IRQ, for sysinfo().
+void
+irqstats(int cpu, uint64 *counts)
+{
+  for(int irq = 0; irq < NIRQ; irq++)
+    counts[irq] = __atomic_load_n(&irqcount[cpu][irq], __ATOMIC_RELAXED);
+}
+
 // ask the PLIC what interrupt we should serve.
 int
 plic_claim(void)
 {
   int hart = cpuid();
   int irq = *(uint32*)PLIC_SCLAIM(hart);
+
+  if(irq > 0 && irq < NIRQ)
+    irqcount[hart][irq]++;
   return irq;
 }
 
@@ -0,0 +1,11 @@
+// poll() events
+#define POLLIN    0x001  // data to read (or end of file)
+#define POLLOUT   0x004  // room to write
+#define POLLHUP   0x010  // other end closed
+#define POLLNVAL  0x020  // fd not open
+
+struct pollfd {
+  int fd;
+  short events;   // requested events
+  short revents;  // returned events
+};
@@ -17,16 +17,52 @@
 
 volatile int panicked = 0;
 
-// lock to avoid interleaving concurrent printf's.
+// each CPU formats a printf() into its own staging buffer,
+// with interrupts off, and hands it to the UART's output
+// buffer in one piece: prints from different CPUs don't
+// interleave, yet take no lock of their own and don't wait
+// for the UART. before printfinit(), and once panicking,
+// output goes straight to the UART instead.
+#define PRBUF 128
+
 static struct {
-  struct spinlock lock;
-  int locking;
+  int buffered;
 } pr;
 
+static struct {
+  char buf[PRBUF];
+  int n;
+} prstage[NCPU];
+
+static void
+prflush(void)
+{
+  int id = cpuid();
+
+  if(prstage[id].n > 0)
+    uartputs(prstage[id].buf, prstage[id].n);
+  prstage[id].n = 0;
+}
+
+// called with interrupts off.
+static void
+prputc(int c, int buffered)
+{
+  int id = cpuid();
+
+  if(!buffered){
+    uartputc_sync(c);
+    return;
+  }
+  prstage[id].buf[prstage[id].n++] = c;
+  if(prstage[id].n == PRBUF)
+    prflush();
+}
+
 static char digits[] = "0123456789abcdef";
 
 static void
-printint(int xx, int base, int sign)
+printint(int xx, int base, int sign, int buffered)
 {
   char buf[16];
   int i;
@@ -46,17 +82,17 @@ printint(int xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    prputc(buf[i], buffered);
 }
 
 static void
-printptr(uint64 x)
+printptr(uint64 x, int buffered)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  prputc('0', buffered);
+  prputc('x', buffered);
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    prputc(digits[x >> (sizeof(uint64) * 8 - 4)], buffered);
 }
 
 // Print to the console. only understands %d, %x, %p, %s.
@@ -64,20 +100,21 @@ void
 printf(char *fmt, ...)
 {
   va_list ap;
-  int i, c, locking;
+  int i, c, buffered;
   char *s;
 
-  locking = pr.locking;
-  if(locking)
-    acquire(&pr.lock);
-
   if (fmt == 0)
     panic("null fmt");
 
+  // stay on this CPU, and keep its interrupts from printing
+  // into the staging buffer meanwhile.
+  push_off();
+  buffered = pr.buffered;
+
   va_start(ap, fmt);
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      consputc(c);
+      prputc(c, buffered);
       continue;
     }
     c = fmt[++i] & 0xff;
@@ -85,39 +122,40 @@ printf(char *fmt, ...)
       break;
     switch(c){
     case 'd':
-      printint(va_arg(ap, int), 10, 1);
+      printint(va_arg(ap, int), 10, 1, buffered);
       break;
     case 'x':
-      printint(va_arg(ap, int), 16, 1);
+      printint(va_arg(ap, int), 16, 1, buffered);
       break;
     case 'p':
-      printptr(va_arg(ap, uint64));
+      printptr(va_arg(ap, uint64), buffered);
       break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        prputc(*s, buffered);
       break;
     case '%':
-      consputc('%');
+      prputc('%', buffered);
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      prputc('%', buffered);
+      prputc(c, buffered);
       break;
     }
   }
 
-  if(locking)
-    release(&pr.lock);
+  if(buffered)
+    prflush();
+  pop_off();
 }
 
 void
 panic(char *s)
 {
-  pr.locking = 0;
+  pr.buffered = 0;
   printf("panic: ");
   printf(s);
   printf("\n");
@@ -129,6 +167,5 @@ panic(char *s)
 void
 printfinit(void)
 {
-  initlock(&pr.lock, "pr");
-  pr.locking = 1;
+  pr.buffered = 1;
 }
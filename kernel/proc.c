@@ -4,6 +4,10 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
+#include "vdso.h"
+#include "spawn.h"
+#include "trace.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -15,7 +19,37 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// sleeping processes, hashed by channel, so that wakeup() only
+// looks at processes that might be sleeping on its channel.
+// a process is on its channel's queue from sleep() until it
+// runs again, whatever woke it; queue locks come before
+// p->lock, except in sleep() when lk is p->lock, which is safe
+// because wakeup() only locks processes already on the queue.
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+};
+static struct sleepq sleepq[NSLEEPQ];
+
+static struct sleepq *
+chanq(void *chan)
+{
+  uint64 h = (uint64)chan * 0x9E3779B97F4A7C15UL;
+  return &sleepq[h >> 32 & (NSLEEPQ - 1)];
+}
+
+// each CPU has queues of RUNNABLE processes, one per level
+// (multi-level feedback): it runs the oldest process of the
+// highest level, unless one lower down has been waiting
+// SCHEDAGE ticks. a process that uses up its time slice moves
+// down a level; one that wakes from sleep goes back to its
+// nice level. a process goes back on the queues of the CPU it
+// last ran on, and a CPU with nothing to do takes one from
+// another CPU. p->lock comes before rqlock, and a process is
+// on a queue exactly while RUNNABLE.
+
 extern void forkret(void);
+static void kthreadret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
@@ -45,8 +79,14 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rqlock, "runq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initlock(&p->tglock, "tglock");
+      initlock(&p->joinlock, "join");
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -92,9 +132,118 @@ allocpid() {
   return pid;
 }
 
+// Make p RUNNABLE, queueing it on the CPU it last ran on, or
+// another it may run on, and wake that CPU if it's idle; if
+// it's busy, wake an idle one that can steal p instead.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c;
+  uint64 now;
+  int i, j;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  i = p->cpu;
+  if(p->cpumask && (p->cpumask & (1L << i)) == 0)
+    for(i = 0; (p->cpumask & (1L << i)) == 0; i++)
+      ;
+  c = &cpus[i];
+  now = r_time();
+  if(p->state == RUNNING)
+    p->rtime += now - p->tstamp;
+  else
+    p->prio = p->nice; // new, or waking up
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  p->rqticks = ticks;
+  p->tstamp = now;
+  acquire(&c->rqlock);
+  if(c->rqtail[p->prio])
+    c->rqtail[p->prio]->rqnext = p;
+  else
+    c->rqhead[p->prio] = p;
+  c->rqtail[p->prio] = p;
+  release(&c->rqlock);
+
+  // release() fenced the queueing from these loads; see the
+  // idle loop in scheduler().
+  if(__atomic_load_n(&c->idle, __ATOMIC_RELAXED)){
+    ipi(i);
+  } else if(p->cpumask == 0){
+    for(j = 0; j < NCPU; j++){
+      if(j != i && __atomic_load_n(&cpus[j].idle, __ATOMIC_RELAXED)){
+        ipi(j);
+        break;
+      }
+    }
+  }
+}
+
+// The first process on c's level l queue that may run on
+// this CPU, or 0. Caller holds c->rqlock.
+static struct proc*
+qfirst(struct cpu *c, int l, uint64 me)
+{
+  struct proc *p;
+
+  for(p = c->rqhead[l]; p; p = p->rqnext)
+    if(p->cpumask == 0 || (p->cpumask & me))
+      break;
+  return p;
+}
+
+// Take the process to run next from c's queues, or return 0.
+static struct proc*
+dequeue(struct cpu *c)
+{
+  struct proc *p = 0, *q, **pp, *prev = 0;
+  uint64 me = 1L << cpuid();
+  int l;
+
+  for(l = 0; l < NPRIO && c->rqhead[l] == 0; l++)
+    ;
+  if(l == NPRIO)
+    return 0; // only a hint; someone else's queue may be changing
+  acquire(&c->rqlock);
+  for(l = 0; l < NPRIO; l++){
+    if((q = qfirst(c, l, me)) == 0)
+      continue;
+    if(p == 0)
+      p = q;
+    else if(ticks - q->rqticks >= SCHEDAGE){
+      p = q; // starving
+      break;
+    }
+  }
+  if(p){
+    for(pp = &c->rqhead[p->prio]; *pp != p; prev = *pp, pp = &(*pp)->rqnext)
+      ;
+    *pp = p->rqnext;
+    if(c->rqtail[p->prio] == p)
+      c->rqtail[p->prio] = prev;
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// the next process for CPU id to run: from its own queues,
+// else stolen from another CPU's.
+static struct proc*
+pick(int id)
+{
+  struct proc *p;
+
+  p = dequeue(&cpus[id]);
+  for(int i = 1; p == 0 && i < NCPU; i++)
+    p = dequeue(&cpus[(id + i) % NCPU]);
+  return p;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held, and the proc USED.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
@@ -113,6 +262,7 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->state = USED;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -120,7 +270,18 @@ found:
     return 0;
   }
 
-  // An empty user page table.
+  // And the page that user space reads its pid from.
+  if((p->vproc = (struct vproc *)kalloc_zeroed()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  p->vproc->pid = p->pid;
+
+  // An empty user page table, with no ASID yet.
+  p->leader = p;
+  p->tfva = TRAPFRAME;
+  p->asidgen = 0;
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
     freeproc(p);
@@ -146,16 +307,28 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->vproc)
+    kfree((void*)p->vproc);
+  p->vproc = 0;
   if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_freepagetable(p->pagetable, p->sz); // not a thread's, see exit()
   p->pagetable = 0;
   p->sz = 0;
+  p->leader = 0;
+  p->tid = 0;
+  p->tids = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->karg = 0;
+  p->uring = 0;
+  p->cpumask = 0;
+  p->prio = p->nice = 0;
+  p->rtime = p->wtime = p->maxwait = 0;
   p->state = UNUSED;
 }
 
@@ -189,6 +362,18 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // and, read-only to the user, the clock and p->vproc.
+  if(mappages(pagetable, VCLOCK, PGSIZE,
+              (uint64)vclock, PTE_R | PTE_U) < 0 ||
+     mappages(pagetable, VPROC, PGSIZE,
+              (uint64)(p->vproc), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, VCLOCK, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -199,6 +384,8 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, VCLOCK, 1, 0);
+  uvmunmap(pagetable, VPROC, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -235,28 +422,58 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn(arg) in its own process
+// slot, scheduled like any other process but only on the given
+// CPU, unless cpu is -1. Kernel threads have no user memory,
+// never return to user space, and must not return from fn.
+// Return the new pid, or -1.
+int
+kthread_create(void (*fn)(void *), void *arg, char *name, int cpu)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  p->kfn = fn;
+  p->karg = arg;
+  if(cpu >= 0)
+    p->cpumask = 1L << cpu;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
+
+  release(&p->lock);
+  return p->pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
-  struct proc *p = myproc();
+  uint64 sz;
+  struct proc *p = myproc()->leader;
 
+  acquire(&p->tglock);
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // lazily: lazyfault() maps each page when it's first used.
+    if(sz + n > mmapbase(p)){
+      release(&p->tglock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
+  release(&p->tglock);
   return 0;
 }
 
@@ -268,19 +485,33 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->leader;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child; the child of a
+  // thread gets a copy of the whole process, with only the
+  // calling thread in it.
+  acquire(&g->tglock);
+  if(uvmcopy(g->pagetable, np->pagetable, g->sz) < 0 || mmapfork(g, np) < 0){
+    release(&g->tglock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->sz = g->sz;
+  // the parent's writable pages are now copy-on-write, and the
+  // other threads must see that.
+  tlbshootdown(g->pagetable);
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  release(&g->tglock);
 
   np->parent = p;
 
@@ -290,21 +521,93 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  execfork(g, np);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  // start on this CPU, whose cache holds what np inherited.
+  np->cpu = p->cpu;
+  np->nice = p->nice;
+  setrunnable(np);
+
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a child running path, without copying the caller's
+// memory as fork() would only for exec() to throw it away: the
+// child's image is built directly, by the caller, while the
+// child is USED but not yet runnable. The child gets the
+// caller's file descriptors, changed by the n actions in act.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *act, int n)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+  struct file *f;
 
+  if((np = allocproc()) == 0)
+    return -1;
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  acquire(&g->tglock);
+  for(i = 0; i < NOFILE; i++)
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  release(&g->tglock);
+  // nothing else looks at a USED proc's files or memory, and
+  // loading the program sleeps.
   release(&np->lock);
 
+  for(i = 0; i < n; i++){
+    if(act[i].fd < 0 || act[i].fd >= NOFILE)
+      goto bad;
+    if(act[i].op == SPAWN_DUP2){
+      if(act[i].src < 0 || act[i].src >= NOFILE || (f = np->ofile[act[i].src]) == 0)
+        goto bad;
+      if(act[i].src == act[i].fd)
+        continue;
+      filedup(f);
+      if(np->ofile[act[i].fd])
+        fileclose(np->ofile[act[i].fd]);
+      np->ofile[act[i].fd] = f;
+    } else if(act[i].op == SPAWN_CLOSE){
+      if(np->ofile[act[i].fd])
+        fileclose(np->ofile[act[i].fd]);
+      np->ofile[act[i].fd] = 0;
+    } else
+      goto bad;
+  }
+
+  if((argc = execinto(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+  np->cwd = idup(p->cwd);
+
+  acquire(&np->lock);
+  np->parent = p;
+  np->nice = p->nice;
+  pid = np->pid;
+  setrunnable(np);
+  release(&np->lock);
   return pid;
+
+ bad:
+  for(i = 0; i < NOFILE; i++){
+    if(np->ofile[i])
+      fileclose(np->ofile[i]);
+    np->ofile[i] = 0;
+  }
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
 }
 
 // Pass p's abandoned children to init.
@@ -333,6 +636,269 @@ reparent(struct proc *p)
   }
 }
 
+// Make np, from allocproc(), a thread of g: running in g's
+// page table, in a free thread slot with its trapframe mapped
+// there. Returns -1, leaving np to be freed, if there is no
+// slot or g is exiting.
+static int
+addthread(struct proc *g, struct proc *np)
+{
+  int tid;
+
+  // run in g's page table, rather than a new one.
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = g->pagetable;
+  np->leader = g;
+
+  // g->killed means g is in exit(), waiting for its threads.
+  acquire(&g->tglock);
+  for(tid = 1; tid < NTHREAD; tid++)
+    if((g->tids & (1 << tid)) == 0)
+      break;
+  if(tid == NTHREAD || g->killed ||
+     mappages(g->pagetable, THREADTF(tid), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&g->tglock);
+    np->pagetable = 0;
+    return -1;
+  }
+  g->tids |= 1 << tid;
+  g->vproc->threads = 1;
+  release(&g->tglock);
+  np->tid = tid;
+  np->tfva = THREADTF(tid);
+  np->parent = g;
+  return 0;
+}
+
+// Start a thread in the current process, running fn(arg) on
+// the user stack that ends at stack. It shares the leader's
+// memory and open files (see proc.h), and has its own
+// trapframe, mapped at THREADTF(tid) in the shared page table,
+// and its own current directory. Return its pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  if(addthread(g, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  np->cpu = p->cpu;
+  np->nice = p->nice;
+  setrunnable(np);
+
+  release(&np->lock);
+
+  return pid;
+}
+
+// Start a kernel thread running fn(arg) as a thread of the
+// current process, so that it works in the process's memory
+// and with its files, for uring.c's workers. fn must exit()
+// once the thread is killed. Return its pid, or -1.
+int
+kthread_clone(void (*fn)(void *), void *arg, char *name)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  if(addthread(g, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  np->kfn = fn;
+  np->karg = arg;
+  np->context.ra = (uint64)kthreadret;
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, name, sizeof(np->name));
+
+  pid = np->pid;
+  np->cpu = p->cpu;
+  np->nice = p->nice;
+  setrunnable(np);
+
+  release(&np->lock);
+  return pid;
+}
+
+// Reap an exited thread of g, the one with the given pid if it
+// isn't 0, and return its pid. Return -1 if there's no such
+// thread, or if the caller is killed, unless dying is set.
+static int
+join1(struct proc *g, int pid, int dying)
+{
+  struct proc *np;
+  struct proc *p = myproc();
+  int found, xpid;
+
+  // hold g->joinlock for the whole time to avoid lost wakeups
+  // from a thread's exit().
+  acquire(&g->joinlock);
+  for(;;){
+    found = 0;
+    for(np = proc; np < &proc[NPROC]; np++){
+      if(np == g || np == p || np->leader != g || (pid && np->pid != pid))
+        continue;
+      acquire(&np->lock);
+      if(np->leader == g){
+        found = 1;
+        if(np->state == ZOMBIE){
+          xpid = np->pid;
+          freeproc(np);
+          release(&np->lock);
+          release(&g->joinlock);
+          return xpid;
+        }
+      }
+      release(&np->lock);
+    }
+
+    if(!found || (!dying && p->killed)){
+      release(&g->joinlock);
+      return -1;
+    }
+    sleep(&g->joinlock, &g->joinlock);
+  }
+}
+
+// Wait for a thread of the current process to exit(), the one
+// with the given pid if it isn't 0. Return its pid, or -1.
+int
+join(int pid)
+{
+  return join1(myproc()->leader, pid, 0);
+}
+
+// Exit the current thread, not its process: the memory and
+// files stay with the leader. Does not return.
+static void
+threadexit(int status)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  acquire(&g->tglock);
+  uvmunmap(p->pagetable, p->tfva, 1, 0);
+  g->tids &= ~(1 << p->tid);
+  g->vproc->threads = g->tids != 0;
+  release(&g->tglock);
+  p->pagetable = 0; // g's; freeproc() mustn't free it
+
+  begin_op();
+  iput(p->cwd);
+  end_op();
+  p->cwd = 0;
+
+  // for reparent(), as in exit().
+  acquire(&initproc->lock);
+  wakeup1(initproc);
+  release(&initproc->lock);
+
+  acquire(&g->joinlock);
+  wakeup(&g->joinlock);
+  acquire(&p->lock);
+  reparent(p);
+  p->xstate = status;
+  p->state = ZOMBIE;
+  release(&g->joinlock);
+
+  // Jump into the scheduler, never to return.
+  sched();
+  panic("zombie exit");
+}
+
+// Kill all of g's threads, and wait for them to exit, before
+// g itself exits.
+static void
+threadkill(struct proc *g)
+{
+  struct proc *np;
+
+  // stop clone() making more.
+  acquire(&g->lock);
+  acquire(&g->tglock);
+  g->killed = 1;
+  release(&g->tglock);
+  release(&g->lock);
+
+  for(np = proc; np < &proc[NPROC]; np++){
+    if(np == g || np->leader != g)
+      continue;
+    acquire(&np->lock);
+    if(np->leader == g){
+      np->killed = 1;
+      if(np->state == SLEEPING)
+        setrunnable(np);
+    }
+    release(&np->lock);
+  }
+  while(join1(g, 0, 1) > 0)
+    ;
+}
+
+// Kill the kernel threads that kthread_clone() gave g, such as
+// uring workers, and wait for them to exit, so that g can
+// exec(). Returns -1, killing none, if g has user threads too;
+// those would be left running in the old image. g is the
+// caller, so it can't start more of either meanwhile.
+int
+kthreadstop(struct proc *g)
+{
+  struct proc *np;
+  int pids[NTHREAD], n = 0, i;
+
+  for(np = proc; np < &proc[NPROC]; np++){
+    if(np == g || np->leader != g)
+      continue;
+    acquire(&np->lock);
+    if(np->leader == g && np->kfn == 0){
+      release(&np->lock);
+      return -1;
+    }
+    release(&np->lock);
+  }
+  for(np = proc; np < &proc[NPROC]; np++){
+    if(np == g || np->leader != g)
+      continue;
+    acquire(&np->lock);
+    if(np->leader == g && n < NTHREAD){
+      pids[n++] = np->pid;
+      np->killed = 1;
+      if(np->state == SLEEPING)
+        setrunnable(np);
+    }
+    release(&np->lock);
+  }
+  for(i = 0; i < n; i++)
+    join1(g, pids[i], 1);
+  return 0;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
@@ -344,6 +910,14 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  if(p->leader != p)
+    threadexit(status);
+  threadkill(p);
+
+  uringfree(p);
+  munmapall(p, p->pagetable);
+  execput(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -358,6 +932,11 @@ exit(int status)
   end_op();
   p->cwd = 0;
 
+#ifdef LAB_NET
+  zcrelease(p);
+  e1000_unbypass(p);
+#endif
+
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
   // acquired any other proc lock. so wake up init whether that's
@@ -419,7 +998,8 @@ wait(uint64 addr)
       // this code uses np->parent without holding np->lock.
       // acquiring the lock first would cause a deadlock,
       // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
+      // threads are for join().
+      if(np->parent == p && np->leader == np){
         // np->parent can't change between the check and the acquire()
         // because only the parent changes it, and we're the parent.
         acquire(&np->lock);
@@ -465,36 +1045,52 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    int nproc = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+
+    if((p = pick(id)) == 0){
+      // nothing to run: wait for an interrupt. saying so
+      // before looking once more means that setrunnable()
+      // either sees c->idle and sends an ipi(), or queued its
+      // process in time to be found. wfi returns with
+      // interrupts off if one is pending; it's taken at the
+      // top of the loop.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if((p = pick(id)) == 0)
+        asm volatile("wfi");
+      c->idle = 0;
+    }
+
+    if(p){
       acquire(&p->lock);
-      if(p->state != UNUSED) {
-        nproc++;
-      }
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
+      if(p->state != RUNNABLE)
+        panic("scheduler: queued but not runnable");
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      uint64 now = r_time();
+      p->wtime += now - p->tstamp;
+      if(now - p->tstamp > p->maxwait)
+        p->maxwait = now - p->tstamp;
+      p->tstamp = now;
+      p->state = RUNNING;
+      p->cpu = id;
+      TRACE(TR_SWITCH, p->pid, 0);
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      // setrunnable() may have restamped it already.
+      c->proc = 0;
       release(&p->lock);
     }
-    if(nproc <= 2) {   // only init and sh exist
-      intr_on();
-      asm volatile("wfi");
-    }
   }
 }
 
@@ -519,19 +1115,85 @@ sched(void)
     panic("sched running");
   if(intr_get())
     panic("sched interruptible");
+  if(p->state != RUNNABLE) // else setrunnable() counted it
+    p->rtime += r_time() - p->tstamp;
 
+  TRACE(TR_SCHED, p->state, 0);
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
 }
 
+// p's time slice is over: move it down a level, and give up
+// the CPU.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+  acquire(&p->lock);
+  if(p->prio < NPRIO-1)
+    p->prio++;
+  setrunnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// Set the level p returns to when it wakes, and return the
+// old one.
+int
+setnice(int nice)
+{
+  struct proc *p = myproc();
+  int old;
+
+  if(nice < 0)
+    nice = 0;
+  if(nice > NPRIO-1)
+    nice = NPRIO-1;
+  acquire(&p->lock);
+  old = p->nice;
+  p->nice = nice;
+  if(p->prio < nice)
+    p->prio = nice;
+  release(&p->lock);
+  return old;
+}
+
+// Fill in st for the current process.
+void
+getschedstat(struct schedstat *st)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  st->prio = p->prio;
+  st->nice = p->nice;
+  st->runtime = p->rtime + (r_time() - p->tstamp);
+  st->waittime = p->wtime;
+  st->maxwait = p->maxwait;
+  release(&p->lock);
+}
+
+// The number of process slots in use, for sysinfo().
+int
+nproc(void)
+{
+  struct proc *p;
+  int n = 0;
+
+  for(p = proc; p < &proc[NPROC]; p++)
+    if(p->state != UNUSED)
+      n++;
+  return n;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -557,38 +1219,62 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn(p->karg);
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = chanq(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold q->lock and p->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks both),
   // so it's okay to release lk.
+  acquire(&q->lock);
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
     release(lk);
   }
+  p->qnext = q->head;
+  q->head = p;
+  release(&q->lock);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  TRACE(TR_SLEEP, chan, 0);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+  acquire(&q->lock);
+  for(pp = &q->head; *pp != p; pp = &(*pp)->qnext)
+    ;
+  *pp = p->qnext;
+  release(&q->lock);
 
   // Reacquire original lock.
-  if(lk != &p->lock){
-    release(&p->lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -596,15 +1282,31 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  wakeupn(chan, NPROC);
+}
+
+// Wake up at most n processes sleeping on chan, and return
+// how many there were; for futex_wake().
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *q = chanq(chan);
   struct proc *p;
+  int woken = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p && woken < n; p = p->qnext) {
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+      setrunnable(p);
+      woken++;
     }
     release(&p->lock);
   }
+  release(&q->lock);
+  TRACE(TR_WAKEUP, chan, woken);
+  return woken;
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -615,7 +1317,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    setrunnable(p);
   }
 }
 
@@ -633,7 +1335,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -681,15 +1383,21 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    printf("cpu %d ipi sent %d recv %d shootdowns %d\n", (int)(c - cpus),
+           c->ipisent, c->ipirecv, c->shootdowns);
+  sleeplockdump();
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->state == UNUSED)
       continue;
@@ -697,7 +1405,10 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    // times in ms, for qemu's 10 MHz time CSR.
+    printf("%d %s %s prio %d run %d wait %d maxwait %d", p->pid, state, p->name,
+           p->prio, (int)(p->rtime / 10000), (int)(p->wtime / 10000),
+           (int)(p->maxwait / 10000));
     printf("\n");
   }
 }
@@ -18,12 +18,31 @@ struct context {
   uint64 s11;
 };
 
+// a function for another CPU to run, see ipicall().
+struct ipicall {
+  void (*fn)(void *);
+  void *arg;
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this CPU's TLB is flushed for
+  int idle;                   // waiting in wfi for something to run, see scheduler()
+  struct spinlock rqlock;     // protects the run queues
+  struct proc *rqhead[NPRIO]; // RUNNABLE processes to run here, by level,
+  struct proc *rqtail[NPRIO]; // oldest first
+  pagetable_t upt;            // the user page table while in user space, else 0
+  uint ugen;                  // traps from user space, for tlbshootdown()
+  struct spinlock ipilock;    // protects call and ncall
+  struct ipicall call[NIPICALL]; // for ipiintr() to run
+  int ncall;
+  uint ipisent;               // IPIs this CPU sent
+  uint ipirecv;               // and received
+  uint shootdowns;            // tlbshootdown()s that had to interrupt another CPU
 };
 
 extern struct cpu cpus[NCPU];
@@ -78,9 +97,30 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_flush;  // uservec must flush the TLB (no ASIDs)
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+// a loadable segment of the program a process runs, paged in
+// from p->execip on demand, see exec.c.
+struct execseg {
+  uint64 va;                   // page-aligned
+  uint64 filesz;
+  uint64 memsz;
+  uint off;                    // file offset of va
+  int writable;
+};
+
+// a region of a file mapped by mmap(), see mmap.c.
+struct vma {
+  uint64 addr;                 // page-aligned
+  uint64 len;
+  int prot;                    // PROT_READ, PROT_WRITE
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  uint64 off;                  // file offset mapped at addr
+  struct file *f;              // 0 if the slot is free
+};
+
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
@@ -99,8 +139,44 @@ struct proc {
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  struct vproc *vproc;         // read-only to user, at VPROC
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct file *argf[2];        // this thread's argfd() references, see argfdput()
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void *);         // If non-zero, a kernel thread running kfn(karg)
+  void *karg;
+  uint64 cpumask;              // If non-zero, the CPUs p may run on
+  struct inode *execip;        // the program, if it's paged in on demand
+  struct execseg seg[NEXECSEG]; // its segments
+  int nseg;
+  struct vma vma[NVMA];        // mmap()ed files
+  struct mbuf *zcbuf[NZCBUF];  // mbufs mapped at ZCBASE by recvzc()
+  struct uringctl *uring;      // async I/O rings at URING, see uring.c
+  struct proc *qnext;          // on a sleep queue, under its lock
+  struct proc *rqnext;         // on a run queue, under its rqlock
+  int cpu;                     // the CPU p last ran on
+  int prio;                    // scheduling level, 0 is the highest
+  int nice;                    // level p returns to when it wakes
+  uint rqticks;                // ticks when p was last queued
+  uint64 tstamp;               // time CSR when p was queued or started running
+  uint64 rtime;                // time spent running
+  uint64 wtime;                // time spent RUNNABLE
+  uint64 maxwait;              // longest time RUNNABLE
+  int asid;                    // address-space ID, see uvmsatp()
+  uint64 asidgen;              // generation asid belongs to; 0 for none
+  uint64 tlbstale;             // CPUs whose TLB may be stale for asid
+
+  // a thread made by clone() shares its leader's page table,
+  // memory, mappings, open files and zero-copy buffers: the
+  // code that uses them goes through p->leader, which is p
+  // itself in a process that isn't a thread. only a leader's
+  // sz, asid, execip, seg, vma, ofile, zcbuf and uring are used.
+  struct proc *leader;
+  int tid;                     // slot in the leader's threads, 0 for a leader
+  uint64 tfva;                 // where p->trapframe is mapped, for trampoline.S
+  uint tids;                   // leader: thread slots in use
+  struct spinlock tglock;      // leader: guards sz, vma, ofile, zcbuf, tids and PTE changes
+  struct spinlock joinlock;    // leader: join() sleeps on it
 };
@@ -0,0 +1,124 @@
+//
+// the sampling profiler.
+//
+// while it is on, each timer interrupt records where its CPU
+// was into that CPU's buffer, which the prof device drains.
+// profile(n) takes n samples per clock tick by running the
+// timer n times as fast, and counting only every nth
+// interrupt as a tick. a full buffer drops samples.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "prof.h"
+#include "defs.h"
+
+// timervec's per-CPU scratch areas, in start.c.
+extern uint64 timer_scratch[NCPU][10];
+
+static uint profrate;   // samples per tick, or 0 when off
+
+static struct profbuf {
+  uint64 head;          // next sample to write; only its CPU writes it
+  uint64 tail;          // next sample to read; only the reader writes it
+  uint dropped;
+  uint sub;             // timer interrupts since the last tick
+  struct profsample s[NPROFSAMPLE];
+} profbuf[NCPU];
+
+// one reader at a time.
+static struct sleeplock proflock;
+
+void
+profinit(void)
+{
+  initsleeplock(&proflock, "prof");
+  devsw[PROFDEV].read = profread;
+}
+
+// take rate samples per tick from now on, or stop if rate is
+// 0. returns how many samples were dropped since the last
+// call, or -1.
+int
+profile(int rate)
+{
+  int i, dropped = 0;
+
+  if(rate < 0 || rate > PROFMAXRATE)
+    return -1;
+  profrate = rate;
+  for(i = 0; i < NCPU; i++){
+    // timervec reads the interval afresh for each interrupt.
+    __atomic_store_n(&timer_scratch[i][4], TICKINTERVAL / (rate ? rate : 1),
+                     __ATOMIC_RELAXED);
+    dropped += __atomic_exchange_n(&profbuf[i].dropped, 0, __ATOMIC_RELAXED);
+  }
+  return dropped;
+}
+
+// called by devintr() for each timer interrupt, with the
+// interrupted sepc and sstatus still in place. returns
+// whether this interrupt is a clock tick.
+int
+profintr(void)
+{
+  struct profbuf *b = &profbuf[cpuid()];
+  struct proc *p = mycpu()->proc;
+  struct profsample *s;
+  uint rate = profrate;
+
+  if(rate == 0){
+    b->sub = 0;
+    return 1;
+  }
+  if(b->head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) < NPROFSAMPLE){
+    s = &b->s[b->head % NPROFSAMPLE];
+    s->pc = r_sepc();
+    s->user = (r_sstatus() & SSTATUS_SPP) == 0;
+    s->cpu = cpuid();
+    s->pid = p ? p->pid : 0;
+    if(p)
+      safestrcpy(s->name, p->name, sizeof(s->name));
+    else
+      s->name[0] = 0;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+  } else {
+    b->dropped++;
+  }
+  if(++b->sub < rate)
+    return 0;
+  b->sub = 0;
+  return 1;
+}
+
+// the prof device: read()s return whole struct profsamples,
+// and 0 once the buffers are empty.
+int
+profread(int user_dst, uint64 dst, int n)
+{
+  struct profbuf *b;
+  struct profsample s;
+  int got = 0;
+
+  acquiresleep(&proflock);
+  for(b = profbuf; b < &profbuf[NCPU] && n - got >= sizeof(s); b++){
+    while(n - got >= sizeof(s) &&
+          b->tail != __atomic_load_n(&b->head, __ATOMIC_ACQUIRE)){
+      s = b->s[b->tail % NPROFSAMPLE];
+      __atomic_store_n(&b->tail, b->tail + 1, __ATOMIC_RELEASE);
+      if(either_copyout(user_dst, dst + got, (char *)&s, sizeof(s)) < 0)
+        goto out;
+      got += sizeof(s);
+    }
+  }
+ out:
+  releasesleep(&proflock);
+  return got;
+}
@@ -0,0 +1,8 @@
+// one sample from the profiler; see prof.c.
+struct profsample {
+  uint64 pc;        // sepc when the timer interrupted
+  int pid;          // the running process, or 0 for none
+  ushort cpu;
+  ushort user;      // 1 if pc is a user address
+  char name[16];    // the process's name, for finding its program
+};
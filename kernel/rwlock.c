@@ -0,0 +1,69 @@
+// Reader-writer spin locks.
+//
+// Any number of CPUs may hold the lock for reading at once,
+// or one for writing. A reader takes lk just long enough to
+// count itself in, so readers and writers get in in ticket
+// order: a waiting writer holds lk, so no new reader can get
+// in ahead of it, and it only waits for the readers already
+// inside to leave. Interrupts stay off while the lock is held,
+// as with a spinlock. Read sections don't nest: a CPU that
+// asks for a lock it's reading may deadlock with a writer.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "rwlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+void
+initrwlock(struct rwlock *rw, char *name)
+{
+  initlock(&rw->lk, name);
+  rw->readers = 0;
+  rw->name = name;
+}
+
+void
+acquireread(struct rwlock *rw)
+{
+  push_off();
+  acquire(&rw->lk);
+  __atomic_fetch_add(&rw->readers, 1, __ATOMIC_ACQUIRE);
+  release(&rw->lk);
+}
+
+void
+releaseread(struct rwlock *rw)
+{
+  __atomic_fetch_sub(&rw->readers, 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+void
+acquirewrite(struct rwlock *rw)
+{
+  acquire(&rw->lk);
+  while(__atomic_load_n(&rw->readers, __ATOMIC_ACQUIRE) != 0) {
+#ifdef LAB_LOCK
+    __sync_fetch_and_add(&rw->lk.nts, 1);
+#else
+    ;
+#endif
+  }
+}
+
+void
+releasewrite(struct rwlock *rw)
+{
+  release(&rw->lk);
+}
+
+// Check whether this cpu holds rw for writing.
+// Interrupts must be off.
+int
+holdingwrite(struct rwlock *rw)
+{
+  return holding(&rw->lk);
+}
@@ -0,0 +1,8 @@
+// Reader-writer spin locks, for read-mostly tables.
+struct rwlock {
+  struct spinlock lk; // writers hold it; readers only to get in
+  uint readers;       // CPUs in a read section
+
+  // For debugging:
+  char *name;        // Name of lock.
+};
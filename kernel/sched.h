@@ -0,0 +1,9 @@
+// scheduling levels and statistics, see proc.c.
+
+struct schedstat {
+  int prio;         // current level, 0 is the highest
+  int nice;         // level it returns to on waking
+  uint64 runtime;   // time running, in time CSR ticks
+  uint64 waittime;  // time runnable but not running
+  uint64 maxwait;   // longest single wait to run
+};
@@ -0,0 +1,240 @@
+// Slab allocator for small kernel objects, on top of kalloc().
+//
+// A kmem_cache hands out objects of one size, carved from
+// whole pages (slabs). Each slab starts with a header that
+// records which of its objects are free; an object's slab is
+// found by rounding its address down to the page. In front of
+// the slabs, each CPU keeps a small magazine of free objects,
+// so that most allocations and frees take no lock.
+//
+// A cache may have a constructor, which runs once per object
+// when its slab is carved, not on every kmem_cache_alloc();
+// objects must be freed in their constructed state (e.g. with
+// their locks released).
+//
+// kmalloc() and kmfree() serve arbitrary sizes from a set of
+// power-of-two caches, or whole pages for big requests.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define SLAB_MINOBJ  32
+#define SLAB_MAXOBJS (PGSIZE / SLAB_MINOBJ)
+#define SLAB_MAXSIZE 1024  // bigger kmalloc()s get whole pages
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;        // on the cache's partial list
+  int nfree;
+  uchar free[SLAB_MAXOBJS]; // indices of the free objects
+};
+
+#define SLAB_HDR ((sizeof(struct slab) + 7) & ~7)
+
+struct kmag {
+  int n;
+  void *obj[SLABMAG];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                // rounded up to a multiple of 8
+  int perslab;
+  void (*ctor)(void *);
+  struct spinlock lock;
+  struct slab *partial;     // slabs with free objects
+  int nslabs;
+  struct kmag mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKMEMCACHE];
+  int n;
+} slabs;
+
+static char *kmalloc_names[] = {
+  "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+  "kmalloc-512", "kmalloc-1024",
+};
+
+static struct kmem_cache *kmalloc_cache[NELEM(kmalloc_names)];
+
+void
+slabinit(void)
+{
+  int i;
+
+  initlock(&slabs.lock, "slabs");
+  for(i = 0; SLAB_MINOBJ << i <= SLAB_MAXSIZE; i++)
+    kmalloc_cache[i] = kmem_cache_create(kmalloc_names[i], SLAB_MINOBJ << i, 0);
+}
+
+// Create a cache of objects of size bytes. Caches are never
+// destroyed.
+struct kmem_cache *
+kmem_cache_create(char *name, uint size, void (*ctor)(void *))
+{
+  struct kmem_cache *c;
+
+  if(size < SLAB_MINOBJ)
+    size = SLAB_MINOBJ;
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - SLAB_HDR)
+    panic("kmem_cache_create: too big");
+
+  acquire(&slabs.lock);
+  if(slabs.n == NKMEMCACHE)
+    panic("kmem_cache_create: no caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLAB_HDR) / size;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  return c;
+}
+
+static void *
+slabobj(struct slab *s, int i)
+{
+  return (char *)s + SLAB_HDR + i * s->cache->size;
+}
+
+// Carve a new slab for c. Caller holds c->lock.
+static struct slab *
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+
+  if((s = (struct slab *)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->nfree = c->perslab;
+  for(int i = 0; i < c->perslab; i++){
+    s->free[i] = c->perslab - 1 - i;
+    if(c->ctor)
+      c->ctor(slabobj(s, i));
+  }
+  s->next = c->partial;
+  c->partial = s;
+  c->nslabs++;
+  return s;
+}
+
+// Refill magazine m with up to half a magazine of objects.
+static void
+magrefill(struct kmem_cache *c, struct kmag *m)
+{
+  struct slab *s;
+
+  acquire(&c->lock);
+  while(m->n < SLABMAG/2){
+    if((s = c->partial) == 0 && (s = slabgrow(c)) == 0)
+      break;
+    m->obj[m->n++] = slabobj(s, s->free[--s->nfree]);
+    if(s->nfree == 0)
+      c->partial = s->next; // full; back on the list when freed from
+  }
+  release(&c->lock);
+}
+
+// Return half of magazine m to the slabs. A slab that becomes
+// entirely free goes back to kalloc(), unless it's the only
+// partial slab left.
+static void
+magdrain(struct kmem_cache *c, struct kmag *m)
+{
+  struct slab *s, **pp;
+  void *o;
+
+  acquire(&c->lock);
+  while(m->n > SLABMAG/2){
+    o = m->obj[--m->n];
+    s = (struct slab *)PGROUNDDOWN((uint64)o);
+    if(s->cache != c)
+      panic("kmem_cache_free: wrong cache");
+    if(s->nfree == 0){
+      s->next = c->partial;
+      c->partial = s;
+    }
+    s->free[s->nfree++] = ((char *)o - (char *)s - SLAB_HDR) / c->size;
+    if(s->nfree == c->perslab && (c->partial != s || s->next != 0)){
+      for(pp = &c->partial; *pp != s; pp = &(*pp)->next)
+        ;
+      *pp = s->next;
+      c->nslabs--;
+      kfree((char *)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c, or return 0.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmag *m;
+  void *o = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    magrefill(c, m);
+  if(m->n > 0)
+    o = m->obj[--m->n];
+  pop_off();
+  return o;
+}
+
+// Free an object that came from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct kmag *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == SLABMAG)
+    magdrain(c, m);
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Allocate n bytes of kernel memory, not zeroed. Requests
+// over SLAB_MAXSIZE bytes get a whole page, so n must be at
+// most PGSIZE.
+void *
+kmalloc(uint n)
+{
+  int i;
+
+  if(n > PGSIZE)
+    return 0;
+  if(n > SLAB_MAXSIZE)
+    return kalloc();
+  for(i = 0; SLAB_MINOBJ << i < n; i++)
+    ;
+  return kmem_cache_alloc(kmalloc_cache[i]);
+}
+
+// Free memory from kmalloc(). Pages are the page-aligned
+// pointers: slab objects never are, because of the header.
+void
+kmfree(void *p)
+{
+  struct slab *s;
+
+  if(((uint64)p % PGSIZE) == 0){
+    kfree(p);
+    return;
+  }
+  s = (struct slab *)PGROUNDDOWN((uint64)p);
+  kmem_cache_free(s->cache, p);
+}
@@ -1,4 +1,17 @@
 // Sleeping locks
+//
+// acquiresleep() of a held lock first spins, briefly, while
+// the holder is running on another CPU: it's likely to release
+// the lock sooner than a sleep() and wakeup() would take. A
+// holder that is sleeping or waiting for a CPU could take a
+// while, so then the caller sleeps at once.
+//
+// A lock can also be held shared, by any number of readers at
+// once, with acquiresleepshared(). Readers don't wait for
+// writers that are waiting, only for one that holds the lock:
+// a shared holder may take the lock shared again (a read()
+// whose copyout() faults in a page of the same file), which
+// would deadlock behind a waiting writer.
 
 #include "types.h"
 #include "riscv.h"
@@ -9,24 +22,75 @@
 #include "proc.h"
 #include "sleeplock.h"
 
+// totals over all sleeplocks, for sleeplockdump().
+static struct {
+  uint ncontend;
+  uint nspun;
+  uint nsleep;
+} sleepstats;
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->ncontend = 0;
+  lk->nspun = 0;
+}
+
+// spin until lk is free, or its holder stops running on some
+// other CPU. returns 1 if lk looks free. called without lk->lk.
+static int
+spinsleep(struct sleeplock *lk, struct proc *owner)
+{
+  for(int i = 0; i < SLEEPSPIN; i++){
+    if(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) == 0)
+      return 1;
+    if(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != owner ||
+       __atomic_load_n(&owner->state, __ATOMIC_RELAXED) != RUNNING)
+      return 0;
+  }
+  return 0;
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *owner;
+  int contended = 0, spun = 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  while (lk->locked || lk->readers) {
+    contended = 1;
+    owner = lk->owner;
+    if(!spun && owner && owner->state == RUNNING){
+      // proc structs are never freed, so owner stays safe
+      // to look at after lk->lk is released.
+      spun = 1;
+      release(&lk->lk);
+      spinsleep(lk, owner);
+      acquire(&lk->lk);
+      continue;
+    }
+    spun = 2;
+    __sync_fetch_and_add(&sleepstats.nsleep, 1);
     sleep(lk, &lk->lk);
   }
+  if(contended){
+    lk->ncontend++;
+    __sync_fetch_and_add(&sleepstats.ncontend, 1);
+    if(spun == 1){
+      lk->nspun++;
+      __sync_fetch_and_add(&sleepstats.nspun, 1);
+    }
+  }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
   release(&lk->lk);
 }
 
@@ -36,10 +100,39 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// hold lk in shared mode, alongside other readers.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->locked){
+    lk->ncontend++;
+    __sync_fetch_and_add(&sleepstats.ncontend, 1);
+  }
+  while (lk->locked) {
+    __sync_fetch_and_add(&sleepstats.nsleep, 1);
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -51,5 +144,22 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+// is lk held shared, by anyone?
+int
+holdingsleepshared(struct sleeplock *lk)
+{
+  int r;
 
+  acquire(&lk->lk);
+  r = lk->readers > 0;
+  release(&lk->lk);
+  return r;
+}
 
+// print the contention totals. for procdump().
+void
+sleeplockdump(void)
+{
+  printf("sleeplocks: contended %d spun %d sleeps %d\n",
+         sleepstats.ncontend, sleepstats.nspun, sleepstats.nsleep);
+}
@@ -1,10 +1,17 @@
 // Long-term locks for processes
 struct sleeplock {
   uint locked;       // Is the lock held?
+  int readers;       // holders in shared mode
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+  struct proc *owner; // and its proc, for acquiresleep() to spin on
+
+  // contention: acquisitions that found the lock held, and
+  // how many of those spun it free rather than sleeping.
+  uint ncontend;
+  uint nspun;
 };
 
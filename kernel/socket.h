@@ -0,0 +1,27 @@
+// socket options, for setsockopt().
+#define SO_TXBLOCK  1   // sleep for TX ring space instead of dropping
+#define SO_RCVBUF   2   // receive queue limit, in bytes (4096 per datagram)
+#define SO_DROPS    3   // getsockopt() only: datagrams dropped at a full queue
+#define SO_REUSEADDR 4  // let other sockets bind() the same port
+#define SO_JOIN     5   // setsockopt() only: join the multicast group in val
+#define SO_LEAVE    6   // setsockopt() only: leave the multicast group in val
+
+// one datagram for sendmmsg()/recvmmsg(). recvmmsg() sets
+// len to the size of the datagram it stored at buf.
+struct mmsg {
+  uint64 buf;
+  uint len;
+};
+
+// a UDP peer, for sendto() and recvfrom().
+struct sockaddr {
+  uint32 addr;  // IPv4 address
+  uint16 port;  // UDP port
+};
+
+// a datagram received by recvzc(), mapped read-only into
+// the caller's address space until handed back by zcfree(addr).
+struct zcbuf {
+  uint64 addr;  // user address of the payload
+  uint len;     // payload length
+};
@@ -0,0 +1,11 @@
+// file descriptor actions for spawn(), applied in order to
+// the child's copy of the caller's descriptors.
+
+#define SPAWN_DUP2   1  // fd becomes a duplicate of src
+#define SPAWN_CLOSE  2  // fd is closed
+
+struct spawnact {
+  int op;
+  int fd;
+  int src;
+};
@@ -47,7 +47,8 @@ void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
 #ifdef LAB_LOCK
   lk->nts = 0;
@@ -61,6 +62,8 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint t;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
@@ -69,11 +72,12 @@ acquire(struct spinlock *lk)
     __sync_fetch_and_add(&(lk->n), 1);
 #endif      
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+  // On RISC-V, taking a ticket is one atomic add:
+  //   amoadd.w t, 1, (&lk->next)
+  // the wait then only reads lk->owner, so the waiters share
+  // its cache line until release() writes it.
+  t = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+  while(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != t) {
 #ifdef LAB_LOCK
     __sync_fetch_and_add(&(lk->nts), 1);
 #else
@@ -108,14 +112,11 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Let the next ticket in. Only the holder writes lk->owner,
+  // but this uses an atomic store rather than a C assignment,
+  // since the C standard implies that an assignment might be
+  // implemented with multiple store instructions.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -126,7 +127,22 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) !=
+       __atomic_load_n(&lk->next, __ATOMIC_RELAXED) && lk->cpu == mycpu());
+  return r;
+}
+
+// Check whether this cpu is holding any spin lock (or is
+// otherwise between push_off() and pop_off()), and so mustn't
+// sleep. Unlike holding(), interrupts may be on.
+int
+holdingany(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
   return r;
 }
 
@@ -1,9 +1,17 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock: a ticket lock. Each acquire() takes
+// the next ticket and waits, reading only, until owner reaches
+// it, so CPUs get the lock in the order they asked for it and
+// can't be starved.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // next ticket to hand out
+  uint owner;        // ticket now holding the lock; held while owner != next
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+#ifdef LAB_LOCK
+  int nts;           // spins waiting for the lock
+  int n;             // acquire()s
+#endif
 };
 
@@ -0,0 +1,113 @@
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, char c)
+{
+  *s = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, long xx, int base, int sign)
+{
+  char buf[24];
+  int i, n;
+  uint64 x;
+
+  if(sign && (sign = xx < 0))
+    x = -xx;
+  else
+    x = xx;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0)
+    n += sputc(s+n, buf[i]);
+  return n;
+}
+
+// Print to buf, which holds sz bytes; output is always
+// NUL-terminated. Understands %d, %x, %p, %s, and %ld/%lx
+// for 64-bit values. Returns the number of bytes written,
+// not counting the NUL.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, l, n;
+  int off = 0;
+  char tmp[24];
+  char *s;
+
+  if(sz <= 0)
+    return 0;
+  va_start(ap, fmt);
+  for(i = 0; off < sz - 1 && (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      off += sputc(buf+off, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    l = 0;
+    if(c == 'l'){
+      l = 1;
+      c = fmt[++i] & 0xff;
+    }
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      n = sprintint(tmp, l ? va_arg(ap, long) : va_arg(ap, int), 10, 1);
+      tmp[n] = 0;
+      s = tmp;
+      break;
+    case 'x':
+      n = sprintint(tmp, l ? va_arg(ap, long) : va_arg(ap, uint), 16, 0);
+      tmp[n] = 0;
+      s = tmp;
+      break;
+    case 'p':
+      n = sprintint(tmp, va_arg(ap, uint64), 16, 0);
+      tmp[n] = 0;
+      s = tmp;
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      break;
+    case '%':
+      s = "%";
+      break;
+    default:
+      // print unknown % sequence to draw attention.
+      tmp[0] = '%';
+      tmp[1] = c;
+      tmp[2] = 0;
+      s = tmp;
+      break;
+    }
+    for(; *s && off < sz - 1; s++)
+      off += sputc(buf+off, *s);
+  }
+  buf[off] = 0;
+  va_end(ap);
+  return off;
+}
@@ -1,13 +1,37 @@
 #include "types.h"
 
+// memset(), memcmp() and memmove() are under every copyin and
+// copyout, buffer-cache copy and kalloc() fill, so they work a
+// 64-bit word at a time, four words per loop iteration, once
+// they've reached an 8-byte boundary. memcmp() and memmove()
+// can only do that when both pointers are equally aligned;
+// otherwise they go a byte at a time, since misaligned loads
+// and stores may trap.
+
+#define WALIGNED(p) (((uint64)(p) & 7) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  for(; n > 0 && !WALIGNED(cdst); n--)
+    *cdst++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(wdst = (uint64 *) cdst; n >= 32; n -= 32, wdst += 4){
+    wdst[0] = w;
+    wdst[1] = w;
+    wdst[2] = w;
+    wdst[3] = w;
   }
+  for(; n >= 8; n -= 8)
+    *wdst++ = w;
+  for(cdst = (char *) wdst; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +42,14 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(((uint64)s1 & 7) == ((uint64)s2 & 7)){
+    for(; n > 0 && !WALIGNED(s1); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip the equal words; the bytes find any difference.
+    for(; n >= 8 && *(uint64 *)s1 == *(uint64 *)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,17 +64,56 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int words;
 
   s = src;
   d = dst;
+  words = ((uint64)s & 7) == ((uint64)d & 7);
   if(s < d && s + n > d){
+    // backwards, since the end of src overlaps the start of dst.
     s += n;
     d += n;
+    if(words){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *--d = *--s;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 32; n -= 32){
+        wd -= 4, ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *d++ = *s++;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 32; n -= 32, wd += 4, ws += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -5,6 +5,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "syscall.h"
+#include "trace.h"
+#include "sysinfo.h"
 #include "defs.h"
 
 // Fetch the uint64 at addr from the current process.
@@ -12,7 +14,7 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
+  if(addr >= p->leader->sz || addr+sizeof(uint64) > p->leader->sz)
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -104,8 +106,46 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_schedstat(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_profile(void);
+extern uint64 sys_sysinfo(void);
+extern uint64 sys_uring_setup(void);
+extern uint64 sys_uring_enter(void);
+extern uint64 sys_irqaffinity(void);
+extern uint64 sys_nanosleep(void);
 #ifdef LAB_NET
 extern uint64 sys_connect(void);
+extern uint64 sys_setsockopt(void);
+extern uint64 sys_recvzc(void);
+extern uint64 sys_zcfree(void);
+extern uint64 sys_recvmmsg(void);
+extern uint64 sys_sendmmsg(void);
+extern uint64 sys_getsockopt(void);
+extern uint64 sys_bind(void);
+extern uint64 sys_recvfrom(void);
+extern uint64 sys_sendto(void);
+extern uint64 sys_tcpconnect(void);
+extern uint64 sys_tcplisten(void);
+extern uint64 sys_tcpaccept(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_netbypass(void);
 #endif
 
 static uint64 (*syscalls[])(void) = {
@@ -130,13 +170,91 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_poll]    sys_poll,
+[SYS_fcntl]   sys_fcntl,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_fsync]   sys_fsync,
+[SYS_nice]    sys_nice,
+[SYS_schedstat] sys_schedstat,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_spawn]   sys_spawn,
+[SYS_splice]  sys_splice,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_trace]   sys_trace,
+[SYS_profile] sys_profile,
+[SYS_sysinfo] sys_sysinfo,
+[SYS_uring_setup] sys_uring_setup,
+[SYS_uring_enter] sys_uring_enter,
+[SYS_irqaffinity] sys_irqaffinity,
+[SYS_nanosleep] sys_nanosleep,
 #ifdef LAB_NET
 [SYS_connect] sys_connect,
+[SYS_setsockopt] sys_setsockopt,
+[SYS_recvzc] sys_recvzc,
+[SYS_zcfree] sys_zcfree,
+[SYS_recvmmsg] sys_recvmmsg,
+[SYS_sendmmsg] sys_sendmmsg,
+[SYS_getsockopt] sys_getsockopt,
+[SYS_bind]    sys_bind,
+[SYS_recvfrom] sys_recvfrom,
+[SYS_sendto]  sys_sendto,
+[SYS_tcpconnect] sys_tcpconnect,
+[SYS_tcplisten] sys_tcplisten,
+[SYS_tcpaccept] sys_tcpaccept,
+[SYS_sendfile] sys_sendfile,
+[SYS_netbypass] sys_netbypass,
 #endif
 };
 
 
 
+// counts and latencies of each system call, kept by the CPU
+// that finished it, so that counting takes no lock.
+static struct syscallstat sysstat[NCPU][NSYSCALL];
+
+static void
+syscallcount(int num, uint64 t)
+{
+  struct syscallstat *st;
+  int b;
+
+  if(num >= NSYSCALL)
+    return;
+  for(b = 0; b < NSYSHIST-1 && (t >> (b+1)) != 0; b++)
+    ;
+  push_off();
+  st = &sysstat[cpuid()][num];
+  st->count++;
+  st->time += t;
+  st->hist[b]++;
+  pop_off();
+}
+
+// the totals over all CPUs for system call num, for sysinfo().
+// the counts may be a call or two behind.
+void
+syscallstats(int num, struct syscallstat *st)
+{
+  struct syscallstat *s;
+  int i, b;
+
+  memset(st, 0, sizeof(*st));
+  for(i = 0; i < NCPU; i++){
+    s = &sysstat[i][num];
+    st->count += s->count;
+    st->time += s->time;
+    for(b = 0; b < NSYSHIST; b++)
+      st->hist[b] += s->hist[b];
+  }
+}
+
 void
 syscall(void)
 {
@@ -145,7 +263,12 @@ syscall(void)
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    TRACE(TR_SYSENTER, num, p->trapframe->a0);
+    uint64 t0 = r_time();
     p->trapframe->a0 = syscalls[num]();
+    argfdput();
+    syscallcount(num, r_time() - t0);
+    TRACE(TR_SYSEXIT, num, p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
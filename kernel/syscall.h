@@ -30,3 +30,37 @@
 #define SYS_mmap   27
 #define SYS_munmap 28
 #define SYS_connect 29
+#define SYS_setsockopt 30
+#define SYS_recvzc 31
+#define SYS_zcfree 32
+#define SYS_recvmmsg 33
+#define SYS_sendmmsg 34
+#define SYS_poll   35
+#define SYS_fcntl  36
+#define SYS_getsockopt 37
+#define SYS_bind   38
+#define SYS_recvfrom 39
+#define SYS_sendto 40
+#define SYS_tcpconnect 41
+#define SYS_tcplisten 42
+#define SYS_tcpaccept 43
+#define SYS_fsync  44
+#define SYS_nice   45
+#define SYS_schedstat 46
+#define SYS_clone  47
+#define SYS_join   48
+#define SYS_futex_wait 49
+#define SYS_futex_wake 50
+#define SYS_spawn  51
+#define SYS_splice 52
+#define SYS_sendfile 53
+#define SYS_readv  54
+#define SYS_writev 55
+#define SYS_pread  56
+#define SYS_pwrite 57
+#define SYS_profile 58
+#define SYS_uring_setup 59
+#define SYS_uring_enter 60
+#define SYS_irqaffinity 61
+#define SYS_nanosleep 62
+#define SYS_netbypass 63
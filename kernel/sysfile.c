@@ -15,19 +15,35 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "socket.h"
+#include "spawn.h"
+#include "iovec.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The file stays open until the system call returns, even if
+// another thread close()s fd meanwhile; see argfdput().
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
-  int fd;
-  struct file *f;
+  struct proc *p = myproc();
+  int fd, i;
+  struct file *f = 0;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  acquire(&p->leader->tglock);
+  if((f = p->leader->ofile[fd]) != 0)
+    filedup(f);
+  release(&p->leader->tglock);
+  if(f == 0)
+    return -1;
+  for(i = 0; p->argf[i]; i++)
+    if(i == NELEM(p->argf) - 1)
+      panic("argfd");
+  p->argf[i] = f;
   if(pfd)
     *pfd = fd;
   if(pf)
@@ -35,23 +51,54 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
+// Drop the references argfd() took; syscall() calls this when
+// a system call returns.
+void
+argfdput(void)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for(i = 0; i < NELEM(p->argf); i++){
+    if(p->argf[i]){
+      fileclose(p->argf[i]);
+      p->argf[i] = 0;
+    }
+  }
+}
+
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
+  acquire(&p->tglock);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      release(&p->tglock);
       return fd;
     }
   }
+  release(&p->tglock);
   return -1;
 }
 
+// Free file descriptor fd, which held f.
+static void
+fdfree(int fd, struct file *f)
+{
+  struct proc *p = myproc()->leader;
+
+  acquire(&p->tglock);
+  if(p->ofile[fd] == f)
+    p->ofile[fd] = 0;
+  release(&p->tglock);
+}
+
 uint64
 sys_dup(void)
 {
@@ -75,7 +122,7 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
-  return fileread(f, p, n);
+  return fileread(f, 1, p, n);
 }
 
 uint64
@@ -88,7 +135,88 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  return filewrite(f, 1, p, n);
+}
+
+// fetch the iovec array that is argument 1, of argument 2's
+// length. returns the length, or -1.
+static int
+argiov(struct iovec *iov)
+{
+  uint64 uiov;
+  int n;
+
+  if(argaddr(1, &uiov) < 0 || argint(2, &n) < 0 || n < 0 || n > NIOV)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, uiov, n*sizeof(iov[0])) < 0)
+    return -1;
+  return n;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(iov)) < 0)
+    return -1;
+  return filereadv(f, iov, n);
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(iov)) < 0)
+    return -1;
+  return filewritev(f, iov, n);
+}
+
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || n < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || n < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+uint64
+sys_uring_setup(void)
+{
+  return uringsetup();
+}
+
+uint64
+sys_uring_enter(void)
+{
+  int min;
+
+  if(argint(0, &min) < 0)
+    return -1;
+  return uringenter(min);
 }
 
 uint64
@@ -96,10 +224,17 @@ sys_close(void)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc()->leader;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE)
+    return -1;
+  // another thread may be closing it too.
+  acquire(&p->tglock);
+  if((f = p->ofile[fd]) != 0)
+    p->ofile[fd] = 0;
+  release(&p->tglock);
+  if(f == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -218,6 +353,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheset(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -340,6 +476,8 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nonblock = (omode & O_NONBLOCK) != 0;
+  f->direct = (omode & O_DIRECT) && ip->type == T_FILE;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -412,23 +550,21 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// copy the user's argv[] into kernel pages, which the
+// caller frees with freeargv(). returns -1 on error.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
@@ -436,22 +572,57 @@ sys_exec(void)
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+  return 0;
+}
 
-  int ret = exec(path, argv);
-
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret = -1;
 
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) == 0)
+    ret = exec(path, argv);
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, act, n): start path in a new child, with
+// the n file descriptor actions in act[], see kernel/spawn.h.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact act[NSPAWNACT];
+  uint64 uargv, uact;
+  int n, ret = -1;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &uact) < 0 || argint(3, &n) < 0)
+    return -1;
+  if(n < 0 || n > NSPAWNACT)
+    return -1;
+  if(n > 0 && copyin(myproc()->pagetable, (char*)act, uact, n*sizeof(act[0])) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) == 0)
+    ret = spawn(path, argv, act, n);
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -469,15 +640,15 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0, rf);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0, rf);
+    fdfree(fd1, wf);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -486,6 +657,98 @@ sys_pipe(void)
 }
 
 
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(addr != 0 || len <= 0 || off < 0)
+    return -1; // the kernel picks the address
+  return mmap(f, len, prot, flags, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+// wait until what has been written through fd, or to any
+// other file, is on the disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE)
+    log_sync();
+  return 0;
+}
+
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+    return -1;
+  switch(cmd){
+  case F_GETFL:
+    return (f->nonblock ? O_NONBLOCK : 0) | (f->direct ? O_DIRECT : 0) |
+      (f->readable && f->writable ? O_RDWR : f->writable ? O_WRONLY : O_RDONLY);
+  case F_SETFL:
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    f->direct = (arg & O_DIRECT) && f->type == FD_INODE && f->ip->type == T_FILE;
+    return 0;
+  case F_GETPIPE_SZ:
+    return f->type == FD_PIPE ? pipesize(f->pipe, 0) : -1;
+  case F_SETPIPE_SZ:
+    if(f->type != FD_PIPE || arg <= 0)
+      return -1;
+    return pipesize(f->pipe, arg);
+  }
+  return -1;
+}
+
+// splice(in, out, n): move up to n bytes from fd in to fd out
+// without copying them through user space.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+uint64
+sys_poll(void)
+{
+  uint64 fds;
+  int nfds, timeout;
+
+  if(argaddr(0, &fds) < 0 || argint(1, &nfds) < 0 || argint(2, &timeout) < 0)
+    return -1;
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+  return pollfds(fds, nfds, timeout);
+}
+
 #ifdef LAB_NET
 int
 sys_connect(void)
@@ -511,4 +774,239 @@ sys_connect(void)
 
   return fd;
 }
+
+// a socket on lport that takes datagrams from any peer.
+uint64
+sys_bind(void)
+{
+  struct file *f;
+  int fd, lport;
+
+  if(argint(0, &lport) < 0 || lport <= 0 || lport > 0xffff)
+    return -1;
+  if(sockalloc(&f, 0, lport, 0) < 0)
+    return -1;
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
+  return fd;
+}
+
+uint64
+sys_recvfrom(void)
+{
+  struct file *f;
+  uint64 addr, from;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0 ||
+     argaddr(3, &from) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM || !f->readable)
+    return -1;
+  return sockread(f->sock, 1, addr, n, from, f->nonblock);
+}
+
+uint64
+sys_sendto(void)
+{
+  struct file *f;
+  struct sockaddr sa;
+  uint64 addr, to;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0 ||
+     argaddr(3, &to) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM || !f->writable)
+    return -1;
+  if(copyin(myproc()->pagetable, (char *)&sa, to, sizeof(sa)) < 0)
+    return -1;
+  return sockwriteto(f->sock, 1, addr, n, sa.addr, sa.port);
+}
+
+// sendfile(sockfd, fd, off, n): send n bytes of the file fd,
+// from offset off, on the connected socket sockfd, without
+// passing them through user space. fd's offset doesn't move.
+uint64
+sys_sendfile(void)
+{
+  struct file *s, *f;
+  int off, n;
+
+  if(argfd(0, 0, &s) < 0 || argfd(1, 0, &f) < 0 || argint(2, &off) < 0 ||
+     argint(3, &n) < 0)
+    return -1;
+  if(s->type != FD_SOCK || !s->writable || f->type != FD_INODE || !f->readable ||
+     off < 0 || n < 0)
+    return -1;
+  if(s->sotype == SOCK_STREAM)
+    return tcpsendfile(s->tcp, f->ip, off, n);
+  return socksendfile(s->sock, f->ip, off, n);
+}
+
+uint64
+sys_setsockopt(void)
+{
+  struct file *f;
+  int opt, val;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &opt) < 0 || argint(2, &val) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM)
+    return -1;
+  return socksetopt(f->sock, opt, val);
+}
+
+uint64
+sys_getsockopt(void)
+{
+  struct file *f;
+  int opt;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &opt) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM)
+    return -1;
+  return sockgetopt(f->sock, opt);
+}
+
+uint64
+sys_recvmmsg(void)
+{
+  struct file *f;
+  uint64 addr;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM || !f->readable)
+    return -1;
+  return sockreadmany(f->sock, addr, n, f->nonblock);
+}
+
+uint64
+sys_sendmmsg(void)
+{
+  struct file *f;
+  uint64 addr;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM || !f->writable)
+    return -1;
+  return sockwritemany(f->sock, addr, n);
+}
+
+uint64
+sys_recvzc(void)
+{
+  struct file *f;
+  uint64 addr;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_DGRAM)
+    return -1;
+  return sockrecvzc(f->sock, addr, f->nonblock);
+}
+
+uint64
+sys_zcfree(void)
+{
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  return zcfree(addr);
+}
+
+// netbypass(1) hands the e1000 to the calling process and
+// returns where its rings are mapped; netbypass(0) gives the
+// e1000 back. see netbypass.h.
+uint64
+sys_netbypass(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  if(on)
+    return e1000_bypass();
+  return e1000_unbypass(myproc()->leader);
+}
+
+// a TCP socket file for t.
+static int
+tcpfd(struct tcpcb *t)
+{
+  struct file *f;
+  int fd;
+
+  if((f = filealloc()) == 0){
+    tcpclose(t);
+    return -1;
+  }
+  f->type = FD_SOCK;
+  f->sotype = SOCK_STREAM;
+  f->readable = 1;
+  f->writable = 1;
+  f->tcp = t;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
+  return fd;
+}
+
+// a TCP connection from lport to raddr:rport, once the
+// handshake is done.
+uint64
+sys_tcpconnect(void)
+{
+  struct tcpcb *t;
+  uint32 raddr;
+  int lport, rport;
+
+  if(argint(0, (int*)&raddr) < 0 || argint(1, &lport) < 0 ||
+     argint(2, &rport) < 0)
+    return -1;
+  if(lport <= 0 || lport > 0xffff || rport <= 0 || rport > 0xffff)
+    return -1;
+  if((t = tcpconnect(raddr, lport, rport)) == 0)
+    return -1;
+  return tcpfd(t);
+}
+
+// a socket that listens for TCP connections to lport.
+uint64
+sys_tcplisten(void)
+{
+  struct tcpcb *t;
+  int lport;
+
+  if(argint(0, &lport) < 0 || lport <= 0 || lport > 0xffff)
+    return -1;
+  if((t = tcplisten(lport)) == 0)
+    return -1;
+  return tcpfd(t);
+}
+
+// the next connection to a tcplisten() socket.
+uint64
+sys_tcpaccept(void)
+{
+  struct file *f;
+  struct tcpcb *t;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_SOCK || f->sotype != SOCK_STREAM)
+    return -1;
+  if((t = tcpaccept(f->tcp, f->nonblock)) == 0)
+    return -1;
+  return tcpfd(t);
+}
 #endif
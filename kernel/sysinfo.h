@@ -0,0 +1,19 @@
+// what sysinfo() reports; needs param.h.
+
+#define NSYSCALL  64    // system call numbers counted
+#define NSYSHIST  24    // latency buckets, by log2 of time CSR ticks
+
+struct syscallstat {
+  uint64 count;
+  uint64 time;            // total, in time CSR ticks (10 MHz in qemu)
+  uint hist[NSYSHIST];    // hist[i]: calls that took [2^i, 2^(i+1)) ticks
+};
+
+struct sysinfo {
+  uint64 freemem;         // bytes of free memory
+  uint64 nproc;           // processes not UNUSED
+  uint64 bhits;           // buffer cache lookups that found the block
+  uint64 bmisses;
+  struct syscallstat sys[NSYSCALL];
+  uint64 irqs[NCPU][NIRQ];  // interrupts each CPU has taken, by IRQ
+};
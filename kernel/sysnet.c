@@ -7,76 +7,147 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rwlock.h"
 #include "proc.h"
 #include "defs.h"
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "net.h"
+#include "socket.h"
+#include "poll.h"
+#include "iovec.h"
 
+#define NSOCKGROUP  4    // multicast groups a socket can join
+#define NSOCKMCQ    32   // multicast datagrams queued per socket
+
+// a socket made by bind() has raddr and rport 0: it takes
+// datagrams from any peer that no connected socket claims,
+// and must be told where to send each one with sendto().
+// it can also join multicast groups (SO_JOIN); a datagram for
+// a group is shared by all the sockets in it, so it waits in
+// each one's mcq by reference rather than on its rxq.
 struct sock {
-  struct sock *next; // the next socket in the list
-  uint32 raddr;      // the remote IPv4 address
+  struct sock *next; // the next socket in the hash bucket
+  uint32 raddr;      // the remote IPv4 address, or 0 if bound
   uint16 lport;      // the local UDP port number
-  uint16 rport;      // the remote UDP port number
-  struct spinlock lock; // protects the rxq
+  uint16 rport;      // the remote UDP port number, or 0 if bound
+  struct spinlock lock; // protects the rxq, mcq and groups
   struct mbufq rxq;  // a queue of packets waiting to be received
+  struct mbuf *mcq[NSOCKMCQ]; // shared multicast datagrams waiting
+  uint mchead, mctail;
+  int rxbytes;       // memory held by rxq and mcq, a whole page per mbuf
+  int rcvbuf;        // SO_RCVBUF: limit on rxbytes
+  int drops;         // datagrams dropped because rxq was full
+  int txblock;       // SO_TXBLOCK: wait for TX ring space on write
+  int reuse;         // SO_REUSEADDR: others may bind lport too
+  uint32 groups[NSOCKGROUP]; // SO_JOIN: multicast groups, 0 if unused
 };
 
-static struct spinlock lock;
-static struct sock *sockets;
+// receive buffer limits, in bytes. each queued datagram is
+// charged the size of a whole page for each of its mbufs,
+// since that's what it pins, so the defaults admit 64
+// datagrams that fit in a frame.
+#define SOCK_RCVBUF      (64*PGSIZE)
+#define SOCK_RCVBUF_MAX  (1024*PGSIZE)
+
+static int sockdrops; // datagrams dropped at full sockets, all told
+
+// sockets are found by hashing (raddr, lport, rport), and
+// each bucket has its own lock, so that delivery to different
+// sockets doesn't contend and costs the same however many
+// sockets are open. delivery only reads a bucket, so CPUs
+// delivering to sockets in the same one don't wait for each
+// other either.
+#define NSOCKHASH 61
+
+static struct {
+  struct rwlock lock;
+  struct sock *head;
+} socktbl[NSOCKHASH];
+
+static uint
+sockhash(uint32 raddr, uint16 lport, uint16 rport)
+{
+  return (raddr ^ (raddr >> 16) ^ (lport << 3) ^ rport) % NSOCKHASH;
+}
+
+static struct kmem_cache *sockcache;
+
+static void
+sockctor(void *o)
+{
+  struct sock *si = o;
+
+  initlock(&si->lock, "sock");
+  mbufq_init(&si->rxq);
+}
 
 void
 sockinit(void)
 {
-  initlock(&lock, "socktbl");
+  for (int i = 0; i < NSOCKHASH; i++)
+    initrwlock(&socktbl[i].lock, "socktbl");
+  sockcache = kmem_cache_create("sock", sizeof(struct sock), sockctor);
 }
 
 int
 sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
 {
   struct sock *si, *pos;
+  uint h;
 
   si = 0;
   *f = 0;
   if ((*f = filealloc()) == 0)
     goto bad;
-  if ((si = (struct sock*)kalloc()) == 0)
+  if ((si = kmem_cache_alloc(sockcache)) == 0)
     goto bad;
 
   // initialize objects
   si->raddr = raddr;
   si->lport = lport;
   si->rport = rport;
-  initlock(&si->lock, "sock");
-  mbufq_init(&si->rxq);
+  si->txblock = 0;
+  si->rxbytes = 0;
+  si->rcvbuf = SOCK_RCVBUF;
+  si->drops = 0;
+  si->reuse = 0;
+  si->mchead = si->mctail = 0;
+  memset(si->groups, 0, sizeof(si->groups));
   (*f)->type = FD_SOCK;
+  (*f)->sotype = SOCK_DGRAM;
   (*f)->readable = 1;
   (*f)->writable = 1;
   (*f)->sock = si;
 
-  // add to list of sockets
-  acquire(&lock);
-  pos = sockets;
+  // add to the table of sockets
+  h = sockhash(raddr, lport, rport);
+  acquirewrite(&socktbl[h].lock);
+  pos = socktbl[h].head;
   while (pos) {
     if (pos->raddr == raddr &&
         pos->lport == lport &&
-	pos->rport == rport) {
-      release(&lock);
+	pos->rport == rport && !pos->reuse) {
+      releasewrite(&socktbl[h].lock);
       goto bad;
     }
     pos = pos->next;
   }
-  si->next = sockets;
-  sockets = si;
-  release(&lock);
+  si->next = socktbl[h].head;
+  socktbl[h].head = si;
+  releasewrite(&socktbl[h].lock);
   return 0;
 
 bad:
   if (si)
-    kfree((char*)si);
-  if (*f)
+    kmem_cache_free(sockcache, si);
+  if (*f) {
+    // si is freed already; don't let fileclose() sockclose() it.
+    (*f)->type = FD_NONE;
+    (*f)->sock = 0;
     fileclose(*f);
+  }
   return -1;
 }
 
@@ -85,10 +156,12 @@ sockclose(struct sock *si)
 {
   struct sock **pos;
   struct mbuf *m;
+  uint h;
 
-  // remove from list of sockets
-  acquire(&lock);
-  pos = &sockets;
+  // remove from the table of sockets
+  h = sockhash(si->raddr, si->lport, si->rport);
+  acquirewrite(&socktbl[h].lock);
+  pos = &socktbl[h].head;
   while (*pos) {
     if (*pos == si){
       *pos = si->next;
@@ -96,61 +169,592 @@ sockclose(struct sock *si)
     }
     pos = &(*pos)->next;
   }
-  release(&lock);
+  releasewrite(&socktbl[h].lock);
+
+  for (int i = 0; i < NSOCKGROUP; i++)
+    if (si->groups[i])
+      net_mcleave(si->groups[i]);
 
   // free any pending mbufs
   while (!mbufq_empty(&si->rxq)) {
     m = mbufq_pophead(&si->rxq);
     mbuffree(m);
   }
+  while (si->mchead != si->mctail)
+    mbuffree(si->mcq[si->mchead++ % NSOCKMCQ]);
 
-  kfree((char*)si);
+  kmem_cache_free(sockcache, si);
 }
 
-int
-sockread(struct sock *si, uint64 addr, int n)
+// is a datagram waiting on si? caller must hold si->lock.
+static int
+sockready(struct sock *si)
+{
+  return !mbufq_empty(&si->rxq) || si->mchead != si->mctail;
+}
+
+// dequeue si's next datagram, unicast before multicast, or
+// return 0 if there is none. caller must hold si->lock.
+static struct mbuf *
+sockdeq(struct sock *si)
+{
+  struct mbuf *m;
+
+  if (!mbufq_empty(&si->rxq))
+    m = mbufq_pophead(&si->rxq);
+  else if (si->mchead != si->mctail)
+    m = si->mcq[si->mchead++ % NSOCKMCQ];
+  else
+    return 0;
+  si->rxbytes -= mbufsegs(m) * PGSIZE;
+  return m;
+}
+
+// wait for and dequeue the next received datagram.
+// returns 0 if the process was killed, or if there is
+// none and nonblock is set.
+static struct mbuf *
+sockpop(struct sock *si, int nonblock)
 {
   struct proc *pr = myproc();
   struct mbuf *m;
-  int len;
 
   acquire(&si->lock);
-  while (mbufq_empty(&si->rxq) && !pr->killed) {
+  while (!sockready(si) && !pr->killed && !nonblock) {
     sleep(&si->rxq, &si->lock);
   }
   if (pr->killed) {
     release(&si->lock);
-    return -1;
+    return 0;
   }
-  m = mbufq_pophead(&si->rxq);
+  m = sockdeq(si);
   release(&si->lock);
+  return m;
+}
 
-  len = m->len;
-  if (len > n)
-    len = n;
-  if (copyout(pr->pagetable, addr, m->head, len) == -1) {
-    mbuffree(m);
+// copy up to n bytes of datagram m out to dst, a user
+// address if user is set. returns the number of bytes copied,
+// or -1.
+static int
+sockcopyout(int user, uint64 dst, struct mbuf *m, int n)
+{
+  int len, tot = 0;
+
+  for (; m && tot < n; m = m->next) {
+    len = m->len;
+    if (len > n - tot)
+      len = n - tot;
+    if (either_copyout(user, dst + tot, m->head, len) == -1)
+      return -1;
+    tot += len;
+  }
+  return tot;
+}
+
+// receive one datagram into addr, a user address if user is
+// set. if from is not 0, store the sender there, in user
+// memory, as a struct sockaddr.
+int
+sockread(struct sock *si, int user, uint64 addr, int n, uint64 from, int nonblock)
+{
+  struct proc *pr = myproc();
+  struct mbuf *m;
+  struct sockaddr sa;
+  int len;
+
+  if ((m = sockpop(si, nonblock)) == 0)
     return -1;
+
+  if ((len = sockcopyout(user, addr, m, n)) == -1)
+    goto bad;
+  if (from) {
+    memset(&sa, 0, sizeof(sa));
+    sa.addr = m->raddr;
+    sa.port = m->rport;
+    if (copyout(pr->pagetable, from, (char *)&sa, sizeof(sa)) == -1)
+      goto bad;
   }
   mbuffree(m);
   return len;
+
+bad:
+  mbuffree(m);
+  return -1;
 }
 
+// receive up to n datagrams, described by the struct mmsg
+// array at vaddr, waiting only for the first. all available
+// datagrams are dequeued under one hold of si->lock.
+// returns the number received, or -1.
 int
-sockwrite(struct sock *si, uint64 addr, int n)
+sockreadmany(struct sock *si, uint64 vaddr, int n, int nonblock)
 {
   struct proc *pr = myproc();
+  struct mbufq q;
   struct mbuf *m;
+  struct mmsg mm;
+  uint64 va;
+  int i, len;
 
-  m = mbufalloc(MBUF_DEFAULT_HEADROOM);
-  if (!m)
+  if (n <= 0)
     return -1;
 
-  if (copyin(pr->pagetable, mbufput(m, n), addr, n) == -1) {
+  mbufq_init(&q);
+  if ((m = sockpop(si, nonblock)) == 0)
+    return -1;
+  mbufq_pushtail(&q, m);
+  acquire(&si->lock);
+  for (i = 1; i < n && (m = sockdeq(si)) != 0; i++)
+    mbufq_pushtail(&q, m);
+  release(&si->lock);
+
+  for (i = 0; !mbufq_empty(&q); i++) {
+    m = mbufq_pophead(&q);
+    va = vaddr + i*sizeof(mm);
+    if (copyin(pr->pagetable, (char *)&mm, va, sizeof(mm)) == -1)
+      goto bad;
+    if ((len = sockcopyout(1, mm.buf, m, mm.len)) == -1)
+      goto bad;
+    mm.len = len;
+    if (copyout(pr->pagetable, va, (char *)&mm, sizeof(mm)) == -1)
+      goto bad;
     mbuffree(m);
+  }
+  return i;
+
+bad:
+  // the rest of the batch is lost, as a failed read() would lose it.
+  mbuffree(m);
+  while (!mbufq_empty(&q))
+    mbuffree(mbufq_pophead(&q));
+  return i > 0 ? i : -1;
+}
+
+// gather the niov pieces at iov, user addresses if user is
+// set, into new mbufs, ready for net_tx_udpq(). a datagram too
+// big for one frame is laid out one IP fragment's worth per
+// mbuf, so that net_ip_frag() can send it without copying; the
+// first leaves room for the UDP header.
+static struct mbuf *
+sockfillv(int user, struct iovec *iov, int niov)
+{
+  struct mbuf *v[IP_MAXFRAGS];
+  int i, k, nseg, got, len, off, cc, n;
+  uint koff;
+  char *p;
+
+  for (n = 0, k = 0; k < niov; k++) {
+    if (iov[k].len > UDP_MAXDATA || n + iov[k].len > UDP_MAXDATA)
+      return 0;
+    n += iov[k].len;
+  }
+  nseg = 1;
+  if (n > IP_FRAGDATA - sizeof(struct udp))
+    nseg += (n - (IP_FRAGDATA - sizeof(struct udp)) + IP_FRAGDATA - 1) / IP_FRAGDATA;
+  if ((got = mbufalloc_batch(v, nseg, MBUF_DEFAULT_HEADROOM)) < nseg) {
+    mbuffree_batch(v, got);
+    return 0;
+  }
+
+  off = 0;
+  k = 0;
+  koff = 0;
+  for (i = 0; i < nseg; i++) {
+    len = (i == 0 ? IP_FRAGDATA - sizeof(struct udp) : IP_FRAGDATA);
+    if (len > n - off)
+      len = n - off;
+    if (i > 0)
+      v[i-1]->next = v[i];
+    off += len;
+    for (p = mbufput(v[i], len); len > 0; p += cc, len -= cc) {
+      while (koff == iov[k].len) {
+        k++;
+        koff = 0;
+      }
+      cc = iov[k].len - koff < len ? iov[k].len - koff : len;
+      if (either_copyin(p, user, iov[k].base + koff, cc) == -1) {
+        mbuffree_batch(v, nseg);
+        return 0;
+      }
+      koff += cc;
+    }
+  }
+  return v[0];
+}
+
+static struct mbuf *
+sockfill(int user, uint64 addr, int n)
+{
+  struct iovec iov;
+
+  if (n < 0)
+    return 0;
+  iov.base = addr;
+  iov.len = n;
+  return sockfillv(user, &iov, 1);
+}
+
+// send the n datagrams described by the struct mmsg array
+// at vaddr, handing them all to the driver as one queue.
+// returns the number sent, or -1.
+int
+sockwritemany(struct sock *si, uint64 vaddr, int n)
+{
+  struct proc *pr = myproc();
+  struct mbufq q;
+  struct mbuf *m;
+  struct mmsg mm;
+  int i;
+
+  if (si->raddr == 0)
+    return -1; // bound sockets have no peer; use sendto()
+  mbufq_init(&q);
+  for (i = 0; i < n; i++) {
+    if (copyin(pr->pagetable, (char *)&mm, vaddr + i*sizeof(mm), sizeof(mm)) == -1)
+      break;
+    if ((m = sockfill(1, mm.buf, mm.len)) == 0)
+      break;
+    mbufq_pushtail(&q, m);
+  }
+  if (mbufq_empty(&q))
     return -1;
+  return net_tx_udpq(&q, si->raddr, si->lport, si->rport, si->txblock);
+}
+
+// send n bytes at addr (a user address if user is set) to
+// raddr:rport, from si's local port.
+int
+sockwriteto(struct sock *si, int user, uint64 addr, int n, uint32 raddr, uint16 rport)
+{
+  struct mbuf *m;
+  struct mbufq q;
+
+  if (raddr == 0 || rport == 0)
+    return -1;
+  if ((m = sockfill(user, addr, n)) == 0)
+    return -1;
+  mbufq_init(&q);
+  mbufq_pushtail(&q, m);
+  if (net_tx_udpq(&q, raddr, si->lport, rport, si->txblock) == 0 &&
+      si->txblock)
+    return -1; // killed while waiting for ring space
+  return n;
+}
+
+// send n bytes of ip, from offset off, to the connected peer,
+// as datagrams that each fit in one frame. readi() copies
+// straight from the buffer cache into the mbufs that go out,
+// leaving headroom for the headers. returns the number of
+// bytes sent, or -1.
+int
+socksendfile(struct sock *si, struct inode *ip, uint off, int n)
+{
+  struct mbufq q;
+  struct mbuf *m;
+  int i, len, r, tot = 0, queued, eof = 0;
+
+  if (si->raddr == 0 || n < 0)
+    return -1;
+  while (tot < n && !eof) {
+    mbufq_init(&q);
+    queued = 0;
+    ilock(ip);
+    for (i = 0; i < NSENDBATCH && tot + queued < n; i++) {
+      len = IP_FRAGDATA - sizeof(struct udp);
+      if (len > n - tot - queued)
+        len = n - tot - queued;
+      if ((m = mbufalloc(MBUF_DEFAULT_HEADROOM)) == 0)
+        break;
+      r = readi(ip, 0, (uint64)mbufput(m, len), off + tot + queued, len);
+      if (r <= 0) {
+        mbuffree(m);
+        eof = 1;
+        break;
+      }
+      if (r < len) {
+        mbuftrim(m, len - r);
+        eof = 1;
+      }
+      mbufq_pushtail(&q, m);
+      queued += r;
+      if (eof)
+        break;
+    }
+    iunlock(ip);
+    if (mbufq_empty(&q))
+      break;
+    if (net_tx_udpq(&q, si->raddr, si->lport, si->rport, si->txblock) == 0 &&
+        si->txblock)
+      break; // killed while waiting for ring space
+    tot += queued;
+  }
+  return tot > 0 || eof ? tot : -1;
+}
+
+// send the niov pieces at iov to the connected peer as one
+// datagram. returns its length, or -1.
+int
+sockwritev(struct sock *si, struct iovec *iov, int niov)
+{
+  struct mbuf *m;
+  struct mbufq q;
+  int i, n = 0;
+
+  if (si->raddr == 0)
+    return -1;
+  if ((m = sockfillv(1, iov, niov)) == 0)
+    return -1;
+  for (i = 0; i < niov; i++)
+    n += iov[i].len;
+  mbufq_init(&q);
+  mbufq_pushtail(&q, m);
+  if (net_tx_udpq(&q, si->raddr, si->lport, si->rport, si->txblock) == 0 &&
+      si->txblock)
+    return -1;
+  return n;
+}
+
+// send to the connected peer; fails on a bound socket.
+int
+sockwrite(struct sock *si, int user, uint64 addr, int n)
+{
+  return sockwriteto(si, user, addr, n, si->raddr, si->rport);
+}
+
+//
+// zero-copy receive. rather than copying a datagram out, map
+// the page holding its mbuf read-only into one of the caller's
+// NZCBUF slots at ZCBASE, and tell the caller where the payload
+// landed with a struct zcbuf at addr. the mbuf belongs to the
+// process until zcfree() or exit/exec.
+//
+int
+sockrecvzc(struct sock *si, uint64 addr, int nonblock)
+{
+  struct proc *pr = myproc()->leader;
+  struct mbuf *m;
+  struct zcbuf zb;
+  uint64 va;
+  uint off, len;
+  int slot, r;
+
+  for (slot = 0; slot < NZCBUF; slot++)
+    if (pr->zcbuf[slot] == 0)
+      break;
+  if (slot == NZCBUF)
+    return -1; // all slots in use; zcfree() some
+
+  if ((m = sockpop(si, nonblock)) == 0)
+    return -1;
+  if (m->next) {
+    // a reassembled datagram spans pages, so it can't be
+    // mapped as one buffer; it's lost, as if truncated.
+    mbuffree(m);
+    return -1;
+  }
+  if (m->refs > 1) {
+    // other sockets share this multicast datagram's page; map
+    // a private copy instead.
+    struct mbuf *c = mbufcopy(m);
+    mbuffree(m);
+    if ((m = c) == 0)
+      return -1;
+  }
+
+  // the page is about to be the reader's to see: only the
+  // datagram may be left in it. the header holds kernel
+  // pointers, and a recycled mbuf's headroom and tail hold
+  // whatever it carried before, maybe for someone else.
+  // mbuffree() needs none of the header once it's zero.
+  off = m->head - (char *)m;
+  len = m->len;
+  memset((char *)m, 0, off);
+  memset((char *)m + off + len, 0, PGSIZE - off - len);
+
+  // another thread may have taken the slot while we waited.
+  acquire(&pr->tglock);
+  for (slot = 0; slot < NZCBUF; slot++)
+    if (pr->zcbuf[slot] == 0)
+      break;
+  r = -1;
+  if (slot < NZCBUF) {
+    va = ZCBASE + slot*PGSIZE;
+    r = mappages(pr->pagetable, va, PGSIZE, (uint64)m, PTE_R | PTE_U);
+    if (r == 0)
+      pr->zcbuf[slot] = m;
+  }
+  release(&pr->tglock);
+  if (r < 0) {
+    mbuffree(m);
+    return -1;
+  }
+
+  zb.addr = va + off;
+  zb.len = len;
+  if (copyout(pr->pagetable, addr, (char *)&zb, sizeof(zb)) < 0) {
+    zcfree(zb.addr);
+    return -1;
+  }
+  return 0;
+}
+
+// hand a zero-copy buffer back to the kernel, given any
+// address within its slot.
+int
+zcfree(uint64 addr)
+{
+  struct proc *pr = myproc()->leader;
+  struct mbuf *m;
+  int slot;
+
+  if (addr < ZCBASE || addr >= ZCBASE + NZCBUF*PGSIZE)
+    return -1;
+  slot = (addr - ZCBASE) / PGSIZE;
+  acquire(&pr->tglock);
+  if ((m = pr->zcbuf[slot]) != 0) {
+    uvmunmap(pr->pagetable, ZCBASE + slot*PGSIZE, 1, 0);
+    pr->zcbuf[slot] = 0;
+  }
+  release(&pr->tglock);
+  if (m == 0)
+    return -1;
+  mbuffree(m);
+  return 0;
+}
+
+// release all of p's zero-copy buffers; for exit and exec.
+void
+zcrelease(struct proc *p)
+{
+  for (int slot = 0; slot < NZCBUF; slot++) {
+    if (p->zcbuf[slot]) {
+      uvmunmap(p->pagetable, ZCBASE + slot*PGSIZE, 1, 0);
+      mbuffree(p->zcbuf[slot]);
+      p->zcbuf[slot] = 0;
+    }
+  }
+}
+
+// sending never waits unless SO_TXBLOCK is set,
+// so a socket is always writable.
+int
+sockpoll(struct sock *si)
+{
+  int ev = POLLOUT;
+
+  acquire(&si->lock);
+  if (sockready(si))
+    ev |= POLLIN;
+  release(&si->lock);
+  return ev;
+}
+
+// join (or leave) multicast group ip, whose datagrams to
+// si's port then reach si. only bound sockets can join.
+static int
+sockgroup(struct sock *si, uint32 ip, int join)
+{
+  int i, slot = -1;
+
+  if (si->raddr != 0 || ip == 0)
+    return -1;
+  acquire(&si->lock);
+  for (i = 0; i < NSOCKGROUP; i++) {
+    if (si->groups[i] == ip)
+      break;
+    if (si->groups[i] == 0 && slot < 0)
+      slot = i;
+  }
+  if (join) {
+    if (i < NSOCKGROUP || slot < 0 || net_mcjoin(ip) < 0)
+      goto bad; // joined already, or too many groups
+    si->groups[slot] = ip;
+  } else {
+    if (i == NSOCKGROUP)
+      goto bad;
+    si->groups[i] = 0;
+    net_mcleave(ip);
+  }
+  release(&si->lock);
+  return 0;
+
+bad:
+  release(&si->lock);
+  return -1;
+}
+
+int
+socksetopt(struct sock *si, int opt, int val)
+{
+  switch (opt) {
+  case SO_TXBLOCK:
+    si->txblock = (val != 0);
+    return 0;
+  case SO_RCVBUF:
+    if (val < PGSIZE)
+      val = PGSIZE;
+    if (val > SOCK_RCVBUF_MAX)
+      val = SOCK_RCVBUF_MAX;
+    acquire(&si->lock);
+    si->rcvbuf = val;
+    release(&si->lock);
+    return 0;
+  case SO_REUSEADDR:
+    si->reuse = (val != 0);
+    return 0;
+  case SO_JOIN:
+  case SO_LEAVE:
+    return sockgroup(si, (uint32)val, opt == SO_JOIN);
+  }
+  return -1;
+}
+
+int
+sockgetopt(struct sock *si, int opt)
+{
+  switch (opt) {
+  case SO_TXBLOCK:
+    return si->txblock;
+  case SO_RCVBUF:
+    return si->rcvbuf;
+  case SO_DROPS:
+    return si->drops;
+  case SO_REUSEADDR:
+    return si->reuse;
+  }
+  return -1;
+}
+
+// total datagrams dropped because their socket's queue was full.
+int
+sockdropped(void)
+{
+  return sockdrops;
+}
+
+// formats one line per open socket into buf for the
+// netstats device: its addresses, queue depth and drops.
+// returns the number of bytes written.
+int
+sockstats(char *buf, int sz)
+{
+  struct sock *si;
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "sock_drops %d\n", sockdrops);
+  for (int h = 0; h < NSOCKHASH; h++) {
+    acquireread(&socktbl[h].lock);
+    for (si = socktbl[h].head; si; si = si->next) {
+      acquire(&si->lock);
+      n += snprintf(buf+n, sz-n, "sock %d.%d.%d.%d:%d lport %d rxq %d/%d drops %d\n",
+                    (si->raddr >> 24) & 0xff, (si->raddr >> 16) & 0xff,
+                    (si->raddr >> 8) & 0xff, si->raddr & 0xff, si->rport,
+                    si->lport, si->rxbytes / PGSIZE, si->rcvbuf / PGSIZE,
+                    si->drops);
+      release(&si->lock);
+    }
+    releaseread(&socktbl[h].lock);
   }
-  net_tx_udp(m, si->raddr, si->lport, si->rport);
   return n;
 }
 
@@ -164,22 +768,97 @@ sockrecvudp(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport)
   // registered to handle it.
   //
   struct sock *si;
+  int charge = mbufsegs(m) * PGSIZE;
+  uint32 a = raddr;
+  uint16 p = rport;
+  uint h;
 
-  acquire(&lock);
-  si = sockets;
-  while (si) {
-    if (si->raddr == raddr && si->lport == lport && si->rport == rport)
-      goto found;
-    si = si->next;
+  // a connected socket first, then one bound to any peer.
+  for (int bound = 0; bound < 2; bound++) {
+    if (bound)
+      a = p = 0;
+    h = sockhash(a, lport, p);
+    acquireread(&socktbl[h].lock);
+    for (si = socktbl[h].head; si; si = si->next)
+      if (si->raddr == a && si->lport == lport && si->rport == p)
+        goto found;
+    releaseread(&socktbl[h].lock);
   }
-  release(&lock);
+  netstat_add(nosock_drops, 1);
   mbuffree(m);
   return;
 
 found:
   acquire(&si->lock);
+  // tail drop: keep what's queued, lose the new arrival.
+  if (si->rxbytes + charge > si->rcvbuf) {
+    si->drops++;
+    __sync_fetch_and_add(&sockdrops, 1);
+    release(&si->lock);
+    releaseread(&socktbl[h].lock);
+    mbuffree(m);
+    return;
+  }
+  si->rxbytes += charge;
+  m->raddr = raddr;
+  m->rport = rport;
   mbufq_pushtail(&si->rxq, m);
   wakeup(&si->rxq);
+  pollwakeup();
   release(&si->lock);
-  release(&lock);
+  releaseread(&socktbl[h].lock);
+}
+
+// has si joined multicast group ip? caller must hold si->lock.
+static int
+sockingroup(struct sock *si, uint32 ip)
+{
+  for (int i = 0; i < NSOCKGROUP; i++)
+    if (si->groups[i] == ip)
+      return 1;
+  return 0;
+}
+
+// called by protocol handler layer to deliver a UDP datagram
+// for multicast group ip to every socket bound to lport that
+// has joined the group. they all share m: each holds a
+// reference in its mcq, and the last to let go frees it.
+void
+sockrecvmcast(struct mbuf *m, uint32 ip, uint32 raddr, uint16 lport, uint16 rport)
+{
+  struct sock *si;
+  int charge = mbufsegs(m) * PGSIZE, n = 0;
+  uint h;
+
+  m->raddr = raddr;
+  m->rport = rport;
+  h = sockhash(0, lport, 0);
+  acquireread(&socktbl[h].lock);
+  for (si = socktbl[h].head; si; si = si->next) {
+    if (si->raddr != 0 || si->lport != lport || si->rport != 0)
+      continue;
+    acquire(&si->lock);
+    if (!sockingroup(si, ip)) {
+      release(&si->lock);
+      continue;
+    }
+    n++;
+    if (si->rxbytes + charge > si->rcvbuf ||
+        si->mctail - si->mchead == NSOCKMCQ) {
+      si->drops++;
+      __sync_fetch_and_add(&sockdrops, 1);
+      release(&si->lock);
+      continue;
+    }
+    __sync_fetch_and_add(&m->refs, 1);
+    si->rxbytes += charge;
+    si->mcq[si->mctail++ % NSOCKMCQ] = m;
+    wakeup(&si->rxq);
+    pollwakeup();
+    release(&si->lock);
+  }
+  releaseread(&socktbl[h].lock);
+  if (n == 0)
+    netstat_add(nosock_drops, 1);
+  mbuffree(m); // the reference the caller passed in
 }
@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
+#include "sysinfo.h"
 
 uint64
 sys_exit(void)
@@ -46,7 +48,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  addr = myproc()->leader->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -73,6 +75,16 @@ sys_sleep(void)
   return 0;
 }
 
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return nanosleep(ns);
+}
+
 uint64
 sys_kill(void)
 {
@@ -85,6 +97,144 @@ sys_kill(void)
 
 // return how many clock tick interrupts have occurred
 // since start.
+// set the caller's nice level (0 to NPRIO-1, 0 is the most
+// favoured); returns the old one.
+uint64
+sys_nice(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return setnice(n);
+}
+
+// enable the kernel trace events in mask (see trace.h), to be
+// read from the trace device; returns the old mask.
+uint64
+sys_trace(void)
+{
+  int mask;
+  uint old;
+
+  if(argint(0, &mask) < 0)
+    return -1;
+  old = tracemask;
+  tracemask = mask;
+  return old;
+}
+
+// start the profiler at n samples per tick, or stop it if n
+// is 0; returns the number of samples dropped meanwhile.
+uint64
+sys_profile(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return profile(n);
+}
+
+// fill in the struct sysinfo at the user address; it's too
+// big for the kernel stack, so it goes out a piece at a time.
+uint64
+sys_sysinfo(void)
+{
+  struct proc *p = myproc();
+  struct sysinfo *u;
+  struct syscallstat st;
+  uint64 addr, v[4], irqs[NIRQ];
+  int i;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  u = (struct sysinfo *)addr;
+  // freemem, nproc, bhits and bmisses, which come first.
+  v[0] = kfreemem();
+  v[1] = nproc();
+  bstats(&v[2], &v[3]);
+  if(copyout(p->pagetable, (uint64)&u->freemem, (char *)v, sizeof(v)) < 0)
+    return -1;
+  for(i = 0; i < NSYSCALL; i++){
+    syscallstats(i, &st);
+    if(copyout(p->pagetable, (uint64)&u->sys[i], (char *)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  for(i = 0; i < NCPU; i++){
+    irqstats(i, irqs);
+    if(copyout(p->pagetable, (uint64)u->irqs[i], (char *)irqs, sizeof(irqs)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+uint64
+sys_irqaffinity(void)
+{
+  int irq, mask;
+
+  if(argint(0, &irq) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return irqaffinity(irq, mask);
+}
+
+uint64
+sys_schedstat(void)
+{
+  struct schedstat st;
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  getschedstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return join(pid);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
+
 uint64
 sys_uptime(void)
 {
@@ -0,0 +1,1112 @@
+//
+// a minimal TCP: connection setup and teardown, a sliding
+// window over fixed-size send and receive buffers, go-back-N
+// retransmission on an RTT-based timeout, slow start, and
+// delayed ACKs. segments that arrive out of order are dropped
+// and answered with a duplicate ACK rather than held.
+//
+// every connection is on tcplist, under tcplock, which also
+// protects the parent/acceptq links between a listener and the
+// connections it spawns. the rest of a tcpcb is protected by
+// its own lock. lock order: tcplock, then a tcpcb.
+//
+// output can hold a tcpcb's lock all the way into net_tx_ip():
+// loopback packets come back up through a network worker, not
+// recursively, so input never runs inside output.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "net.h"
+#include "poll.h"
+
+#define TCP_BUFPAGES 4    // pages each of send and receive buffer
+#define TCP_BUFSZ    (TCP_BUFPAGES * PGSIZE)
+#define TCP_MSS      (NET_MTU - sizeof(struct ip) - sizeof(struct tcp))
+#define TCP_DEFMSS   536  // the peer's MSS if it doesn't say
+#define TCP_HZ       100  // tcptimer() ticks per second, which the timers count
+#define TCP_RTOINIT  TCP_HZ  // initial retransmission timeout, 1s
+#define TCP_RTOMIN   (TCP_HZ/5)
+#define TCP_RTOMAX   (64*TCP_HZ/10)
+#define TCP_MAXRTX   10   // retransmissions before giving up
+#define TCP_DELACK   (TCP_HZ/20)  // how long an ACK may wait for a second segment
+#define TCP_TWTICKS  (2*TCP_HZ)   // how long TIME_WAIT lasts
+#define TCP_FINWAIT  (20*TCP_HZ)  // FIN_WAIT_2 limit once the file is closed
+#define TCP_BACKLOG  8    // connections a listener holds for tcpaccept()
+
+#define SEQ_LT(a, b) ((int)((a) - (b)) < 0)
+#define SEQ_LE(a, b) ((int)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int)((a) - (b)) > 0)
+#define SEQ_GE(a, b) ((int)((a) - (b)) >= 0)
+
+enum tcpstate {
+  TCP_CLOSED, TCP_LISTEN, TCP_SYN_SENT, TCP_SYN_RCVD, TCP_ESTABLISHED,
+  TCP_FIN_WAIT_1, TCP_FIN_WAIT_2, TCP_CLOSE_WAIT, TCP_CLOSING,
+  TCP_LAST_ACK, TCP_TIME_WAIT,
+};
+
+struct tcpcb {
+  struct spinlock lock;
+  struct tcpcb *next;     // on tcplist
+  enum tcpstate state;
+  uint32 raddr;           // 0 for a listener
+  uint16 lport, rport;
+  int userclosed;         // no file refers to it; free once CLOSED
+  int err;                // refused, reset or timed out
+
+  // tcplock protects these three.
+  struct tcpcb *parent;   // the listener of a SYN_RCVD connection
+  struct tcpcb *acceptq;  // a listener's connections for tcpaccept()
+  struct tcpcb *anext;    // on a listener's acceptq
+  int inq;                // on a listener's acceptq
+
+  // send side. sbuf holds the slen bytes from sequence number
+  // sbase on, starting at offset sstart.
+  uint32 iss, snd_una, snd_nxt, snd_max, snd_wnd, sbase;
+  char *sbuf[TCP_BUFPAGES];
+  int sstart, slen;
+  int finpending;         // send FIN after what's in sbuf
+  int force;              // send a byte even into a zero window
+  uint mss, cwnd, ssthresh;
+
+  // receive side. rbuf holds rlen bytes from offset rstart.
+  uint32 irs, rcv_nxt;
+  uint32 rcv_adv;         // right edge of the window last advertised
+  char *rbuf[TCP_BUFPAGES];
+  int rstart, rlen;
+  int rcvdfin;            // end of file after rbuf
+
+  // timers, counting down in tcptimer() ticks; 0 is off.
+  int rtx;                // retransmission, or window probe
+  int delack;             // delayed ACK
+  int tw;                 // TIME_WAIT or FIN_WAIT_2
+  int rto, nrtx;
+  int ackpending;         // segments received but not ACKed
+  int timing;             // an RTT measurement is under way:
+  uint32 rtt_seq;         //   the ACK of rtt_seq
+  uint rtt_start;         //   for a segment sent at this tcpticks value
+  int srtt, rttvar;       // times 8 and 4, in tcptimer() ticks
+};
+
+static struct spinlock tcplock;
+static struct tcpcb *tcplist;
+static uint tcpticks;     // tcptimer() ticks so far
+static struct kmem_cache *tcpcache;
+
+void
+tcpinit(void)
+{
+  initlock(&tcplock, "tcp");
+  tcpcache = kmem_cache_create("tcpcb", sizeof(struct tcpcb), 0);
+}
+
+// copies n bytes between offset off in a buffer ring and addr,
+// which is a user address if user is set. tobuf is the
+// direction.
+static int
+tcpcopy(char **ring, int off, int user, uint64 addr, int n, int tobuf)
+{
+  char *p;
+  int k;
+
+  while (n > 0) {
+    off %= TCP_BUFSZ;
+    p = ring[off / PGSIZE] + off % PGSIZE;
+    k = PGSIZE - off % PGSIZE;
+    if (k > n)
+      k = n;
+    if (tobuf) {
+      if (either_copyin(p, user, addr, k) < 0)
+        return -1;
+    } else if (either_copyout(user, addr, p, k) < 0) {
+      return -1;
+    }
+    off += k;
+    addr += k;
+    n -= k;
+  }
+  return 0;
+}
+
+static void
+tcpfree(struct tcpcb *t)
+{
+  for (int i = 0; i < TCP_BUFPAGES; i++) {
+    if (t->sbuf[i])
+      kfree(t->sbuf[i]);
+    if (t->rbuf[i])
+      kfree(t->rbuf[i]);
+  }
+  kmem_cache_free(tcpcache, t);
+}
+
+// a new tcpcb, not yet on tcplist. listeners need no buffers.
+static struct tcpcb *
+tcpalloc(uint32 raddr, uint16 lport, uint16 rport, int bufs)
+{
+  struct tcpcb *t;
+
+  if ((t = kmem_cache_alloc(tcpcache)) == 0)
+    return 0;
+  memset(t, 0, sizeof(*t));
+  initlock(&t->lock, "tcpcb");
+  t->raddr = raddr;
+  t->lport = lport;
+  t->rport = rport;
+  t->rto = TCP_RTOINIT;
+  t->mss = TCP_DEFMSS;
+  for (int i = 0; bufs && i < TCP_BUFPAGES; i++) {
+    if ((t->sbuf[i] = kalloc()) == 0 || (t->rbuf[i] = kalloc()) == 0) {
+      tcpfree(t);
+      return 0;
+    }
+  }
+  // an unpredictable initial sequence number
+  t->iss = r_time() * 2654435761U;
+  t->snd_una = t->snd_max = t->iss;
+  t->snd_nxt = t->iss + 1;
+  t->sbase = t->iss + 1;
+  return t;
+}
+
+// the connection for a segment from raddr:rport to lport,
+// or the listener on lport. caller holds tcplock.
+static struct tcpcb *
+tcplookup(uint32 raddr, uint16 lport, uint16 rport, int listener)
+{
+  struct tcpcb *t;
+
+  for (t = tcplist; t; t = t->next)
+    if (t->raddr == raddr && t->lport == lport && t->rport == rport &&
+        t->state != TCP_CLOSED)
+      return t;
+  for (t = tcplist; listener && t; t = t->next)
+    if (t->state == TCP_LISTEN && t->lport == lport)
+      return t;
+  return 0;
+}
+
+static void
+tcpinsert(struct tcpcb *t)
+{
+  t->next = tcplist;
+  tcplist = t;
+  wakeup(&tcplist); // the timer thread
+}
+
+// the receive window we can offer now.
+static uint
+tcp_rcvwnd(struct tcpcb *t)
+{
+  if (t->rbuf[0] == 0)
+    return 0;
+  return TCP_BUFSZ - t->rlen;
+}
+
+// prepends a TCP header to m, which holds any payload, and
+// sends it.
+static void
+tcp_xmit(struct mbuf *m, uint32 raddr, uint16 lport, uint16 rport,
+         uint32 seq, uint32 ack, int flags, uint win)
+{
+  struct tcp *th;
+  uint8 *opt;
+  int hlen;
+
+  hlen = sizeof(*th) + ((flags & TCP_SYN) ? 4 : 0);
+  th = (struct tcp *)mbufpush(m, hlen);
+  th->sport = htons(lport);
+  th->dport = htons(rport);
+  th->seq = htonl(seq);
+  th->ack = htonl(ack);
+  th->off = (hlen / 4) << 4;
+  th->flags = flags;
+  th->win = htons(win > 0xffff ? 0xffff : win);
+  th->sum = 0;
+  th->urp = 0;
+  if (flags & TCP_SYN) {
+    // our maximum segment size
+    opt = (uint8 *)(th + 1);
+    opt[0] = TCPOPT_MSS;
+    opt[1] = 4;
+    opt[2] = TCP_MSS >> 8;
+    opt[3] = TCP_MSS & 0xff;
+  }
+  th->sum = ~in_fold(in_sum(m->head, m->len,
+                            in_pseudo(net_srcaddr(raddr), raddr,
+                                      IPPROTO_TCP, m->len)));
+  net_tx_ip(m, IPPROTO_TCP, raddr);
+}
+
+// sends a segment of t's: len bytes of data from offset off in
+// sbuf, at sequence number seq. a lost mbuf is as good as a
+// lost segment; retransmission takes care of both.
+static void
+tcp_send(struct tcpcb *t, uint32 seq, int flags, int off, int len)
+{
+  struct mbuf *m;
+  uint win;
+
+  if ((m = mbufalloc(MBUF_DEFAULT_HEADROOM)) == 0)
+    return;
+  if (len > 0)
+    tcpcopy(t->sbuf, t->sstart + off, 0, (uint64)mbufput(m, len), len, 0);
+  win = tcp_rcvwnd(t);
+  if (flags & TCP_ACK) {
+    t->rcv_adv = t->rcv_nxt + win;
+    t->ackpending = 0;
+    t->delack = 0;
+  }
+  tcp_xmit(m, t->raddr, t->lport, t->rport, seq,
+           (flags & TCP_ACK) ? t->rcv_nxt : 0, flags, win);
+}
+
+static void
+tcp_sendack(struct tcpcb *t)
+{
+  tcp_send(t, t->snd_nxt, TCP_ACK, 0, 0);
+}
+
+// answers a segment that belongs to no connection.
+static void
+tcp_reset(uint32 raddr, uint16 lport, uint16 rport,
+          uint32 seq, uint32 ack, int flags, int dlen)
+{
+  struct mbuf *m;
+
+  if (flags & TCP_RST)
+    return;
+  if ((m = mbufalloc(MBUF_DEFAULT_HEADROOM)) == 0)
+    return;
+  if (flags & TCP_ACK)
+    tcp_xmit(m, raddr, lport, rport, ack, 0, TCP_RST, 0);
+  else
+    tcp_xmit(m, raddr, lport, rport, 0,
+             seq + dlen + ((flags & TCP_SYN) ? 1 : 0) + ((flags & TCP_FIN) ? 1 : 0),
+             TCP_RST | TCP_ACK, 0);
+}
+
+// wakes everyone waiting on t.
+static void
+tcp_wakeup(struct tcpcb *t)
+{
+  wakeup(&t->rlen);
+  wakeup(&t->slen);
+  wakeup(t);
+  pollwakeup();
+}
+
+// the connection is over, with error err if it didn't end
+// normally.
+static void
+tcp_drop(struct tcpcb *t, int err)
+{
+  t->state = TCP_CLOSED;
+  t->err = err;
+  t->rtx = t->delack = t->tw = 0;
+  tcp_wakeup(t);
+}
+
+// sends a RST and drops t.
+static void
+tcp_abort(struct tcpcb *t)
+{
+  if (t->state >= TCP_SYN_RCVD)
+    tcp_send(t, t->snd_nxt, TCP_RST | TCP_ACK, 0, 0);
+  tcp_drop(t, 1);
+}
+
+//
+// sends as much of sbuf, and the FIN after it, as the windows
+// allow, from snd_nxt on.
+//
+static void
+tcp_output(struct tcpcb *t)
+{
+  int off, len, avail, win, fin, flags;
+
+  switch (t->state) {
+  case TCP_ESTABLISHED:
+  case TCP_CLOSE_WAIT:
+  case TCP_FIN_WAIT_1:
+  case TCP_CLOSING:
+  case TCP_LAST_ACK:
+    break;
+  default:
+    return;
+  }
+
+  for (;;) {
+    off = t->snd_nxt - t->sbase;
+    if (off > t->slen)
+      break; // the FIN has gone
+    avail = t->slen - off;
+    win = (int)(t->snd_wnd < t->cwnd ? t->snd_wnd : t->cwnd) -
+          (int)(t->snd_nxt - t->snd_una);
+    if (t->force && win < 1)
+      win = 1;
+    t->force = 0;
+    len = avail;
+    if (len > t->mss)
+      len = t->mss;
+    if (len > win)
+      len = win < 0 ? 0 : win;
+    fin = t->finpending && off + len == t->slen;
+    if (len == 0 && !fin)
+      break;
+
+    flags = TCP_ACK;
+    if (len > 0 && off + len == t->slen)
+      flags |= TCP_PSH;
+    if (fin)
+      flags |= TCP_FIN;
+    // time one segment per round trip, never a retransmission
+    if (!t->timing && t->snd_nxt == t->snd_max) {
+      t->timing = 1;
+      t->rtt_seq = t->snd_nxt;
+      t->rtt_start = tcpticks;
+    }
+    tcp_send(t, t->snd_nxt, flags, off, len);
+    t->snd_nxt += len + fin;
+    if (SEQ_GT(t->snd_nxt, t->snd_max))
+      t->snd_max = t->snd_nxt;
+    if (t->rtx == 0)
+      t->rtx = t->rto;
+    if (fin) {
+      if (t->state == TCP_ESTABLISHED)
+        t->state = TCP_FIN_WAIT_1;
+      else if (t->state == TCP_CLOSE_WAIT)
+        t->state = TCP_LAST_ACK;
+      break;
+    }
+  }
+
+  // data is waiting on a zero window: probe it later.
+  if (t->rtx == 0 && t->slen > (int)(t->snd_nxt - t->sbase))
+    t->rtx = t->rto;
+}
+
+// the retransmission timer went off.
+static void
+tcp_rexmit(struct tcpcb *t)
+{
+  uint flight = t->snd_max - t->snd_una;
+
+  if (flight == 0) {
+    // nothing outstanding, so this is a window probe.
+    t->force = 1;
+    tcp_output(t);
+    return;
+  }
+  // a zero window can last; a silent peer can't.
+  if (t->snd_wnd > 0 && ++t->nrtx > TCP_MAXRTX) {
+    tcp_drop(t, 1);
+    return;
+  }
+  t->rto = t->rto * 2 > TCP_RTOMAX ? TCP_RTOMAX : t->rto * 2;
+  t->timing = 0;
+  t->ssthresh = flight / 2 > 2 * t->mss ? flight / 2 : 2 * t->mss;
+  t->cwnd = t->mss;
+
+  if (t->state == TCP_SYN_SENT) {
+    tcp_send(t, t->iss, TCP_SYN, 0, 0);
+    t->rtx = t->rto;
+  } else if (t->state == TCP_SYN_RCVD) {
+    tcp_send(t, t->iss, TCP_SYN | TCP_ACK, 0, 0);
+    t->rtx = t->rto;
+  } else {
+    // go back N
+    t->snd_nxt = t->snd_una;
+    tcp_output(t);
+  }
+}
+
+// one tick of t's timers.
+static void
+tcp_timers(struct tcpcb *t)
+{
+  if (t->delack && --t->delack == 0 && t->ackpending)
+    tcp_sendack(t);
+  if (t->tw && --t->tw == 0)
+    tcp_drop(t, t->state == TCP_TIME_WAIT ? 0 : 1);
+  if (t->rtx && --t->rtx == 0)
+    tcp_rexmit(t);
+}
+
+//
+// runs every connection's timers TCP_HZ times a second, on an
+// hrtimer, and frees connections that are over. it only runs
+// while there are connections.
+//
+static void
+tcptimer(void *arg)
+{
+  struct tcpcb *t, **pp;
+  uint64 next = 0;
+
+  for (;;) {
+    acquire(&tcplock);
+    while (tcplist == 0)
+      sleep(&tcplist, &tcplock);
+
+    next += TIMEHZ / TCP_HZ;
+    if (next < r_time())
+      next = r_time() + TIMEHZ / TCP_HZ;  // idle, or fell behind
+    while (r_time() < next)
+      sleepuntil(&next, &tcplock, next);
+    tcpticks++;
+
+    for (pp = &tcplist; (t = *pp) != 0; ) {
+      acquire(&t->lock);
+      tcp_timers(t);
+      if (t->state == TCP_CLOSED && t->userclosed && !t->inq) {
+        *pp = t->next;
+        release(&t->lock);
+        tcpfree(t);
+        continue;
+      }
+      release(&t->lock);
+      pp = &t->next;
+    }
+    release(&tcplock);
+  }
+}
+
+void
+tcpstart(void)
+{
+  if (kthread_create(tcptimer, 0, "tcptimer", -1) < 0)
+    panic("tcpstart");
+}
+
+// takes in an RTT sample of rtt tcptimer() ticks, Jacobson's way.
+static void
+tcp_rtt(struct tcpcb *t, int rtt)
+{
+  int delta;
+
+  if (t->srtt == 0) {
+    t->srtt = rtt << 3;
+    t->rttvar = rtt << 1;
+  } else {
+    delta = rtt - (t->srtt >> 3);
+    t->srtt += delta;
+    if (delta < 0)
+      delta = -delta;
+    t->rttvar += delta - (t->rttvar >> 2);
+  }
+  t->rto = (t->srtt >> 3) + t->rttvar;
+  if (t->rto < TCP_RTOMIN)
+    t->rto = TCP_RTOMIN;
+  if (t->rto > TCP_RTOMAX)
+    t->rto = TCP_RTOMAX;
+}
+
+// the peer has acknowledged everything before ack.
+static void
+tcp_ack(struct tcpcb *t, uint32 ack)
+{
+  int n;
+
+  n = ack - t->sbase;
+  if (n > t->slen)
+    n = t->slen; // and the FIN
+  if (n > 0) {
+    t->sstart = (t->sstart + n) % TCP_BUFSZ;
+    t->slen -= n;
+    t->sbase += n;
+    wakeup(&t->slen);
+    pollwakeup();
+  }
+  t->snd_una = ack;
+  if (SEQ_LT(t->snd_nxt, ack))
+    t->snd_nxt = ack;
+
+  if (t->timing && SEQ_GT(ack, t->rtt_seq)) {
+    t->timing = 0;
+    tcp_rtt(t, tcpticks - t->rtt_start);
+  }
+  // slow start, then congestion avoidance
+  if (t->cwnd < t->ssthresh)
+    t->cwnd += t->mss;
+  else
+    t->cwnd += t->mss * t->mss / t->cwnd;
+  if (t->cwnd > TCP_BUFSZ)
+    t->cwnd = TCP_BUFSZ;
+
+  t->nrtx = 0;
+  t->rtx = t->snd_una == t->snd_max ? 0 : t->rto;
+}
+
+// the MSS option of a SYN, if it has one.
+static uint
+tcp_mssopt(struct tcp *th, int hlen)
+{
+  uint8 *p = (uint8 *)(th + 1), *e = (uint8 *)th + hlen;
+  uint mss;
+
+  while (p < e && *p != TCPOPT_EOL) {
+    if (*p == TCPOPT_NOP) {
+      p++;
+      continue;
+    }
+    if (p + 1 >= e || p[1] < 2 || p + p[1] > e)
+      break;
+    if (p[0] == TCPOPT_MSS && p[1] == 4) {
+      mss = (p[2] << 8) | p[3];
+      if (mss > TCP_MSS)
+        mss = TCP_MSS;
+      return mss < 64 ? 64 : mss;
+    }
+    p += p[1];
+  }
+  return TCP_DEFMSS;
+}
+
+// appends n bytes of m's chain, from skip on, to t's rbuf.
+static void
+tcp_rbufput(struct tcpcb *t, struct mbuf *m, int skip, int n)
+{
+  int k;
+
+  for (; m && n > 0; m = m->next) {
+    if (skip >= m->len) {
+      skip -= m->len;
+      continue;
+    }
+    k = m->len - skip;
+    if (k > n)
+      k = n;
+    tcpcopy(t->rbuf, t->rstart + t->rlen, 0, (uint64)(m->head + skip), k, 1);
+    t->rlen += k;
+    n -= k;
+    skip = 0;
+  }
+}
+
+// a listener t got a SYN: starts a connection in SYN_RCVD.
+// caller holds tcplock.
+static void
+tcp_passive(struct tcpcb *t, uint32 raddr, uint16 rport,
+            struct tcp *th, int hlen)
+{
+  struct tcpcb *c;
+  int n = 0;
+
+  for (c = tcplist; c; c = c->next)
+    if (c->parent == t)
+      n++;
+  for (c = t->acceptq; c; c = c->anext)
+    n++;
+  if (n >= TCP_BACKLOG)
+    return; // the peer will try again
+  if ((c = tcpalloc(raddr, t->lport, rport, 1)) == 0)
+    return;
+
+  c->state = TCP_SYN_RCVD;
+  c->parent = t;
+  c->userclosed = 1; // until accepted
+  c->irs = ntohl(th->seq);
+  c->rcv_nxt = c->irs + 1;
+  c->snd_wnd = ntohs(th->win);
+  c->mss = tcp_mssopt(th, hlen);
+  c->cwnd = 4 * c->mss;
+  c->ssthresh = TCP_BUFSZ;
+  tcpinsert(c);
+  acquire(&c->lock);
+  tcp_send(c, c->iss, TCP_SYN | TCP_ACK, 0, 0);
+  c->snd_max = c->snd_nxt;
+  c->rtx = c->rto;
+  release(&c->lock);
+}
+
+//
+// processes a received TCP segment of len bytes, the payload
+// of iphdr. m's head is at the TCP header.
+//
+void
+tcp_input(struct mbuf *m, uint16 len, struct ip *iphdr)
+{
+  struct tcpcb *t;
+  struct tcp *th;
+  uint32 raddr, seq, ack;
+  uint16 lport, rport;
+  int hlen, dlen, flags, skip, n, needack, locked;
+
+  raddr = ntohl(iphdr->ip_src);
+  if (len < sizeof(*th) || m->len < sizeof(*th) || len > mbuflen(m))
+    goto drop;
+  if (m->next == 0)
+    mbuftrim(m, m->len - len);
+  if (!(m->flags & M_L4CSUM_OK) &&
+      in_fold(in_sum_chain(m, in_pseudo(raddr, ntohl(iphdr->ip_dst),
+                                        IPPROTO_TCP, len))) != 0xffff)
+    goto drop;
+
+  th = (struct tcp *)m->head;
+  hlen = (th->off >> 4) * 4;
+  if (hlen < sizeof(*th) || hlen > len || hlen > m->len)
+    goto drop;
+  lport = ntohs(th->dport);
+  rport = ntohs(th->sport);
+  seq = ntohl(th->seq);
+  ack = ntohl(th->ack);
+  flags = th->flags;
+  dlen = len - hlen;
+
+  // tcplock stays held for a listener or a SYN_RCVD
+  // connection, whose handling touches tcplist and acceptq.
+  acquire(&tcplock);
+  t = tcplookup(raddr, lport, rport,
+                (flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN);
+  if (t == 0) {
+    release(&tcplock);
+    tcp_reset(raddr, lport, rport, seq, ack, flags, dlen);
+    goto drop;
+  }
+  acquire(&t->lock);
+  locked = t->state == TCP_LISTEN || t->state == TCP_SYN_RCVD;
+  if (!locked)
+    release(&tcplock);
+
+  if (t->state == TCP_LISTEN) {
+    tcp_passive(t, raddr, rport, th, hlen);
+    goto done;
+  }
+
+  if (t->state == TCP_SYN_SENT) {
+    if ((flags & TCP_ACK) && ack != t->iss + 1) {
+      tcp_reset(raddr, lport, rport, seq, ack, flags, dlen);
+      goto done;
+    }
+    if (flags & TCP_RST) {
+      if (flags & TCP_ACK)
+        tcp_drop(t, 1); // refused
+      goto done;
+    }
+    if ((flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK))
+      goto done;
+    t->irs = seq;
+    t->rcv_nxt = seq + 1;
+    t->snd_una = ack;
+    t->snd_wnd = ntohs(th->win);
+    t->mss = tcp_mssopt(th, hlen);
+    t->cwnd = 4 * t->mss;
+    t->rtx = 0;
+    t->nrtx = 0;
+    t->state = TCP_ESTABLISHED;
+    tcp_sendack(t);
+    tcp_wakeup(t);
+    goto done;
+  }
+
+  // a synchronized state.
+  if (flags & TCP_RST) {
+    if (SEQ_GE(seq, t->rcv_nxt) && SEQ_LT(seq, t->rcv_nxt + tcp_rcvwnd(t) + 1))
+      tcp_drop(t, t->state == TCP_TIME_WAIT ? 0 : 1);
+    goto done;
+  }
+  if (flags & TCP_SYN) {
+    if (t->state == TCP_SYN_RCVD && seq == t->irs)
+      tcp_send(t, t->iss, TCP_SYN | TCP_ACK, 0, 0); // our SYN-ACK was lost
+    else
+      tcp_sendack(t);
+    goto done;
+  }
+  if (!(flags & TCP_ACK))
+    goto done;
+
+  if (t->state == TCP_SYN_RCVD) {
+    if (ack != t->iss + 1) {
+      tcp_reset(raddr, lport, rport, seq, ack, flags, dlen);
+      goto done;
+    }
+    t->state = TCP_ESTABLISHED;
+    t->snd_una = ack;
+    t->rtx = 0;
+    t->nrtx = 0;
+    if (t->parent) {
+      // hand it to the listener
+      struct tcpcb **pp = &t->parent->acceptq;
+      while (*pp)
+        pp = &(*pp)->anext;
+      *pp = t;
+      t->anext = 0;
+      t->inq = 1;
+      wakeup(t->parent);
+      pollwakeup();
+      t->parent = 0;
+    }
+  }
+
+  // ACK
+  if (SEQ_GT(ack, t->snd_max)) {
+    tcp_sendack(t);
+    goto done;
+  }
+  if (SEQ_GE(ack, t->snd_una))
+    t->snd_wnd = ntohs(th->win);
+  if (SEQ_GT(ack, t->snd_una))
+    tcp_ack(t, ack);
+  if (t->snd_una == t->snd_max && t->slen == 0) {
+    // all sent, FIN included, is acknowledged
+    if (t->state == TCP_FIN_WAIT_1) {
+      t->state = TCP_FIN_WAIT_2;
+      if (t->userclosed)
+        t->tw = TCP_FINWAIT;
+    } else if (t->state == TCP_CLOSING) {
+      t->state = TCP_TIME_WAIT;
+      t->tw = TCP_TWTICKS;
+    } else if (t->state == TCP_LAST_ACK) {
+      tcp_drop(t, 0);
+      goto done;
+    }
+  }
+
+  // data, and FIN, in order only
+  needack = 0;
+  skip = 0;
+  if (SEQ_LT(seq, t->rcv_nxt)) {
+    // a retransmission of some we already have
+    skip = t->rcv_nxt - seq;
+    needack = 1;
+    if (skip > dlen) {
+      skip = dlen;
+      flags &= ~TCP_FIN; // that too
+    }
+    seq += skip;
+    dlen -= skip;
+  }
+  if (seq != t->rcv_nxt && (dlen > 0 || (flags & TCP_FIN))) {
+    tcp_sendack(t); // a hole: ask for what's missing
+    goto out;
+  }
+  if (dlen > 0) {
+    if (t->state == TCP_ESTABLISHED || t->state == TCP_FIN_WAIT_1 ||
+        t->state == TCP_FIN_WAIT_2) {
+      n = tcp_rcvwnd(t);
+      if (n > dlen)
+        n = dlen;
+      tcp_rbufput(t, m, hlen + skip, n);
+      t->rcv_nxt += n;
+      if (n < dlen) {
+        // past our window; the rest will come again
+        flags &= ~TCP_FIN;
+        needack = 1;
+      }
+      if (n > 0) {
+        wakeup(&t->rlen);
+        pollwakeup();
+        // ACK every second segment at once, others a little later
+        if (++t->ackpending >= 2)
+          needack = 1;
+        else if (t->delack == 0)
+          t->delack = TCP_DELACK;
+      }
+    } else {
+      needack = 1;
+    }
+  }
+  if ((flags & TCP_FIN) && !t->rcvdfin) {
+    t->rcvdfin = 1;
+    t->rcv_nxt++;
+    needack = 1;
+    if (t->state == TCP_ESTABLISHED || t->state == TCP_SYN_RCVD) {
+      t->state = TCP_CLOSE_WAIT;
+    } else if (t->state == TCP_FIN_WAIT_1) {
+      t->state = TCP_CLOSING;
+    } else if (t->state == TCP_FIN_WAIT_2) {
+      t->state = TCP_TIME_WAIT;
+      t->tw = TCP_TWTICKS;
+    }
+    tcp_wakeup(t);
+  } else if (flags & TCP_FIN) {
+    needack = 1; // our ACK of it was lost
+  }
+
+out:
+  tcp_output(t);
+  if (needack)
+    tcp_sendack(t);
+done:
+  release(&t->lock);
+  if (locked)
+    release(&tcplock);
+drop:
+  mbuffree(m);
+}
+
+//
+// the system call side.
+//
+
+// connects lport to raddr:rport, waiting for the handshake.
+struct tcpcb *
+tcpconnect(uint32 raddr, uint16 lport, uint16 rport)
+{
+  struct proc *pr = myproc();
+  struct tcpcb *t;
+
+  if (raddr == 0 || rport == 0)
+    return 0;
+  if ((t = tcpalloc(raddr, lport, rport, 1)) == 0)
+    return 0;
+  t->state = TCP_SYN_SENT;
+  t->cwnd = TCP_DEFMSS;
+  t->ssthresh = TCP_BUFSZ;
+
+  acquire(&tcplock);
+  if (tcplookup(raddr, lport, rport, 0)) {
+    release(&tcplock);
+    tcpfree(t);
+    return 0;
+  }
+  tcpinsert(t);
+  acquire(&t->lock);
+  release(&tcplock);
+
+  tcp_send(t, t->iss, TCP_SYN, 0, 0);
+  t->snd_max = t->snd_nxt;
+  t->rtx = t->rto;
+  while (t->state == TCP_SYN_SENT && !pr->killed)
+    sleep(t, &t->lock);
+  if (t->state != TCP_ESTABLISHED) {
+    if (t->state != TCP_CLOSED)
+      tcp_drop(t, 1);
+    t->userclosed = 1; // the timer frees it
+    release(&t->lock);
+    return 0;
+  }
+  release(&t->lock);
+  return t;
+}
+
+// a listener for connections to lport.
+struct tcpcb *
+tcplisten(uint16 lport)
+{
+  struct tcpcb *t, *pos;
+
+  if ((t = tcpalloc(0, lport, 0, 0)) == 0)
+    return 0;
+  t->state = TCP_LISTEN;
+  acquire(&tcplock);
+  for (pos = tcplist; pos; pos = pos->next) {
+    if (pos->state == TCP_LISTEN && pos->lport == lport) {
+      release(&tcplock);
+      tcpfree(t);
+      return 0;
+    }
+  }
+  tcpinsert(t);
+  release(&tcplock);
+  return t;
+}
+
+// the next established connection on listener t.
+struct tcpcb *
+tcpaccept(struct tcpcb *t, int nonblock)
+{
+  struct proc *pr = myproc();
+  struct tcpcb *c;
+
+  acquire(&tcplock);
+  if (t->state != TCP_LISTEN) {
+    release(&tcplock);
+    return 0;
+  }
+  while (t->acceptq == 0 && !pr->killed && !nonblock)
+    sleep(t, &tcplock);
+  if ((c = t->acceptq) == 0) {
+    release(&tcplock);
+    return 0;
+  }
+  t->acceptq = c->anext;
+  acquire(&c->lock);
+  c->anext = 0;
+  c->inq = 0;
+  c->userclosed = 0;
+  release(&c->lock);
+  release(&tcplock);
+  return c;
+}
+
+// reads what has arrived, up to n bytes, into addr, a user
+// address if user is set. 0 at end of file.
+int
+tcpread(struct tcpcb *t, int user, uint64 addr, int n, int nonblock)
+{
+  struct proc *pr = myproc();
+  int k;
+
+  acquire(&t->lock);
+  while (t->rlen == 0 && !t->rcvdfin && t->state != TCP_CLOSED) {
+    if (pr->killed || nonblock) {
+      release(&t->lock);
+      return -1;
+    }
+    sleep(&t->rlen, &t->lock);
+  }
+  if (t->rlen == 0) {
+    k = t->err ? -1 : 0;
+    release(&t->lock);
+    return k;
+  }
+
+  k = n < t->rlen ? n : t->rlen;
+  if (tcpcopy(t->rbuf, t->rstart, user, addr, k, 0) < 0) {
+    release(&t->lock);
+    return -1;
+  }
+  t->rstart = (t->rstart + k) % TCP_BUFSZ;
+  t->rlen -= k;
+
+  // tell the peer about the space, once there's enough of it
+  // to matter, instead of after every read.
+  if (t->state == TCP_ESTABLISHED || t->state == TCP_FIN_WAIT_1 ||
+      t->state == TCP_FIN_WAIT_2) {
+    uint inc = t->rcv_nxt + tcp_rcvwnd(t) - t->rcv_adv;
+    if (inc >= 2 * t->mss || inc >= TCP_BUFSZ / 2)
+      tcp_sendack(t);
+  }
+  release(&t->lock);
+  return k;
+}
+
+// queues n bytes at addr (a user address if user is set) for
+// sending, waiting for buffer space unless nonblock is set.
+// returns the number queued.
+int
+tcpwrite(struct tcpcb *t, int user, uint64 addr, int n, int nonblock)
+{
+  struct proc *pr = myproc();
+  int done = 0, k;
+
+  acquire(&t->lock);
+  while (done < n) {
+    if ((t->state != TCP_ESTABLISHED && t->state != TCP_CLOSE_WAIT) ||
+        t->finpending || pr->killed)
+      break;
+    if (t->slen == TCP_BUFSZ) {
+      if (nonblock)
+        break;
+      sleep(&t->slen, &t->lock);
+      continue;
+    }
+    k = TCP_BUFSZ - t->slen;
+    if (k > n - done)
+      k = n - done;
+    if (tcpcopy(t->sbuf, t->sstart + t->slen, user, addr + done, k, 1) < 0)
+      break;
+    t->slen += k;
+    done += k;
+    tcp_output(t);
+  }
+  release(&t->lock);
+  return done > 0 ? done : -1;
+}
+
+// queues n bytes of ip, from offset off, for sending, a page
+// at a time through a kernel page rather than user memory.
+// returns the number queued, or -1.
+int
+tcpsendfile(struct tcpcb *t, struct inode *ip, uint off, int n)
+{
+  char *page;
+  int k, r, w, tot = 0;
+
+  if ((page = kalloc()) == 0)
+    return -1;
+  while (tot < n) {
+    k = n - tot < PGSIZE ? n - tot : PGSIZE;
+    ilock(ip);
+    r = readi(ip, 0, (uint64)page, off + tot, k);
+    iunlock(ip);
+    if (r <= 0)
+      break;
+    if ((w = tcpwrite(t, 0, (uint64)page, r, 0)) > 0)
+      tot += w;
+    if (w != r || r < k)
+      break;
+  }
+  kfree(page);
+  return tot > 0 || n == 0 ? tot : -1;
+}
+
+int
+tcppoll(struct tcpcb *t)
+{
+  int ev = 0;
+
+  if (t->state == TCP_LISTEN) {
+    acquire(&tcplock);
+    if (t->acceptq)
+      ev |= POLLIN;
+    release(&tcplock);
+    return ev;
+  }
+  acquire(&t->lock);
+  if (t->rlen > 0 || t->rcvdfin || t->state == TCP_CLOSED)
+    ev |= POLLIN;
+  if (t->rcvdfin || t->state == TCP_CLOSED)
+    ev |= POLLHUP;
+  if ((t->state == TCP_ESTABLISHED || t->state == TCP_CLOSE_WAIT) &&
+      t->slen < TCP_BUFSZ)
+    ev |= POLLOUT;
+  release(&t->lock);
+  return ev;
+}
+
+// the last file reference to t is gone: send FIN after the
+// rest of the data, or tear down a listener and the
+// connections nobody accepted.
+void
+tcpclose(struct tcpcb *t)
+{
+  struct tcpcb *c;
+
+  acquire(&tcplock);
+  if (t->state == TCP_LISTEN) {
+    for (c = tcplist; c; c = c->next) {
+      if (c->parent == t) {
+        acquire(&c->lock);
+        c->parent = 0;
+        tcp_abort(c);
+        release(&c->lock);
+      }
+    }
+    while ((c = t->acceptq) != 0) {
+      t->acceptq = c->anext;
+      acquire(&c->lock);
+      c->anext = 0;
+      c->inq = 0;
+      c->userclosed = 1;
+      tcp_abort(c);
+      release(&c->lock);
+    }
+    acquire(&t->lock);
+    t->state = TCP_CLOSED;
+    t->userclosed = 1;
+    release(&t->lock);
+    release(&tcplock);
+    return;
+  }
+  release(&tcplock);
+
+  acquire(&t->lock);
+  t->userclosed = 1;
+  if (t->state == TCP_ESTABLISHED || t->state == TCP_CLOSE_WAIT) {
+    t->finpending = 1;
+    tcp_output(t);
+  } else if (t->state == TCP_FIN_WAIT_2) {
+    t->tw = TCP_FINWAIT;
+  } else if (t->state == TCP_SYN_SENT || t->state == TCP_SYN_RCVD) {
+    tcp_abort(t);
+  }
+  release(&t->lock);
+}
@@ -0,0 +1,126 @@
+//
+// kernel event tracing.
+//
+// each CPU records events into its own ring, with interrupts
+// off, so recording takes no lock: only the CPU writes its
+// ring's head. a reader of the trace device drains the rings
+// in time order. if a CPU laps the reader, the overwritten
+// events are lost, and the reader says how many with a
+// TR_LOST event.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "trace.h"
+#include "defs.h"
+
+uint tracemask;   // the enabled event types
+
+static struct tracebuf {
+  uint64 head;    // next event to write; only its CPU writes it
+  uint64 tail;    // next event to read
+  struct traceev ev[NTRACEEV];
+} tracebuf[NCPU];
+
+// one reader at a time; it may sleep in copyout().
+static struct sleeplock tracelock;
+
+void
+traceinit(void)
+{
+  initsleeplock(&tracelock, "trace");
+  devsw[TRACEDEV].read = traceread;
+}
+
+void
+tracerec(int type, uint64 a0, uint64 a1)
+{
+  struct tracebuf *t;
+  struct traceev *e;
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  t = &tracebuf[cpuid()];
+  e = &t->ev[t->head % NTRACEEV];
+  e->time = r_time();
+  e->type = type;
+  e->cpu = cpuid();
+  e->pid = c->proc ? c->proc->pid : 0;
+  e->a0 = a0;
+  e->a1 = a1;
+  // publish the event only once it's filled in.
+  __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// copy the next event from t into e, if it hasn't been
+// overwritten meanwhile. returns 0 if it has, after moving
+// t->tail past the lost events and saying so in e.
+static int
+tracenext(struct tracebuf *t, int cpu, struct traceev *e)
+{
+  uint64 head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+
+  // the CPU rewrites slot tail while head is tail+NTRACEEV.
+  if(head - t->tail < NTRACEEV){
+    *e = t->ev[t->tail % NTRACEEV];
+    __sync_synchronize();
+    head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if(head - t->tail < NTRACEEV)
+      return 1;
+  }
+  e->time = r_time();
+  e->type = TR_LOST;
+  e->cpu = cpu;
+  e->pid = 0;
+  e->a0 = head - NTRACEEV + 1 - t->tail;
+  e->a1 = 0;
+  t->tail = head - NTRACEEV + 1;
+  return 0;
+}
+
+// the trace device: read()s return whole struct traceevs,
+// oldest first across the CPUs, and 0 once the rings are
+// empty.
+int
+traceread(int user_dst, uint64 dst, int n)
+{
+  struct traceev e, best;
+  int i, cpu, got = 0;
+
+  acquiresleep(&tracelock);
+  while(n - got >= sizeof(e)){
+    cpu = -1;
+    for(i = 0; i < NCPU; i++){
+      if(__atomic_load_n(&tracebuf[i].head, __ATOMIC_ACQUIRE) == tracebuf[i].tail)
+        continue;
+      if(tracenext(&tracebuf[i], i, &e) == 0){
+        // report the loss at once.
+        best = e;
+        cpu = i;
+        break;
+      }
+      if(cpu < 0 || e.time < best.time){
+        best = e;
+        cpu = i;
+      }
+    }
+    if(cpu < 0)
+      break;
+    if(best.type != TR_LOST)
+      tracebuf[cpu].tail++;
+    if(either_copyout(user_dst, dst + got, (char *)&best, sizeof(best)) < 0)
+      break;
+    got += sizeof(best);
+  }
+  releasesleep(&tracelock);
+  return got;
+}
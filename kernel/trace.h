@@ -0,0 +1,31 @@
+// kernel event tracing; see trace.c. shared with user/trace.c.
+
+// event types, which are also their bits in the mask that
+// trace() enables.
+#define TR_SYSENTER  (1<<0)   // a0: syscall number, a1: first argument
+#define TR_SYSEXIT   (1<<1)   // a0: syscall number, a1: return value
+#define TR_SWITCH    (1<<2)   // scheduler() runs a0: pid
+#define TR_SCHED     (1<<3)   // sched() gives up the CPU, a0: new state
+#define TR_SLEEP     (1<<4)   // a0: chan
+#define TR_WAKEUP    (1<<5)   // a0: chan, a1: processes woken
+#define TR_BHIT      (1<<6)   // bread() found the block cached; a0: blockno
+#define TR_BMISS     (1<<7)   // bread() must read it; a0: blockno
+#define TR_DISKSUB   (1<<8)   // a0: blockno, a1: 1 for a write
+#define TR_DISKDONE  (1<<9)   // a0: blockno
+#define TR_NETRX     (1<<10)  // a0: frame length
+#define TR_NETTX     (1<<11)  // a0: frame length
+#define TR_LOST      (1<<15)  // always on: a0 events were overwritten on cpu
+
+struct traceev {
+  uint64 time;    // the time CSR
+  ushort type;
+  ushort cpu;
+  int pid;        // of the current process, or 0
+  uint64 a0;
+  uint64 a1;
+};
+
+// in the kernel: record an event if its type is enabled,
+// which costs a load and a branch when it isn't.
+#define TRACE(t, a0, a1) \
+  do { if(tracemask & (t)) tracerec((t), (uint64)(a0), (uint64)(a1)); } while(0)
@@ -4,13 +4,18 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "vdso.h"
 #include "defs.h"
 
 struct spinlock tickslock;
 uint ticks;
+struct vclock *vclock;  // mapped at VCLOCK in every process
 
 extern char trampoline[], uservec[], userret[];
 
+// timervec's per-CPU scratch areas, in start.c.
+extern uint64 timer_scratch[NCPU][10];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -20,6 +25,8 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  if((vclock = (struct vclock *)kalloc_zeroed()) == 0)
+    panic("trapinit");
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -45,6 +52,11 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // off the user page table, for tlbshootdown().
+  struct cpu *c = mycpu();
+  c->upt = 0;
+  __atomic_fetch_add(&c->ugen, 1, __ATOMIC_RELEASE);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -67,9 +79,16 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && cowfault(p->pagetable, r_stval()) == 0){
+    // store to a copy-on-write page
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            lazyfault(p->pagetable, r_stval()) == 0){
+    // first use of a page of heap
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            mmapfault(p->pagetable, r_stval(), r_scause() == 15) == 0){
+    // a page of an mmap()ed file
   } else {
 
-    
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
     p->killed = 1;
@@ -81,7 +100,7 @@ usertrap(void)
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
-    yield();
+    preempt();
 
   usertrapret();
 }
@@ -121,14 +140,21 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with p's ASID. from here, tlbshootdown() waits for
+  // this CPU to trap back in.
+  __atomic_store_n(&mycpu()->upt, p->pagetable, __ATOMIC_RELAXED);
+  if(p == p->leader)
+    p->vproc->cpu = cpuid();
+  __sync_synchronize();
+  uint64 satp = uvmsatp(p);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // and switches to user mode with sret. a thread's trapframe
+  // isn't at TRAPFRAME, which is its leader's.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64,uint64))fn)(p->tfva, satp, p->trapframe->kernel_flush);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -154,7 +180,7 @@ kerneltrap()
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -167,6 +193,12 @@ clockintr()
 {
   acquire(&tickslock);
   ticks++;
+  // publish the time at VCLOCK, for user/ulib.c.
+  __atomic_store_n(&vclock->seq, vclock->seq + 1, __ATOMIC_RELAXED);
+  __sync_synchronize();
+  vclock->ticks = ticks;
+  vclock->mtime = r_time();
+  __atomic_store_n(&vclock->seq, vclock->seq + 1, __ATOMIC_RELEASE);
   wakeup(&ticks);
   release(&tickslock);
 }
@@ -211,16 +243,36 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or an IPI, forwarded by timervec in kernelvec.S, which
+    // sets timer_scratch[hart][6] for a tick (rather than an
+    // hrtimer deadline).
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip, before looking at why, so that
+    // another one is not missed.
+    w_sip(r_sip() & ~2);
+
+    // an IPI, a tick and an hrtimer deadline can arrive as
+    // one interrupt, so queued calls and expired timers run
+    // either way.
+    int tick = __atomic_exchange_n(&timer_scratch[cpuid()][6], 0, __ATOMIC_ACQ_REL);
+    int fired = hrtimerintr();
+    if(!tick && !fired)
+      mycpu()->ipirecv++;
+    ipiintr();
+
+    if(!tick)
+      return 1;
+
+    // while profiling, the timer runs faster than the clock,
+    // and only some of its interrupts are ticks.
+    if(!profintr())
+      return 1;
 
     if(cpuid() == 0){
       clockintr();
     }
     
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
-
     return 2;
   } else {
     return 0;
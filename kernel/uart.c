@@ -38,9 +38,12 @@
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// the transmit output buffer.
+// the transmit output buffer, for write()s to the console and
+// for the kernel's printf() and echo alike, so they come out
+// in order.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 2048
+#define UART_FIFO 16          // bytes the transmit FIFO holds
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uar_tx_r % UART_TX_BUF_SIZE]
@@ -77,15 +80,17 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
-// UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// add n bytes at s to the output buffer, as many at a time
+// as fit, and tell the UART to start sending if it isn't
+// already. blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(char *s, int n)
 {
+  int i = 0;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
@@ -93,25 +98,48 @@ uartputc(int c)
       ;
   }
 
-  while(1){
+  while(i < n){
     if(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
       // buffer is full.
       // wait for uartstart() to open up space in the buffer.
       sleep(&uart_tx_r, &uart_tx_lock);
-    } else {
-      uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-      uart_tx_w += 1;
-      uartstart();
-      release(&uart_tx_lock);
-      return;
+      continue;
     }
+    while(i < n && uart_tx_w != uart_tx_r + UART_TX_BUF_SIZE)
+      uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = s[i++];
+    uartstart();
+  }
+  release(&uart_tx_lock);
+}
+
+// the kernel's version of uartwrite(), for printf() and to
+// echo characters: it can't sleep, so if the buffer is full
+// it spins, sending bytes itself as the UART takes them.
+void
+uartputs(char *s, int n)
+{
+  int i;
+
+  acquire(&uart_tx_lock);
+
+  if(panicked){
+    for(;;)
+      ;
   }
+
+  for(i = 0; i < n; i++){
+    while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE)
+      uartstart();
+    uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = s[i];
+  }
+  uartstart();
+  release(&uart_tx_lock);
 }
 
-// alternate version of uartputc() that doesn't 
-// use interrupts, for use by kernel printf() and
-// to echo characters. it spins waiting for the uart's
-// output register to be empty.
+// alternate version of uartputs() that doesn't
+// use the buffer or interrupts, for printf() before
+// printfinit() and during a panic. it spins waiting
+// for the uart's output register to be empty.
 void
 uartputc_sync(int c)
 {
@@ -130,13 +158,15 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// if the UART is idle, and characters are waiting
+// in the transmit buffer, send a FIFO's worth.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
+  int i;
+
   while(1){
     if(uart_tx_w == uart_tx_r){
       // transmit buffer is empty.
@@ -149,14 +179,16 @@ uartstart()
       // it will interrupt when it's ready for a new byte.
       return;
     }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
-    uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
+
+    // with FIFOs enabled, TX_IDLE means the whole transmit
+    // FIFO is empty, so it can take UART_FIFO bytes.
+    for(i = 0; i < UART_FIFO && uart_tx_r != uart_tx_w; i++){
+      WriteReg(THR, uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]);
+      uart_tx_r += 1;
+    }
+
+    // maybe uartwrite() is waiting for space in the buffer.
     wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
   }
 }
 
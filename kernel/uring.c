@@ -0,0 +1,229 @@
+//
+// async I/O through rings shared with the process.
+//
+// uring_setup() maps a struct uring at URING. the process
+// queues operations in its submission ring and calls
+// uring_enter(), once for any number of them; kernel threads
+// of the process (kthread_clone()) carry them out, each with
+// the ordinary blocking fileread() and friends, and post the
+// results in the completion ring. with several workers, many
+// disk and network operations are in flight at once. workers
+// are started as the queue needs them, up to NURINGWORKER,
+// and exit with the process.
+//
+// the shared page is not trusted: the kernel keeps its own
+// copies of the indices it advances, and copies each sqe
+// before using it. a worker takes a submission only when the
+// completion ring has room saved for its result.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "uring.h"
+#include "defs.h"
+
+struct uringctl {
+  struct spinlock lock;
+  struct uring *ring;   // the shared page
+  uint sqhead;          // the kernel's copies of what it advances
+  uint cqtail;
+  int inflight;         // operations taken, not yet completed
+  int nworker;
+};
+
+// submissions queued and not yet taken. caller holds u->lock.
+static uint
+uringpending(struct uringctl *u)
+{
+  uint n = __atomic_load_n(&u->ring->sqtail, __ATOMIC_ACQUIRE) - u->sqhead;
+
+  return n > NSQE ? 0 : n;
+}
+
+// completions posted and not yet used by the process.
+static uint
+uringdone(struct uringctl *u)
+{
+  uint n = u->cqtail - __atomic_load_n(&u->ring->cqhead, __ATOMIC_ACQUIRE);
+
+  return n > NCQE ? NCQE : n;
+}
+
+// can a worker take a submission? caller holds u->lock.
+static int
+uringready(struct uringctl *u)
+{
+  return uringpending(u) > 0 && uringdone(u) + u->inflight < NCQE;
+}
+
+// carry out e for the current process, and return the result.
+static int
+uringop(struct sqe *e)
+{
+  struct proc *g = myproc()->leader;
+  struct file *f = 0;
+  int r = -1;
+
+  if(e->fd < 0 || e->fd >= NOFILE)
+    return -1;
+  // keep f open even if the process close()s it meanwhile.
+  acquire(&g->tglock);
+  if((f = g->ofile[e->fd]) != 0)
+    filedup(f);
+  release(&g->tglock);
+  if(f == 0)
+    return -1;
+
+  switch(e->op){
+  case UR_READ:
+    r = fileread(f, 1, e->addr, e->len);
+    break;
+  case UR_WRITE:
+    r = filewrite(f, 1, e->addr, e->len);
+    break;
+  case UR_PREAD:
+    r = filepread(f, e->addr, e->len, e->off);
+    break;
+  case UR_PWRITE:
+    r = filepwrite(f, e->addr, e->len, e->off);
+    break;
+  }
+  fileclose(f);
+  return r;
+}
+
+static void
+uringworker(void *arg)
+{
+  struct uringctl *u = arg;
+  struct proc *p = myproc();
+  struct sqe e;
+  struct cqe *c;
+  int r;
+
+  for(;;){
+    acquire(&u->lock);
+    while(!p->killed && !uringready(u))
+      sleep(u, &u->lock);
+    if(p->killed){
+      u->nworker--;
+      release(&u->lock);
+      exit(0);
+    }
+    e = u->ring->sq[u->sqhead % NSQE];
+    u->sqhead++;
+    __atomic_store_n(&u->ring->sqhead, u->sqhead, __ATOMIC_RELEASE);
+    u->inflight++;
+    // another worker may be able to take the next one.
+    if(uringready(u))
+      wakeup(u);
+    release(&u->lock);
+
+    r = uringop(&e);
+
+    acquire(&u->lock);
+    c = &u->ring->cq[u->cqtail % NCQE];
+    c->data = e.data;
+    c->res = r;
+    u->cqtail++;
+    __atomic_store_n(&u->ring->cqtail, u->cqtail, __ATOMIC_RELEASE);
+    u->inflight--;
+    wakeup(&u->cqtail);
+    release(&u->lock);
+  }
+}
+
+// map the current process's rings at URING, and return that
+// address, or -1 if it has them already.
+uint64
+uringsetup(void)
+{
+  struct proc *g = myproc()->leader;
+  struct uringctl *u;
+  char *pa;
+
+  if((u = kmalloc(sizeof(*u))) == 0)
+    return -1;
+  if((pa = kalloc_zeroed()) == 0){
+    kmfree(u);
+    return -1;
+  }
+  initlock(&u->lock, "uring");
+  u->ring = (struct uring *)pa;
+  u->sqhead = u->cqtail = 0;
+  u->inflight = u->nworker = 0;
+
+  acquire(&g->tglock);
+  if(g->uring || mappages(g->pagetable, URING, PGSIZE, (uint64)pa,
+                          PTE_R | PTE_W | PTE_U) < 0){
+    release(&g->tglock);
+    kfree(pa);
+    kmfree(u);
+    return -1;
+  }
+  g->uring = u;
+  release(&g->tglock);
+  return URING;
+}
+
+// start on the submissions queued so far, and wait until at
+// least min completions are ready. returns how many are, or
+// -1 if the process has no rings.
+int
+uringenter(int min)
+{
+  struct proc *p = myproc();
+  struct uringctl *u = p->leader->uring;
+  int need, n;
+
+  if(u == 0)
+    return -1;
+  if(min > NCQE)
+    min = NCQE;
+
+  // enough workers for what's queued, counting idle ones.
+  acquire(&u->lock);
+  need = uringpending(u) - (u->nworker - u->inflight);
+  if(need > NURINGWORKER - u->nworker)
+    need = NURINGWORKER - u->nworker;
+  if(need > 0)
+    u->nworker += need;
+  release(&u->lock);
+  for(; need > 0; need--){
+    if(kthread_clone(uringworker, u, "uring") < 0){
+      acquire(&u->lock);
+      u->nworker -= need;
+      release(&u->lock);
+      break;
+    }
+  }
+
+  acquire(&u->lock);
+  wakeup(u);
+  while(uringdone(u) < min && !p->killed)
+    sleep(&u->cqtail, &u->lock);
+  n = uringdone(u);
+  release(&u->lock);
+  return n;
+}
+
+// free p's rings once its workers are gone; for exit() and
+// exec(). p is a leader with no other threads.
+void
+uringfree(struct proc *p)
+{
+  struct uringctl *u = p->uring;
+
+  if(u == 0)
+    return;
+  p->uring = 0;
+  uvmunmap(p->pagetable, URING, 1, 1);
+  kmfree(u);
+}
@@ -0,0 +1,40 @@
+// async I/O rings, in a page shared by a process and the
+// kernel; see uring.c, and uring_setup() and uring_enter().
+
+#define UR_READ    1    // read(fd, addr, len)
+#define UR_WRITE   2    // write(fd, addr, len)
+#define UR_PREAD   3    // pread(fd, addr, len, off)
+#define UR_PWRITE  4    // pwrite(fd, addr, len, off)
+
+#define NSQE 64         // submission ring entries
+#define NCQE 64         // completion ring entries
+
+// a submission: one operation.
+struct sqe {
+  int op;
+  int fd;
+  uint64 addr;
+  uint len;
+  uint off;
+  uint64 data;          // for the caller; copied to its cqe
+};
+
+// a completion.
+struct cqe {
+  uint64 data;
+  int res;              // what the system call would have returned
+  uint pad;
+};
+
+// the page at URING. the process fills sq[sqtail % NSQE] and
+// then advances sqtail, and advances cqhead past completions
+// it has used; the kernel advances sqhead and cqtail. the
+// indices only ever grow.
+struct uring {
+  uint sqhead;
+  uint sqtail;
+  uint cqhead;
+  uint cqtail;
+  struct sqe sq[NSQE];
+  struct cqe cq[NCQE];
+};
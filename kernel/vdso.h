@@ -0,0 +1,20 @@
+// read-only pages that the kernel maps into every process,
+// so that user code can read these without a system call.
+// see memlayout.h for where, and user/ulib.c for the readers.
+
+// at VCLOCK: the same page in every process, updated by
+// clockintr(). seq is odd while an update is in progress.
+struct vclock {
+  uint seq;
+  uint ticks;     // as returned by uptime()
+  uint64 mtime;   // the time CSR at the last tick
+};
+
+// at VPROC: one page per process, shared by its threads, so
+// it describes the leader. while threads is set, the readers
+// can't tell which thread is asking and ask the kernel.
+struct vproc {
+  int pid;        // the thread group leader's
+  int cpu;        // the CPU the leader last returned to user space on
+  int threads;    // the leader has clone()d threads
+};
@@ -44,8 +44,9 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that the
+// descriptors and the avail ring fit in one page.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,6 +57,10 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
+
+// most blocks one request covers.
+#define MAXSEG 16
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
@@ -16,6 +16,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "trace.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
@@ -56,18 +57,32 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int indirect;    // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+
+  // bufs started but not yet given to the device; kick() sorts
+  // them and turns each run of consecutive blocks in the same
+  // direction into one request.
+  struct {
+    struct buf *b;
+    int write;
+  } pend[NUM];
+  int npend;
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;  // first of the request's bufs, linked by qnext
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // with indirect descriptors, a request takes one ring
+  // descriptor, pointing at its chain here.
+  struct virtq_desc ind[NUM][MAXSEG+2];
   
   struct spinlock vdisk_lock;
   
@@ -101,7 +116,7 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -184,12 +199,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,30 +214,53 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// the length of the run of consecutive blocks, in the same
+// direction, at the start of disk.pend[].
+static int
+run(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  int n;
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
+  for(n = 1; n < disk.npend && n < MAXSEG; n++){
+    if(disk.pend[n].write != disk.pend[0].write ||
+       disk.pend[n].b->blockno != disk.pend[n-1].b->blockno + 1)
       break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
   }
+  return n;
+}
+
+// turn the first n bufs in disk.pend[] into one request in
+// the avail ring, or return -1 if there aren't enough free
+// descriptors. virtio_disk_intr() frees its descriptors when
+// it completes. caller holds vdisk_lock.
+static int
+submit(int n)
+{
+  int write = disk.pend[0].write;
+  uint64 sector = disk.pend[0].b->blockno * (BSIZE / 512);
+  struct virtq_desc *d;
+  int idx[MAXSEG+2], head, i;
 
-  // format the three descriptors.
+  // the spec's Section 5.2 says that legacy block operations use
+  // a descriptor for type/reserved/sector, then the data, then
+  // one for a 1-byte status result. the data may be split over
+  // several descriptors, here one per buf.
+
+  if(alloc_descs(idx, disk.indirect ? 1 : n+2) < 0)
+    return -1;
+  head = idx[0];
+  if(disk.indirect){
+    // the chain is in disk.ind[head], numbered from 0.
+    d = disk.ind[head];
+    for(i = 0; i < n+2; i++)
+      idx[i] = i;
+  } else
+    d = disk.desc;
+
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,50 +269,156 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
+
+  for(i = 0; i < n; i++){
+    struct buf *b = disk.pend[i].b;
+    d[idx[i+1]].addr = (uint64) b->data;
+    d[idx[i+1]].len = BSIZE;
+    if(write)
+      d[idx[i+1]].flags = 0; // device reads b->data
+    else
+      d[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    d[idx[i+1]].next = idx[i+2];
+    b->qnext = i+1 < n ? disk.pend[i+1].b : 0;
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.info[head].status = 0xff; // device writes 0 on success
+  d[idx[n+1]].addr = (uint64) &disk.info[head].status;
+  d[idx[n+1]].len = 1;
+  d[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[n+1]].next = 0;
+
+  if(disk.indirect){
+    disk.desc[head].addr = (uint64) d;
+    disk.desc[head].len = (n+2) * sizeof(struct virtq_desc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for virtio_disk_intr().
+  disk.info[head].b = disk.pend[0].b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % NUM] = head;
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
+  // another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  return 0;
+}
 
-  __sync_synchronize();
+// turn the started bufs into requests, and tell the device
+// about them all with one register write.
+// caller holds vdisk_lock.
+static void
+kick(void)
+{
+  int i, j, n, added = 0;
+
+  while(disk.npend > 0){
+    // sort by block number, so that runs are adjacent.
+    // there is at most one pending request per buf, since
+    // each buf is locked until its request completes.
+    for(i = 1; i < disk.npend; i++){
+      struct buf *b = disk.pend[i].b;
+      int w = disk.pend[i].write;
+      for(j = i; j > 0 && disk.pend[j-1].b->blockno > b->blockno; j--)
+        disk.pend[j] = disk.pend[j-1];
+      disk.pend[j].b = b;
+      disk.pend[j].write = w;
+    }
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+    n = run();
+    if(submit(n) < 0){
+      // let some complete and free their descriptors. someone
+      // else may submit disk.pend[] meanwhile, so start over.
+      if(added){
+        __sync_synchronize();
+        *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+        added = 0;
+      }
+      sleep(&disk.free[0], &disk.vdisk_lock);
+      continue;
+    }
+    added = 1;
+    disk.npend -= n;
+    memmove(disk.pend, disk.pend + n, disk.npend * sizeof(disk.pend[0]));
+  }
+
+  if(added){
+    __sync_synchronize();
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  }
+}
+
+// add b to the bufs for the next kick().
+// caller holds vdisk_lock.
+static void
+start(struct buf *b, int write)
+{
+  if(disk.npend == NUM)
+    kick();
+  TRACE(TR_DISKSUB, b->blockno, write);
+  b->disk = 1;
+  disk.pend[disk.npend].b = b;
+  disk.pend[disk.npend].write = write;
+  disk.npend++;
+}
+
+// Read or write b, and wait for it.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  start(b, write);
+  kick();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&disk.vdisk_lock);
+}
+
+// Start reading or writing b, and return without waiting.
+// The device isn't told until virtio_disk_kick() or
+// virtio_disk_wait(), so that a batch of requests costs one
+// notification, and bufs for consecutive blocks can share a
+// request. If b->async is set, virtio_disk_intr() hands b
+// to bdone() when it's done; otherwise wait for it with
+// virtio_disk_wait().
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  start(b, write);
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
 
+// Wait for b's request from virtio_disk_start() to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
@@ -295,7 +438,8 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // adds an entry to the used ring. there may be many
+  // requests in flight, and many done by now.
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
@@ -304,9 +448,19 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].b, *nb;
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = nb){
+      nb = b->qnext;
+      TRACE(TR_DISKDONE, b->blockno, 0);
+      b->disk = 0;   // disk is done with buf
+      if(b->async){
+        b->async = 0;
+        bdone(b);
+      } else
+        wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
@@ -14,17 +14,34 @@
 pagetable_t kernel_pagetable;
 
 extern char etext[];  // kernel.ld sets this to end of kernel code.
+extern char end[];    // and this to the first address after the kernel.
 
 extern char trampoline[]; // trampoline.S
 
+// Address-space IDs (ASIDs) let the TLB hold translations for
+// several page tables at once, so that traps needn't flush it
+// when they switch between the kernel's page table, which has
+// ASID 0, and a process's. A process takes the next ASID when
+// it returns to user space without one of the current
+// generation; when they run out, a new generation starts, and
+// each CPU flushes its whole TLB before it uses an ASID of the
+// new one. A CPU also flushes a process's ASID before running
+// it if its page table has changed since (uvmstale()).
+static struct {
+  struct spinlock lock;
+  uint64 gen;
+  int next;
+} asids;
+
+static int asidmax; // the largest ASID; 0 if the hardware has none
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -43,6 +60,11 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // the CLINT's MSIP registers, for ipi(), and its MTIMECMP
+  // registers, for hrtimer.c.
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, CLINT_MTIMECMP(0), CLINT_MTIMECMP(0), PGSIZE, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -64,6 +86,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asids.lock, "asids");
+  asids.gen = 1;
+  asids.next = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -71,10 +96,83 @@ kvminit(void)
 void
 kvminithart()
 {
+  if(cpuid() == 0){
+    // the ASID field keeps only as many bits as there are.
+    w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+    asidmax = SATP2ASID(r_satp());
+  }
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
+// The satp for p's user page table, with p's ASID, for
+// usertrapret() to return to p on this CPU. First flushes
+// whatever TLB entries of p's ASID may be stale here, and tells
+// trampoline.S whether it must flush the TLB on every switch
+// instead. Called with interrupts off. Threads use their
+// leader's ASID, and may run on several CPUs at once, so
+// tlbstale is updated atomically.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *g = p->leader;
+  uint64 me = 1L << cpuid();
+  uint64 stale;
+
+  p->trapframe->kernel_flush = (asidmax == 0);
+  if(asidmax == 0)
+    return MAKE_SATP(p->pagetable);
+
+  if(g->asidgen != __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE)){
+    acquire(&asids.lock);
+    if(g->asidgen != asids.gen){
+      if(asids.next > asidmax){
+        asids.gen++;
+        asids.next = 1;
+      }
+      g->asid = asids.next++;
+      g->asidgen = asids.gen;
+      g->tlbstale = 0; // no CPU has used it this generation
+    }
+    release(&asids.lock);
+  }
+  stale = __atomic_fetch_and(&g->tlbstale, ~me, __ATOMIC_ACQ_REL);
+  if(c->asidgen != g->asidgen){
+    sfence_vma();
+    c->asidgen = g->asidgen;
+  } else if(stale & me){
+    sfence_vma_asid(g->asid);
+  }
+  return MAKE_SATP(p->pagetable) | SATP_ASID(g->asid);
+}
+
+// pagetable's PTEs have changed. If it's the current process's,
+// every CPU that may have cached them, this one included, must
+// flush p's ASID before running it again. Another thread
+// running on another CPU only notices at its next trap.
+void
+uvmstale(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    __atomic_store_n(&p->leader->tlbstale, ~0L, __ATOMIC_RELEASE);
+}
+
+// the lock that keeps the other threads sharing pagetable, if
+// it's the current process's, from changing its PTEs at the
+// same time; or 0.
+static struct spinlock *
+ptlock(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    return &p->leader->tglock;
+  return 0;
+}
+
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
@@ -88,24 +186,35 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+//
+// walkto() stops at the PTE in the page-table page of the given
+// level; walk() goes down to level 0. Both return a leaf PTE
+// they meet on the way, i.e. a megapage of the kernel's.
+static pte_t *
+walkto(pagetable_t pagetable, uint64 va, int alloc, int stop)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > stop; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(stop, va)];
+}
+
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walkto(pagetable, va, alloc, 0);
 }
 
 // Look up a virtual address, return the physical address,
@@ -121,6 +230,9 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
 
   pte = walk(pagetable, va, 0);
+  if((pte == 0 || (*pte & PTE_V) == 0) &&
+     (lazyfault(pagetable, va) == 0 || mmapfault(pagetable, va, 0) == 0))
+    pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -131,14 +243,73 @@ walkaddr(pagetable_t pagetable, uint64 va)
   return pa;
 }
 
+// Map a page of zeroes at va, if it's in heap that sbrk() has
+// grown the current process into but nothing has touched yet:
+// below p->sz, and unmapped. Pages of a program that exec()
+// hasn't read in yet come from the file instead. Returns 0 if
+// it did.
+int
+lazyfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct execseg *s;
+  pte_t *pte;
+  char *mem;
+  int r;
+
+  if(p == 0 || pagetable != p->pagetable || va >= p->leader->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1; // e.g. the stack guard page
+  if((s = execseg(p->leader, va)) != 0)
+    return execfault(pagetable, s, va); // part of the program
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  // another thread may have shrunk the heap, or mapped the
+  // page, in the meantime.
+  acquire(&p->leader->tglock);
+  r = -1;
+  if(va < p->leader->sz){
+    pte = walk(pagetable, va, 0);
+    if(pte && (*pte & PTE_V))
+      r = 1;
+    else
+      r = mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U);
+  }
+  release(&p->leader->tglock);
+  if(r != 0)
+    kfree(mem);
+  return r < 0 ? -1 : 0;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// the parts of the range that are 2-megabyte aligned both in
+// va and pa are mapped with megapages, which takes fewer
+// page-table pages and TLB entries than 512 pages each.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  pte_t *pte;
+  uint64 n;
+
+  while(sz > 0){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && sz >= SUPERPGSIZE){
+      if((pte = walkto(kpgtbl, va, 1, 1)) == 0 || (*pte & PTE_V))
+        panic("kvmmap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      n = SUPERPGSIZE;
+    } else {
+      n = sz < PGSIZE ? sz : PGSIZE;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -164,36 +335,50 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+  uvmstale(pagetable); // the TLB may have cached the invalid PTEs
+  return 0;
+}
+
+// n pages of pagetable's have been unmapped: make sure no CPU
+// can still reach them through its TLB, then free them.
+static int
+uvmflush(pagetable_t pagetable, void **batch, int n)
+{
+  uvmstale(pagetable);
+  tlbshootdown(pagetable);
+  for(int i = 0; i < n; i++)
+    kfree(batch[i]);
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped, such as the
+// untouched parts of a lazily grown heap, are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
+  void *batch[TLBBATCH];
   uint64 a;
   pte_t *pte;
+  int n = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0) {
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
-    }
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(n == TLBBATCH)
+        n = uvmflush(pagetable, batch, n);
+      batch[n++] = (void*)PTE2PA(*pte);
     }
     *pte = 0;
   }
+  uvmflush(pagetable, batch, n);
 }
 
 // create an empty user page table.
@@ -202,10 +387,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -220,8 +404,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -239,12 +422,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -314,30 +496,73 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue; // not touched since sbrk()
+    // share the page; a writable one becomes read-only and
+    // copy-on-write in both, and cowfault() copies it on the
+    // first store.
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
+  uvmstale(old);
   return 0;
 
  err:
+  uvmstale(old);
   uvmunmap(new, 0, i / PGSIZE, 1);
   return -1;
 }
 
+// Give the process a private, writable copy of the
+// copy-on-write page at va, or make the page writable if
+// nothing else shares it any more. Returns -1 if va isn't a
+// copy-on-write page, or there's no memory for the copy.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  struct spinlock *lk = ptlock(pagetable);
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+  int r = -1;
+
+  if(va >= MAXVA)
+    return -1;
+  if(lk)
+    acquire(lk);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & (PTE_V|PTE_U|PTE_W|PTE_COW)) == (PTE_V|PTE_U|PTE_W)){
+    r = 0; // another thread got here first
+    goto out;
+  }
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    goto out;
+  pa = PTE2PA(*pte);
+  if(krefs((void*)pa) == 1){
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+  } else {
+    if((mem = kalloc()) == 0)
+      goto out;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W);
+    kfree((void*)pa);
+  }
+  uvmstale(pagetable);
+  tlbshootdown(pagetable); // other threads may hold the old page
+  r = 0;
+ out:
+  if(lk)
+    release(lk);
+  return r;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -358,12 +583,24 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    // the page must be user-writable, once any copy-on-write
+    // sharing is broken; some user pages, such as zero-copy
+    // receive buffers, are read-only.
+    pte = walk(pagetable, va0, 0);
+    if((pte == 0 || (*pte & PTE_V) == 0 || (*pte & (PTE_W|PTE_COW)) == 0) &&
+       (lazyfault(pagetable, va0) == 0 || mmapfault(pagetable, va0, 1) == 0))
+      pte = walk(pagetable, va0, 0);
+    if(pte && (*pte & PTE_COW) && cowfault(pagetable, va0) < 0)
       return -1;
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W))
+      return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -376,6 +613,68 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
+// Fault in the user pages of [va, va+len) as copyout() (if
+// write) or copyin() would, before the caller takes a lock that
+// a fault can't sleep under, such as a pipe's spin lock. A page
+// can go again (munmap() by another thread, say), and then the
+// copy fails rather than sleep. Returns 0, or -1 if some page
+// can't be faulted in.
+int
+uvmfaultin(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 va0;
+  pte_t *pte;
+
+  for(va0 = PGROUNDDOWN(va); va0 < va + len; va0 += PGSIZE){
+    if(va0 >= MAXVA)
+      return -1;
+    if(write){
+      pte = walk(pagetable, va0, 0);
+      if((pte == 0 || (*pte & PTE_V) == 0 || (*pte & (PTE_W|PTE_COW)) == 0) &&
+         (lazyfault(pagetable, va0) == 0 || mmapfault(pagetable, va0, 1) == 0))
+        pte = walk(pagetable, va0, 0);
+      if(pte && (*pte & PTE_COW) && cowfault(pagetable, va0) < 0)
+        return -1;
+      if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W))
+        return -1;
+    } else if(walkaddr(pagetable, va0) == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Pin the user page holding va, faulting it in first as
+// copyout() (if write) or copyin() would, so that a device can
+// DMA to or from it while the caller sleeps: returns va's
+// physical address, with a reference to its page that kfree()
+// drops, or 0. Pages that aren't ordinary memory, such as
+// device registers mapped by netbypass(), can't be pinned.
+uint64
+uvmpin(pagetable_t pagetable, uint64 va, int write)
+{
+  struct spinlock *lk = ptlock(pagetable);
+  uint64 va0 = PGROUNDDOWN(va), pa = 0;
+  pte_t *pte;
+  int need = PTE_V|PTE_U|(write ? PTE_W : 0);
+
+  if(uvmfaultin(pagetable, va0, 1, write) < 0)
+    return 0;
+
+  // another thread may unmap the page meanwhile.
+  if(lk)
+    acquire(lk);
+  pte = walk(pagetable, va0, 0);
+  if(pte && (*pte & need) == need){
+    pa = PTE2PA(*pte);
+    if((char*)pa >= end && pa < PHYSTOP)
+      kdup((void*)pa);
+    else
+      pa = 0;
+  }
+  if(lk)
+    release(lk);
+  return pa ? pa + (va - va0) : 0;
+}
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
@@ -0,0 +1,28 @@
+#
+# host side of user/netbench: echoes each datagram back to its
+# sender, except that datagrams starting with "sink" are just
+# dropped, and "blast <n> <size>" asks for n datagrams of size
+# bytes, as fast as they can be sent.
+#
+import socket
+import sys
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+addr = ('localhost', int(sys.argv[1]))
+print('netbench listening on %s port %s' % addr, file=sys.stderr)
+sock.bind(addr)
+
+while True:
+    buf, raddr = sock.recvfrom(65536)
+    if buf.startswith(b'sink'):
+        continue
+    if buf.startswith(b'blast '):
+        n, size = [int(x) for x in buf.split()[1:3]]
+        out = bytes(size)
+        for i in range(n):
+            sock.sendto(out, raddr)
+        print('blasted %d x %d bytes to %s:%d' % (n, size, raddr[0], raddr[1]),
+              file=sys.stderr)
+    else:
+        sock.sendto(buf, raddr)
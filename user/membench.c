@@ -0,0 +1,102 @@
+//
+// membench: how fast the kernel moves memory.
+//
+// times read()s of a file that's in the buffer cache (bread,
+// then memmove() to copy out), with buffers aligned and not,
+// and growing and touching the heap (kalloc()'s memset()s).
+// compare the rates from two kernels.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILESZ (64*1024)
+#define ROUNDS 64
+#define HEAPSZ (8*1024*1024)
+
+static char buf[FILESZ + 8];
+
+// the time CSR, which counts at 10 MHz in qemu.
+static uint64
+rdtime(void)
+{
+  uint64 t;
+  asm volatile("rdtime %0" : "=r" (t));
+  return t;
+}
+
+static void
+rate(char *what, uint64 bytes, uint64 t0, uint64 t1)
+{
+  uint64 us = (t1 - t0) / 10;
+
+  if(us == 0)
+    us = 1;
+  printf("%s: %l bytes in %l us: %l KB/s\n", what, bytes, us,
+         bytes * 1000000 / 1024 / us);
+}
+
+// read the file into buf + off, ROUNDS times.
+static void
+readbench(char *what, int off, int chunk)
+{
+  uint64 t0, t1;
+  int fd, i, n;
+
+  t0 = rdtime();
+  for(i = 0; i < ROUNDS; i++){
+    if((fd = open("membench.tmp", O_RDONLY)) < 0){
+      fprintf(2, "membench: open failed\n");
+      exit(1);
+    }
+    for(n = 0; n < FILESZ; n += chunk)
+      if(read(fd, buf + off + n, chunk) != chunk){
+        fprintf(2, "membench: read failed\n");
+        exit(1);
+      }
+    close(fd);
+  }
+  t1 = rdtime();
+  rate(what, (uint64)ROUNDS * FILESZ, t0, t1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 t0, t1;
+  char *p;
+  int fd, i;
+
+  if((fd = open("membench.tmp", O_CREATE|O_WRONLY)) < 0){
+    fprintf(2, "membench: create failed\n");
+    exit(1);
+  }
+  memset(buf, 'x', FILESZ);
+  if(write(fd, buf, FILESZ) != FILESZ){
+    fprintf(2, "membench: write failed\n");
+    exit(1);
+  }
+  close(fd);
+
+  readbench("read, aligned", 0, 4096);
+  readbench("read, misaligned", 3, 4096);
+  readbench("read, 128-byte pieces", 0, 128);
+
+  t0 = rdtime();
+  for(i = 0; i < 4; i++){
+    if((p = sbrk(HEAPSZ)) == (char*)-1){
+      fprintf(2, "membench: sbrk failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < HEAPSZ; j += 4096)
+      p[j] = 1;
+    sbrk(-HEAPSZ);
+  }
+  t1 = rdtime();
+  rate("heap pages", 4 * (uint64)HEAPSZ, t0, t1);
+
+  unlink("membench.tmp");
+  exit(0);
+}
@@ -0,0 +1,332 @@
+//
+// netbench: throughput and latency of the network stack.
+//
+// run "make benchserver" on the host (netbench.py), then
+// "netbench" in xv6. "netbench -l" runs against an echo
+// server forked inside xv6 on 127.0.0.1 instead, to measure
+// the stack without the e1000.
+//
+
+#include "kernel/types.h"
+#include "kernel/net.h"
+#include "kernel/stat.h"
+#include "kernel/socket.h"
+#include "kernel/poll.h"
+#include "user/user.h"
+
+#define SPORT     3000   // first local port used
+#define NBATCH    16     // datagrams per sendmmsg()/recvmmsg()
+#define NLAT      500    // round trips for the latency test
+#define NFAN      4      // processes in the fan-out test
+#define FANROUNDS 200    // round trips per fan-out process
+#define TIMEOUT   10     // ticks to wait for a reply
+
+static uint32 dst;
+static uint16 dport;
+
+static char buf[NBATCH][2048];
+static char big[8192];
+static int rtt[NLAT];
+
+// the time CSR, which counts at 10 MHz in qemu.
+static uint64
+rdtime(void)
+{
+  uint64 t;
+  asm volatile("rdtime %0" : "=r" (t));
+  return t;
+}
+
+static int
+usec(uint64 t0, uint64 t1)
+{
+  return (t1 - t0) / 10;
+}
+
+static int
+sock(uint16 sport)
+{
+  int fd;
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "netbench: connect() failed\n");
+    exit(1);
+  }
+  setsockopt(fd, SO_TXBLOCK, 1);
+  setsockopt(fd, SO_RCVBUF, 256*4096);
+  return fd;
+}
+
+// wait for fd to become readable; returns 0 on timeout.
+static int
+waitin(int fd, int ticks)
+{
+  struct pollfd p;
+
+  p.fd = fd;
+  p.events = POLLIN;
+  p.revents = 0;
+  return poll(&p, 1, ticks) > 0;
+}
+
+// prints n per us microseconds as a rate per second.
+static void
+rate(char *what, uint64 n, int us)
+{
+  if(us <= 0)
+    us = 1;
+  printf(" %l %s/s", n * 1000000 / us, what);
+}
+
+//
+// send n datagrams of size bytes as fast as the stack allows;
+// the server discards them.
+//
+static void
+txbench(int size, int n)
+{
+  struct mmsg mm[NBATCH];
+  char *p;
+  int fd, i, k, sent;
+  uint64 t0, t1;
+
+  fd = sock(SPORT);
+  p = size > sizeof(buf[0]) ? big : buf[0];
+  memmove(p, "sink", 4);
+  for(i = 0; i < NBATCH; i++){
+    mm[i].buf = (uint64)p;
+    mm[i].len = size;
+  }
+
+  sent = 0;
+  t0 = rdtime();
+  while(sent < n){
+    k = n - sent < NBATCH ? n - sent : NBATCH;
+    if((k = sendmmsg(fd, mm, k)) <= 0){
+      fprintf(2, "netbench: sendmmsg() failed\n");
+      exit(1);
+    }
+    sent += k;
+  }
+  t1 = rdtime();
+  close(fd);
+
+  printf("tx %d bytes: %d datagrams in %d us:", size, sent, usec(t0, t1));
+  rate("pkts", sent, usec(t0, t1));
+  rate("bytes", (uint64)sent * size, usec(t0, t1));
+  printf("\n");
+}
+
+//
+// have the server send n datagrams of size bytes, and count
+// how many arrive, from the first to the last.
+//
+static void
+rxbench(int size, int n)
+{
+  struct mmsg mm[NBATCH];
+  char req[32], *p;
+  int fd, i, k, got;
+  uint64 t0, t1;
+
+  fd = sock(SPORT);
+  for(i = 0; i < NBATCH; i++){
+    mm[i].buf = (uint64)buf[i];
+    mm[i].len = sizeof(buf[i]);
+  }
+  if(size > sizeof(buf[0])){
+    mm[0].buf = (uint64)big;
+    mm[0].len = sizeof(big);
+  }
+
+  // "blast <n> <size>"
+  strcpy(req, "blast ");
+  p = req + strlen(req);
+  for(i = 1000000; i > 0; i /= 10)
+    if(n >= i || i == 1)
+      *p++ = '0' + (n / i) % 10;
+  *p++ = ' ';
+  for(i = 1000000; i > 0; i /= 10)
+    if(size >= i || i == 1)
+      *p++ = '0' + (size / i) % 10;
+  *p = 0;
+  if(write(fd, req, strlen(req)) < 0){
+    fprintf(2, "netbench: write() failed\n");
+    exit(1);
+  }
+
+  got = 0;
+  t0 = t1 = 0;
+  while(got < n && waitin(fd, TIMEOUT)){
+    // big datagrams one at a time, into big.
+    k = recvmmsg(fd, mm, size > sizeof(buf[0]) ? 1 : NBATCH);
+    if(k <= 0)
+      break;
+    if(got == 0)
+      t0 = rdtime();
+    got += k;
+    t1 = rdtime();
+  }
+  close(fd);
+
+  printf("rx %d bytes: %d/%d datagrams in %d us:", size, got, n, usec(t0, t1));
+  rate("pkts", got, usec(t0, t1));
+  rate("bytes", (uint64)got * size, usec(t0, t1));
+  printf("\n");
+}
+
+// round trips of a small datagram over fd; fills in out[]
+// (if it isn't 0) with their times in microseconds. returns
+// the number that came back.
+static int
+pingpong(int fd, int n, int *out)
+{
+  char msg[64];
+  uint64 t0;
+  int i, ok = 0;
+
+  memset(msg, 'x', sizeof(msg));
+  for(i = 0; i < n; i++){
+    t0 = rdtime();
+    if(write(fd, msg, sizeof(msg)) != sizeof(msg))
+      break;
+    if(!waitin(fd, TIMEOUT) || read(fd, buf[0], sizeof(buf[0])) != sizeof(msg))
+      continue; // lost
+    if(out)
+      out[ok] = usec(t0, rdtime());
+    ok++;
+  }
+  return ok;
+}
+
+static void
+latbench(void)
+{
+  int fd, n, i, j, t;
+
+  fd = sock(SPORT);
+  n = pingpong(fd, NLAT, rtt);
+  close(fd);
+  if(n == 0){
+    printf("latency: no replies\n");
+    return;
+  }
+
+  for(i = 1; i < n; i++){
+    t = rtt[i];
+    for(j = i; j > 0 && rtt[j-1] > t; j--)
+      rtt[j] = rtt[j-1];
+    rtt[j] = t;
+  }
+  printf("latency: %d/%d replies, us p50 %d p90 %d p99 %d max %d\n",
+         n, NLAT, rtt[n/2], rtt[n*9/10], rtt[n*99/100], rtt[n-1]);
+}
+
+//
+// NFAN processes, each with its own socket, doing round trips
+// at once; reports the aggregate rate.
+//
+static void
+fanbench(void)
+{
+  int i, pid, st, ok;
+  uint64 t0, t1;
+
+  t0 = rdtime();
+  for(i = 0; i < NFAN; i++){
+    if((pid = fork()) < 0){
+      fprintf(2, "netbench: fork() failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      int fd = sock(SPORT + 1 + i);
+      ok = pingpong(fd, FANROUNDS, 0);
+      close(fd);
+      exit(ok == FANROUNDS ? 0 : 1);
+    }
+  }
+  ok = 1;
+  for(i = 0; i < NFAN; i++){
+    wait(&st);
+    if(st != 0)
+      ok = 0;
+  }
+  t1 = rdtime();
+
+  printf("fan-out: %d processes x %d round trips in %d us%s:",
+         NFAN, FANROUNDS, usec(t0, t1), ok ? "" : " (some lost)");
+  rate("round trips", NFAN * FANROUNDS, usec(t0, t1));
+  printf("\n");
+}
+
+// for -l: the server's side of the protocol, on 127.0.0.1.
+static void
+echoserver(void)
+{
+  struct sockaddr from;
+  char *p, *q;
+  int fd, n, size, cc;
+
+  if((fd = bind(dport)) < 0){
+    fprintf(2, "netbench: bind() failed\n");
+    exit(1);
+  }
+  for(;;){
+    if((cc = recvfrom(fd, big, sizeof(big) - 1, &from)) < 0)
+      exit(1);
+    big[cc] = 0;
+    if(cc >= 4 && memcmp(big, "sink", 4) == 0)
+      continue;
+    if(cc > 6 && memcmp(big, "blast ", 6) == 0){
+      n = atoi(big + 6);
+      for(p = big + 6; *p && *p != ' '; p++)
+        ;
+      size = *p ? atoi(p + 1) : 0;
+      if(size > sizeof(big))
+        size = sizeof(big);
+      for(q = big; q < big + size; q++)
+        *q = 0;
+      while(n-- > 0)
+        sendto(fd, big, size, &from);
+      continue;
+    }
+    sendto(fd, big, cc, &from);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 64, 512, 1472, 8192 };
+  int i, lo = 0, server = 0;
+
+  dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  dport = NET_TESTS_PORT;
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-l") == 0)
+      lo = 1;
+    else
+      dport = atoi(argv[i]);
+  }
+
+  if(lo){
+    dst = (127 << 24) | 1;
+    if((server = fork()) == 0)
+      echoserver();
+    sleep(1); // let it bind
+  }
+
+  printf("netbench: %s port %d\n", lo ? "127.0.0.1" : "host", dport);
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+    txbench(sizes[i], sizes[i] > 1472 ? 500 : 2000);
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+    rxbench(sizes[i], sizes[i] > 1472 ? 100 : 500);
+  latbench();
+  fanbench();
+
+  if(server > 0){
+    kill(server);
+    wait(0);
+  }
+  exit(0);
+}
@@ -0,0 +1,30 @@
+// netstat: print the network statistics kept by the kernel.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+char buf[512];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n;
+
+  if((fd = open("netstats", O_RDONLY)) < 0){
+    mknod("netstats", NETSTATS, 0);
+    if((fd = open("netstats", O_RDONLY)) < 0){
+      fprintf(2, "netstat: cannot open netstats\n");
+      exit(1);
+    }
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(1, buf, n);
+  close(fd);
+  exit(0);
+}
@@ -1,6 +1,17 @@
 #include "kernel/types.h"
 #include "kernel/net.h"
 #include "kernel/stat.h"
+#include "kernel/socket.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/e1000_dev.h"
+#include "kernel/netbypass.h"
 #include "user/user.h"
 #include "user.h"
 
@@ -49,6 +60,608 @@ ping(uint16 sport, uint16 dport, int attempts)
   }
 }
 
+//
+// send a burst larger than the TX ring on a socket in
+// SO_TXBLOCK mode; every write should be accepted.
+//
+static void
+burst(uint16 sport, uint16 dport, int n)
+{
+  int fd;
+  char *obuf = "a message from xv6!";
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "burst: connect() failed\n");
+    exit(1);
+  }
+  if(setsockopt(fd, SO_TXBLOCK, 1) < 0){
+    fprintf(2, "burst: setsockopt() failed\n");
+    exit(1);
+  }
+
+  for(int i = 0; i < n; i++) {
+    if(write(fd, obuf, strlen(obuf)) != strlen(obuf)){
+      fprintf(2, "burst: send() failed\n");
+      exit(1);
+    }
+  }
+
+  char ibuf[128];
+  int cc = read(fd, ibuf, sizeof(ibuf)-1);
+  if(cc < 0){
+    fprintf(2, "burst: recv() failed\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+//
+// ping, but receive the reply with recvzc() instead of read().
+//
+static void
+zcping(uint16 sport, uint16 dport)
+{
+  int fd;
+  char *obuf = "a message from xv6!";
+  char *reply = "this is the host!";
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  struct zcbuf zb;
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "zcping: connect() failed\n");
+    exit(1);
+  }
+  if(write(fd, obuf, strlen(obuf)) < 0){
+    fprintf(2, "zcping: send() failed\n");
+    exit(1);
+  }
+  if(recvzc(fd, &zb) < 0){
+    fprintf(2, "zcping: recvzc() failed\n");
+    exit(1);
+  }
+  if(zb.len != strlen(reply) || memcmp((char*)zb.addr, reply, zb.len) != 0){
+    fprintf(2, "zcping didn't receive correct payload\n");
+    exit(1);
+  }
+  // the buffer is read-only to us, even via the kernel.
+  int p[2];
+  if(pipe(p) < 0 || write(p[1], "x", 1) != 1){
+    fprintf(2, "zcping: pipe() failed\n");
+    exit(1);
+  }
+  if(read(p[0], (char*)zb.addr, 1) == 1){
+    fprintf(2, "zcping: buffer is writable\n");
+    exit(1);
+  }
+  close(p[0]);
+  close(p[1]);
+  if(zcfree((char*)zb.addr) < 0 || zcfree((char*)zb.addr) == 0){
+    fprintf(2, "zcping: zcfree() misbehaved\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+//
+// send a batch of pings with one sendmmsg() and collect
+// the replies with recvmmsg().
+//
+static void
+mmsgping(uint16 sport, uint16 dport, int n)
+{
+  int fd, got, cc;
+  char *obuf = "a message from xv6!";
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  struct mmsg msgs[8];
+  char ibuf[8][128];
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "mmsgping: connect() failed\n");
+    exit(1);
+  }
+  setsockopt(fd, SO_TXBLOCK, 1);
+
+  for(int i = 0; i < n; i++){
+    msgs[i].buf = (uint64)obuf;
+    msgs[i].len = strlen(obuf);
+  }
+  if(sendmmsg(fd, msgs, n) != n){
+    fprintf(2, "mmsgping: sendmmsg() failed\n");
+    exit(1);
+  }
+
+  for(got = 0; got < n; got += cc){
+    for(int i = 0; i < n; i++){
+      msgs[i].buf = (uint64)ibuf[i];
+      msgs[i].len = sizeof(ibuf[i]) - 1;
+    }
+    if((cc = recvmmsg(fd, msgs, n - got)) <= 0){
+      fprintf(2, "mmsgping: recvmmsg() failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < cc; i++){
+      ibuf[i][msgs[i].len] = '\0';
+      if(strcmp(ibuf[i], "this is the host!") != 0){
+        fprintf(2, "mmsgping didn't receive correct payload\n");
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+}
+
+//
+// with room for only one datagram, further replies are
+// dropped and counted rather than queued.
+//
+static void
+rcvbuf(uint16 sport, uint16 dport)
+{
+  int fd;
+  char *obuf = "a message from xv6!";
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  char ibuf[128];
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "rcvbuf: connect() failed\n");
+    exit(1);
+  }
+  if(setsockopt(fd, SO_RCVBUF, 4096) < 0 || getsockopt(fd, SO_RCVBUF) != 4096){
+    fprintf(2, "rcvbuf: SO_RCVBUF failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < 4; i++){
+    if(write(fd, obuf, strlen(obuf)) < 0){
+      fprintf(2, "rcvbuf: send() failed\n");
+      exit(1);
+    }
+  }
+  sleep(10); // let the replies arrive
+
+  if(read(fd, ibuf, sizeof(ibuf)) <= 0){
+    fprintf(2, "rcvbuf: recv() failed\n");
+    exit(1);
+  }
+  if(getsockopt(fd, SO_DROPS) != 3){
+    fprintf(2, "rcvbuf: expected 3 drops, got %d\n", getsockopt(fd, SO_DROPS));
+    exit(1);
+  }
+  close(fd);
+}
+
+//
+// send a datagram too big for one frame, which the kernel must
+// fragment, and check that the host put it back together
+// (it answers each datagram). one over the UDP limit must fail.
+//
+static void
+bigping(uint16 sport, uint16 dport, int len)
+{
+  static char obuf[UDP_MAXDATA + 1];
+  char ibuf[128];
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  int fd, cc;
+
+  for(int i = 0; i < sizeof(obuf); i++)
+    obuf[i] = 'a' + i % 26;
+
+  if((fd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "bigping: connect() failed\n");
+    exit(1);
+  }
+  setsockopt(fd, SO_TXBLOCK, 1);
+  if(write(fd, obuf, sizeof(obuf)) >= 0){
+    fprintf(2, "bigping: oversized write() succeeded\n");
+    exit(1);
+  }
+  if(write(fd, obuf, len) != len){
+    fprintf(2, "bigping: write() failed\n");
+    exit(1);
+  }
+  cc = read(fd, ibuf, sizeof(ibuf)-1);
+  if(cc < 0){
+    fprintf(2, "bigping: read() failed\n");
+    exit(1);
+  }
+  ibuf[cc] = '\0';
+  if(strcmp(ibuf, "this is the host!") != 0){
+    fprintf(2, "bigping didn't receive correct payload\n");
+    exit(1);
+  }
+  close(fd);
+}
+
+//
+// ping through a socket bound to sport, addressing each
+// message with sendto() and checking the reply's sender.
+//
+static void
+bindping(uint16 sport, uint16 dport, int attempts)
+{
+  int fd;
+  char *obuf = "a message from xv6!";
+  char ibuf[128];
+  struct sockaddr to, from;
+
+  to.addr = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+  to.port = dport;
+
+  if((fd = bind(sport)) < 0){
+    fprintf(2, "bindping: bind() failed\n");
+    exit(1);
+  }
+  if(write(fd, obuf, strlen(obuf)) >= 0){
+    fprintf(2, "bindping: write() without a peer succeeded\n");
+    exit(1);
+  }
+
+  for(int i = 0; i < attempts; i++) {
+    if(sendto(fd, obuf, strlen(obuf), &to) < 0){
+      fprintf(2, "bindping: sendto() failed\n");
+      exit(1);
+    }
+  }
+
+  memset(&from, 0, sizeof(from));
+  int cc = recvfrom(fd, ibuf, sizeof(ibuf)-1, &from);
+  if(cc < 0){
+    fprintf(2, "bindping: recvfrom() failed\n");
+    exit(1);
+  }
+  ibuf[cc] = '\0';
+  if(strcmp(ibuf, "this is the host!") != 0){
+    fprintf(2, "bindping didn't receive correct payload\n");
+    exit(1);
+  }
+  if(from.addr != to.addr || from.port != to.port){
+    fprintf(2, "bindping: reply from the wrong sender\n");
+    exit(1);
+  }
+
+  close(fd);
+}
+
+//
+// talk to ourselves over 127.0.0.1: a connected socket to a
+// bound one, and a reply of len bytes back.
+//
+static void
+loopback(uint16 port, int len)
+{
+  static char obuf[30000], ibuf[30000+1];
+  uint32 lo = (127 << 24) | 1;
+  struct sockaddr from;
+  int bfd, cfd, cc;
+
+  if(len > sizeof(obuf)){
+    fprintf(2, "loopback: len too big\n");
+    exit(1);
+  }
+  for(int i = 0; i < len; i++)
+    obuf[i] = 'A' + i % 23;
+
+  if((bfd = bind(port)) < 0 || (cfd = connect(lo, port + 1, port)) < 0){
+    fprintf(2, "loopback: bind() or connect() failed\n");
+    exit(1);
+  }
+  if(write(cfd, "ping", 4) != 4){
+    fprintf(2, "loopback: write() failed\n");
+    exit(1);
+  }
+  cc = recvfrom(bfd, ibuf, sizeof(ibuf), &from);
+  if(cc != 4 || memcmp(ibuf, "ping", 4) != 0 ||
+     from.addr != lo || from.port != port + 1){
+    fprintf(2, "loopback: wrong datagram or sender\n");
+    exit(1);
+  }
+  if(sendto(bfd, obuf, len, &from) != len){
+    fprintf(2, "loopback: sendto() failed\n");
+    exit(1);
+  }
+  cc = read(cfd, ibuf, sizeof(ibuf));
+  if(cc != len || memcmp(ibuf, obuf, len) != 0){
+    fprintf(2, "loopback: reply of %d bytes, wanted %d\n", cc, len);
+    exit(1);
+  }
+  close(bfd);
+  close(cfd);
+}
+
+//
+// two sockets bound to one port join a multicast group, and
+// each gets the datagrams sent to it, looped back; once one
+// leaves, only the other does.
+//
+static void
+multicast(uint16 port)
+{
+  uint32 grp = MAKE_IP_ADDR(239, 1, 2, 3);
+  struct sockaddr from;
+  char ibuf[16];
+  int a, b, s, cc;
+
+  if((a = bind(port)) < 0 || setsockopt(a, SO_REUSEADDR, 1) < 0 ||
+     (b = bind(port)) < 0){
+    fprintf(2, "multicast: can't bind the port twice\n");
+    exit(1);
+  }
+  if(setsockopt(a, SO_JOIN, grp) < 0 || setsockopt(b, SO_JOIN, grp) < 0 ||
+     setsockopt(a, SO_JOIN, grp) == 0){
+    fprintf(2, "multicast: SO_JOIN\n");
+    exit(1);
+  }
+  if((s = connect(grp, port + 1, port)) < 0 || write(s, "mcast", 5) != 5){
+    fprintf(2, "multicast: send failed\n");
+    exit(1);
+  }
+  for(int fd = a; ; fd = b){
+    cc = recvfrom(fd, ibuf, sizeof(ibuf), &from);
+    if(cc != 5 || memcmp(ibuf, "mcast", 5) != 0 || from.port != port + 1){
+      fprintf(2, "multicast: wrong datagram\n");
+      exit(1);
+    }
+    if(fd == b)
+      break;
+  }
+
+  if(setsockopt(b, SO_LEAVE, grp) < 0 || setsockopt(b, SO_LEAVE, grp) == 0){
+    fprintf(2, "multicast: SO_LEAVE\n");
+    exit(1);
+  }
+  if(write(s, "again", 5) != 5 || read(a, ibuf, sizeof(ibuf)) != 5){
+    fprintf(2, "multicast: second datagram lost\n");
+    exit(1);
+  }
+  fcntl(b, F_SETFL, O_NONBLOCK);
+  if(read(b, ibuf, sizeof(ibuf)) >= 0){
+    fprintf(2, "multicast: datagram after SO_LEAVE\n");
+    exit(1);
+  }
+  close(a);
+  close(b);
+  close(s);
+}
+
+//
+// sendfile() part of a file over 127.0.0.1 to a bound socket:
+// it arrives as datagrams of at most a frame's payload.
+//
+static void
+sendfiletest(uint16 port)
+{
+  static char buf[6000], ibuf[2048];
+  uint32 lo = (127 << 24) | 1;
+  struct sockaddr from;
+  int fd, bfd, cfd, cc, n, off = 100, len = 4000;
+
+  for(int i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 247;
+  if((fd = open("sendfile.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    fprintf(2, "sendfile: can't write sendfile.tmp\n");
+    exit(1);
+  }
+  if((bfd = bind(port)) < 0 || (cfd = connect(lo, port + 1, port)) < 0){
+    fprintf(2, "sendfile: bind() or connect() failed\n");
+    exit(1);
+  }
+  if(sendfile(cfd, fd, off, len) != len){
+    fprintf(2, "sendfile: sendfile() failed\n");
+    exit(1);
+  }
+  for(n = 0; n < len; n += cc){
+    cc = recvfrom(bfd, ibuf, sizeof(ibuf), &from);
+    if(cc <= 0 || cc > 1472 || memcmp(ibuf, buf + off + n, cc) != 0){
+      fprintf(2, "sendfile: wrong datagram of %d bytes at %d\n", cc, n);
+      exit(1);
+    }
+  }
+  close(fd);
+  close(bfd);
+  close(cfd);
+  unlink("sendfile.tmp");
+}
+
+//
+// a TCP stream of len bytes over 127.0.0.1, from a child to
+// its parent, which checks them and replies; the child's
+// close is then the parent's end of file.
+//
+static void
+tcpstream(uint16 port, int len)
+{
+  static char buf[4096];
+  uint32 lo = (127 << 24) | 1;
+  int lfd, fd, pid, cc, n, st;
+
+  if((lfd = tcplisten(port)) < 0){
+    fprintf(2, "tcpstream: tcplisten() failed\n");
+    exit(1);
+  }
+  if((pid = fork()) == 0){
+    close(lfd);
+    if((fd = tcpconnect(lo, port + 1, port)) < 0){
+      fprintf(2, "tcpstream: tcpconnect() failed\n");
+      exit(1);
+    }
+    for(n = 0; n < len; n += cc){
+      cc = len - n < sizeof(buf) ? len - n : sizeof(buf);
+      for(int i = 0; i < cc; i++)
+        buf[i] = (n + i) % 251;
+      if(write(fd, buf, cc) != cc){
+        fprintf(2, "tcpstream: write() failed\n");
+        exit(1);
+      }
+    }
+    if(read(fd, buf, sizeof(buf)) != 4 || memcmp(buf, "done", 4) != 0){
+      fprintf(2, "tcpstream: no reply\n");
+      exit(1);
+    }
+    close(fd);
+    exit(0);
+  }
+
+  if((fd = tcpaccept(lfd)) < 0){
+    fprintf(2, "tcpstream: tcpaccept() failed\n");
+    exit(1);
+  }
+  close(lfd);
+  for(n = 0; n < len && (cc = read(fd, buf, sizeof(buf))) > 0; n += cc){
+    for(int i = 0; i < cc; i++){
+      if((uchar)buf[i] != (n + i) % 251){
+        fprintf(2, "tcpstream: wrong byte at %d\n", n + i);
+        exit(1);
+      }
+    }
+  }
+  if(n != len){
+    fprintf(2, "tcpstream: got %d bytes, wanted %d\n", n, len);
+    exit(1);
+  }
+  if(write(fd, "done", 4) != 4 || read(fd, buf, sizeof(buf)) != 0){
+    fprintf(2, "tcpstream: no end of file\n");
+    exit(1);
+  }
+  close(fd);
+  wait(&st);
+  if(st != 0)
+    exit(1);
+}
+
+// returns the value of the counter called name in a
+// netstats report, or -1 if it's missing.
+static int
+statvalue(char *report, char *name)
+{
+  int n = strlen(name);
+
+  for(char *p = report; *p; p++){
+    if((p == report || p[-1] == '\n') &&
+       memcmp(p, name, n) == 0 && p[n] == ' ')
+      return atoi(p + n + 1);
+  }
+  return -1;
+}
+
+//
+// read the netstats device, check that it has counted the
+// pings sent so far, and that it lists an open socket.
+//
+static void
+netstats(uint16 sport, uint16 dport)
+{
+  static char report[4096];
+  int fd, sfd, n, tot;
+  uint32 dst = (10 << 24) | (0 << 16) | (2 << 8) | (2 << 0);
+
+  if((sfd = connect(dst, sport, dport)) < 0){
+    fprintf(2, "netstats: connect() failed\n");
+    exit(1);
+  }
+  if((fd = open("netstats", O_RDONLY)) < 0){
+    mknod("netstats", NETSTATS, 0);
+    if((fd = open("netstats", O_RDONLY)) < 0){
+      fprintf(2, "netstats: open failed\n");
+      exit(1);
+    }
+  }
+  tot = 0;
+  while((n = read(fd, report + tot, sizeof(report) - 1 - tot)) > 0)
+    tot += n;
+  report[tot] = 0;
+  close(fd);
+  close(sfd);
+
+  if(statvalue(report, "tx_pkts") <= 0 || statvalue(report, "rx_pkts") <= 0){
+    fprintf(2, "netstats: no packets counted\n%s", report);
+    exit(1);
+  }
+  for(n = 0; n < tot; n++)
+    if(memcmp(report + n, "lport ", 6) == 0 && atoi(report + n + 6) == sport)
+      break;
+  if(n == tot){
+    fprintf(2, "netstats: socket %d not listed\n%s", sport, report);
+    exit(1);
+  }
+}
+
+//
+// take the e1000 with netbypass(), send an ARP request for
+// qemu's 10.0.2.2 straight from the TX ring, and poll the RX
+// ring for the reply. then give the e1000 back and check
+// that the kernel's stack works again.
+//
+static void
+bypass(uint16 sport, uint16 dport)
+{
+  volatile uint32 *regs = (uint32 *)NETBPREGS;
+  volatile struct netbpring *r;
+  char mac[ETHADDR_LEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+  struct eth *eth;
+  struct arp *arp;
+  uint32 i;
+  int start;
+
+  if((r = netbypass(1)) == (struct netbpring *)-1){
+    fprintf(2, "bypass: netbypass(1) failed\n");
+    exit(1);
+  }
+  if(netbypass(1) != (struct netbpring *)-1){
+    fprintf(2, "bypass: took the e1000 twice\n");
+    exit(1);
+  }
+
+  eth = (struct eth *)(NETBP + BPTXBUF(0));
+  arp = (struct arp *)(eth + 1);
+  memset(eth->dhost, 0xff, ETHADDR_LEN);
+  memmove(eth->shost, mac, ETHADDR_LEN);
+  eth->type = htons(ETHTYPE_ARP);
+  arp->hrd = htons(ARP_HRD_ETHER);
+  arp->pro = htons(ETHTYPE_IP);
+  arp->hln = ETHADDR_LEN;
+  arp->pln = sizeof(uint32);
+  arp->op = htons(ARP_OP_REQUEST);
+  memmove(arp->sha, mac, ETHADDR_LEN);
+  arp->sip = htonl(MAKE_IP_ADDR(10, 0, 2, 15));
+  memset(arp->tha, 0, ETHADDR_LEN);
+  arp->tip = htonl(MAKE_IP_ADDR(10, 0, 2, 2));
+  r->tx[0].length = sizeof(*eth) + sizeof(*arp);
+  r->tx[0].cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+  r->tx[0].status = 0;
+  __sync_synchronize();
+  regs[E1000_TDT] = 1;
+
+  // qemu answers at once; give up after a second or so.
+  start = uptime();
+  for(i = 0; ; i = (i + 1) % NBPDESC){
+    while(!(r->rx[i].status & E1000_RXD_STAT_DD)){
+      if(uptime() - start > 10){
+        fprintf(2, "bypass: no ARP reply\n");
+        exit(1);
+      }
+    }
+    eth = (struct eth *)(NETBP + BPRXBUF(i));
+    arp = (struct arp *)(eth + 1);
+    r->rx[i].status = 0;
+    __sync_synchronize();
+    regs[E1000_RDT] = i;
+    if(eth->type == htons(ETHTYPE_ARP) && arp->op == htons(ARP_OP_REPLY) &&
+       arp->sip == htonl(MAKE_IP_ADDR(10, 0, 2, 2)))
+      break;
+  }
+  if(!(r->tx[0].status & E1000_TXD_STAT_DD)){
+    fprintf(2, "bypass: TX descriptor not done\n");
+    exit(1);
+  }
+
+  if(netbypass(0) != 0 || netbypass(0) != (struct netbpring *)-1){
+    fprintf(2, "bypass: netbypass(0) failed\n");
+    exit(1);
+  }
+  ping(sport, dport, 1);
+}
+
 // Encode a DNS name
 static void
 encode_qname(char *qn, char *host)
@@ -254,6 +867,54 @@ main(int argc, char *argv[])
   }
   printf("OK\n");
   
+  printf("testing blocking burst: ");
+  burst(2100, dport, 200);
+  printf("OK\n");
+
+  printf("testing zero-copy receive: ");
+  zcping(2200, dport);
+  printf("OK\n");
+
+  printf("testing batched pings: ");
+  mmsgping(2300, dport, 8);
+  printf("OK\n");
+
+  printf("testing receive buffer limit: ");
+  rcvbuf(2400, dport);
+  printf("OK\n");
+
+  printf("testing fragmented datagram: ");
+  bigping(2700, dport, 20000);
+  printf("OK\n");
+
+  printf("testing bound socket: ");
+  bindping(2600, dport, 1);
+  printf("OK\n");
+
+  printf("testing loopback: ");
+  loopback(2800, 30000);
+  printf("OK\n");
+
+  printf("testing multicast: ");
+  multicast(2870);
+  printf("OK\n");
+
+  printf("testing sendfile: ");
+  sendfiletest(2850);
+  printf("OK\n");
+
+  printf("testing TCP stream: ");
+  tcpstream(2900, 200000);
+  printf("OK\n");
+
+  printf("testing netstats: ");
+  netstats(2500, dport);
+  printf("OK\n");
+
+  printf("testing kernel bypass: ");
+  bypass(2950, dport);
+  printf("OK\n");
+
   printf("testing DNS\n");
   dns();
   printf("DNS OK\n");
@@ -4,16 +4,42 @@
 
 #include <stdarg.h>
 
+// each printf() collects its output in a buffer and hands it
+// to write() when it's done, or whenever PRBUF bytes pile up,
+// rather than making one system call per character; a line
+// from one process no longer interleaves character by
+// character with another's. nothing stays buffered between
+// calls, so output isn't duplicated by fork() or lost by
+// exit().
+
+#define PRBUF 128
+
+struct prbuf {
+  int fd;
+  int n;
+  char buf[PRBUF];
+};
+
 static char digits[] = "0123456789ABCDEF";
 
 static void
-putc(int fd, char c)
+flush(struct prbuf *b)
+{
+  if(b->n > 0)
+    write(b->fd, b->buf, b->n);
+  b->n = 0;
+}
+
+static void
+putc(struct prbuf *b, char c)
 {
-  write(fd, &c, 1);
+  if(b->n == PRBUF)
+    flush(b);
+  b->buf[b->n++] = c;
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+printint(struct prbuf *b, int xx, int base, int sgn)
 {
   char buf[16];
   int i, neg;
@@ -35,25 +61,28 @@ printint(int fd, int xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(b, buf[i]);
 }
 
 static void
-printptr(int fd, uint64 x) {
+printptr(struct prbuf *b, uint64 x) {
   int i;
-  putc(fd, '0');
-  putc(fd, 'x');
+  putc(b, '0');
+  putc(b, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(b, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
 void
 vprintf(int fd, const char *fmt, va_list ap)
 {
+  struct prbuf b;
   char *s;
   int c, i, state;
 
+  b.fd = fd;
+  b.n = 0;
   state = 0;
   for(i = 0; fmt[i]; i++){
     c = fmt[i] & 0xff;
@@ -61,37 +90,38 @@ vprintf(int fd, const char *fmt, va_list ap)
       if(c == '%'){
         state = '%';
       } else {
-        putc(fd, c);
+        putc(&b, c);
       }
     } else if(state == '%'){
       if(c == 'd'){
-        printint(fd, va_arg(ap, int), 10, 1);
+        printint(&b, va_arg(ap, int), 10, 1);
       } else if(c == 'l') {
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(&b, va_arg(ap, uint64), 10, 0);
       } else if(c == 'x') {
-        printint(fd, va_arg(ap, int), 16, 0);
+        printint(&b, va_arg(ap, int), 16, 0);
       } else if(c == 'p') {
-        printptr(fd, va_arg(ap, uint64));
+        printptr(&b, va_arg(ap, uint64));
       } else if(c == 's'){
         s = va_arg(ap, char*);
         if(s == 0)
           s = "(null)";
         while(*s != 0){
-          putc(fd, *s);
+          putc(&b, *s);
           s++;
         }
       } else if(c == 'c'){
-        putc(fd, va_arg(ap, uint));
+        putc(&b, va_arg(ap, uint));
       } else if(c == '%'){
-        putc(fd, c);
+        putc(&b, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(&b, '%');
+        putc(&b, c);
       }
       state = 0;
     }
   }
+  flush(&b);
 }
 
 void
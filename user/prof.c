@@ -0,0 +1,293 @@
+//
+// prof: sample where the CPUs spend their time, and report
+// it by function.
+//
+//   prof [-r rate] command args...   profile a command
+//   prof start [rate]                start sampling
+//   prof stop                        stop, and report
+//
+// rate is samples per clock tick (default 10). kernel
+// addresses are looked up in kernel.sym, and user ones in the
+// symbol table of the program each process was running,
+// found by its name.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/elf.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+#define NIMAGE 16     // programs symbolized
+#define NTOP   30     // functions reported
+
+struct sym {
+  uint64 addr;
+  char *name;
+  int count;
+};
+
+struct image {
+  char name[16];      // "kernel", or a process name
+  struct sym *sym;    // sorted by addr
+  int nsym;
+  int unknown;        // samples with no symbol
+};
+
+static struct image images[NIMAGE];
+static int nimage;
+static struct profsample buf[64];
+
+static void
+sortsyms(struct sym *s, int n)
+{
+  struct sym t;
+  int gap, i, j;
+
+  for(gap = n/2; gap > 0; gap /= 2)
+    for(i = gap; i < n; i++)
+      for(j = i; j >= gap && s[j-gap].addr > s[j].addr; j -= gap){
+        t = s[j];
+        s[j] = s[j-gap];
+        s[j-gap] = t;
+      }
+}
+
+// read all of file into memory; returns its size, or -1.
+static int
+slurp(char *file, char **data)
+{
+  struct stat st;
+  int fd, n;
+
+  if((fd = open(file, O_RDONLY)) < 0)
+    return -1;
+  if(fstat(fd, &st) < 0 || (*data = malloc(st.size + 1)) == 0){
+    close(fd);
+    return -1;
+  }
+  n = read(fd, *data, st.size);
+  close(fd);
+  if(n != st.size)
+    return -1;
+  (*data)[n] = 0;
+  return n;
+}
+
+// kernel.sym: lines of "<hex address> <name>".
+static void
+loadksyms(struct image *im)
+{
+  char *data, *p, *nl;
+  uint64 a;
+  int n, c;
+
+  if(slurp("kernel.sym", &data) < 0)
+    return;
+  for(n = 0, p = data; *p; p++)
+    if(*p == '\n')
+      n++;
+  im->sym = malloc((n + 1) * sizeof(struct sym));
+  for(p = data; *p; p = nl + 1){
+    for(nl = p; *nl && *nl != '\n'; nl++)
+      ;
+    if(*nl == 0)
+      break;
+    *nl = 0;
+    for(a = 0; (c = *p) && c != ' '; p++)
+      a = a*16 + (c >= 'a' ? c - 'a' + 10 : c - '0');
+    if(*p != ' ')
+      continue;
+    im->sym[im->nsym].addr = a;
+    im->sym[im->nsym].name = p + 1;
+    im->sym[im->nsym].count = 0;
+    im->nsym++;
+  }
+  sortsyms(im->sym, im->nsym);
+}
+
+// the function symbols in the program file's .symtab.
+static void
+loadusyms(struct image *im)
+{
+  char *data, *path, *strtab;
+  struct elfhdr *elf;
+  struct secthdr *sh, *ss;
+  struct elfsym *es;
+  int n, i, k;
+
+  path = malloc(strlen(im->name) + 2);
+  path[0] = '/';
+  strcpy(path + 1, im->name);
+  n = slurp(path, &data);
+  free(path);
+  if(n < sizeof(*elf))
+    return;
+  elf = (struct elfhdr *)data;
+  if(elf->magic != ELF_MAGIC || elf->shoff + elf->shnum * sizeof(*sh) > n)
+    return;
+  sh = (struct secthdr *)(data + elf->shoff);
+  for(i = 0; i < elf->shnum; i++){
+    ss = &sh[i];
+    if(ss->type != ELF_SECT_SYMTAB || ss->link >= elf->shnum ||
+       ss->off + ss->size > n || sh[ss->link].off + sh[ss->link].size > n)
+      continue;
+    strtab = data + sh[ss->link].off;
+    es = (struct elfsym *)(data + ss->off);
+    im->sym = malloc((ss->size / sizeof(*es)) * sizeof(struct sym));
+    for(k = 0; k < ss->size / sizeof(*es); k++){
+      if((es[k].info & 0xf) != ELF_SYM_FUNC || es[k].name >= sh[ss->link].size)
+        continue;
+      im->sym[im->nsym].addr = es[k].value;
+      im->sym[im->nsym].name = strtab + es[k].name;
+      im->sym[im->nsym].count = 0;
+      im->nsym++;
+    }
+    sortsyms(im->sym, im->nsym);
+    return;
+  }
+}
+
+static struct image *
+getimage(char *name)
+{
+  struct image *im;
+
+  for(im = images; im < &images[nimage]; im++)
+    if(strcmp(im->name, name) == 0)
+      return im;
+  if(nimage == NIMAGE)
+    return 0;
+  im = &images[nimage++];
+  strcpy(im->name, name);
+  if(strcmp(name, "kernel") == 0)
+    loadksyms(im);
+  else
+    loadusyms(im);
+  return im;
+}
+
+// count a sample against the last symbol at or before pc.
+static void
+account(struct profsample *s)
+{
+  struct image *im;
+  int lo, hi, mid;
+
+  s->name[sizeof(s->name)-1] = 0;
+  if((im = getimage(s->user ? s->name : "kernel")) == 0)
+    return;
+  lo = 0;
+  hi = im->nsym;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(im->sym[mid].addr <= s->pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == 0)
+    im->unknown++;
+  else
+    im->sym[lo-1].count++;
+}
+
+static void
+report(int dropped)
+{
+  struct sym *top[NTOP], *s;
+  char *where[NTOP];
+  int fd, i, j, k, n, total = 0, ntop = 0;
+  struct image *im;
+
+  if((fd = open("prof", O_RDONLY)) < 0){
+    mknod("prof", PROFDEV, 0);
+    if((fd = open("prof", O_RDONLY)) < 0){
+      fprintf(2, "prof: cannot open prof\n");
+      exit(1);
+    }
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(i = 0; i < n / sizeof(buf[0]); i++)
+      account(&buf[i]);
+    total += n / sizeof(buf[0]);
+  }
+  close(fd);
+
+  // the NTOP busiest functions, by insertion.
+  for(im = images; im < &images[nimage]; im++){
+    for(k = 0; k < im->nsym; k++){
+      s = &im->sym[k];
+      if(s->count == 0 || (ntop == NTOP && s->count <= top[NTOP-1]->count))
+        continue;
+      for(j = ntop < NTOP ? ntop++ : NTOP-1; j > 0 && top[j-1]->count < s->count; j--){
+        top[j] = top[j-1];
+        where[j] = where[j-1];
+      }
+      top[j] = s;
+      where[j] = im->name;
+    }
+  }
+
+  printf("%d samples, %d dropped\n", total, dropped);
+  if(total == 0)
+    return;
+  for(i = 0; i < ntop; i++)
+    printf("%d\t%d%%\t%s\t%s\n", top[i]->count, top[i]->count * 100 / total,
+           where[i], top[i]->name);
+  for(im = images; im < &images[nimage]; im++)
+    if(im->unknown)
+      printf("%d\t%d%%\t%s\t?\n", im->unknown, im->unknown * 100 / total, im->name);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rate = 10, pid, dropped;
+
+  if(argc >= 2 && strcmp(argv[1], "start") == 0){
+    if(argc > 2)
+      rate = atoi(argv[2]);
+    if(profile(rate) < 0){
+      fprintf(2, "prof: bad rate %d\n", rate);
+      exit(1);
+    }
+    exit(0);
+  }
+  if(argc >= 2 && strcmp(argv[1], "stop") == 0){
+    report(profile(0));
+    exit(0);
+  }
+
+  if(argc >= 3 && strcmp(argv[1], "-r") == 0){
+    rate = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc < 2){
+    fprintf(2, "usage: prof [-r rate] command args... | start [rate] | stop\n");
+    exit(1);
+  }
+  if(profile(rate) < 0){
+    fprintf(2, "prof: bad rate %d\n", rate);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    fprintf(2, "prof: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv + 1);
+    fprintf(2, "prof: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  dropped = profile(0);
+  report(dropped);
+  exit(0);
+}
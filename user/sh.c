@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int spawncmd(char*);
 
 // Execute cmd.  Never returns.
 void
@@ -164,6 +165,8 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(spawncmd(buf) == 0)
+      continue;
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
@@ -491,3 +494,32 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Run buf with spawn() rather than fork() and exec(), if it's
+// a plain command, with no redirections, pipes or lists.
+// Returns -1 if it isn't.
+int
+spawncmd(char *buf)
+{
+  struct execcmd *ecmd;
+  char *s;
+  int n;
+
+  n = 0;
+  for(s = buf; *s; s++){
+    if(strchr(symbols, *s))
+      return -1;
+    if(!strchr(whitespace, *s) && (s == buf || strchr(whitespace, s[-1])))
+      n++;
+  }
+  if(n == 0 || n >= MAXARGS)
+    return -1; // let runcmd() deal with it
+
+  ecmd = (struct execcmd*)parsecmd(buf);
+  if(spawn(ecmd->argv[0], ecmd->argv, 0, 0) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+  else
+    wait(0);
+  free(ecmd);
+  return 0;
+}
@@ -0,0 +1,154 @@
+//
+// sysstat: print the kernel's counters from sysinfo(): free
+// memory, processes, the buffer cache hit rate, and for each
+// system call that has been made, its count and latency, and
+// each CPU's device interrupts.
+//
+//   sysstat        totals since boot
+//   sysstat -h     with each call's latency histogram too
+//   sysstat -a irq cpumask
+//                  send irq only to the CPUs in cpumask
+//
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "kernel/syscall.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+static char *names[NSYSCALL] = {
+[SYS_fork]    "fork",
+[SYS_exit]    "exit",
+[SYS_wait]    "wait",
+[SYS_pipe]    "pipe",
+[SYS_read]    "read",
+[SYS_kill]    "kill",
+[SYS_exec]    "exec",
+[SYS_fstat]   "fstat",
+[SYS_chdir]   "chdir",
+[SYS_dup]     "dup",
+[SYS_getpid]  "getpid",
+[SYS_sbrk]    "sbrk",
+[SYS_sleep]   "sleep",
+[SYS_uptime]  "uptime",
+[SYS_open]    "open",
+[SYS_write]   "write",
+[SYS_mknod]   "mknod",
+[SYS_unlink]  "unlink",
+[SYS_link]    "link",
+[SYS_mkdir]   "mkdir",
+[SYS_close]   "close",
+[SYS_trace]   "trace",
+[SYS_sysinfo] "sysinfo",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_connect] "connect",
+[SYS_setsockopt] "setsockopt",
+[SYS_recvzc]  "recvzc",
+[SYS_zcfree]  "zcfree",
+[SYS_recvmmsg] "recvmmsg",
+[SYS_sendmmsg] "sendmmsg",
+[SYS_poll]    "poll",
+[SYS_fcntl]   "fcntl",
+[SYS_getsockopt] "getsockopt",
+[SYS_bind]    "bind",
+[SYS_recvfrom] "recvfrom",
+[SYS_sendto]  "sendto",
+[SYS_tcpconnect] "tcpconnect",
+[SYS_tcplisten] "tcplisten",
+[SYS_tcpaccept] "tcpaccept",
+[SYS_fsync]   "fsync",
+[SYS_nice]    "nice",
+[SYS_schedstat] "schedstat",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_spawn]   "spawn",
+[SYS_splice]  "splice",
+[SYS_sendfile] "sendfile",
+[SYS_readv]   "readv",
+[SYS_writev]  "writev",
+[SYS_pread]   "pread",
+[SYS_pwrite]  "pwrite",
+[SYS_profile] "profile",
+[SYS_uring_setup] "uring_setup",
+[SYS_uring_enter] "uring_enter",
+[SYS_irqaffinity] "irqaffinity",
+[SYS_nanosleep] "nanosleep",
+[SYS_netbypass] "netbypass",
+};
+
+static struct sysinfo info;
+
+// the upper edge of the bucket holding the pth percentile
+// of st's calls, in time CSR ticks.
+static int
+percentile(struct syscallstat *st, int p)
+{
+  uint64 n = 0;
+  int b;
+
+  for(b = 0; b < NSYSHIST; b++){
+    n += st->hist[b];
+    if(n * 100 >= st->count * p)
+      break;
+  }
+  return 2 << b;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct syscallstat *st;
+  int i, b, c, hist = argc > 1 && strcmp(argv[1], "-h") == 0;
+  uint64 lookups, n;
+
+  if(argc == 4 && strcmp(argv[1], "-a") == 0){
+    if((i = irqaffinity(atoi(argv[2]), atoi(argv[3]))) < 0){
+      fprintf(2, "sysstat: irqaffinity failed\n");
+      exit(1);
+    }
+    printf("irq %s: cpumask %d, was %d\n", argv[2], atoi(argv[3]), i);
+    exit(0);
+  }
+
+  if(sysinfo(&info) < 0){
+    fprintf(2, "sysstat: sysinfo failed\n");
+    exit(1);
+  }
+  lookups = info.bhits + info.bmisses;
+  printf("free memory %d KB, %d processes\n", (int)(info.freemem / 1024), (int)info.nproc);
+  printf("buffer cache %d hits %d misses (%d%% hits)\n", (int)info.bhits,
+         (int)info.bmisses, lookups ? (int)(info.bhits * 100 / lookups) : 0);
+
+  // latencies are in time CSR ticks, 10 per microsecond.
+  printf("syscall\tcalls\tmean us\tp50 us\tp99 us\n");
+  for(i = 0; i < NSYSCALL; i++){
+    st = &info.sys[i];
+    if(st->count == 0)
+      continue;
+    printf("%s\t%d\t%d\t%d\t%d\n", names[i] ? names[i] : "?", (int)st->count,
+           (int)(st->time / st->count / 10),
+           percentile(st, 50) / 10, percentile(st, 99) / 10);
+    if(hist){
+      for(b = 0; b < NSYSHIST; b++)
+        if(st->hist[b])
+          printf("\t< %d ticks: %d\n", 2 << b, st->hist[b]);
+    }
+  }
+
+  printf("irq\tcpumask\tper-CPU interrupts\n");
+  for(i = 1; i < NIRQ; i++){
+    for(n = 0, c = 0; c < NCPU; c++)
+      n += info.irqs[c][i];
+    if(n == 0)
+      continue;
+    printf("%d\t%d\t", i, irqaffinity(i, 0));
+    for(c = 0; c < NCPU; c++)
+      printf(" %d", (int)info.irqs[c][i]);
+    printf("\n");
+  }
+  exit(0);
+}
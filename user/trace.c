@@ -0,0 +1,146 @@
+//
+// trace: record kernel events while a command runs, then
+// print them.
+//
+//   trace sys,disk cat README
+//
+// the events are named as below, or given as a number (a mask
+// of trace.h's TR_ bits). without a command, trace just sets
+// the mask and prints what has been recorded so far. the
+// kernel keeps NTRACEEV events per CPU; older ones are lost.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+
+static struct {
+  char *name;
+  int mask;
+} groups[] = {
+  { "sys",   TR_SYSENTER | TR_SYSEXIT },
+  { "sched", TR_SWITCH | TR_SCHED },
+  { "sleep", TR_SLEEP | TR_WAKEUP },
+  { "bio",   TR_BHIT | TR_BMISS },
+  { "disk",  TR_DISKSUB | TR_DISKDONE },
+  { "net",   TR_NETRX | TR_NETTX },
+  { "all",   0xffff },
+};
+
+static char *names[16] = {
+  "sysenter", "sysexit", "switch", "sched", "sleep", "wakeup",
+  "bhit", "bmiss", "disksub", "diskdone", "netrx", "nettx",
+  0, 0, 0, "lost",
+};
+
+static struct traceev ev[64];
+
+static int
+parsemask(char *s)
+{
+  char *e;
+  int i, n, mask = 0;
+
+  if(*s >= '0' && *s <= '9')
+    return atoi(s);
+  while(*s){
+    for(e = s; *e && *e != ','; e++)
+      ;
+    n = e - s;
+    for(i = 0; i < sizeof(groups)/sizeof(groups[0]); i++)
+      if(strlen(groups[i].name) == n && memcmp(groups[i].name, s, n) == 0)
+        break;
+    if(i == sizeof(groups)/sizeof(groups[0])){
+      fprintf(2, "trace: unknown events %s\n", s);
+      exit(1);
+    }
+    mask |= groups[i].mask;
+    s = *e ? e + 1 : e;
+  }
+  return mask;
+}
+
+static int
+opentrace(void)
+{
+  int fd;
+
+  if((fd = open("trace", O_RDONLY)) < 0){
+    mknod("trace", TRACEDEV, 0);
+    if((fd = open("trace", O_RDONLY)) < 0){
+      fprintf(2, "trace: cannot open trace\n");
+      exit(1);
+    }
+  }
+  return fd;
+}
+
+static void
+print(struct traceev *e, uint64 t0)
+{
+  int i, bit = 0;
+  char *name;
+
+  for(i = 0; i < 16; i++)
+    if(e->type == (1 << i))
+      bit = i;
+  name = names[bit] ? names[bit] : "?";
+  printf("%d us cpu %d pid %d %s ", (int)((e->time - t0) / 10), e->cpu, e->pid, name);
+  switch(e->type){
+  case TR_SLEEP:
+  case TR_WAKEUP:
+    printf("%p %d\n", e->a0, (int)e->a1);
+    break;
+  default:
+    printf("%d %d\n", (int)e->a0, (int)e->a1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, mask, pid, i, n;
+  uint64 t0 = 0;
+
+  if(argc < 2){
+    fprintf(2, "usage: trace events [command args...]\n");
+    exit(1);
+  }
+  mask = parsemask(argv[1]);
+  fd = opentrace();
+
+  if(argc > 2){
+    // start from empty rings.
+    while(read(fd, ev, sizeof(ev)) > 0)
+      ;
+    trace(mask);
+    if((pid = fork()) < 0){
+      fprintf(2, "trace: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[2], argv + 2);
+      fprintf(2, "trace: exec %s failed\n", argv[2]);
+      exit(1);
+    }
+    wait(0);
+    trace(0);
+  } else
+    trace(mask);
+
+  while((n = read(fd, ev, sizeof(ev))) > 0){
+    for(i = 0; i < n / sizeof(ev[0]); i++){
+      if(t0 == 0)
+        t0 = ev[i].time;
+      print(&ev[i], t0);
+    }
+  }
+  close(fd);
+  exit(0);
+}
@@ -0,0 +1,402 @@
+//
+// ubench: how long the kernel's basic operations take.
+//
+// "ubench" runs every benchmark in one process; "ubench -p 4"
+// runs four copies of each at once, to see how they scale
+// across CPUs; "ubench null pipelat" runs just those. each
+// benchmark prints one line,
+//
+//   name procs ops us ns/op
+//
+// the operations each process did, the elapsed time for all
+// of them, and the time per operation as one process saw it.
+// lines starting with # are comments. compare the numbers
+// from two kernels.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define CHUNK   4096            // bytes per pipebulk write
+#define SBRKPG  64              // pages per sbrk step
+#define HITBLKS 8               // blocks in the bhit file
+#define MISSBLKS (2*NBUF)       // blocks in the bmiss file: twice the cache
+#define MAXPROCS (NPROC/4)      // for -p; each may fork helpers
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+static char buf[CHUNK];
+
+// the time CSR, which counts at 10 MHz in qemu.
+static uint64
+rdtime(void)
+{
+  uint64 t;
+  asm volatile("rdtime %0" : "=r" (t));
+  return t;
+}
+
+static void
+fail(char *what)
+{
+  fprintf(2, "ubench: %s failed\n", what);
+  exit(1);
+}
+
+// prefix followed by the digits of i.
+static char*
+mkname(char *dst, char *prefix, int i)
+{
+  char *p;
+  int d;
+
+  strcpy(dst, prefix);
+  p = dst + strlen(dst);
+  for(d = 1; i / d >= 10; d *= 10)
+    ;
+  for(; d > 0; d /= 10)
+    *p++ = '0' + (i / d) % 10;
+  *p = 0;
+  return dst;
+}
+
+static void
+mkfile(char *path, int nblocks)
+{
+  int fd, i;
+
+  if((fd = open(path, O_CREATE|O_WRONLY)) < 0)
+    fail("create");
+  memset(buf, 'x', BSIZE);
+  for(i = 0; i < nblocks; i++)
+    if(write(fd, buf, BSIZE) != BSIZE)
+      fail("write");
+  close(fd);
+}
+
+static void
+null(int id, int n)
+{
+  while(n-- > 0)
+    getpid();
+}
+
+static void
+forkexit(int id, int n)
+{
+  int pid;
+
+  while(n-- > 0){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+}
+
+static void
+forkexec(int id, int n)
+{
+  char *argv[] = { "ubench", "-x", 0 };
+  int pid, st;
+
+  while(n-- > 0){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      exec("/ubench", argv);
+      exit(1);
+    }
+    wait(&st);
+    if(st != 0)
+      fail("exec");
+  }
+}
+
+// one-byte round trips with an echoing child.
+static void
+pipelat(int id, int n)
+{
+  int to[2], from[2];
+  char c;
+
+  if(pipe(to) < 0 || pipe(from) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+  while(n-- > 0){
+    if(write(to[1], "x", 1) != 1 || read(from[0], &c, 1) != 1)
+      fail("pipe round trip");
+  }
+  close(to[1]);
+  close(from[0]);
+  wait(0);
+}
+
+// CHUNK-byte writes to a child that reads and discards them.
+static void
+pipebulk(int id, int n)
+{
+  int fds[2];
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    close(fds[1]);
+    while(read(fds[0], buf, sizeof(buf)) > 0)
+      ;
+    exit(0);
+  }
+  close(fds[0]);
+  while(n-- > 0)
+    if(write(fds[1], buf, CHUNK) != CHUNK)
+      fail("pipe write");
+  close(fds[1]);
+  wait(0);
+}
+
+// grow the heap, fault in each page, and shrink it again; an
+// op is one page.
+static void
+pagefault(int id, int n)
+{
+  char *p;
+  int i;
+
+  for(; n > 0; n -= SBRKPG){
+    if((p = sbrk(SBRKPG * 4096)) == (char*)-1)
+      fail("sbrk");
+    for(i = 0; i < SBRKPG; i++)
+      p[i * 4096] = 1;
+    sbrk(-SBRKPG * 4096);
+  }
+}
+
+// create, write, close, open, read, close and unlink a one
+// block file.
+static void
+file(int id, int n)
+{
+  char name[16];
+  int fd;
+
+  mkname(name, "ubfile", id);
+  while(n-- > 0){
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0)
+      fail("create");
+    if(write(fd, buf, BSIZE) != BSIZE)
+      fail("write");
+    close(fd);
+    if((fd = open(name, O_RDONLY)) < 0)
+      fail("open");
+    if(read(fd, buf, BSIZE) != BSIZE)
+      fail("read");
+    close(fd);
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+}
+
+static char *lookupdirs[] = { "ubd", "ubd/a", "ubd/a/b", "ubd/a/b/c", "ubd/a/b/c/d" };
+#define LOOKUPPATH "ubd/a/b/c/d/f"
+
+static void
+lookupsetup(void)
+{
+  int i;
+
+  for(i = 0; i < NELEM(lookupdirs); i++)
+    mkdir(lookupdirs[i]);
+  mkfile(LOOKUPPATH, 0);
+}
+
+static void
+lookupcleanup(void)
+{
+  int i;
+
+  unlink(LOOKUPPATH);
+  for(i = NELEM(lookupdirs) - 1; i >= 0; i--)
+    unlink(lookupdirs[i]);
+}
+
+// stat() of a path six names deep.
+static void
+lookup(int id, int n)
+{
+  struct stat st;
+
+  while(n-- > 0)
+    if(stat(LOOKUPPATH, &st) < 0)
+      fail("stat");
+}
+
+static void
+bhitsetup(void)
+{
+  mkfile("ubhit", HITBLKS);
+}
+
+static void
+bmisssetup(void)
+{
+  mkfile("ubmiss", MISSBLKS);
+}
+
+static void
+bhitcleanup(void)
+{
+  unlink("ubhit");
+}
+
+static void
+bmisscleanup(void)
+{
+  unlink("ubmiss");
+}
+
+// one-block pread()s, cycling through nblocks of path.
+static void
+preadloop(char *path, int nblocks, int start, int n)
+{
+  char b[BSIZE];
+  int fd, i;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    fail("open");
+  for(i = start; n-- > 0; i++)
+    if(pread(fd, b, BSIZE, (i % nblocks) * BSIZE) != BSIZE)
+      fail("pread");
+  close(fd);
+}
+
+// a few blocks that stay in the buffer cache.
+static void
+bhit(int id, int n)
+{
+  preadloop("ubhit", HITBLKS, 0, n);
+}
+
+// reading straight through a file twice the size of the buffer
+// cache evicts each block before it's wanted again.
+static void
+bmiss(int id, int n)
+{
+  preadloop("ubmiss", MISSBLKS, id * (MISSBLKS / MAXPROCS), n);
+}
+
+struct bench {
+  char *name;
+  void (*fn)(int, int);
+  int n;                // ops per process
+  void (*setup)(void);
+  void (*cleanup)(void);
+} benches[] = {
+  { "null",      null,      20000 },
+  { "forkexit",  forkexit,  200 },
+  { "forkexec",  forkexec,  50 },
+  { "pipelat",   pipelat,   2000 },
+  { "pipebulk",  pipebulk,  1024 },
+  { "pagefault", pagefault, 4096 },
+  { "file",      file,      100 },
+  { "lookup",    lookup,    2000,  lookupsetup, lookupcleanup },
+  { "bhit",      bhit,      5000,  bhitsetup,   bhitcleanup },
+  { "bmiss",     bmiss,     1024,  bmisssetup,  bmisscleanup },
+};
+
+// run b in nproc processes at once, released together once
+// they've all been forked.
+static void
+run(struct bench *b, int nproc)
+{
+  int go[2], i, st, ok;
+  uint64 t0, t1, us;
+  char c;
+
+  if(b->setup)
+    b->setup();
+  if(pipe(go) < 0)
+    fail("pipe");
+  for(i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("fork");
+    if(pid == 0){
+      close(go[1]);
+      read(go[0], &c, 1);
+      close(go[0]);
+      b->fn(i, b->n);
+      exit(0);
+    }
+  }
+  close(go[0]);
+  t0 = rdtime();
+  close(go[1]);
+  ok = 1;
+  for(i = 0; i < nproc; i++){
+    wait(&st);
+    if(st != 0)
+      ok = 0;
+  }
+  t1 = rdtime();
+  if(b->cleanup)
+    b->cleanup();
+
+  if(!ok){
+    printf("# %s failed\n", b->name);
+    return;
+  }
+  us = (t1 - t0) / 10;
+  printf("%s %d %d %l %l\n", b->name, nproc, b->n, us, us * 1000 / b->n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, nproc, any;
+
+  if(argc == 2 && strcmp(argv[1], "-x") == 0)
+    exit(0);  // forkexec's child
+
+  nproc = 1;
+  i = 1;
+  if(i + 1 < argc && strcmp(argv[i], "-p") == 0){
+    nproc = atoi(argv[i + 1]);
+    i += 2;
+  }
+  if(nproc < 1 || nproc > MAXPROCS){
+    fprintf(2, "usage: ubench [-p nproc] [benchmark...]\n");
+    exit(1);
+  }
+
+  printf("# name procs ops us ns/op\n");
+  any = 0;
+  for(j = 0; j < NELEM(benches); j++){
+    if(i < argc){
+      int k;
+      for(k = i; k < argc && strcmp(argv[k], benches[j].name) != 0; k++)
+        ;
+      if(k == argc)
+        continue;
+    }
+    run(&benches[j], nproc);
+    any = 1;
+  }
+  if(!any){
+    fprintf(2, "ubench: no such benchmark\n");
+    exit(1);
+  }
+  exit(0);
+}
@@ -1,8 +1,25 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/vdso.h"
 #include "user/user.h"
 
+// the string and memory routines work a 64-bit word at a
+// time once they've reached an 8-byte boundary, like the
+// kernel's in kernel/string.c. those that take two pointers
+// can only do that when both are equally aligned; otherwise
+// they go a byte at a time, since misaligned loads and stores
+// may trap. strlen() and strcmp() test a whole word for a zero
+// byte at once; an aligned word never crosses a page, so they
+// can't fault by reading past the end of the string.
+
+#define WALIGNED(p) (((uint64)(p) & 7) == 0)
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -17,6 +34,21 @@ strcpy(char *s, const char *t)
 int
 strcmp(const char *p, const char *q)
 {
+  const uint64 *wp, *wq;
+
+  if(((uint64)p & 7) == ((uint64)q & 7)){
+    for(; !WALIGNED(p); p++, q++)
+      if(*p == 0 || *p != *q)
+        return (uchar)*p - (uchar)*q;
+    // skip the equal words without a zero byte; the bytes
+    // find the end or the difference.
+    wp = (const uint64 *) p;
+    wq = (const uint64 *) q;
+    while(*wp == *wq && !HASZERO(*wp))
+      wp++, wq++;
+    p = (const char *) wp;
+    q = (const char *) wq;
+  }
   while(*p && *p == *q)
     p++, q++;
   return (uchar)*p - (uchar)*q;
@@ -25,21 +57,41 @@ strcmp(const char *p, const char *q)
 uint
 strlen(const char *s)
 {
-  int n;
+  const char *p;
+  const uint64 *w;
 
-  for(n = 0; s[n]; n++)
+  for(p = s; !WALIGNED(p); p++)
+    if(*p == 0)
+      return p - s;
+  for(w = (const uint64 *) p; !HASZERO(*w); w++)
     ;
-  return n;
+  for(p = (const char *) w; *p; p++)
+    ;
+  return p - s;
 }
 
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  for(; n > 0 && !WALIGNED(cdst); n--)
+    *cdst++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(wdst = (uint64 *) cdst; n >= 32; n -= 32, wdst += 4){
+    wdst[0] = w;
+    wdst[1] = w;
+    wdst[2] = w;
+    wdst[3] = w;
   }
+  for(; n >= 8; n -= 8)
+    *wdst++ = w;
+  for(cdst = (char *) wdst; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -52,14 +104,38 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// read a line from fd. a read() from the console returns at
+// most one line, so from a device the line comes in one
+// read(). from a file or a pipe it has to come a byte at a
+// time: reading ahead would take input that belongs to the
+// next reader of the descriptor, e.g. a command that sh runs
+// with the same standard input.
 char*
-gets(char *buf, int max)
+getsfd(int fd, char *buf, int max)
 {
-  int i, cc;
+  struct stat st;
+  int i, cc, n;
   char c;
 
-  for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
+  i = 0;
+  if(fstat(fd, &st) == 0 && st.type == T_DEVICE){
+    while(i+1 < max){
+      if((cc = read(fd, buf+i, max-1-i)) < 1)
+        break;
+      for(n = i + cc; i < n; i++)
+        if(buf[i] == '\n' || buf[i] == '\r')
+          break;
+      if(i < n){
+        i++;
+        break;
+      }
+    }
+    buf[i] = '\0';
+    return buf;
+  }
+
+  for(; i+1 < max; ){
+    cc = read(fd, &c, 1);
     if(cc < 1)
       break;
     buf[i++] = c;
@@ -70,6 +146,12 @@ gets(char *buf, int max)
   return buf;
 }
 
+char*
+gets(char *buf, int max)
+{
+  return getsfd(0, buf, max);
+}
+
 int
 stat(const char *n, struct stat *st)
 {
@@ -96,35 +178,83 @@ atoi(const char *s)
 }
 
 void*
-memmove(void *vdst, const void *vsrc, int n)
+memmove(void *vdst, const void *vsrc, int len)
 {
-  char *dst;
-  const char *src;
+  const char *s;
+  char *d;
+  const uint64 *ws;
+  uint64 *wd;
+  uint n;
+  int words;
 
-  dst = vdst;
-  src = vsrc;
-  if (src > dst) {
+  if(len <= 0)
+    return vdst;
+  n = len;
+  s = vsrc;
+  d = vdst;
+  words = ((uint64)s & 7) == ((uint64)d & 7);
+  if(s < d && s + n > d){
+    // backwards, since the end of src overlaps the start of dst.
+    s += n;
+    d += n;
+    if(words){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *--d = *--s;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 32; n -= 32){
+        wd -= 4, ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
-      *dst++ = *src++;
+      *--d = *--s;
   } else {
-    dst += n;
-    src += n;
+    if(words){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *d++ = *s++;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 32; n -= 32, wd += 4, ws += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
-      *--dst = *--src;
+      *d++ = *s++;
   }
   return vdst;
 }
 
 int
-memcmp(const void *s1, const void *s2, uint n)
+memcmp(const void *v1, const void *v2, uint n)
 {
-  const char *p1 = s1, *p2 = s2;
-  while (n-- > 0) {
-    if (*p1 != *p2) {
-      return *p1 - *p2;
-    }
-    p1++;
-    p2++;
+  const uchar *s1 = v1, *s2 = v2;
+
+  if(((uint64)s1 & 7) == ((uint64)s2 & 7)){
+    for(; n > 0 && !WALIGNED(s1); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    for(; n >= 8 && *(uint64 *)s1 == *(uint64 *)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
   }
   return 0;
 }
@@ -134,3 +264,68 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// the kernel's read-only pages, see kernel/vdso.h: these
+// cost a few loads rather than a system call.
+
+static void
+vclockread(uint *ticks, uint64 *mtime)
+{
+  volatile struct vclock *c = (struct vclock *)VCLOCK;
+  uint seq;
+
+  do {
+    while((seq = c->seq) & 1)
+      ;
+    __sync_synchronize();
+    *ticks = c->ticks;
+    *mtime = c->mtime;
+    __sync_synchronize();
+  } while(c->seq != seq);
+}
+
+// like uptime().
+int
+vuptime(void)
+{
+  uint t;
+  uint64 m;
+
+  vclockread(&t, &m);
+  return t;
+}
+
+// the time CSR as of the last clock tick.
+uint64
+vmtime(void)
+{
+  uint t;
+  uint64 m;
+
+  vclockread(&t, &m);
+  return m;
+}
+
+// getpid(), without a system call unless the process has
+// threads, which share the leader's VPROC page.
+int
+vgetpid(void)
+{
+  volatile struct vproc *v = (volatile struct vproc *)VPROC;
+
+  if(v->threads)
+    return getpid();
+  return v->pid;
+}
+
+// the CPU this process last entered user space on, which
+// may already be out of date; -1 if it has threads.
+int
+vcpuid(void)
+{
+  volatile struct vproc *v = (volatile struct vproc *)VPROC;
+
+  if(v->threads)
+    return -1;
+  return v->cpu;
+}
@@ -0,0 +1,9 @@
+// for user/ulock.c.
+
+struct mutex {
+  int state;  // 0 unlocked, 1 locked, 2 locked and maybe waited for
+};
+
+struct cond {
+  int seq;    // bumped by each signal or broadcast
+};
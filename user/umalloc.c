@@ -1,90 +1,217 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "user/ulock.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with segregated size classes.
+//
+// The heap is managed in pages. Each page (or run of pages)
+// starts with a header; an object's header is found by
+// rounding its address down to the page. Requests up to
+// MAXSMALL bytes come from pages carved into objects of one
+// power-of-two size, kept on a per-class free list, so
+// malloc() and free() of small objects are a list pop and
+// push. Bigger requests get a run of whole pages, and freed
+// runs are coalesced; once a free run at the top of the heap
+// is TRIMPAGES long, it goes back to the kernel with sbrk(-n).
+//
+// Each class has its own mutex, and the page pool another,
+// so threads from clone() allocating different sizes don't
+// contend; an uncontended mutex costs no system call.
 
-typedef long Align;
+#define PGSIZE    4096
+#define MINSMALL  16
+#define MAXSMALL  1024
+#define NCLASS    7     // 16, 32, ..., 1024
+#define GROWPAGES 16    // grow the heap at least this much
+#define TRIMPAGES 32    // give back a free top run this big
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+#define LARGE     -1
+
+struct page {
+  int cls;              // size class, or LARGE
+  uint npages;
+  struct page *next;    // on the free run list
 };
 
-typedef union header Header;
+#define HDR ((sizeof(struct page) + 15) & ~15)
 
-static Header base;
-static Header *freep;
+struct obj {
+  struct obj *next;
+};
 
-void
-free(void *ap)
-{
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
-}
+static struct {
+  struct mutex lock;
+  struct obj *free;
+} cls[NCLASS];
 
-static Header*
-morecore(uint nu)
+static struct {
+  struct mutex lock;
+  struct page *free;    // free runs, sorted by address
+} pool;
+
+static char*
+sbrkpages(uint n)
 {
-  char *p;
-  Header *hp;
+  char *p, *top;
+  uint64 pad;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
+  top = sbrk(0);
+  pad = (PGSIZE - (uint64)top % PGSIZE) % PGSIZE;
+  p = sbrk(pad + (uint64)n * PGSIZE);
   if(p == (char*)-1)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  return p + pad;
+}
+
+// put run r back on the free list, merging it with its
+// neighbours. caller holds pool.lock.
+static void
+runfree(struct page *r)
+{
+  struct page *prev, *q;
+
+  prev = 0;
+  for(q = pool.free; q && q < r; q = q->next)
+    prev = q;
+  r->next = q;
+  if(prev)
+    prev->next = r;
+  else
+    pool.free = r;
+  if(q && (char*)r + r->npages * PGSIZE == (char*)q){
+    r->npages += q->npages;
+    r->next = q->next;
+  }
+  if(prev && (char*)prev + prev->npages * PGSIZE == (char*)r){
+    prev->npages += r->npages;
+    prev->next = r->next;
+  }
+}
+
+// if the last free run ends at the break and is big enough,
+// give it back. caller holds pool.lock.
+static void
+trim(void)
+{
+  struct page **pp, *r;
+
+  if(pool.free == 0)
+    return;
+  for(pp = &pool.free; (*pp)->next; pp = &(*pp)->next)
+    ;
+  r = *pp;
+  if(r->npages < TRIMPAGES || (char*)r + r->npages * PGSIZE != sbrk(0))
+    return;
+  *pp = 0;
+  sbrk(-(int)(r->npages * PGSIZE));
+}
+
+// a run of n pages, first fit from the free runs, else from
+// the kernel.
+static struct page*
+pagealloc(uint n)
+{
+  struct page **pp, *r;
+  uint grow;
+
+  mutex_lock(&pool.lock);
+  for(pp = &pool.free; (r = *pp) != 0; pp = &r->next){
+    if(r->npages >= n){
+      if(r->npages == n){
+        *pp = r->next;
+      } else {
+        r->npages -= n;
+        r = (struct page*)((char*)r + r->npages * PGSIZE);
+      }
+      goto found;
+    }
+  }
+  grow = n < GROWPAGES ? GROWPAGES : n;
+  if((r = (struct page*)sbrkpages(grow)) == 0){
+    grow = n;
+    if((r = (struct page*)sbrkpages(grow)) == 0){
+      mutex_unlock(&pool.lock);
+      return 0;
+    }
+  }
+  if(grow > n){
+    struct page *rest = (struct page*)((char*)r + n * PGSIZE);
+    rest->npages = grow - n;
+    runfree(rest);
+  }
+found:
+  mutex_unlock(&pool.lock);
+  r->npages = n;
+  return r;
+}
+
+static void
+pagefree(struct page *r)
+{
+  mutex_lock(&pool.lock);
+  runfree(r);
+  trim();
+  mutex_unlock(&pool.lock);
+}
+
+void
+free(void *ap)
+{
+  struct page *pg;
+  struct obj *o;
+  int c;
+
+  if(ap == 0)
+    return;
+  pg = (struct page*)((uint64)ap & ~(uint64)(PGSIZE - 1));
+  if((c = pg->cls) == LARGE){
+    pagefree(pg);
+    return;
+  }
+  o = (struct obj*)ap;
+  mutex_lock(&cls[c].lock);
+  o->next = cls[c].free;
+  cls[c].free = o;
+  mutex_unlock(&cls[c].lock);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct page *pg;
+  struct obj *o;
+  char *p;
+  int c;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(nbytes > MAXSMALL){
+    if(nbytes > 0x7fffffff - HDR - PGSIZE)
+      return 0;
+    if((pg = pagealloc((nbytes + HDR + PGSIZE - 1) / PGSIZE)) == 0)
+      return 0;
+    pg->cls = LARGE;
+    return (char*)pg + HDR;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
+
+  for(c = 0; MINSMALL << c < nbytes; c++)
+    ;
+  mutex_lock(&cls[c].lock);
+  if(cls[c].free == 0){
+    // carve a fresh page into objects of this class.
+    if((pg = pagealloc(1)) == 0){
+      mutex_unlock(&cls[c].lock);
+      return 0;
+    }
+    pg->cls = c;
+    for(p = (char*)pg + HDR; p + (MINSMALL << c) <= (char*)pg + PGSIZE; p += MINSMALL << c){
+      o = (struct obj*)p;
+      o->next = cls[c].free;
+      cls[c].free = o;
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
   }
+  o = cls[c].free;
+  cls[c].free = o->next;
+  mutex_unlock(&cls[c].lock);
+  return o;
 }
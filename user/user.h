@@ -1,6 +1,17 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct uring;
+struct zcbuf;
+struct mmsg;
+struct pollfd;
+struct sockaddr;
+struct netbpring;
+struct schedstat;
+struct mutex;
+struct cond;
+struct spawnact;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -24,8 +35,46 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int poll(struct pollfd*, int, int);
+int fcntl(int, int, int);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int fsync(int);
+int nice(int);
+int schedstat(struct schedstat*);
+int clone(void (*)(void*), void*, void*);
+int join(int);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int spawn(char*, char**, struct spawnact*, int);
+int splice(int, int, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int trace(int);
+int profile(int);
+int sysinfo(struct sysinfo*);
+struct uring* uring_setup(void);
+int uring_enter(int);
+int irqaffinity(int, int);
+int nanosleep(uint64);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
+int setsockopt(int, int, int);
+int recvzc(int, struct zcbuf*);
+int zcfree(void*);
+int recvmmsg(int, struct mmsg*, int);
+int sendmmsg(int, struct mmsg*, int);
+int getsockopt(int, int);
+int bind(uint16);
+int recvfrom(int, void*, int, struct sockaddr*);
+int sendto(int, const void*, int, struct sockaddr*);
+int tcpconnect(uint32, uint16, uint16);
+int tcplisten(uint16);
+int tcpaccept(int);
+int sendfile(int, int, int, int);
+struct netbpring* netbypass(int);
 #endif
 
 // ulib.c
@@ -37,6 +86,7 @@ int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
 char* gets(char*, int max);
+char* getsfd(int, char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
@@ -45,3 +95,17 @@ int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 int statistics(void*, int);
+int vuptime(void);
+uint64 vmtime(void);
+int vgetpid(void);
+int vcpuid(void);
+
+// ulock.c, with the structs in user/ulock.h
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+int mutex_trylock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -7,6 +7,17 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/poll.h"
+#include "kernel/sched.h"
+#include "user/ulock.h"
+#include "kernel/spawn.h"
+#include "kernel/iovec.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/file.h"
+#include "kernel/trace.h"
+#include "kernel/sysinfo.h"
+#include "kernel/uring.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -107,6 +118,48 @@ copyout(char *s)
   }
 }
 
+// write() and read() a file from buffers at every alignment and
+// with lengths around the kernel's word copies, which must get
+// each byte right and touch nothing beside the buffer.
+void
+copyalign(char *s)
+{
+  static char data[600], got[600 + 16];
+  int fd, soff, doff, n, i;
+
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = i * 7 + i / 256;
+  for(soff = 0; soff < 8; soff++){
+    for(n = 1; n < 100; n += 13){
+      unlink("copyalign");
+      fd = open("copyalign", O_CREATE|O_RDWR);
+      if(fd < 0 || write(fd, data + soff, n) != n){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+      close(fd);
+      for(doff = 0; doff < 8; doff++){
+        memset(got, 'z', sizeof(got));
+        fd = open("copyalign", O_RDONLY);
+        if(fd < 0 || read(fd, got + 8 + doff, n) != n){
+          printf("%s: read failed\n", s);
+          exit(1);
+        }
+        close(fd);
+        if(memcmp(got + 8 + doff, data + soff, n) != 0){
+          printf("%s: wrong data, offsets %d %d length %d\n", s, soff, doff, n);
+          exit(1);
+        }
+        if(got[8 + doff - 1] != 'z' || got[8 + doff + n] != 'z'){
+          printf("%s: copy overran, offsets %d %d length %d\n", s, soff, doff, n);
+          exit(1);
+        }
+      }
+    }
+  }
+  unlink("copyalign");
+}
+
 // what if you pass ridiculous string pointers to system calls?
 void
 copyinstr1(char *s)
@@ -779,211 +832,1542 @@ pipe1(char *s)
   }
 }
 
-// meant to be run w/ at most two CPUs
+// splice() a file through a pipe into another file.
 void
-preempt(char *s)
+splicetest(char *s)
 {
-  int pid1, pid2, pid3;
-  int pfds[2];
+  int fd, fds[2], pid, xstatus, i, n, tot, sz = 3*4096 + 100;
+  char *b;
 
-  pid1 = fork();
-  if(pid1 < 0) {
-    printf("%s: fork failed", s);
+  if((b = malloc(sz)) == 0){
+    printf("%s: malloc failed\n", s);
     exit(1);
   }
-  if(pid1 == 0)
-    for(;;)
-      ;
+  for(i = 0; i < sz; i++)
+    b[i] = i % 253;
+  fd = open("splice.in", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, b, sz) != sz){
+    printf("%s: couldn't write splice.in\n", s);
+    exit(1);
+  }
+  close(fd);
 
-  pid2 = fork();
-  if(pid2 < 0) {
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
     printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(pid2 == 0)
-    for(;;)
-      ;
-
-  pipe(pfds);
-  pid3 = fork();
-  if(pid3 < 0) {
-     printf("%s: fork failed\n", s);
-     exit(1);
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("splice.in", O_RDONLY);
+    n = splice(fd, fds[1], sz + 1000);
+    exit(n == sz ? 0 : 1);
   }
-  if(pid3 == 0){
-    close(pfds[0]);
-    if(write(pfds[1], "x", 1) != 1)
-      printf("%s: preempt write error", s);
-    close(pfds[1]);
-    for(;;)
-      ;
+  close(fds[1]);
+  fd = open("splice.out", O_CREATE|O_RDWR);
+  tot = 0;
+  while((n = splice(fds[0], fd, 8192)) > 0)
+    tot += n;
+  close(fds[0]);
+  close(fd);
+  wait(&xstatus);
+  if(xstatus != 0 || tot != sz){
+    printf("%s: spliced %d bytes, child status %d\n", s, tot, xstatus);
+    exit(1);
   }
 
-  close(pfds[1]);
-  if(read(pfds[0], buf, sizeof(buf)) != 1){
-    printf("%s: preempt read error", s);
-    return;
+  memset(b, 0, sz);
+  fd = open("splice.out", O_RDONLY);
+  if(fd < 0 || read(fd, b, sz) != sz){
+    printf("%s: couldn't read splice.out\n", s);
+    exit(1);
   }
-  close(pfds[0]);
-  printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
-  printf("wait... ");
-  wait(0);
-  wait(0);
-  wait(0);
+  close(fd);
+  for(i = 0; i < sz; i++){
+    if(b[i] != (char)(i % 253)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splice.in");
+  unlink("splice.out");
+  free(b);
 }
 
-// try to find any races between exit and wait
+// writev() and readv() of pieces, and pread()/pwrite(), which
+// leave the file offset alone.
 void
-exitwait(char *s)
+iovtest(char *s)
 {
-  int i, pid;
+  static char big[3000];
+  char hdr[8], b[4];
+  struct iovec iov[3];
+  int fd, i;
 
-  for(i = 0; i < 100; i++){
-    pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
+  for(i = 0; i < sizeof(big); i++)
+    big[i] = i % 199;
+  memmove(hdr, "header:", 8);
+  iov[0].base = (uint64)hdr;
+  iov[0].len = 8;
+  iov[1].base = (uint64)big;
+  iov[1].len = sizeof(big);
+  iov[2].base = (uint64)"end";
+  iov[2].len = 3;
+  fd = open("iov.tmp", O_CREATE|O_RDWR);
+  if(fd < 0 || writev(fd, iov, 3) != 8 + sizeof(big) + 3){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "HEAD", 4, 0) != 4 || pread(fd, b, 3, 8 + sizeof(big)) != 3 ||
+     memcmp(b, "end", 3) != 0){
+    printf("%s: pread/pwrite failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "!", 1) != 1){
+    printf("%s: write after pwrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  memset(big, 0, sizeof(big));
+  fd = open("iov.tmp", O_RDONLY);
+  iov[2].base = (uint64)b;
+  iov[2].len = 4;
+  if(fd < 0 || readv(fd, iov, 3) != 8 + sizeof(big) + 4){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  if(memcmp(hdr, "HEADer:", 8) != 0 || memcmp(b, "end!", 4) != 0){
+    printf("%s: readv read the wrong bytes\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(big); i++){
+    if(big[i] != (char)(i % 199)){
+      printf("%s: wrong byte at %d\n", s, i);
       exit(1);
     }
-    if(pid){
-      int xstate;
-      if(wait(&xstate) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-      if(i != xstate) {
-        printf("%s: wait wrong exit status\n", s);
-        exit(1);
-      }
-    } else {
-      exit(i);
-    }
   }
+  close(fd);
+  unlink("iov.tmp");
 }
 
-// try to find races in the reparenting
-// code that handles a parent exiting
-// when it still has live children.
+// O_DIRECT writes and reads of whole blocks don't go through
+// the buffer cache, yet agree with buffered I/O on the same
+// file; unaligned I/O on an O_DIRECT file is buffered.
+#define NDIRECTB 40
 void
-reparent(char *s)
+directtest(char *s)
 {
-  int master_pid = getpid();
-  for(int i = 0; i < 200; i++){
-    int pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
+  static char big[NDIRECTB*BSIZE] __attribute__((aligned(PGSIZE)));
+  static char back[(NDIRECTB+1)*BSIZE] __attribute__((aligned(PGSIZE)));
+  static struct sysinfo a, b;
+  char blk[BSIZE];
+  int fd, i;
+
+  for(i = 0; i < sizeof(big); i++)
+    big[i] = i % 251;
+  unlink("direct.tmp");
+  fd = open("direct.tmp", O_CREATE|O_RDWR|O_DIRECT);
+  if(fd < 0 || !(fcntl(fd, F_GETFL, 0) & O_DIRECT)){
+    printf("%s: open O_DIRECT failed\n", s);
+    exit(1);
+  }
+  sysinfo(&a);
+  if(write(fd, big, sizeof(big)) != sizeof(big)){
+    printf("%s: direct write failed\n", s);
+    exit(1);
+  }
+  sysinfo(&b);
+  if(b.bmisses - a.bmisses >= NDIRECTB/2){
+    printf("%s: direct write of %d blocks missed the cache %d times\n", s,
+           NDIRECTB, (int)(b.bmisses - a.bmisses));
+    exit(1);
+  }
+  if(write(fd, "end", 3) != 3){
+    printf("%s: unaligned write failed\n", s);
+    exit(1);
+  }
+
+  // buffered reads see what went straight to the disk, and
+  // leave block 3 cached for the direct write below.
+  for(i = 0; i < NDIRECTB; i++){
+    if(pread(fd, blk, 5, i*BSIZE + 7) != 5 || memcmp(blk, big + i*BSIZE + 7, 5) != 0){
+      printf("%s: buffered read of block %d is wrong\n", s, i);
       exit(1);
     }
-    if(pid){
-      if(wait(0) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        kill(master_pid);
-        exit(1);
-      }
-      exit(0);
-    }
   }
-  exit(0);
+  memset(big + 3*BSIZE, 'x', BSIZE);
+  if(pwrite(fd, big + 3*BSIZE, BSIZE, 3*BSIZE) != BSIZE){
+    printf("%s: direct pwrite failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, blk, 10, 3*BSIZE + 100) != 10 || blk[0] != 'x' || blk[9] != 'x'){
+    printf("%s: buffered read missed a direct write to a cached block\n", s);
+    exit(1);
+  }
+
+  // a direct read ending past the end of the file is short.
+  if(pread(fd, back, sizeof(back), 0) != sizeof(big) + 3 ||
+     memcmp(back, big, sizeof(big)) != 0 || memcmp(back + sizeof(big), "end", 3) != 0){
+    printf("%s: direct read is wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("direct.tmp");
 }
 
-// what if two children exit() at the same time?
+// a traced getpid() shows up on the trace device, entry and
+// exit, and nothing that wasn't enabled does.
 void
-twochildren(char *s)
+tracetest(char *s)
 {
-  for(int i = 0; i < 1000; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
-      exit(1);
-    }
-    if(pid1 == 0){
-      exit(0);
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        printf("%s: fork failed\n", s);
+  static struct traceev ev[64];
+  int fd, i, n, enter = 0, exit_ = 0, pid = getpid();
+
+  unlink("trace.tmp");
+  if(mknod("trace.tmp", TRACEDEV, 0) < 0 || (fd = open("trace.tmp", O_RDONLY)) < 0){
+    printf("%s: cannot open the trace device\n", s);
+    exit(1);
+  }
+  while(read(fd, ev, sizeof(ev)) > 0)
+    ;
+  trace(TR_SYSENTER | TR_SYSEXIT);
+  getpid();
+  trace(0);
+  while((n = read(fd, ev, sizeof(ev))) > 0){
+    for(i = 0; i < n / sizeof(ev[0]); i++){
+      if(ev[i].type & ~(TR_SYSENTER | TR_SYSEXIT | TR_LOST)){
+        printf("%s: event %d wasn't enabled\n", s, ev[i].type);
         exit(1);
       }
-      if(pid2 == 0){
-        exit(0);
-      } else {
-        wait(0);
-        wait(0);
+      if(ev[i].pid == pid && ev[i].a0 == SYS_getpid){
+        if(ev[i].type == TR_SYSENTER)
+          enter++;
+        if(ev[i].type == TR_SYSEXIT && ev[i].a1 == pid)
+          exit_++;
       }
     }
   }
+  close(fd);
+  unlink("trace.tmp");
+  if(enter != 1 || exit_ != 1){
+    printf("%s: getpid traced %d/%d times\n", s, enter, exit_);
+    exit(1);
+  }
 }
 
-// concurrent forks to try to expose locking bugs.
+// sysinfo() counts each getpid(), with a histogram that adds
+// up, and sees this process and some free memory.
 void
-forkfork(char *s)
+sysinfotest(char *s)
 {
-  enum { N=2 };
-  
-  for(int i = 0; i < N; i++){
-    int pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed", s);
+  static struct sysinfo a, b;
+  struct syscallstat *st;
+  uint64 n;
+  int i;
+
+  if(sysinfo(&a) < 0){
+    printf("%s: sysinfo failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 100; i++)
+    getpid();
+  if(sysinfo(&b) < 0){
+    printf("%s: sysinfo failed\n", s);
+    exit(1);
+  }
+  st = &b.sys[SYS_getpid];
+  if(st->count < a.sys[SYS_getpid].count + 100){
+    printf("%s: %d getpid()s counted, not 100\n", s,
+           (int)(st->count - a.sys[SYS_getpid].count));
+    exit(1);
+  }
+  for(n = 0, i = 0; i < NSYSHIST; i++)
+    n += st->hist[i];
+  if(n != st->count){
+    printf("%s: histogram holds %d of %d calls\n", s, (int)n, (int)st->count);
+    exit(1);
+  }
+  if(b.nproc < 2 || b.freemem == 0 || b.bhits + b.bmisses == 0){
+    printf("%s: bad counters\n", s);
+    exit(1);
+  }
+  if(sysinfo((struct sysinfo *)0xffffffffffffff00ULL) != -1){
+    printf("%s: sysinfo to a bad address succeeded\n", s);
+    exit(1);
+  }
+}
+
+// pin the disk's interrupt to CPU 0, and check that no other
+// CPU takes it while files are written.
+void
+irqtest(char *s)
+{
+  static struct sysinfo a, b;
+  static char buf[BSIZE];
+  int old, fd, i, c;
+
+  if(irqaffinity(0, 1) != -1 || irqaffinity(NIRQ, 1) != -1 || irqaffinity(2, 1) != -1){
+    printf("%s: irqaffinity of a bad irq succeeded\n", s);
+    exit(1);
+  }
+  if((old = irqaffinity(VIRTIO0_IRQ, 0)) <= 0){
+    printf("%s: no cpumask for the disk\n", s);
+    exit(1);
+  }
+  if(irqaffinity(VIRTIO0_IRQ, 1) != old){
+    printf("%s: irqaffinity lost the old mask\n", s);
+    exit(1);
+  }
+  sysinfo(&a);
+  for(i = 0; i < 20; i++){
+    if((fd = open("irqtest", O_CREATE|O_WRONLY)) < 0){
+      printf("%s: create failed\n", s);
       exit(1);
     }
-    if(pid == 0){
-      for(int j = 0; j < 200; j++){
-        int pid1 = fork();
-        if(pid1 < 0){
-          exit(1);
-        }
-        if(pid1 == 0){
-          exit(0);
-        }
-        wait(0);
-      }
-      exit(0);
-    }
+    write(fd, buf, sizeof(buf));
+    close(fd);
+    unlink("irqtest");
   }
-
-  int xstatus;
-  for(int i = 0; i < N; i++){
-    wait(&xstatus);
-    if(xstatus != 0) {
-      printf("%s: fork in child failed", s);
+  sysinfo(&b);
+  irqaffinity(VIRTIO0_IRQ, old);
+  if(b.irqs[0][VIRTIO0_IRQ] == a.irqs[0][VIRTIO0_IRQ]){
+    printf("%s: CPU 0 took no disk interrupts\n", s);
+    exit(1);
+  }
+  for(c = 1; c < NCPU; c++){
+    if(b.irqs[c][VIRTIO0_IRQ] != a.irqs[c][VIRTIO0_IRQ]){
+      printf("%s: CPU %d took a pinned disk interrupt\n", s, c);
       exit(1);
     }
   }
 }
 
+// nanosleep() for much less than a tick should take about
+// that long, and be cut short by kill().
 void
-forkforkfork(char *s)
+nanosleeptest(char *s)
 {
-  unlink("stopforking");
+  uint64 t0, t1;
+  int i, pid, xst;
 
-  int pid = fork();
+  asm volatile("rdtime %0" : "=r" (t0));
+  for(i = 0; i < 20; i++)
+    if(nanosleep(2000000) < 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  asm volatile("rdtime %0" : "=r" (t1));
+  // 10 time CSR counts per microsecond.
+  if(t1 - t0 < 20 * 2000 * 10){
+    printf("%s: 20 2ms sleeps took only %d us\n", s, (int)((t1 - t0) / 10));
+    exit(1);
+  }
+  if(t1 - t0 > 20 * TICKINTERVAL / 2){
+    printf("%s: 20 2ms sleeps took %d us, like ticks\n", s, (int)((t1 - t0) / 10));
+    exit(1);
+  }
+
+  pid = fork();
   if(pid < 0){
-    printf("%s: fork failed", s);
+    printf("%s: fork failed\n", s);
     exit(1);
   }
   if(pid == 0){
-    while(1){
-      int fd = open("stopforking", 0);
-      if(fd >= 0){
-        exit(0);
-      }
-      if(fork() < 0){
-        close(open("stopforking", O_CREATE|O_RDWR));
-      }
-    }
-
+    nanosleep(1000ULL * 1000000000);
     exit(0);
   }
-
-  sleep(20); // two seconds
-  close(open("stopforking", O_CREATE|O_RDWR));
+  sleep(1);
+  kill(pid);
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: killed nanosleep() returned\n", s);
+    exit(1);
+  }
+}
+
+// a formatted line should cost one write(), not one per
+// character, and a long one only a few.
+void
+printfwrite(char *s)
+{
+  static struct sysinfo a, b;
+  static char want[400], got[400];
+  char *p;
+  int fds[2], n, i;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 300; i++)
+    want[i] = 'a' + i % 26;
+  want[300] = 0;
+  sysinfo(&a);
+  fprintf(fds[1], "%s %d %x %s\n", "printfwrite", -42, 0xbeef, want);
+  sysinfo(&b);
+  if(b.sys[SYS_write].count - a.sys[SYS_write].count > 8){
+    printf("%s: %d write()s for one line\n", s,
+           (int)(b.sys[SYS_write].count - a.sys[SYS_write].count));
+    exit(1);
+  }
+  close(fds[1]);
+  for(p = got; (n = read(fds[0], p, got + sizeof(got) - 1 - p)) > 0; p += n)
+    ;
+  *p = 0;
+  close(fds[0]);
+  if(memcmp(got, "printfwrite -42 BEEF ", 21) != 0 || strlen(got) != 21 + 300 + 1 || memcmp(got + 21, want, 300) != 0 || got[321] != '\n'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+}
+
+static void
+uringsub(struct uring *r, int op, int fd, void *addr, int len, int off, int data)
+{
+  struct sqe *e = &r->sq[r->sqtail % NSQE];
+
+  e->op = op;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->len = len;
+  e->off = off;
+  e->data = data;
+  __sync_synchronize();
+  r->sqtail++;
+}
+
+// a read of an empty pipe, queued first, doesn't hold up file
+// writes queued behind it; and every submission completes,
+// with its data, once.
+void
+uringtest(char *s)
+{
+  enum { NREC = 8 };
+  static char rec[NREC][512], got[NREC][512], pbuf[8];
+  struct uring *r;
+  struct cqe *c;
+  char *echoargv[] = { "echo", "OK", 0 };
+  int fds[2], fd, i, n, done[NREC+1];
+
+  if((r = uring_setup()) == (struct uring *)-1 || uring_setup() != (struct uring *)-1){
+    printf("%s: uring_setup failed\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0 || (fd = open("uring.tmp", O_CREATE|O_RDWR)) < 0){
+    printf("%s: pipe/open failed\n", s);
+    exit(1);
+  }
+  uringsub(r, UR_READ, fds[0], pbuf, sizeof(pbuf), 0, NREC);
+  for(i = 0; i < NREC; i++){
+    memset(rec[i], 'a' + i, sizeof(rec[i]));
+    uringsub(r, UR_PWRITE, fd, rec[i], sizeof(rec[i]), i * sizeof(rec[i]), i);
+  }
+  memset(done, 0, sizeof(done));
+  for(n = 0; n < NREC; ){
+    uring_enter(1);
+    for(; r->cqhead != r->cqtail; r->cqhead++){
+      c = &r->cq[r->cqhead % NCQE];
+      if(c->data >= NREC || c->res != sizeof(rec[0]) || done[c->data]++){
+        printf("%s: bad completion %d res %d\n", s, (int)c->data, c->res);
+        exit(1);
+      }
+      n++;
+    }
+  }
+  if(done[NREC] || r->sqhead != r->sqtail){
+    printf("%s: pipe read finished early\n", s);
+    exit(1);
+  }
+
+  // read the records back, and wake the pipe read.
+  for(i = 0; i < NREC; i++)
+    uringsub(r, UR_PREAD, fd, got[i], sizeof(got[i]), i * sizeof(got[i]), i);
+  if(write(fds[1], "wake", 4) != 4){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  memset(done, 0, sizeof(done));
+  for(n = 0; n < NREC + 1; ){
+    uring_enter(NREC + 1 - n);
+    for(; r->cqhead != r->cqtail; r->cqhead++, n++){
+      c = &r->cq[r->cqhead % NCQE];
+      if(c->data > NREC || done[c->data]++ ||
+         c->res != (c->data == NREC ? 4 : sizeof(got[0]))){
+        printf("%s: bad completion %d res %d\n", s, (int)c->data, c->res);
+        exit(1);
+      }
+    }
+  }
+  for(i = 0; i < NREC; i++)
+    if(memcmp(got[i], rec[i], sizeof(rec[i])) != 0){
+      printf("%s: record %d read back wrong\n", s, i);
+      exit(1);
+    }
+  close(fd);
+  close(fds[0]);
+  close(fds[1]);
+  unlink("uring.tmp");
+
+  // the workers mustn't keep this process from exec()ing.
+  close(1);
+  if(open("uring.out", O_CREATE|O_WRONLY) != 1 || unlink("uring.out") < 0){
+    fprintf(2, "%s: open failed\n", s);
+    exit(1);
+  }
+  exec("echo", echoargv);
+  fprintf(2, "%s: exec after uring_enter failed\n", s);
+  exit(1);
+}
+
+// readers share a file's lock, but never see a write() half
+// done: each pwrite() fills a whole record with one byte.
+void
+sharedread(char *s)
+{
+  enum { NREC = 4, RECSZ = 1024, NREAD = 3, ROUNDS = 200 };
+  static char rec[RECSZ];
+  int fd, i, j, k, pid, xst, ok = 1;
+
+  fd = open("shared.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  memset(rec, 'a', RECSZ);
+  for(i = 0; i < NREC; i++)
+    if(write(fd, rec, RECSZ) != RECSZ){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+
+  for(i = 0; i < NREAD; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(k = 0; k < ROUNDS; k++){
+        j = k % NREC;
+        if(pread(fd, rec, RECSZ, j * RECSZ) != RECSZ)
+          exit(1);
+        for(i = 1; i < RECSZ; i++)
+          if(rec[i] != rec[0]){
+            printf("%s: torn record %d\n", s, j);
+            exit(1);
+          }
+      }
+      exit(0);
+    }
+  }
+  for(k = 0; k < ROUNDS; k++){
+    memset(rec, 'a' + k % 26, RECSZ);
+    if(pwrite(fd, rec, RECSZ, (k % NREC) * RECSZ) != RECSZ){
+      printf("%s: pwrite failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NREAD; i++){
+    wait(&xst);
+    if(xst != 0)
+      ok = 0;
+  }
+  close(fd);
+  unlink("shared.tmp");
+  if(!ok)
+    exit(1);
+}
+
+// grow a pipe with F_SETPIPE_SZ, fill it without blocking, and
+// read the bytes back in order.
+void
+pipesize(char *s)
+{
+  int fds[2], i, n, cc, sz = 64*1024;
+  char *b;
+
+  if(pipe(fds) != 0 || (b = malloc(sz)) == 0){
+    printf("%s: pipe() or malloc() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, sz) != sz || fcntl(fds[0], F_GETPIPE_SZ, 0) != sz){
+    printf("%s: F_SETPIPE_SZ failed\n", s);
+    exit(1);
+  }
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  for(i = 0; i < sz; i++)
+    b[i] = i % 251;
+  if(write(fds[1], b, 100) != 100 || write(fds[1], b + 100, sz) != sz - 100 ||
+     write(fds[1], b, 1) != -1){
+    printf("%s: pipe didn't hold %d bytes\n", s, sz);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 4096) != -1){
+    printf("%s: shrank a full pipe\n", s);
+    exit(1);
+  }
+  memset(b, 0, sz);
+  for(n = 0; n < sz; n += cc){
+    if((cc = read(fds[0], b + n, 3000)) <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < sz; i++){
+    if(b[i] != (char)(i % 251)){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  free(b);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// poll() and O_NONBLOCK on a pipe.
+void
+polltest(char *s)
+{
+  int fds[2], pid, xstatus;
+  struct pollfd pfd;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  // nothing to read yet.
+  if(fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+     (fcntl(fds[0], F_GETFL, 0) & O_NONBLOCK) == 0){
+    printf("%s: fcntl failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], &c, 1) != -1){
+    printf("%s: non-blocking read of empty pipe succeeded\n", s);
+    exit(1);
+  }
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, 0) != 0 || pfd.revents != 0){
+    printf("%s: empty pipe polled readable\n", s);
+    exit(1);
+  }
+  if(poll(&pfd, 1, 2) != 0){
+    printf("%s: poll timeout failed\n", s);
+    exit(1);
+  }
+
+  // a writer should wake a blocked poll().
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(2);
+    write(fds[1], "x", 1);
+    exit(0);
+  }
+  if(poll(&pfd, 1, -1) != 1 || (pfd.revents & POLLIN) == 0){
+    printf("%s: poll missed write\n", s);
+    exit(1);
+  }
+  if(read(fds[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: read after poll failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+
+  // closed fds are reported, not waited for.
+  pfd.fd = 100;
+  if(poll(&pfd, 1, -1) != 1 || pfd.revents != POLLNVAL){
+    printf("%s: poll on closed fd\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// meant to be run w/ at most two CPUs
+void
+preempt(char *s)
+{
+  int pid1, pid2, pid3;
+  int pfds[2];
+
+  pid1 = fork();
+  if(pid1 < 0) {
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid1 == 0)
+    for(;;)
+      ;
+
+  pid2 = fork();
+  if(pid2 < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0)
+    for(;;)
+      ;
+
+  pipe(pfds);
+  pid3 = fork();
+  if(pid3 < 0) {
+     printf("%s: fork failed\n", s);
+     exit(1);
+  }
+  if(pid3 == 0){
+    close(pfds[0]);
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: preempt write error", s);
+    close(pfds[1]);
+    for(;;)
+      ;
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: preempt read error", s);
+    return;
+  }
+  close(pfds[0]);
+  printf("kill... ");
+  kill(pid1);
+  kill(pid2);
+  kill(pid3);
+  printf("wait... ");
+  wait(0);
+  wait(0);
+  wait(0);
+}
+
+// try to find any races between exit and wait
+void
+exitwait(char *s)
+{
+  int i, pid;
+
+  for(i = 0; i < 100; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      int xstate;
+      if(wait(&xstate) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+      if(i != xstate) {
+        printf("%s: wait wrong exit status\n", s);
+        exit(1);
+      }
+    } else {
+      exit(i);
+    }
+  }
+}
+
+// try to find races in the reparenting
+// code that handles a parent exiting
+// when it still has live children.
+void
+reparent(char *s)
+{
+  int master_pid = getpid();
+  for(int i = 0; i < 200; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      if(wait(0) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        kill(master_pid);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  exit(0);
+}
+
+// what if two children exit() at the same time?
+void
+twochildren(char *s)
+{
+  for(int i = 0; i < 1000; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      exit(0);
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid2 == 0){
+        exit(0);
+      } else {
+        wait(0);
+        wait(0);
+      }
+    }
+  }
+}
+
+// fork() shares memory copy-on-write: three children of a
+// process holding more than a third of physical memory read
+// all of it, and their stores, including the kernel's for
+// read(), stay out of the parent's copy.
+void
+cowfork(char *s)
+{
+  int sz = 48*1024*1024, fds[2], i, pid, st;
+  char *p;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sz; i += 4096)
+    p[i] = i / 4096;
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int n = 0; n < 3; n++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(i = 0; i < sz; i += 4096)
+        if(p[i] != (char)(i / 4096))
+          exit(1);
+      for(i = n; i < sz; i += 3*4096)
+        p[i] = 'c';
+      if(read(fds[0], p + 4096, 1) != 1 || p[4096] != 'x')
+        exit(1);
+      exit(0);
+    }
+  }
+  if(write(fds[1], "xxx", 3) != 3){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  for(int n = 0; n < 3; n++){
+    wait(&st);
+    if(st != 0){
+      printf("%s: child saw the wrong memory\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < sz; i += 4096){
+    if(p[i] != (char)(i / 4096)){
+      printf("%s: child's store reached the parent\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-sz);
+}
+
+// nice() levels, and the scheduling statistics that a process
+// that spins runs up.
+void
+nicetest(char *s)
+{
+  struct schedstat st;
+  int i, old;
+  uint64 t0;
+
+  old = nice(2);
+  if(nice(old) != 2 || nice(100) != old || nice(old) != NPRIO-1){
+    printf("%s: nice() didn't set the level\n", s);
+    exit(1);
+  }
+  if(schedstat(&st) < 0){
+    printf("%s: schedstat failed\n", s);
+    exit(1);
+  }
+  t0 = st.runtime;
+  for(i = 0; i < 10000000; i++)
+    asm volatile("");
+  if(schedstat(&st) < 0 || st.runtime <= t0 ||
+     st.prio < 0 || st.prio >= NPRIO || st.nice != old){
+    printf("%s: bad schedstat\n", s);
+    exit(1);
+  }
+  if(schedstat((struct schedstat*)0xffffffffffffffff) >= 0){
+    printf("%s: schedstat to a bad address succeeded\n", s);
+    exit(1);
+  }
+}
+
+static int tcount;
+static int tfd = -1;
+
+static void
+threadfn(void *arg)
+{
+  for(int i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&tcount, 1);
+  if(arg == 0)
+    tfd = open("threadf", O_CREATE|O_RDWR);
+  exit(0);
+}
+
+static void
+spinfn(void *arg)
+{
+  for(;;)
+    ;
+}
+
+// threads from clone() share memory and open files, and
+// exit() of the leader takes them with it.
+void
+threadtest(char *s)
+{
+  int pids[4], i, pid, xstatus;
+  char *stack;
+
+  if(join(0) != -1){
+    printf("%s: join() without threads succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    stack = malloc(4096);
+    pids[i] = clone(threadfn, (void*)(uint64)i, stack + 4096);
+    if(pids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    if(join(pids[i]) != pids[i]){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(tcount != 4000){
+    printf("%s: count %d, not 4000\n", s, tcount);
+    exit(1);
+  }
+  if(tfd < 0 || write(tfd, "x", 1) != 1){
+    printf("%s: thread's fd isn't shared\n", s);
+    exit(1);
+  }
+  close(tfd);
+  unlink("threadf");
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    stack = malloc(4096);
+    if(clone(spinfn, 0, stack + 4096) < 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: clone in child failed\n", s);
+    exit(1);
+  }
+}
+
+static struct mutex fmu;
+static struct cond fcv;
+static int fcount, fready;
+
+static void
+futexfn(void *arg)
+{
+  for(int i = 0; i < 500; i++){
+    mutex_lock(&fmu);
+    fcount++; // not atomic: the mutex must exclude the others
+    mutex_unlock(&fmu);
+  }
+  mutex_lock(&fmu);
+  while(!fready)
+    cond_wait(&fcv, &fmu);
+  fcount += 1000;
+  mutex_unlock(&fmu);
+  exit(0);
+}
+
+// futex-based mutexes and condition variables between threads.
+void
+futextest(char *s)
+{
+  int pids[4], i, v = 1;
+
+  if(futex_wait(&v, 2) != -1 || futex_wake(&v, 1) != 0){
+    printf("%s: futex on a changed word\n", s);
+    exit(1);
+  }
+  mutex_init(&fmu);
+  cond_init(&fcv);
+  for(i = 0; i < 4; i++){
+    pids[i] = clone(futexfn, 0, (char*)malloc(4096) + 4096);
+    if(pids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  sleep(2);
+  mutex_lock(&fmu);
+  fready = 1;
+  cond_broadcast(&fcv);
+  mutex_unlock(&fmu);
+  for(i = 0; i < 4; i++){
+    if(join(pids[i]) != pids[i]){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(fcount != 4*500 + 4*1000){
+    printf("%s: count %d, not %d\n", s, fcount, 4*500 + 4*1000);
+    exit(1);
+  }
+}
+
+// spawn() a child with its stdout on a pipe, and check that
+// bad programs and file actions fail.
+void
+spawntest(char *s)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  struct spawnact act[2];
+  char buf[32];
+  int fds[2], pid, xstatus, n, cc;
+
+  if(spawn("nosuchprogram", args, 0, 0) != -1){
+    printf("%s: spawn of a missing program succeeded\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = 1;
+  act[0].src = NOFILE - 1; // not open
+  if(spawn("echo", args, act, 1) != -1){
+    printf("%s: spawn with a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  act[0].src = fds[1];
+  act[1].op = SPAWN_CLOSE;
+  act[1].fd = fds[0];
+  pid = spawn("echo", args, act, 2);
+  close(fds[1]);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(n < sizeof(buf) - 1 && (cc = read(fds[0], buf + n, sizeof(buf) - 1 - n)) > 0)
+    n += cc;
+  buf[n] = 0;
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait for spawned child failed\n", s);
+    exit(1);
+  }
+  if(strcmp(buf, "spawned\n") != 0){
+    printf("%s: read '%s' from spawned echo\n", s, buf);
+    exit(1);
+  }
+}
+
+static int vdsook;
+
+static void
+vdsofn(void *arg)
+{
+  vdsook = vgetpid() == getpid() && vcpuid() == -1;
+  exit(0);
+}
+
+// the read-only pages at VCLOCK and VPROC agree with the
+// system calls, and can't be written.
+void
+vdsotest(char *s)
+{
+  int pid, xstatus, t;
+  uint64 m;
+
+  if(vgetpid() != getpid()){
+    printf("%s: vgetpid %d, getpid %d\n", s, vgetpid(), getpid());
+    exit(1);
+  }
+  if(vcpuid() < 0 || vcpuid() >= NCPU){
+    printf("%s: vcpuid %d\n", s, vcpuid());
+    exit(1);
+  }
+  t = uptime();
+  if(vuptime() < t || vuptime() > t + 1){
+    printf("%s: vuptime %d, uptime %d\n", s, vuptime(), t);
+    exit(1);
+  }
+  m = vmtime();
+  sleep(2);
+  if(vmtime() <= m){
+    printf("%s: vmtime didn't advance\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(vgetpid() == getpid() ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child's vgetpid is wrong\n", s);
+    exit(1);
+  }
+
+  // a thread shares the leader's VPROC page, but not its pid.
+  pid = clone(vdsofn, 0, (char*)malloc(4096) + 4096);
+  if(pid < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  if(join(pid) != pid){
+    printf("%s: join failed\n", s);
+    exit(1);
+  }
+  if(!vdsook){
+    printf("%s: thread's vgetpid or vcpuid is wrong\n", s);
+    exit(1);
+  }
+  if(vgetpid() != getpid() || vcpuid() < 0){
+    printf("%s: vgetpid or vcpuid wrong after join\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    *(volatile int *)VCLOCK = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: VCLOCK is writable\n", s);
+    exit(1);
+  }
+}
+
+// fsync() after writes, and on things that aren't files.
+void
+fsynctest(char *s)
+{
+  char buf[64];
+  int fd, fds[2], i;
+
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'f', sizeof(buf));
+  for(i = 0; i < 20; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) != 0){
+      printf("%s: write/fsync failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(fsync(fd) >= 0){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0 || fsync(fds[0]) != 0){
+    printf("%s: fsync of pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("fsyncf");
+}
+
+// hold open more distinct files than the old 50-entry inode
+// cache had room for.
+void
+manyinodes(char *s)
+{
+  enum { N = 100 };
+  char name[8];
+  int fds[N], i;
+
+  name[0] = 'm';
+  name[1] = 'i';
+  name[4] = 0;
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    if((fds[i] = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    if(write(fds[i], &i, sizeof(i)) != sizeof(i)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    int j = -1;
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    close(fds[i]);
+    int fd = open(name, 0);
+    if(fd < 0 || read(fd, &j, sizeof(j)) != sizeof(j) || j != i){
+      printf("%s: %s has the wrong contents\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+}
+
+// repeated lookups of names that come and go, which the kernel
+// answers from its directory entry cache.
+void
+dentrycache(char *s)
+{
+  char buf[4];
+  int fd, i;
+
+  if(mkdir("dcd") < 0 || mkdir("dcd/sub") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    if(open("dcd/sub/f", 0) >= 0){
+      printf("%s: open of missing file succeeded\n", s);
+      exit(1);
+    }
+    fd = open("dcd/sub/f", O_CREATE|O_RDWR);
+    buf[0] = '0' + i;
+    if(fd < 0 || write(fd, buf, 1) != 1){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    fd = open("dcd/sub/f", 0);
+    if(fd < 0 || read(fd, buf, 2) != 1 || buf[0] != '0' + i){
+      printf("%s: wrong file after re-create\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcd/sub/f") < 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+
+  // a new directory, probably reusing the old one's inode,
+  // must not show the old one's names.
+  fd = open("dcd/sub/g", O_CREATE|O_RDWR);
+  close(fd);
+  if(unlink("dcd/sub/g") < 0 || unlink("dcd/sub") < 0 || mkdir("dcd/sub") < 0){
+    printf("%s: rmdir/mkdir failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/sub/g", 0) >= 0 || open("dcd/sub/f", 0) >= 0){
+    printf("%s: name survived its directory\n", s);
+    exit(1);
+  }
+  if(unlink("dcd/sub") < 0 || unlink("dcd") < 0){
+    printf("%s: unlink dirs failed\n", s);
+    exit(1);
+  }
+}
+
+// a big sbrk() that is only sparsely touched, by the process, by
+// a system call, and by a child that inherits the untouched rest.
+void
+lazysbrk(char *s)
+{
+  int sz = 1024*1024*1024, i, fds[2], pid, st;
+  char *p;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sz; i += 64*1024*1024){
+    if(p[i] != 0){
+      printf("%s: new heap isn't zero\n", s);
+      exit(1);
+    }
+    p[i] = 'a';
+  }
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "xy", 2) != 2 || read(fds[0], p + sz - 2, 2) != 2 ||
+     p[sz-1] != 'y'){
+    printf("%s: read into untouched heap failed\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'a' || p[4096] != 0 || p[sz-1] != 'y')
+      exit(1);
+    p[4096] = 'b';
+    exit(0);
+  }
+  wait(&st);
+  if(st != 0 || p[4096] != 0){
+    printf("%s: child saw the wrong heap\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-sz);
+}
+
+// mmap() a file of two and a half pages: privately, where stores
+// stay in memory, and shared, where they reach the file once
+// unmapped, including a child's through the page it inherits.
+void
+mmaptest(char *s)
+{
+  int sz = 2*4096 + 2048, fd, i, pid, st;
+  char *p, *q, buf[64];
+
+  unlink("mmap.tmp");
+  fd = open("mmap.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sz; i += sizeof(buf)){
+    memset(buf, 'a' + i / 4096, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sz; i++){
+    if(p[i] != 'a' + i / 4096){
+      printf("%s: wrong file contents\n", s);
+      exit(1);
+    }
+  }
+  if(p[sz] != 0){
+    printf("%s: no zeroes past the end of the file\n", s);
+    exit(1);
+  }
+  p[0] = 'x';
+  if(munmap(p, sz) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 4096);
+  if(p == (char*)0xffffffffffffffffL || q == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a' || q[0] != 'b'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'y';
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[1] != 'y')
+      exit(1);
+    p[2*4096] = 'z';
+    exit(0);
+  }
+  wait(&st);
+  if(st != 0 || p[2*4096] != 'z'){
+    printf("%s: child doesn't share the mapping\n", s);
+    exit(1);
+  }
+  if(munmap(q, 4096) < 0 || munmap(p, 4096) < 0 || munmap(p + 4096, sz - 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmap.tmp", O_RDONLY);
+  for(i = 0; i < sz; i += sizeof(buf)){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: file changed size\n", s);
+      exit(1);
+    }
+    if((i == 0 && buf[1] != 'y') || (i == 2*4096 && buf[0] != 'z')){
+      printf("%s: shared store didn't reach the file\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmap.tmp");
+}
+
+// read() a file into its own mapping, and write() it from one,
+// where the copy faults in the page of the block it is copying.
+void
+mmapselftest(char *s)
+{
+  int fd, i;
+  char *p, buf[64];
+
+  unlink("mmap.tmp");
+  fd = open("mmap.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', sizeof(buf));
+  for(i = 0; i < 4096; i += sizeof(buf)){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("mmap.tmp", O_RDWR);
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(read(fd, p, 4096) != 4096 || p[0] != 'a' || p[4095] != 'a'){
+    printf("%s: read into own mapping failed\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+
+  fd = open("mmap.tmp", O_RDWR);
+  p = mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(write(fd, p, 4096) != 4096){
+    printf("%s: write from own mapping failed\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+  unlink("mmap.tmp");
+}
+
+// concurrent forks to try to expose locking bugs.
+void
+forkfork(char *s)
+{
+  enum { N=2 };
+  
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 200; j++){
+        int pid1 = fork();
+        if(pid1 < 0){
+          exit(1);
+        }
+        if(pid1 == 0){
+          exit(0);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+
+  int xstatus;
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0) {
+      printf("%s: fork in child failed", s);
+      exit(1);
+    }
+  }
+}
+
+void
+forkforkfork(char *s)
+{
+  unlink("stopforking");
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(1){
+      int fd = open("stopforking", 0);
+      if(fd >= 0){
+        exit(0);
+      }
+      if(fork() < 0){
+        close(open("stopforking", O_CREATE|O_RDWR));
+      }
+    }
+
+    exit(0);
+  }
+
+  sleep(20); // two seconds
+  close(open("stopforking", O_CREATE|O_RDWR));
   wait(0);
   sleep(10); // one second
 }
@@ -1050,6 +2434,158 @@ mem(char *s)
   }
 }
 
+// objects of every size class and a few page runs at once
+// must not overlap, freed objects must be reused, and freeing
+// a big block at the top of the heap must shrink it.
+void
+malloctest(char *s)
+{
+  enum { N = 200 };
+  static char *p[N];
+  static int sz[N];
+  char *top, *b;
+  int i, j;
+
+  for(i = 0; i < N; i++){
+    sz[i] = i % 5 == 4 ? 1500 + 37*i : 1 + (i*97) % 1024;
+    if((p[i] = malloc(sz[i])) == 0){
+      printf("%s: malloc(%d) failed\n", s, sz[i]);
+      exit(1);
+    }
+    if((uint64)p[i] % 16){
+      printf("%s: malloc() not aligned\n", s);
+      exit(1);
+    }
+    memset(p[i], i, sz[i]);
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < sz[i]; j++){
+      if(p[i][j] != (char)i){
+        printf("%s: block %d overwritten\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  for(i = 0; i < N; i += 2)
+    free(p[i]);
+  for(i = 0; i < N; i += 2){
+    if((p[i] = malloc(sz[i])) == 0){
+      printf("%s: malloc() after free failed\n", s);
+      exit(1);
+    }
+    memset(p[i], i, sz[i]);
+  }
+  for(i = 1; i < N; i += 2){
+    for(j = 0; j < sz[i]; j++){
+      if(p[i][j] != (char)i){
+        printf("%s: block %d overwritten after reuse\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  for(i = 0; i < N; i++)
+    free(p[i]);
+
+  top = sbrk(0);
+  if((b = malloc(1024*1024)) == 0){
+    printf("%s: malloc(1MB) failed\n", s);
+    exit(1);
+  }
+  b[0] = b[1024*1024-1] = 1;
+  if(sbrk(0) < top + 1024*1024){
+    printf("%s: heap didn't grow\n", s);
+    exit(1);
+  }
+  free(b);
+  if(sbrk(0) > top){
+    printf("%s: free() didn't shrink the heap\n", s);
+    exit(1);
+  }
+}
+
+// the word-at-a-time string routines, at every alignment of
+// source and destination, against byte-at-a-time answers.
+void
+stringtest(char *s)
+{
+  static char a[128], b[128], c[128];
+  int i, j, n, k;
+
+  for(i = 0; i < 8; i++){
+    for(j = 0; j < 8; j++){
+      for(n = 0; n < 70; n += 1 + n/8){
+        for(k = 0; k < sizeof(a); k++)
+          a[k] = 'a' + k % 23, b[k] = c[k] = 0;
+        memmove(b + j, a + i, n);
+        for(k = 0; k < sizeof(b); k++){
+          if(b[k] != (k >= j && k < j + n ? a[i + k - j] : 0)){
+            printf("%s: memmove(%d, %d, %d) wrong\n", s, j, i, n);
+            exit(1);
+          }
+        }
+        if(n > 0 && memcmp(b + j, a + i, n) != 0){
+          printf("%s: memcmp(%d, %d, %d) of equal bytes\n", s, j, i, n);
+          exit(1);
+        }
+        if(n > 0){
+          b[j + n - 1] ^= 0x80;
+          if(memcmp(b + j, a + i, n) <= 0 || memcmp(a + i, b + j, n) >= 0){
+            printf("%s: memcmp(%d, %d, %d) misordered\n", s, j, i, n);
+            exit(1);
+          }
+          b[j + n - 1] ^= 0x80;
+        }
+        b[j + n] = 0;
+        memmove(c + i, b + j, n + 1);
+        if(strlen(b + j) != n || strlen(c + i) != n){
+          printf("%s: strlen(%d) wrong\n", s, n);
+          exit(1);
+        }
+        if(strcmp(b + j, c + i) != 0){
+          printf("%s: strcmp(%d, %d, %d) of equal strings\n", s, j, i, n);
+          exit(1);
+        }
+        if(n > 0){
+          c[i + n - 1]++;
+          if(strcmp(b + j, c + i) >= 0 || strcmp(c + i, b + j) <= 0){
+            printf("%s: strcmp(%d, %d, %d) misordered\n", s, j, i, n);
+            exit(1);
+          }
+        }
+        memset(a + i, 'z', n);
+        for(k = 0; k < sizeof(a); k++){
+          if((a[k] == 'z') != (k >= i && k < i + n)){
+            printf("%s: memset(%d, %d) wrong\n", s, i, n);
+            exit(1);
+          }
+        }
+      }
+    }
+  }
+
+  // overlapping moves, both ways.
+  for(i = 0; i < 8; i++){
+    for(k = 0; k < sizeof(a); k++)
+      a[k] = k;
+    memmove(a + i + 9, a + 3, 100);
+    for(k = 0; k < 100; k++){
+      if(a[i + 9 + k] != k + 3){
+        printf("%s: overlapping memmove up wrong\n", s);
+        exit(1);
+      }
+    }
+    for(k = 0; k < sizeof(a); k++)
+      a[k] = k;
+    memmove(a + 3, a + i + 9, 100);
+    for(k = 0; k < 100; k++){
+      if(a[3 + k] != i + 9 + k){
+        printf("%s: overlapping memmove down wrong\n", s);
+        exit(1);
+      }
+    }
+  }
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -2743,6 +4279,7 @@ main(int argc, char *argv[])
     {copyinstr1, "copyinstr1"},
     {copyinstr2, "copyinstr2"},
     {copyinstr3, "copyinstr3"},
+    {copyalign, "copyalign"},
     {rwsbrk, "rwsbrk" },
     {truncate1, "truncate1"},
     {truncate2, "truncate2"},
@@ -2755,6 +4292,18 @@ main(int argc, char *argv[])
     {reparent, "reparent" },
     {twochildren, "twochildren"},
     {forkfork, "forkfork"},
+    {cowfork, "cowfork"},
+    {lazysbrk, "lazysbrk"},
+    {mmaptest, "mmaptest"},
+    {mmapselftest, "mmapselftest"},
+    {dentrycache, "dentrycache"},
+    {manyinodes, "manyinodes"},
+    {fsynctest, "fsynctest"},
+    {nicetest, "nicetest"},
+    {threadtest, "threadtest"},
+    {futextest, "futextest"},
+    {vdsotest, "vdsotest"},
+    {spawntest, "spawntest"},
     {forkforkfork, "forkforkfork"},
     {argptest, "argptest"},
     {createdelete, "createdelete"},
@@ -2785,7 +4334,21 @@ main(int argc, char *argv[])
     {exitiputtest, "exitiput"},
     {iputtest, "iput"},
     {mem, "mem"},
+    {malloctest, "malloctest"},
+    {stringtest, "stringtest"},
     {pipe1, "pipe1"},
+    {pipesize, "pipesize"},
+    {splicetest, "splicetest"},
+    {iovtest, "iovtest"},
+    {directtest, "directtest"},
+    {sharedread, "sharedread"},
+    {tracetest, "tracetest"},
+    {sysinfotest, "sysinfotest"},
+    {printfwrite, "printfwrite"},
+    {irqtest, "irqtest"},
+    {nanosleeptest, "nanosleeptest"},
+    {uringtest, "uringtest"},
+    {polltest, "polltest"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
@@ -36,4 +36,42 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("poll");
+entry("fcntl");
+entry("mmap");
+entry("munmap");
+entry("fsync");
+entry("nice");
+entry("schedstat");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("spawn");
+entry("splice");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("trace");
+entry("profile");
+entry("sysinfo");
+entry("uring_setup");
+entry("uring_enter");
+entry("irqaffinity");
+entry("nanosleep");
 entry("connect");
+entry("setsockopt");
+entry("recvzc");
+entry("zcfree");
+entry("recvmmsg");
+entry("sendmmsg");
+entry("getsockopt");
+entry("bind");
+entry("recvfrom");
+entry("sendto");
+entry("tcpconnect");
+entry("tcplisten");
+entry("tcpaccept");
+entry("sendfile");
+entry("netbypass");